@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <string.h> // For memcpy
+#include <math.h> // For sin, cos and floor
+#include "err.h"
+#include "augment.h"
+#include "placement.h" // For placing scratch memory
+
+// Arguments of augmentSamples, shared by every worker
+typedef struct _AugmentJob {
+    Augmenter* augmenter;
+    Matrix* batch;
+    uint64_t batchNumber;
+} AugmentJob;
+
+void defaultAugmentOptions(AugmentOptions* options) {
+    options->maxShift = 2.0;
+    options->maxRotation = 0.15; // Roughly 8.5 degrees
+    options->maxScale = 0.1;
+    options->maxShear = 0.1;
+    options->elasticAlpha = 1.0;
+    options->elasticGrid = 4;
+}
+
+// Size of each worker's scratch memory in doubles
+static size_t scratchSize(Augmenter* augmenter) {
+    unsigned int grid = augmenter->options.elasticGrid;
+    return (size_t) augmenter->rows * augmenter->columns // Source sample
+         + 2 * augmenter->columns // Source coordinates of one row
+         + 2 * grid * grid; // Elastic displacements at the control points
+}
+
+int makeAugmenter(AugmentOptions* options, unsigned int rows,
+                  unsigned int columns, uint64_t seed, ThreadPool* pool,
+                  Augmenter** augmenter) {
+    *augmenter = calloc(1, sizeof(Augmenter));
+    if (*augmenter == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*augmenter)->options = *options;
+    if ((*augmenter)->options.elasticGrid < 2) {
+        (*augmenter)->options.elasticGrid = 2; // Needed to interpolate
+    }
+    (*augmenter)->rows = rows;
+    (*augmenter)->columns = columns;
+    (*augmenter)->seed = seed;
+    (*augmenter)->pool = pool;
+    (*augmenter)->workers = pool == NULL ? 1 : pool->threads;
+
+    // Scratch memory for each worker, so that workers never share a buffer,
+    // on the pages of its own node
+    (*augmenter)->scratch = calloc((*augmenter)->workers, sizeof(double*));
+    if ((*augmenter)->scratch == NULL) {
+        free(*augmenter);
+        *augmenter = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    for (unsigned int i = 0; i < (*augmenter)->workers; i++) {
+        size_t bytes = scratchSize(*augmenter) * sizeof(double);
+        int returnCode = allocatePages(bytes, (void**) &(*augmenter)->scratch[i]);
+        if (returnCode == SUCCESS) {
+            returnCode = placeOnWorkerNode((*augmenter)->scratch[i], bytes, i);
+        }
+        if (returnCode != SUCCESS) {
+            freeAugmenter(*augmenter);
+            *augmenter = NULL;
+            return returnCode;
+        }
+    }
+    return SUCCESS;
+}
+
+void freeAugmenter(Augmenter* augmenter) {
+    if (augmenter == NULL) {
+        return;
+    }
+    for (unsigned int i = 0; i < augmenter->workers; i++) {
+        free(augmenter->scratch[i]);
+    }
+    free(augmenter->scratch);
+    free(augmenter);
+}
+
+// Returns a random value in the range [-`limit`, `limit`]
+static double randomSymmetric(Rng* rng, double limit) {
+    return (2 * randomUniform(rng) - 1) * limit;
+}
+
+// Bilinearly samples the `rows` by `columns` image `source` at (`y`, `x`),
+// treating everything outside of it as 0
+static double sampleBilinear(const double* source, unsigned int rows,
+                             unsigned int columns, double y, double x) {
+    double top = floor(y);
+    double left = floor(x);
+    double fy = y - top;
+    double fx = x - left;
+    int r = (int) top;
+    int c = (int) left;
+
+    double p00 = 0, p01 = 0, p10 = 0, p11 = 0;
+    int r0 = r >= 0 && r < rows, r1 = r + 1 >= 0 && r + 1 < rows;
+    int c0 = c >= 0 && c < columns, c1 = c + 1 >= 0 && c + 1 < columns;
+    if (r0 && c0) {
+        p00 = source[r * columns + c];
+    }
+    if (r0 && c1) {
+        p01 = source[r * columns + c + 1];
+    }
+    if (r1 && c0) {
+        p10 = source[(r + 1) * columns + c];
+    }
+    if (r1 && c1) {
+        p11 = source[(r + 1) * columns + c + 1];
+    }
+    return (1 - fy) * ((1 - fx) * p00 + fx * p01) + fy * ((1 - fx) * p10 + fx * p11);
+}
+
+// Transforms the single sample `sample` in place using `scratch`
+static void augmentSample(Augmenter* augmenter, double* sample, double* scratch,
+                          Rng* rng) {
+    AugmentOptions* o = &augmenter->options;
+    unsigned int rows = augmenter->rows;
+    unsigned int columns = augmenter->columns;
+    unsigned int grid = o->elasticGrid;
+    double* restrict source = scratch;
+    double* restrict sourceX = source + (size_t) rows * columns;
+    double* restrict sourceY = sourceX + columns;
+    double* restrict field = sourceY + columns; // (dy, dx) per control point
+    memcpy(source, sample, (size_t) rows * columns * sizeof(double));
+
+    // Random affine transform, about the centre of the sample
+    double angle = randomSymmetric(rng, o->maxRotation);
+    double scale = 1 + randomSymmetric(rng, o->maxScale);
+    double shear = randomSymmetric(rng, o->maxShear);
+    double shiftX = randomSymmetric(rng, o->maxShift);
+    double shiftY = randomSymmetric(rng, o->maxShift);
+
+    // Forward matrix M = scale * rotation * shear, inverted so that each
+    // output pixel can look up where it comes from
+    double m00 = scale * cos(angle), m01 = scale * (cos(angle) * shear - sin(angle));
+    double m10 = scale * sin(angle), m11 = scale * (sin(angle) * shear + cos(angle));
+    double determinant = m00 * m11 - m01 * m10;
+    double i00 = m11 / determinant, i01 = -m01 / determinant;
+    double i10 = -m10 / determinant, i11 = m00 / determinant;
+    double centreX = (columns - 1) / 2.0;
+    double centreY = (rows - 1) / 2.0;
+
+    // Random displacements at a coarse grid of control points, interpolated
+    // between them so that the distortion is smooth
+    int elastic = o->elasticAlpha > 0;
+    if (elastic) {
+        for (unsigned int i = 0; i < 2 * grid * grid; i++) {
+            field[i] = randomSymmetric(rng, o->elasticAlpha);
+        }
+    }
+    double gridStepY = rows > 1 ? (double) (grid - 1) / (rows - 1) : 0;
+    double gridStepX = columns > 1 ? (double) (grid - 1) / (columns - 1) : 0;
+
+    for (unsigned int y = 0; y < rows; y++) {
+        // Source coordinates of the whole row, linear in x so this loop
+        // has no dependencies between iterations and vectorises
+        double dy = y - centreY - shiftY;
+        double baseX = i01 * dy + centreX;
+        double baseY = i11 * dy + centreY;
+        for (unsigned int x = 0; x < columns; x++) {
+            double dx = x - centreX - shiftX;
+            sourceX[x] = i00 * dx + baseX;
+            sourceY[x] = i10 * dx + baseY;
+        }
+
+        if (elastic) {
+            double gy = y * gridStepY;
+            unsigned int g0 = (unsigned int) gy;
+            if (g0 >= grid - 1) {
+                g0 = grid - 2;
+            }
+            double fy = gy - g0;
+            for (unsigned int x = 0; x < columns; x++) {
+                double gx = x * gridStepX;
+                unsigned int h0 = (unsigned int) gx;
+                if (h0 >= grid - 1) {
+                    h0 = grid - 2;
+                }
+                double fx = gx - h0;
+                const double* p00 = &field[2 * (g0 * grid + h0)];
+                const double* p01 = p00 + 2;
+                const double* p10 = p00 + 2 * grid;
+                const double* p11 = p10 + 2;
+                sourceY[x] += (1 - fy) * ((1 - fx) * p00[0] + fx * p01[0])
+                            + fy * ((1 - fx) * p10[0] + fx * p11[0]);
+                sourceX[x] += (1 - fy) * ((1 - fx) * p00[1] + fx * p01[1])
+                            + fy * ((1 - fx) * p10[1] + fx * p11[1]);
+            }
+        }
+
+        for (unsigned int x = 0; x < columns; x++) {
+            sample[y * columns + x] = sampleBilinear(source, rows, columns,
+                                                     sourceY[x], sourceX[x]);
+        }
+    }
+}
+
+// ParallelTask transforming samples [begin, end) of a batch
+static void augmentSamples(void* arg, unsigned int begin, unsigned int end,
+                           unsigned int worker) {
+    AugmentJob* job = (AugmentJob*) arg;
+    Augmenter* augmenter = job->augmenter;
+    for (unsigned int i = begin; i < end; i++) {
+        // Every sample gets its own stream so results do not depend on
+        // how the batch was split between threads
+        Rng rng;
+        seedRng(&rng, augmenter->seed);
+        rng.state ^= nextRandom(&rng) + job->batchNumber * 0xD1B54A32D192ED03ULL + i;
+        augmentSample(augmenter, &job->batch->values[(size_t) i * job->batch->columns],
+                      augmenter->scratch[worker], &rng);
+    }
+}
+
+int augmentBatch(Augmenter* augmenter, Matrix* batch, unsigned int count,
+                 uint64_t batchNumber) {
+    if (batch->columns != augmenter->rows * augmenter->columns) {
+        return reportError(MISC, "augmentBatch error: batch columns do not match the sample size");
+    }
+    if (count > batch->rows) {
+        return reportError(MISC, "augmentBatch error: batch matrix has too few rows");
+    }
+    AugmentJob job = {augmenter, batch, batchNumber};
+    parallelFor(augmenter->pool, count, augmentSamples, &job);
+    return SUCCESS;
+}
@@ -0,0 +1,57 @@
+#ifndef AUGMENT
+#define AUGMENT
+
+#include <stdint.h>
+#include "mathLib.h"
+#include "threadPool.h"
+
+typedef struct _AugmentOptions {
+    double maxShift; // Largest translation in pixels, may be fractional
+    double maxRotation; // Largest rotation in radians
+    double maxScale; // Largest change in scale, e.g. 0.1 is 90%-110%
+    double maxShear; // Largest horizontal shear factor
+    double elasticAlpha; // Largest elastic displacement in pixels, 0 disables it
+    unsigned int elasticGrid; // Control points along each side of the elastic field
+} AugmentOptions;
+
+/**
+ * Randomly transforms the samples of mini batches as they are fed to the
+ * network, so that each epoch sees different versions of the same samples
+ * without them ever being stored.
+ */
+typedef struct _Augmenter {
+    AugmentOptions options;
+    unsigned int rows;
+    unsigned int columns;
+    uint64_t seed;
+    ThreadPool* pool; // Not owned, may be NULL
+    double** scratch; // Per worker copy of the sample being transformed
+    unsigned int workers;
+} Augmenter;
+
+/**
+ * Fills `options` with small transformations suited to handwritten digits.
+ */
+void defaultAugmentOptions(AugmentOptions* options);
+
+/**
+ * Makes an augmenter for samples of `rows * columns` values, placed in the
+ * output vector `augmenter`. Batches are split between the threads of
+ * `pool`, which may be NULL. The transformation of a sample only depends
+ * on `seed`, the batch number and its position in the batch.
+ */
+int makeAugmenter(AugmentOptions* options, unsigned int rows,
+                  unsigned int columns, uint64_t seed, ThreadPool* pool,
+                  Augmenter** augmenter);
+
+void freeAugmenter(Augmenter* augmenter);
+
+/**
+ * Transforms the first `count` rows of `batch` in place, where each row is
+ * one sample. `batchNumber` should be different for every mini batch of a
+ * training run.
+ */
+int augmentBatch(Augmenter* augmenter, Matrix* batch, unsigned int count,
+                 uint64_t batchNumber);
+
+#endif // AUGMENT
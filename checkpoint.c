@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h> // For memcpy
+#include "err.h"
+#include "checkpoint.h"
+#include "phaseTimer.h"
+#include "placement.h"
+#include "trace.h"
+
+static void* checkpointWriter(void* arg) {
+    Checkpointer* checkpointer = (Checkpointer*) arg;
+    uint64_t start = phaseClock();
+    unpinThread(); // Off the CPU of the training thread that started it
+    nameTraceThread("checkpoint writer");
+    traceBegin("checkpoint write", checkpointer->state.epoch);
+    checkpointer->returnCode = saveNetworkCheckpoint(checkpointer->snapshot,
+                                                     &checkpointer->state,
+                                                     checkpointer->filename);
+    endPhase(PHASE_SAVE, start);
+    traceEnd("checkpoint write");
+    return NULL;
+}
+
+int makeCheckpointer(NeuralNetwork* network, char* filename, unsigned int every,
+                     Checkpointer** checkpointer) {
+    *checkpointer = calloc(1, sizeof(Checkpointer));
+    if (*checkpointer == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*checkpointer)->filename = filename;
+    (*checkpointer)->every = every == 0 ? 1 : every;
+    (*checkpointer)->returnCode = SUCCESS;
+
+    // The snapshot has the same shape, it needs its own neurons array
+    unsigned int* neurons = malloc((network->hiddenLayers + 2) * sizeof(unsigned int));
+    if (neurons == NULL) {
+        free(*checkpointer);
+        *checkpointer = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    memcpy(neurons, network->neurons, (network->hiddenLayers + 2) * sizeof(unsigned int));
+    int returnCode = makeNetwork(network->hiddenLayers, neurons,
+                                 network->learningRate, &(*checkpointer)->snapshot);
+    for (int i = 0; i < network->hiddenLayers + 1 && returnCode == SUCCESS; i++) {
+        if (network->conv[i] != NULL) {
+            returnCode = setConvLayer((*checkpointer)->snapshot, i, &network->conv[i]->shape);
+        }
+    }
+    if (returnCode != SUCCESS) {
+        freeCheckpointer(*checkpointer);
+        *checkpointer = NULL;
+    }
+    return returnCode;
+}
+
+void freeCheckpointer(Checkpointer* checkpointer) {
+    if (checkpointer == NULL) {
+        return;
+    }
+    waitForCheckpoint(checkpointer);
+    freeNetwork(checkpointer->snapshot);
+    free(checkpointer);
+}
+
+int waitForCheckpoint(Checkpointer* checkpointer) {
+    if (checkpointer->writing) {
+        pthread_join(checkpointer->writer, NULL);
+        checkpointer->writing = 0;
+    }
+    return checkpointer->returnCode;
+}
+
+int checkpointEpoch(Checkpointer* checkpointer, NeuralNetwork* network,
+                    TrainingState* state) {
+    if (state->epoch % checkpointer->every != 0) {
+        return SUCCESS;
+    }
+
+    // The snapshot cannot be changed whilst it is being written
+    traceBegin("checkpoint wait", TRACE_NO_ARGUMENT);
+    int returnCode = waitForCheckpoint(checkpointer);
+    traceEnd("checkpoint wait");
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+
+    // Copy the parameters into the second buffer
+    traceBegin("checkpoint snapshot", TRACE_NO_ARGUMENT);
+    NeuralNetwork* snapshot = checkpointer->snapshot;
+    for (int i = 0; i < network->hiddenLayers + 1; i++) {
+        Matrix* weights = network->weights[i];
+        Matrix* biases = network->biases[i];
+        memcpy(snapshot->weights[i]->values, weights->values,
+               (size_t) weights->rows * weights->columns * sizeof(double));
+        memcpy(snapshot->biases[i]->values, biases->values,
+               (size_t) biases->rows * biases->columns * sizeof(double));
+    }
+    checkpointer->state = *state;
+    traceEnd("checkpoint snapshot");
+
+    // Write it whilst training carries on
+    if (pthread_create(&checkpointer->writer, NULL, checkpointWriter, checkpointer) != 0) {
+        return reportError(MISC, "checkpointEpoch error: writer thread could not be started");
+    }
+    checkpointer->writing = 1;
+    return SUCCESS;
+}
@@ -0,0 +1,52 @@
+#ifndef CHECKPOINT
+#define CHECKPOINT
+
+#include <pthread.h>
+#include "neuralNetwork.h"
+#include "modelFile.h"
+
+/**
+ * Periodically saves a training network without stopping training for the
+ * disk writes. The parameters are copied into a second network, `snapshot`,
+ * which a background thread writes while training carries on with the
+ * first.
+ */
+typedef struct _Checkpointer {
+    char* filename;
+    unsigned int every; // Epochs between checkpoints
+    NeuralNetwork* snapshot;
+    TrainingState state; // Progress matching `snapshot`
+
+    pthread_t writer;
+    int writing; // 1 while `writer` has not been joined
+    int returnCode; // Result of the last write
+} Checkpointer;
+
+/**
+ * Makes a checkpointer in the output vector `checkpointer` that saves
+ * `network` to `filename` every `every` epochs.
+ */
+int makeCheckpointer(NeuralNetwork* network, char* filename, unsigned int every,
+                     Checkpointer** checkpointer);
+
+/**
+ * Waits for any write in progress, then frees `checkpointer`.
+ */
+void freeCheckpointer(Checkpointer* checkpointer);
+
+/**
+ * Called at the end of every epoch. If a checkpoint is due, this copies the
+ * parameters of `network` and its progress `state` and starts writing them
+ * in the background. Only the copy is done on the calling thread, unless the
+ * previous checkpoint is still being written, in which case it is waited for.
+ */
+int checkpointEpoch(Checkpointer* checkpointer, NeuralNetwork* network,
+                    TrainingState* state);
+
+/**
+ * Waits until the checkpoint being written, if any, is on disk and returns
+ * the result of writing it.
+ */
+int waitForCheckpoint(Checkpointer* checkpointer);
+
+#endif // CHECKPOINT
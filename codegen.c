@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // For comparing option names
+#include <ctype.h> // For upper case constant names
+#include "neuralNetwork.h"
+#include "err.h"
+
+/*
+ * Ahead of time compiler for a trained network. It reads a model file or
+ * network directory and writes a standalone C file with the topology as
+ * compile time constants and the weights as aligned static arrays:
+ *
+ *     int predict(const double input[INPUTS], double output[OUTPUTS]);
+ *     int predictUint8(const unsigned char input[INPUTS], double output[OUTPUTS]);
+ *
+ * Both return the predicted class and never allocate. `output` may be NULL.
+ * Summation happens in the same order as multiplyMatricesInto, so in double
+ * precision the results match the library exactly.
+ */
+
+#define ROW_TILE 4 // Output neurons computed together, sharing each input load
+#define VALUES_PER_LINE 6
+
+typedef struct _CodegenOptions {
+    char* name; // Name of the predict function, prefixing everything else
+    int singlePrecision; // Emit float rather than double weights and maths
+} CodegenOptions;
+
+// Writes `count` values as the body of a static array initialiser
+static void emitValues(FILE* file, double* values, unsigned int count, int singlePrecision) {
+    for (unsigned int i = 0; i < count; i++) {
+        if (i % VALUES_PER_LINE == 0) {
+            fprintf(file, "    ");
+        }
+        if (singlePrecision) {
+            fprintf(file, "%.9gf,", (float) values[i]);
+        } else {
+            fprintf(file, "%.17g,", values[i]);
+        }
+        fprintf(file, (i % VALUES_PER_LINE == VALUES_PER_LINE - 1 || i == count - 1) ? "\n" : " ");
+    }
+}
+
+/**
+ * Writes the body of a block computing `rows` output neurons of layer
+ * `layer`, sharing each load of the layer's input between them. The first
+ * neuron is `first`, an expression such as "j" or "28".
+ */
+static void emitRowTile(FILE* file, CodegenOptions* options, unsigned int layer,
+                        unsigned int inputs, const char* first, unsigned int rows) {
+    const char* type = options->singlePrecision ? "float" : "double";
+    fprintf(file, "        %s", type);
+    for (unsigned int r = 0; r < rows; r++) {
+        fprintf(file, "%s s%u = 0", r == 0 ? "" : ",", r);
+    }
+    fprintf(file, ";\n");
+    fprintf(file, "        const %s* w = &%sWeights%u[%s * %u];\n", type, options->name, layer, first, inputs);
+    fprintf(file, "        for (int k = 0; k < %u; k++) {\n", inputs);
+    fprintf(file, "            %s x = a%u[k];\n", type, layer);
+    for (unsigned int r = 0; r < rows; r++) {
+        fprintf(file, "            s%u += w[%u + k] * x;\n", r, r * inputs);
+    }
+    fprintf(file, "        }\n");
+    for (unsigned int r = 0; r < rows; r++) {
+        fprintf(file, "        a%u[%s + %u] = %sSigmoid(s%u + %sBiases%u[%s + %u]);\n",
+                layer + 1, first, r, options->name, r, options->name, layer, first, r);
+    }
+}
+
+/**
+ * Writes `network` as a standalone C file `filename`, as described at the
+ * top of this file.
+ */
+static int emitNetwork(NeuralNetwork* network, char* modelName, char* filename,
+                       CodegenOptions* options) {
+    for (unsigned int l = 0; l < network->hiddenLayers + 1; l++) {
+        if (network->conv[l] != NULL) {
+            return reportError(MISC, "codegen only supports fully connected layers");
+        }
+    }
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        return reportError(BAD_FILE_NAME, filename);
+    }
+    const char* type = options->singlePrecision ? "float" : "double";
+    unsigned int layers = network->hiddenLayers + 2;
+    unsigned int inputs = network->neurons[0];
+    unsigned int outputs = network->neurons[layers - 1];
+
+    char upper[64];
+    unsigned int length = 0;
+    for (; options->name[length] != '\0' && length < sizeof(upper) - 1; length++) {
+        upper[length] = toupper((unsigned char) options->name[length]);
+    }
+    upper[length] = '\0';
+
+    // Header comment with the topology
+    fprintf(file, "/*\n * Generated by codegen from %s, do not edit.\n * Topology ", modelName);
+    for (unsigned int i = 0; i < layers; i++) {
+        fprintf(file, "%s%u", i == 0 ? "" : "-", network->neurons[i]);
+    }
+    fprintf(file, ", %s precision.\n *\n", type);
+    fprintf(file, " *     int %s(const %s input[%u], %s output[%u]);\n", options->name, type, inputs, type, outputs);
+    fprintf(file, " *     int %sUint8(const unsigned char input[%u], %s output[%u]);\n", options->name, inputs, type, outputs);
+    fprintf(file, " *\n * Both return the predicted class. `output` may be NULL.\n */\n");
+    fprintf(file, "#include <math.h>\n#include <stddef.h>\n\n");
+    fprintf(file, "#define %s_INPUTS %u\n#define %s_OUTPUTS %u\n\n", upper, inputs, upper, outputs);
+
+    // Weights and biases
+    for (unsigned int l = 0; l < layers - 1; l++) {
+        unsigned int rows = network->neurons[l + 1];
+        unsigned int columns = network->neurons[l];
+        fprintf(file, "static const %s %sWeights%u[%u] __attribute__((aligned(64))) = {\n",
+                type, options->name, l, rows * columns);
+        emitValues(file, network->weights[l]->values, rows * columns, options->singlePrecision);
+        fprintf(file, "};\n\n");
+        fprintf(file, "static const %s %sBiases%u[%u] __attribute__((aligned(64))) = {\n",
+                type, options->name, l, rows);
+        emitValues(file, network->biases[l]->values, rows, options->singlePrecision);
+        fprintf(file, "};\n\n");
+    }
+
+    fprintf(file, "static inline %s %sSigmoid(%s x) {\n    return 1/(1+%s(-x));\n}\n\n",
+            type, options->name, type, options->singlePrecision ? "expf" : "exp");
+
+    // The forward pass, one block per layer
+    fprintf(file, "int %s(const %s input[%u], %s output[%u]) {\n", options->name, type, inputs, type, outputs);
+    fprintf(file, "    const %s* a0 = input;\n", type);
+    for (unsigned int l = 1; l < layers; l++) {
+        fprintf(file, "    %s a%u[%u] __attribute__((aligned(64)));\n", type, l, network->neurons[l]);
+    }
+    for (unsigned int l = 0; l < layers - 1; l++) {
+        unsigned int rows = network->neurons[l + 1];
+        unsigned int columns = network->neurons[l];
+        unsigned int tiled = rows - rows % ROW_TILE;
+        fprintf(file, "\n    // Layer %u: %u -> %u\n", l + 1, columns, rows);
+        if (tiled > 0) {
+            fprintf(file, "    for (int j = 0; j < %u; j += %u) {\n", tiled, ROW_TILE);
+            emitRowTile(file, options, l, columns, "j", ROW_TILE);
+            fprintf(file, "    }\n");
+        }
+        if (tiled < rows) {
+            // The remaining neurons, known now so not looped over
+            char first[16];
+            snprintf(first, sizeof(first), "%u", tiled);
+            fprintf(file, "    {\n");
+            emitRowTile(file, options, l, columns, first, rows - tiled);
+            fprintf(file, "    }\n");
+        }
+    }
+
+    unsigned int last = layers - 1;
+    fprintf(file, "\n    int label = 0;\n");
+    fprintf(file, "    for (int i = 0; i < %u; i++) {\n", outputs);
+    fprintf(file, "        if (a%u[i] > a%u[label]) {\n            label = i;\n        }\n", last, last);
+    fprintf(file, "        if (output != NULL) {\n            output[i] = a%u[i];\n        }\n    }\n", last);
+    fprintf(file, "    return label;\n}\n\n");
+
+    // Bytes are scaled as in training
+    fprintf(file, "int %sUint8(const unsigned char input[%u], %s output[%u]) {\n", options->name, inputs, type, outputs);
+    fprintf(file, "    %s scaled[%u] __attribute__((aligned(64)));\n", type, inputs);
+    fprintf(file, "    for (int i = 0; i < %u; i++) {\n", inputs);
+    fprintf(file, "        scaled[i] = (%s) input[i] / 256;\n    }\n", type);
+    fprintf(file, "    return %s(scaled, output);\n}\n", options->name);
+
+    if (ferror(file)) {
+        fclose(file);
+        return reportError(OUTPUT_FAILED, filename);
+    }
+    if (fclose(file) != 0) {
+        return reportError(OUTPUT_FAILED, filename);
+    }
+    return SUCCESS;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        printf("Usage: ./codegen model output.c [--name predict] [--float]\n"
+               "`model` is a model file or network directory. `output.c` is written as a\n"
+               "standalone C file defining `name` and `nameUint8`.\n");
+        return reportError(BAD_ARGUMENT_COUNT, "");
+    }
+
+    CodegenOptions options = {"predict", 0};
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--float") == 0) {
+            options.singlePrecision = 1;
+        } else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
+            options.name = argv[++i];
+        } else {
+            return reportError(MISC, argv[i]);
+        }
+    }
+
+    // The learning rate is never used
+    NeuralNetwork* network = NULL;
+    int returnCode = loadNetwork(&network, argv[1], 0);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    returnCode = emitNetwork(network, argv[1], argv[2], &options);
+    freeNetwork(network);
+    return returnCode;
+}
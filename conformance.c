@@ -0,0 +1,1110 @@
+#define _POSIX_C_SOURCE 200809L // For dup and fileno
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // For comparing option names and copying bits
+#include <stdint.h> // For ordering doubles by their bits
+#include <math.h> // For exp and fabs
+#include <fcntl.h> // For opening /dev/null
+#include <unistd.h> // For silencing training's output
+#include "mathLib.h"
+#include "neuralNetwork.h"
+#include "dataset.h"
+#include "err.h"
+#include "quantize.h"
+#include "lowRank.h"
+#include "convolution.h"
+
+/*
+ * Conformance harness, run by `make check`. Every kernel backend is checked
+ * against a plain reference implementation written here, over random shapes
+ * that include sizes of one and sizes around every power of two so that odd
+ * remainders of any vector width are covered. An element conforms if it is
+ * within the check's ULPs of the reference, or within its relative tolerance
+ * of the largest reference value, so reordered sums with cancellation still
+ * conform.
+ *
+ * A short training run with a fixed seed on synthetic data is then compared
+ * with `conformance.baseline`, failing if the accuracy or cost of an epoch
+ * drifts too far. `--record` rewrites the baseline from the current code.
+ *
+ * New backends are added as rows of `checks`, so that a fast path can only
+ * be switched on once it conforms.
+ */
+
+#define DEFAULT_SHAPES 40
+#define DEFAULT_BASELINE "conformance.baseline"
+#define MAX_DIMENSION 257
+#define CHECK_THREADS 4 // Threads of the pool the parallel backends split kernels between
+#define QUANTIZED_LARGEST_INPUT 4 // Operands are up to 4, negative ones quantize to 0
+
+// Training run compared with the baseline
+#define TRAINING_SEED 1
+#define TRAINING_SAMPLES 1200
+#define TESTING_SAMPLES 200
+#define TRAINING_EPOCHS 3
+#define TRAINING_BATCH 10
+#define TRAINING_RATE 0.5
+#define TRAINING_HIDDEN 30
+#define TRAINING_STAGES 2 // Pipeline stages of the second run, which must match the first exactly
+#define ACCURACY_TOLERANCE 0.01 // Absolute, 0-1
+#define COST_TOLERANCE 1e-3 // Relative
+
+// Sizes around every power of two, mixed into the random shapes
+static const unsigned int edgeSizes[] = {1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33,
+                                         63, 64, 65, 127, 128, 129, 255, 256, 257};
+
+// Inputs of one check and room for both outputs, which are up to
+// MAX_DIMENSION square so that each check can shape them as it needs
+typedef struct _Operands {
+    unsigned int m, n, k;
+    Matrix* a; // m x k
+    Matrix* b; // k x n
+    Matrix* at; // k x m
+    Matrix* same; // m x n
+    Matrix* other; // m x n
+    Matrix* column; // m x 1
+    Matrix* vector; // n x 1
+    Matrix* mostlyZero; // n x k, four in five values zero like image rows
+    Matrix* got;
+    Matrix* expected;
+} Operands;
+
+typedef int (*CheckFunction)(Operands* o, Matrix* output);
+
+typedef struct _Check {
+    const char* name;
+    CheckFunction backend;
+    CheckFunction reference;
+    uint64_t maxUlps;
+    double relativeTolerance; // Of the largest reference value
+    int (*available)(void); // Whether this CPU can run the backend, NULL if it always can
+    int parallel; // Run the backend with `checkPool` as the kernel thread pool
+} Check;
+
+// Sets the shape of an output matrix, which always has room
+static void shapeOutput(Matrix* output, unsigned int rows, unsigned int columns) {
+    output->rows = rows;
+    output->columns = columns;
+}
+
+static void copyInto(Matrix* from, Matrix* to) {
+    shapeOutput(to, from->rows, from->columns);
+    memcpy(to->values, from->values, (size_t) from->rows * from->columns * sizeof(double));
+}
+
+// --- Backends ---
+
+static int multiplyBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    return multiplyMatricesInto(o->a, o->b, out);
+}
+
+static int multiplyTransposedBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    return multiplyTransposedInto(o->at, o->b, out);
+}
+
+static int outerProductBackend(Operands* o, Matrix* out) {
+    copyInto(o->same, out);
+    return addOuterProductInto(o->column, o->vector, out);
+}
+
+// Each row of `mostlyZero` fed through `a` as a sparse input, laid out m x n
+static int sparseMultiplyBackend(Operands* o, Matrix* out) {
+    SparseMatrix* sparse = NULL;
+    Matrix* product = NULL;
+    int returnCode = makeSparseMatrix(o->n, o->k, (size_t) o->n * o->k, &sparse);
+    if (returnCode == SUCCESS) {
+        returnCode = makeMatrix(o->m, 1, &product);
+    }
+    if (returnCode == SUCCESS) {
+        returnCode = sparseFromDense(o->mostlyZero, sparse);
+    }
+    shapeOutput(out, o->m, o->n);
+    for (unsigned int j = 0; j < o->n && returnCode == SUCCESS; j++) {
+        returnCode = multiplySparseRowInto(o->a, sparse, j, product);
+        for (unsigned int i = 0; i < o->m; i++) {
+            out->values[i * o->n + j] = product->values[i];
+        }
+    }
+    freeSparseMatrix(sparse);
+    if (product != NULL) {
+        freeMatrix(product);
+    }
+    return returnCode;
+}
+
+// `mostlyZero` as pruned weights times `b`, n x n
+static int sparseWeightsBackend(Operands* o, Matrix* out) {
+    SparseMatrix* sparse = NULL;
+    int returnCode = makeSparseMatrix(o->n, o->k, (size_t) o->n * o->k, &sparse);
+    if (returnCode == SUCCESS) {
+        returnCode = sparseFromDense(o->mostlyZero, sparse);
+    }
+    shapeOutput(out, o->n, o->n);
+    if (returnCode == SUCCESS) {
+        returnCode = multiplySparseInto(sparse, o->b, out);
+    }
+    freeSparseMatrix(sparse);
+    return returnCode;
+}
+
+static int sparseOuterProductBackend(Operands* o, Matrix* out) {
+    SparseMatrix* sparse = NULL;
+    int returnCode = makeSparseMatrix(o->n, o->k, (size_t) o->n * o->k, &sparse);
+    if (returnCode == SUCCESS) {
+        returnCode = sparseFromDense(o->mostlyZero, sparse);
+    }
+    copyInto(o->a, out);
+    if (returnCode == SUCCESS) {
+        returnCode = addSparseOuterProductInto(o->column, sparse, 0, out);
+    }
+    freeSparseMatrix(sparse);
+    return returnCode;
+}
+
+static int transposeBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->k, o->m);
+    return transposeMatrix(o->a, &out);
+}
+
+static int addBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    return addMatricesInto(o->same, o->other, out);
+}
+
+static int addColumnBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    return addColumnInto(o->same, o->column, out);
+}
+
+static int scaleBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    return multiplyScalarInto(o->same, -0.3, out);
+}
+
+static int hadamardBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    return hadamardProduct(o->same, o->other, &out);
+}
+
+static int updateBackend(Operands* o, Matrix* out) {
+    copyInto(o->same, out);
+    return addScaledInto(out, -0.05, o->other, out);
+}
+
+static int sigmoidBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    return sigmoidInto(o->same, out);
+}
+
+static int dsigmoidBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    return dsigmoidInto(o->same, out);
+}
+
+static int reluBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    return reluInto(o->same, out);
+}
+
+static int dreluBackend(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    return dreluInto(o->same, out);
+}
+
+// Reduced precision round trips, checked against the unrounded values
+static int halfBackend(Operands* o, Matrix* out) {
+    size_t n = (size_t) o->m * o->n;
+    uint16_t* narrow = malloc(n * sizeof(uint16_t));
+    if (narrow == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    shapeOutput(out, o->m, o->n);
+    narrowToHalf(o->same->values, narrow, n, 1);
+    widenHalf(narrow, out->values, n, 1);
+    free(narrow);
+    return SUCCESS;
+}
+
+static int bfloat16Backend(Operands* o, Matrix* out) {
+    size_t n = (size_t) o->m * o->n;
+    uint16_t* narrow = malloc(n * sizeof(uint16_t));
+    if (narrow == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    shapeOutput(out, o->m, o->n);
+    narrowToBfloat16(o->same->values, narrow, n, 1);
+    widenBfloat16(narrow, out->values, n, 1);
+    free(narrow);
+    return SUCCESS;
+}
+
+// The k-m-m network the forward checks feed `b` through, its layers
+// factorized at half rank if `lowRank` is set
+static int makeCheckNetwork(Operands* o, int lowRank, NeuralNetwork** network) {
+    unsigned int* neurons = malloc(3 * sizeof(unsigned int));
+    if (neurons == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    neurons[0] = o->k;
+    neurons[1] = o->m;
+    neurons[2] = o->m;
+    int returnCode = makeSeededNetwork(1, neurons, 0, o->m * 31 + o->k, network);
+    if (returnCode == SUCCESS && lowRank) {
+        (*network)->lowRank = calloc(2, sizeof(LowRankLayer*));
+        if ((*network)->lowRank == NULL) {
+            returnCode = reportError(IMAGE_MALLOC_FAILED, "");
+        }
+    }
+    for (int l = 0; l < 2 && returnCode == SUCCESS && lowRank; l++) {
+        Matrix* weights = (*network)->weights[l];
+        unsigned int n = weights->rows < weights->columns ? weights->rows : weights->columns;
+        Matrix* vectors = NULL;
+        returnCode = singularVectors(weights, &vectors);
+        if (returnCode == SUCCESS) {
+            returnCode = makeLowRankLayer(weights, vectors, (n + 1) / 2, 1, &(*network)->lowRank[l]);
+            freeMatrix(vectors);
+        }
+    }
+    if (returnCode != SUCCESS) {
+        freeNetwork(*network); // Which owns `neurons`
+        *network = NULL;
+    }
+    return returnCode;
+}
+
+// A k-m-m network fed all n columns of `b` at once, laid out m x n
+static int batchForward(Operands* o, Matrix* out, int lowRank) {
+    NeuralNetwork* network = NULL;
+    int returnCode = makeCheckNetwork(o, lowRank, &network);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    BatchActivations* activations = NULL;
+    returnCode = makeBatchActivations(network, o->n, &activations);
+    if (returnCode == SUCCESS) {
+        copyInto(o->b, activations->layers[0]);
+        returnCode = feedForwardNetworkBatch(network, activations);
+        copyInto(activations->layers[2], out);
+        freeBatchActivations(network, activations);
+    }
+    freeNetwork(network);
+    return returnCode;
+}
+
+static int batchForwardBackend(Operands* o, Matrix* out) {
+    return batchForward(o, out, 0);
+}
+
+static int batchLowRankForwardBackend(Operands* o, Matrix* out) {
+    return batchForward(o, out, 1);
+}
+
+// Threads parallel checks split the kernels between, which only reach the
+// parallel paths for the larger shapes
+static ThreadPool* checkPool = NULL;
+
+// `a` quantized to int8 times `b`, through `kernel`
+static int quantizedBackend(Operands* o, Matrix* out, QuantizedKernel kernel, int perChannel) {
+    QuantizedLayer* layer = NULL;
+    int returnCode = setQuantizedKernel(kernel);
+    if (returnCode == SUCCESS) {
+        returnCode = quantizeWeights(o->a, perChannel, QUANTIZED_LARGEST_INPUT, &layer);
+    }
+    shapeOutput(out, o->m, o->n);
+    if (returnCode == SUCCESS) {
+        returnCode = multiplyQuantizedInto(layer, o->b, out);
+    }
+    freeQuantizedLayer(layer);
+    return returnCode;
+}
+
+static int quantizedScalarBackend(Operands* o, Matrix* out) {
+    return quantizedBackend(o, out, QUANTIZED_SCALAR, 1);
+}
+
+static int quantizedAvx2Backend(Operands* o, Matrix* out) {
+    return quantizedBackend(o, out, QUANTIZED_AVX2, 1);
+}
+
+static int quantizedVnniBackend(Operands* o, Matrix* out) {
+    return quantizedBackend(o, out, QUANTIZED_AVX512_VNNI, 1);
+}
+
+static int quantizedPerLayerBackend(Operands* o, Matrix* out) {
+    return quantizedBackend(o, out, QUANTIZED_SCALAR, 0);
+}
+
+// `a` factorized at full rank times `b`, which only differs from `a` times
+// `b` by the rounding of the decomposition
+static int lowRankBackend(Operands* o, Matrix* out) {
+    Matrix* vectors = NULL;
+    LowRankLayer* layer = NULL;
+    int returnCode = singularVectors(o->a, &vectors);
+    if (returnCode == SUCCESS) {
+        returnCode = makeLowRankLayer(o->a, vectors, o->m < o->k ? o->m : o->k, o->n, &layer);
+    }
+    shapeOutput(out, o->m, o->n);
+    if (returnCode == SUCCESS) {
+        returnCode = multiplyLowRankInto(layer, o->b, NULL, out);
+    }
+    if (vectors != NULL) {
+        freeMatrix(vectors);
+    }
+    freeLowRankLayer(layer);
+    return returnCode;
+}
+
+// A convolutional layer over `b` as a one channel k by n image, with up to
+// four filters cycled from the values of `a`
+static void convShapeOf(Operands* o, ConvShape* shape) {
+    unsigned int kernel = o->k < o->n ? o->k : o->n;
+    shape->channels = 1;
+    shape->height = o->k;
+    shape->width = o->n;
+    shape->kernel = kernel < 3 ? kernel : 3;
+    shape->filters = o->m < 4 ? o->m : 4;
+    shape->pool = o->k - shape->kernel >= 1 && o->n - shape->kernel >= 1 ? 2 : 1;
+}
+
+static double convWeight(Operands* o, unsigned int index) {
+    return o->a->values[index % (o->m * o->k)];
+}
+
+// The image unfolded, multiplied by the filters and pooled as networks do
+static int convBackend(Operands* o, Matrix* out) {
+    ConvShape shape;
+    convShapeOf(o, &shape);
+    unsigned int patch = shape.kernel * shape.kernel;
+    ConvLayer* layer = NULL;
+    Matrix* weights = NULL;
+    Matrix* image = NULL;
+    int returnCode = makeConvLayer(&shape, &layer);
+    if (returnCode == SUCCESS) {
+        returnCode = makeMatrix(shape.filters, patch, &weights);
+    }
+    if (returnCode == SUCCESS) {
+        returnCode = makeMatrixView(o->k * o->n, 1, o->b->values, &image);
+    }
+    if (returnCode == SUCCESS) {
+        for (unsigned int i = 0; i < shape.filters * patch; i++) {
+            weights->values[i] = convWeight(o, i);
+        }
+        returnCode = unfoldInput(layer, image);
+    }
+    if (returnCode == SUCCESS) {
+        returnCode = multiplyMatricesInto(weights, layer->columns, layer->convolved);
+    }
+    if (returnCode == SUCCESS) {
+        shapeOutput(out, layer->pooled->rows, 1);
+        returnCode = poolInto(layer, out);
+    }
+    if (weights != NULL) {
+        freeMatrix(weights);
+    }
+    if (image != NULL) {
+        freeMatrix(image);
+    }
+    freeConvLayer(layer);
+    return returnCode;
+}
+
+static int avx2Available(void) {
+    return quantizedKernelSupported(QUANTIZED_AVX2);
+}
+
+static int vnniAvailable(void) {
+    return quantizedKernelSupported(QUANTIZED_AVX512_VNNI);
+}
+
+// --- References ---
+
+static int multiplyReference(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    for (unsigned int i = 0; i < o->m; i++) {
+        for (unsigned int j = 0; j < o->n; j++) {
+            double sum = 0;
+            for (unsigned int k = 0; k < o->k; k++) {
+                sum += o->a->values[i * o->k + k] * o->b->values[k * o->n + j];
+            }
+            out->values[i * o->n + j] = sum;
+        }
+    }
+    return SUCCESS;
+}
+
+static int multiplyTransposedReference(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    for (unsigned int i = 0; i < o->m; i++) {
+        for (unsigned int j = 0; j < o->n; j++) {
+            double sum = 0;
+            for (unsigned int k = 0; k < o->k; k++) {
+                sum += o->at->values[k * o->m + i] * o->b->values[k * o->n + j];
+            }
+            out->values[i * o->n + j] = sum;
+        }
+    }
+    return SUCCESS;
+}
+
+static int outerProductReference(Operands* o, Matrix* out) {
+    copyInto(o->same, out);
+    for (unsigned int i = 0; i < o->m; i++) {
+        for (unsigned int j = 0; j < o->n; j++) {
+            out->values[i * o->n + j] += o->column->values[i] * o->vector->values[j];
+        }
+    }
+    return SUCCESS;
+}
+
+static int sparseMultiplyReference(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    for (unsigned int i = 0; i < o->m; i++) {
+        for (unsigned int j = 0; j < o->n; j++) {
+            double sum = 0;
+            for (unsigned int k = 0; k < o->k; k++) {
+                sum += o->a->values[i * o->k + k] * o->mostlyZero->values[j * o->k + k];
+            }
+            out->values[i * o->n + j] = sum;
+        }
+    }
+    return SUCCESS;
+}
+
+static int sparseWeightsReference(Operands* o, Matrix* out) {
+    shapeOutput(out, o->n, o->n);
+    for (unsigned int i = 0; i < o->n; i++) {
+        for (unsigned int j = 0; j < o->n; j++) {
+            double sum = 0;
+            for (unsigned int k = 0; k < o->k; k++) {
+                sum += o->mostlyZero->values[i * o->k + k] * o->b->values[k * o->n + j];
+            }
+            out->values[i * o->n + j] = sum;
+        }
+    }
+    return SUCCESS;
+}
+
+// Quantizes `a` and `b` as the int8 kernels describe, then sums exactly
+static int quantizedReference(Operands* o, Matrix* out, int perChannel) {
+    double* scales = malloc(o->m * sizeof(double));
+    if (scales == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    double layerLargest = 0;
+    for (unsigned int i = 0; i < o->m; i++) {
+        double largest = 0;
+        for (unsigned int k = 0; k < o->k; k++) {
+            largest = fmax(largest, fabs(o->a->values[i * o->k + k]));
+        }
+        scales[i] = largest > 0 ? largest / QUANTIZED_WEIGHT_LEVELS : 1;
+        layerLargest = fmax(layerLargest, largest);
+    }
+    double inputScale = (double) QUANTIZED_LARGEST_INPUT / QUANTIZED_INPUT_LEVELS;
+    shapeOutput(out, o->m, o->n);
+    for (unsigned int i = 0; i < o->m; i++) {
+        double scale = perChannel ? scales[i] : (layerLargest > 0 ? layerLargest / QUANTIZED_WEIGHT_LEVELS : 1);
+        for (unsigned int j = 0; j < o->n; j++) {
+            long sum = 0;
+            for (unsigned int k = 0; k < o->k; k++) {
+                long weight = lround(o->a->values[i * o->k + k] / scale);
+                long input = lround(o->b->values[k * o->n + j] * (1 / inputScale));
+                sum += weight * (input < 0 ? 0 : input > QUANTIZED_INPUT_LEVELS ? QUANTIZED_INPUT_LEVELS : input);
+            }
+            out->values[i * o->n + j] = (double) sum * (scale * inputScale);
+        }
+    }
+    free(scales);
+    return SUCCESS;
+}
+
+static int quantizedPerChannelReference(Operands* o, Matrix* out) {
+    return quantizedReference(o, out, 1);
+}
+
+static int quantizedPerLayerReference(Operands* o, Matrix* out) {
+    return quantizedReference(o, out, 0);
+}
+
+static int sparseOuterProductReference(Operands* o, Matrix* out) {
+    copyInto(o->a, out);
+    for (unsigned int i = 0; i < o->m; i++) {
+        for (unsigned int k = 0; k < o->k; k++) {
+            out->values[i * o->k + k] += o->column->values[i] * o->mostlyZero->values[k];
+        }
+    }
+    return SUCCESS;
+}
+
+// Slides each filter over the image directly, then takes the first largest
+// value of each pooling window
+static int convReference(Operands* o, Matrix* out) {
+    ConvShape shape;
+    convShapeOf(o, &shape);
+    unsigned int kernel = shape.kernel;
+    unsigned int height = o->k - kernel + 1;
+    unsigned int width = o->n - kernel + 1;
+    unsigned int pooledHeight = height / shape.pool;
+    unsigned int pooledWidth = width / shape.pool;
+    shapeOutput(out, shape.filters * pooledHeight * pooledWidth, 1);
+    for (unsigned int f = 0; f < shape.filters; f++) {
+        for (unsigned int y = 0; y < pooledHeight; y++) {
+            for (unsigned int x = 0; x < pooledWidth; x++) {
+                double best = -INFINITY;
+                for (unsigned int p = 0; p < shape.pool * shape.pool; p++) {
+                    unsigned int top = y * shape.pool + p / shape.pool;
+                    unsigned int left = x * shape.pool + p % shape.pool;
+                    double sum = 0;
+                    for (unsigned int i = 0; i < kernel; i++) {
+                        for (unsigned int j = 0; j < kernel; j++) {
+                            sum += convWeight(o, (f * kernel + i) * kernel + j) *
+                                   o->b->values[(top + i) * o->n + left + j];
+                        }
+                    }
+                    best = sum > best ? sum : best;
+                }
+                out->values[(f * pooledHeight + y) * pooledWidth + x] = best;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+static int transposeReference(Operands* o, Matrix* out) {
+    shapeOutput(out, o->k, o->m);
+    for (unsigned int i = 0; i < o->m; i++) {
+        for (unsigned int k = 0; k < o->k; k++) {
+            out->values[k * o->m + i] = o->a->values[i * o->k + k];
+        }
+    }
+    return SUCCESS;
+}
+
+// Applies `operation` to every element of `same` and `other`
+static void elementWise(Operands* o, Matrix* out, double (*operation)(double, double)) {
+    shapeOutput(out, o->m, o->n);
+    for (unsigned int i = 0; i < o->m * o->n; i++) {
+        out->values[i] = operation(o->same->values[i], o->other->values[i]);
+    }
+}
+
+static double add(double x, double y) {
+    return x + y;
+}
+static double scale(double x, double y) {
+    return -0.3 * x;
+}
+static double multiply(double x, double y) {
+    return x * y;
+}
+static double update(double x, double y) {
+    return x + -0.05 * y;
+}
+static double sigmoid(double x, double y) {
+    return 1 / (1 + exp(-x));
+}
+static double dsigmoid(double x, double y) {
+    return sigmoid(x, y) * (1 - sigmoid(x, y));
+}
+static double relu(double x, double y) {
+    return x > 0 ? x : 0;
+}
+static double drelu(double x, double y) {
+    return x > 0 ? 1 : 0;
+}
+static double identity(double x, double y) {
+    return x;
+}
+
+static int addReference(Operands* o, Matrix* out) {
+    elementWise(o, out, add);
+    return SUCCESS;
+}
+static int scaleReference(Operands* o, Matrix* out) {
+    elementWise(o, out, scale);
+    return SUCCESS;
+}
+static int hadamardReference(Operands* o, Matrix* out) {
+    elementWise(o, out, multiply);
+    return SUCCESS;
+}
+static int updateReference(Operands* o, Matrix* out) {
+    elementWise(o, out, update);
+    return SUCCESS;
+}
+static int sigmoidReference(Operands* o, Matrix* out) {
+    elementWise(o, out, sigmoid);
+    return SUCCESS;
+}
+static int dsigmoidReference(Operands* o, Matrix* out) {
+    elementWise(o, out, dsigmoid);
+    return SUCCESS;
+}
+static int reluReference(Operands* o, Matrix* out) {
+    elementWise(o, out, relu);
+    return SUCCESS;
+}
+static int dreluReference(Operands* o, Matrix* out) {
+    elementWise(o, out, drelu);
+    return SUCCESS;
+}
+static int identityReference(Operands* o, Matrix* out) {
+    elementWise(o, out, identity);
+    return SUCCESS;
+}
+
+static int addColumnReference(Operands* o, Matrix* out) {
+    shapeOutput(out, o->m, o->n);
+    for (unsigned int i = 0; i < o->m; i++) {
+        for (unsigned int j = 0; j < o->n; j++) {
+            out->values[i * o->n + j] = o->same->values[i * o->n + j] + o->column->values[i];
+        }
+    }
+    return SUCCESS;
+}
+
+// The same network fed one column of `b` at a time through feedForwardNetwork
+static int singleForward(Operands* o, Matrix* out, int lowRank) {
+    NeuralNetwork* network = NULL;
+    int returnCode = makeCheckNetwork(o, lowRank, &network);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    Matrix* input = NULL;
+    returnCode = makeMatrix(o->k, 1, &input);
+    shapeOutput(out, o->m, o->n);
+    for (unsigned int j = 0; j < o->n && returnCode == SUCCESS; j++) {
+        for (unsigned int k = 0; k < o->k; k++) {
+            input->values[k] = o->b->values[k * o->n + j];
+        }
+        returnCode = feedForwardNetwork(network, input);
+        for (unsigned int i = 0; i < o->m && returnCode == SUCCESS; i++) {
+            out->values[i * o->n + j] = network->a[2]->values[i];
+        }
+    }
+    if (input != NULL) {
+        freeMatrix(input);
+    }
+    freeNetwork(network);
+    return returnCode;
+}
+
+static int singleForwardReference(Operands* o, Matrix* out) {
+    return singleForward(o, out, 0);
+}
+
+static int singleLowRankForwardReference(Operands* o, Matrix* out) {
+    return singleForward(o, out, 1);
+}
+
+static const Check checks[] = {
+    {"multiplyMatricesInto", multiplyBackend, multiplyReference, 4, 1e-12},
+    {"multiplyTransposedInto", multiplyTransposedBackend, multiplyTransposedReference, 4, 1e-12},
+    {"addOuterProductInto", outerProductBackend, outerProductReference, 1, 1e-15},
+    {"transposeMatrix", transposeBackend, transposeReference, 0, 0},
+    {"addMatricesInto", addBackend, addReference, 0, 0},
+    {"addColumnInto", addColumnBackend, addColumnReference, 0, 0},
+    {"multiplyScalarInto", scaleBackend, scaleReference, 0, 0},
+    {"hadamardProduct", hadamardBackend, hadamardReference, 0, 0},
+    {"addScaledInto", updateBackend, updateReference, 1, 1e-15},
+    {"sigmoidInto", sigmoidBackend, sigmoidReference, 4, 1e-15},
+    {"dsigmoidInto", dsigmoidBackend, dsigmoidReference, 4, 1e-15},
+    {"reluInto", reluBackend, reluReference, 0, 0},
+    {"dreluInto", dreluBackend, dreluReference, 0, 0},
+    {"half round trip", halfBackend, identityReference, 0, 1.0 / 2048},
+    {"bfloat16 round trip", bfloat16Backend, identityReference, 0, 1.0 / 256},
+    {"feedForwardNetworkBatch", batchForwardBackend, singleForwardReference, 4, 1e-12},
+    {"feedForwardNetworkBatch low rank", batchLowRankForwardBackend, singleLowRankForwardReference, 4, 1e-12},
+    {"multiplySparseRowInto", sparseMultiplyBackend, sparseMultiplyReference, 0, 0},
+    {"addSparseOuterProductInto", sparseOuterProductBackend, sparseOuterProductReference, 0, 0},
+    {"multiplySparseInto", sparseWeightsBackend, sparseWeightsReference, 0, 0},
+    {"multiplyQuantizedInto scalar", quantizedScalarBackend, quantizedPerChannelReference, 0, 0},
+    {"multiplyQuantizedInto avx2", quantizedAvx2Backend, quantizedPerChannelReference, 0, 0, avx2Available},
+    {"multiplyQuantizedInto avx512-vnni", quantizedVnniBackend, quantizedPerChannelReference, 0, 0, vnniAvailable},
+    {"multiplyQuantizedInto per layer", quantizedPerLayerBackend, quantizedPerLayerReference, 0, 0},
+    {"multiplyLowRankInto full rank", lowRankBackend, multiplyReference, 0, 1e-11},
+    {"unfoldInput convolution", convBackend, convReference, 0, 0},
+    {"multiplyMatricesInto parallel", multiplyBackend, multiplyReference, 4, 1e-12, NULL, 1},
+    {"addColumnInto parallel", addColumnBackend, addColumnReference, 0, 0, NULL, 1},
+    {"addScaledInto parallel", updateBackend, updateReference, 1, 1e-15, NULL, 1},
+    {"sigmoidInto parallel", sigmoidBackend, sigmoidReference, 4, 1e-15, NULL, 1},
+    {"multiplySparseInto parallel", sparseWeightsBackend, sparseWeightsReference, 0, 0, NULL, 1},
+    {"feedForwardNetworkBatch parallel", batchForwardBackend, singleForwardReference, 4, 1e-12, NULL, 1},
+    {"feedForwardNetworkBatch low rank parallel", batchLowRankForwardBackend, singleLowRankForwardReference,
+     4, 1e-12, NULL, 1},
+};
+
+// --- Comparison ---
+
+// Distance between two doubles in units in the last place
+static uint64_t ulpDistance(double x, double y) {
+    if (isnan(x) || isnan(y)) {
+        return isnan(x) && isnan(y) ? 0 : UINT64_MAX;
+    }
+    int64_t a, b;
+    memcpy(&a, &x, sizeof(double));
+    memcpy(&b, &y, sizeof(double));
+    // Order negative doubles below positive ones, -0 and 0 being equal
+    a = a < 0 ? INT64_MIN - a : a;
+    b = b < 0 ? INT64_MIN - b : b;
+    return a > b ? (uint64_t) a - (uint64_t) b : (uint64_t) b - (uint64_t) a;
+}
+
+typedef struct _CheckResult {
+    unsigned int shapes;
+    unsigned int failures; // Shapes with an element that didn't conform
+    uint64_t worstUlps;
+    double worstRelative; // Of the largest reference value
+    unsigned int failedM, failedN, failedK; // First failing shape
+} CheckResult;
+
+// Compares `got` with `expected` under `check`'s tolerances, adding to `result`
+static int compareOutputs(const Check* check, Matrix* got, Matrix* expected, CheckResult* result) {
+    if (got->rows != expected->rows || got->columns != expected->columns) {
+        return 0;
+    }
+    unsigned int n = expected->rows * expected->columns;
+    double largest = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        largest = fmax(largest, fabs(expected->values[i]));
+    }
+    int conforms = 1;
+    for (unsigned int i = 0; i < n; i++) {
+        uint64_t ulps = ulpDistance(got->values[i], expected->values[i]);
+        double relative = largest > 0 ? fabs(got->values[i] - expected->values[i]) / largest : 0;
+        if (ulps > result->worstUlps) {
+            result->worstUlps = ulps;
+        }
+        if (relative > result->worstRelative || isnan(relative)) {
+            result->worstRelative = isnan(relative) ? INFINITY : relative;
+        }
+        if (ulps > check->maxUlps && !(relative <= check->relativeTolerance)) {
+            conforms = 0;
+        }
+    }
+    return conforms;
+}
+
+// --- Operands ---
+
+static void fillMatrix(Matrix* m, Rng* rng) {
+    for (unsigned int i = 0; i < m->rows * m->columns; i++) {
+        m->values[i] = randomUniform(rng) * 8 - 4;
+    }
+}
+
+static void freeOperands(Operands* o) {
+    Matrix* matrices[] = {o->a, o->b, o->at, o->same, o->other, o->column, o->vector,
+                          o->mostlyZero, o->got, o->expected};
+    for (unsigned int i = 0; i < sizeof(matrices) / sizeof(Matrix*); i++) {
+        if (matrices[i] != NULL) {
+            freeMatrix(matrices[i]);
+        }
+    }
+    memset(o, 0, sizeof(Operands));
+}
+
+static int makeOperands(unsigned int m, unsigned int n, unsigned int k, Rng* rng, Operands* o) {
+    memset(o, 0, sizeof(Operands));
+    o->m = m;
+    o->n = n;
+    o->k = k;
+    int returnCode = SUCCESS;
+    if ((returnCode = makeMatrix(m, k, &o->a)) != SUCCESS ||
+        (returnCode = makeMatrix(k, n, &o->b)) != SUCCESS ||
+        (returnCode = makeMatrix(k, m, &o->at)) != SUCCESS ||
+        (returnCode = makeMatrix(m, n, &o->same)) != SUCCESS ||
+        (returnCode = makeMatrix(m, n, &o->other)) != SUCCESS ||
+        (returnCode = makeMatrix(m, 1, &o->column)) != SUCCESS ||
+        (returnCode = makeMatrix(n, 1, &o->vector)) != SUCCESS ||
+        (returnCode = makeMatrix(n, k, &o->mostlyZero)) != SUCCESS ||
+        (returnCode = makeMatrix(MAX_DIMENSION, MAX_DIMENSION, &o->got)) != SUCCESS ||
+        (returnCode = makeMatrix(MAX_DIMENSION, MAX_DIMENSION, &o->expected)) != SUCCESS) {
+        freeOperands(o);
+        return returnCode;
+    }
+    Matrix* inputs[] = {o->a, o->b, o->at, o->same, o->other, o->column, o->vector, o->mostlyZero};
+    for (unsigned int i = 0; i < sizeof(inputs) / sizeof(Matrix*); i++) {
+        fillMatrix(inputs[i], rng);
+    }
+    for (unsigned int i = 0; i < n * k; i++) {
+        if (randomUniform(rng) < 0.8) {
+            o->mostlyZero->values[i] = 0;
+        }
+    }
+    return SUCCESS;
+}
+
+// A random size, an edge size half of the time
+static unsigned int randomSize(Rng* rng, unsigned int limit) {
+    unsigned int size;
+    do {
+        if (randomUniform(rng) < 0.5) {
+            size = edgeSizes[(unsigned int) (randomUniform(rng) * (sizeof(edgeSizes) / sizeof(unsigned int)))];
+        } else {
+            size = 1 + (unsigned int) (randomUniform(rng) * 96);
+        }
+    } while (size > limit);
+    return size;
+}
+
+// --- Training ---
+
+/**
+ * Trains the baseline's network with output silenced, placing the testing
+ * accuracy and cost after each epoch in `records`. The layers are trained
+ * as a pipeline of `pipelineStages` threads if it is above 1.
+ */
+static int trainBaselineNetwork(EpochRecord* records, unsigned int pipelineStages) {
+    Dataset* trainingData = NULL;
+    Dataset* testingData = NULL;
+    NeuralNetwork* network = NULL;
+    int returnCode = makeSyntheticDataset(TRAINING_SAMPLES, 28, 28, 10, TRAINING_SEED, 0, &trainingData);
+    if (returnCode == SUCCESS) {
+        returnCode = makeSyntheticDataset(TESTING_SAMPLES, 28, 28, 10, TRAINING_SEED, 1, &testingData);
+    }
+    unsigned int* neurons = malloc(3 * sizeof(unsigned int));
+    if (returnCode == SUCCESS && neurons == NULL) {
+        returnCode = reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    if (returnCode == SUCCESS) {
+        neurons[0] = 28 * 28;
+        neurons[1] = TRAINING_HIDDEN;
+        neurons[2] = 10;
+        returnCode = makeSeededNetwork(1, neurons, TRAINING_RATE, TRAINING_SEED, &network);
+        neurons = NULL; // Owned by the network
+    }
+    if (returnCode == SUCCESS) {
+        network->trainingData = trainingData;
+        network->testingData = testingData;
+        network->epochRecords = records;
+        network->pipelineStages = pipelineStages;
+
+        // Each epoch prints its evaluation, which would bury the report
+        fflush(stdout);
+        int savedOutput = dup(fileno(stdout));
+        int devNull = open("/dev/null", O_WRONLY);
+        if (savedOutput >= 0 && devNull >= 0) {
+            dup2(devNull, fileno(stdout));
+        }
+        returnCode = trainNetworkMiniBatches(network, TRAINING_EPOCHS, TRAINING_BATCH);
+        fflush(stdout);
+        if (savedOutput >= 0 && devNull >= 0) {
+            dup2(savedOutput, fileno(stdout));
+        }
+        if (savedOutput >= 0) {
+            close(savedOutput);
+        }
+        if (devNull >= 0) {
+            close(devNull);
+        }
+    }
+    free(neurons);
+    freeNetwork(network);
+    freeDataset(trainingData);
+    freeDataset(testingData);
+    return returnCode;
+}
+
+static int writeBaseline(char* filename, EpochRecord* records) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        return reportError(BAD_FILE_NAME, filename);
+    }
+    fprintf(file, "# epoch accuracy cost, from ./conformance --record\n");
+    for (unsigned int e = 0; e < TRAINING_EPOCHS; e++) {
+        fprintf(file, "%u %.17g %.17g\n", e, records[e].accuracy, records[e].cost);
+    }
+    if (fclose(file) != 0) {
+        return reportError(OUTPUT_FAILED, filename);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Compares `records` with the baseline in `filename`, printing each epoch,
+ * and places whether they all agree in `agrees`.
+ */
+static int compareBaseline(char* filename, EpochRecord* records, int* agrees) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        return reportError(BAD_FILE_NAME, filename);
+    }
+    char line[256];
+    unsigned int compared = 0;
+    *agrees = 1;
+    printf("%-8s %12s %12s %14s %14s %8s\n", "epoch", "accuracy", "baseline", "cost", "baseline", "result");
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned int epoch;
+        double accuracy, cost;
+        if (line[0] == '#' || sscanf(line, "%u %lf %lf", &epoch, &accuracy, &cost) != 3) {
+            continue;
+        }
+        if (epoch >= TRAINING_EPOCHS) {
+            continue;
+        }
+        EpochRecord* record = &records[epoch];
+        int agreed = fabs(record->accuracy - accuracy) <= ACCURACY_TOLERANCE &&
+                     fabs(record->cost - cost) <= COST_TOLERANCE * fabs(cost);
+        printf("%-8u %12.4f %12.4f %14.8f %14.8f %8s\n", epoch, record->accuracy, accuracy,
+               record->cost, cost, agreed ? "ok" : "DRIFTED");
+        *agrees = *agrees && agreed;
+        compared++;
+    }
+    fclose(file);
+    if (compared != TRAINING_EPOCHS) {
+        *agrees = 0;
+        printf("The baseline has %u of %u epochs, run ./conformance --record\n", compared, TRAINING_EPOCHS);
+    }
+    return SUCCESS;
+}
+
+// --- Main ---
+
+int main(int argc, char** argv) {
+    char* only = NULL;
+    char* baseline = DEFAULT_BASELINE;
+    unsigned int numberOfShapes = DEFAULT_SHAPES;
+    unsigned long long seed = 1;
+    int record = 0;
+    int training = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--record") == 0) {
+            record = 1;
+            continue;
+        } else if (strcmp(argv[i], "--no-training") == 0) {
+            training = 0;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            printf("Usage: ./conformance [--shapes n] [--seed n] [--check name] [--baseline file]\n"
+                   "                     [--record] [--no-training]\n");
+            return reportError(MISC, argv[i]);
+        }
+        if (strcmp(argv[i], "--shapes") == 0) {
+            if (sscanf(argv[++i], "%u", &numberOfShapes) != 1 || numberOfShapes == 0) {
+                return reportError(MISC, "Conversion of shapes argument error");
+            }
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            if (sscanf(argv[++i], "%llu", &seed) != 1) {
+                return reportError(MISC, "Conversion of seed argument error");
+            }
+        } else if (strcmp(argv[i], "--check") == 0) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0) {
+            baseline = argv[++i];
+        } else {
+            return reportError(MISC, argv[i]);
+        }
+    }
+
+    Rng rng;
+    seedRng(&rng, seed);
+    int returnCode = SUCCESS;
+    int conforms = 1;
+    returnCode = makeThreadPool(CHECK_THREADS, &checkPool);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    printf("%-42s %8s %8s %12s %12s %8s\n", "check", "shapes", "failed", "worst ULPs", "worst rel", "result");
+    for (unsigned int c = 0; c < sizeof(checks) / sizeof(Check) && returnCode == SUCCESS; c++) {
+        const Check* check = &checks[c];
+        if (only != NULL && strcmp(only, check->name) != 0) {
+            continue;
+        }
+        if (check->available != NULL && !check->available()) {
+            printf("%-42s %8s %8s %12s %12s %8s\n", check->name, "-", "-", "-", "-", "skipped");
+            continue;
+        }
+        CheckResult result;
+        memset(&result, 0, sizeof(CheckResult));
+        for (unsigned int s = 0; s < numberOfShapes; s++) {
+            unsigned int m = randomSize(&rng, MAX_DIMENSION);
+            unsigned int n = randomSize(&rng, MAX_DIMENSION);
+            unsigned int k = randomSize(&rng, MAX_DIMENSION);
+            Operands operands;
+            returnCode = makeOperands(m, n, k, &rng, &operands);
+            if (returnCode != SUCCESS) {
+                break;
+            }
+            if (check->parallel) {
+                setKernelThreadPool(checkPool);
+            }
+            returnCode = check->backend(&operands, operands.got);
+            setKernelThreadPool(NULL);
+            if (returnCode == SUCCESS) {
+                returnCode = check->reference(&operands, operands.expected);
+            }
+            if (returnCode == SUCCESS && !compareOutputs(check, operands.got, operands.expected, &result)) {
+                if (result.failures++ == 0) {
+                    result.failedM = m;
+                    result.failedN = n;
+                    result.failedK = k;
+                }
+            }
+            result.shapes++;
+            freeOperands(&operands);
+            if (returnCode != SUCCESS) {
+                break;
+            }
+        }
+        printf("%-42s %8u %8u %12llu %12.3g %8s", check->name, result.shapes, result.failures,
+               (unsigned long long) result.worstUlps, result.worstRelative,
+               result.failures == 0 ? "ok" : "FAILED");
+        if (result.failures > 0) {
+            printf("  first at m=%u n=%u k=%u", result.failedM, result.failedN, result.failedK);
+        }
+        printf("\n");
+        conforms = conforms && result.failures == 0;
+    }
+    freeThreadPool(checkPool);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+
+    if (training) {
+        EpochRecord records[TRAINING_EPOCHS];
+        memset(records, 0, sizeof(records));
+        printf("\nTraining %u epochs of %u synthetic images, seed %u\n", TRAINING_EPOCHS, TRAINING_SAMPLES, TRAINING_SEED);
+        returnCode = trainBaselineNetwork(records, 0);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+        if (record) {
+            returnCode = writeBaseline(baseline, records);
+            if (returnCode != SUCCESS) {
+                return returnCode;
+            }
+            printf("Recorded the baseline in %s\n", baseline);
+        } else {
+            int agrees;
+            returnCode = compareBaseline(baseline, records, &agrees);
+            if (returnCode != SUCCESS) {
+                return returnCode;
+            }
+            conforms = conforms && agrees;
+        }
+
+        // Pipelining sums every gradient in the same order, so nothing may differ
+        EpochRecord pipelined[TRAINING_EPOCHS];
+        memset(pipelined, 0, sizeof(pipelined));
+        returnCode = trainBaselineNetwork(pipelined, TRAINING_STAGES);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+        int identical = 1;
+        for (unsigned int e = 0; e < TRAINING_EPOCHS; e++) {
+            identical = identical && pipelined[e].accuracy == records[e].accuracy &&
+                        pipelined[e].cost == records[e].cost;
+        }
+        printf("Pipelined between %u threads: %s\n", TRAINING_STAGES, identical ? "identical" : "DIFFERED");
+        conforms = conforms && identical;
+    }
+
+    if (!conforms) {
+        return reportError(MISC, "conformance failed");
+    }
+    printf("All checks conform\n");
+    return SUCCESS;
+}
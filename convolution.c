@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include "err.h"
+#include "convolution.h"
+#include "perfCounters.h"
+
+int convShapeSize(const ConvShape* shape, unsigned int* inputs, unsigned int* outputs) {
+    if (shape->channels == 0 || shape->filters == 0 || shape->kernel == 0 || shape->pool == 0 ||
+        shape->kernel > shape->height || shape->kernel > shape->width) {
+        return reportError(MISC, "convShapeSize error: filters must fit inside the input");
+    }
+    unsigned int height = (shape->height - shape->kernel + 1) / shape->pool;
+    unsigned int width = (shape->width - shape->kernel + 1) / shape->pool;
+    if (height == 0 || width == 0) {
+        return reportError(MISC, "convShapeSize error: pool is larger than the convolution");
+    }
+    *inputs = shape->channels * shape->height * shape->width;
+    *outputs = shape->filters * height * width;
+    return SUCCESS;
+}
+
+int makeConvLayer(const ConvShape* shape, ConvLayer** layer) {
+    unsigned int inputs, outputs;
+    int returnCode = convShapeSize(shape, &inputs, &outputs);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    *layer = calloc(1, sizeof(ConvLayer));
+    if (*layer == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    ConvLayer* l = *layer;
+    l->shape = *shape;
+    l->outputHeight = shape->height - shape->kernel + 1;
+    l->outputWidth = shape->width - shape->kernel + 1;
+    unsigned int patch = shape->channels * shape->kernel * shape->kernel;
+    unsigned int positions = l->outputHeight * l->outputWidth;
+    l->maxima = malloc(outputs * sizeof(unsigned int));
+    if (l->maxima == NULL ||
+        (returnCode = makeMatrix(patch, positions, &l->columns)) != SUCCESS ||
+        (returnCode = makeMatrix(positions, patch, &l->columnsTransposed)) != SUCCESS ||
+        (returnCode = makeMatrix(shape->filters, positions, &l->convolved)) != SUCCESS ||
+        (returnCode = makeMatrix(shape->filters, positions, &l->gradient)) != SUCCESS ||
+        (returnCode = makeMatrix(patch, positions, &l->columnGradient)) != SUCCESS ||
+        (returnCode = makeMatrix(shape->filters, patch, &l->weightGradient)) != SUCCESS ||
+        (returnCode = makeMatrix(inputs, 1, &l->sample)) != SUCCESS ||
+        (returnCode = makeMatrix(outputs, 1, &l->pooled)) != SUCCESS) {
+        freeConvLayer(l);
+        *layer = NULL;
+        return returnCode != SUCCESS ? returnCode : reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    return SUCCESS;
+}
+
+void freeConvLayer(ConvLayer* layer) {
+    if (layer == NULL) {
+        return;
+    }
+    Matrix* matrices[] = {layer->columns, layer->columnsTransposed, layer->convolved,
+                          layer->gradient, layer->columnGradient, layer->weightGradient,
+                          layer->sample, layer->pooled};
+    for (unsigned int i = 0; i < sizeof(matrices) / sizeof(Matrix*); i++) {
+        if (matrices[i] != NULL) {
+            freeMatrix(matrices[i]);
+        }
+    }
+    free(layer->maxima);
+    free(layer);
+}
+
+int unfoldInput(ConvLayer* layer, Matrix* input) {
+    ConvShape* s = &layer->shape;
+    if (input->rows != s->channels * s->height * s->width || input->columns != 1) {
+        return reportError(MISC, "unfoldInput error: input doesn't match the layer");
+    }
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    // Row (c, i, j) of the columns is pixel (y + i, x + j) of channel c for
+    // the filter at (y, x), so each row is a shifted window of one channel
+    unsigned int positions = layer->outputHeight * layer->outputWidth;
+    double* row = layer->columns->values;
+    for (unsigned int c = 0; c < s->channels; c++) {
+        const double* channel = &input->values[(size_t) c * s->height * s->width];
+        for (unsigned int i = 0; i < s->kernel; i++) {
+            for (unsigned int j = 0; j < s->kernel; j++) {
+                for (unsigned int y = 0; y < layer->outputHeight; y++) {
+                    const double* pixels = &channel[(y + i) * s->width + j];
+                    for (unsigned int x = 0; x < layer->outputWidth; x++) {
+                        row[y * layer->outputWidth + x] = pixels[x];
+                    }
+                }
+                row += positions;
+            }
+        }
+    }
+    if (counting) {
+        perfEnd("unfoldInput", layer->columns->rows, positions, 0, &counters);
+    }
+    return SUCCESS;
+}
+
+int poolInto(ConvLayer* layer, Matrix* output) {
+    ConvShape* s = &layer->shape;
+    unsigned int height = layer->outputHeight / s->pool;
+    unsigned int width = layer->outputWidth / s->pool;
+    if (output->rows != s->filters * height * width || output->columns != 1) {
+        return reportError(MISC, "poolInto error: output doesn't match the layer");
+    }
+    unsigned int positions = layer->outputHeight * layer->outputWidth;
+    unsigned int o = 0;
+    for (unsigned int f = 0; f < s->filters; f++) {
+        for (unsigned int y = 0; y < height; y++) {
+            for (unsigned int x = 0; x < width; x++) {
+                // First largest position of the window, scanned row by row
+                unsigned int best = f * positions + y * s->pool * layer->outputWidth + x * s->pool;
+                for (unsigned int i = 0; i < s->pool; i++) {
+                    for (unsigned int j = 0; j < s->pool; j++) {
+                        unsigned int p = f * positions + (y * s->pool + i) * layer->outputWidth + x * s->pool + j;
+                        if (layer->convolved->values[p] > layer->convolved->values[best]) {
+                            best = p;
+                        }
+                    }
+                }
+                layer->maxima[o] = best;
+                output->values[o++] = layer->convolved->values[best];
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+int unpoolGradient(ConvLayer* layer, Matrix* delta) {
+    if (delta->rows != layer->pooled->rows || delta->columns != 1) {
+        return reportError(MISC, "unpoolGradient error: delta doesn't match the layer");
+    }
+    zeroMatrix(layer->gradient);
+    for (unsigned int o = 0; o < delta->rows; o++) {
+        layer->gradient->values[layer->maxima[o]] += delta->values[o];
+    }
+    return SUCCESS;
+}
+
+int addConvWeightGradientInto(ConvLayer* layer, Matrix* nablaW) {
+    // nablaW += gradient * columns^T
+    int returnCode = transposeMatrix(layer->columns, &layer->columnsTransposed);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    returnCode = multiplyMatricesInto(layer->gradient, layer->columnsTransposed, layer->weightGradient);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    return addMatricesInto(nablaW, layer->weightGradient, nablaW);
+}
+
+int convInputGradientInto(ConvLayer* layer, Matrix* weights, Matrix* result) {
+    ConvShape* s = &layer->shape;
+    if (result->rows != s->channels * s->height * s->width || result->columns != 1) {
+        return reportError(MISC, "convInputGradientInto error: result doesn't match the layer");
+    }
+    // Gradient of the columns is weights^T * gradient, folded back onto the
+    // pixels each column was unfolded from
+    int returnCode = multiplyTransposedInto(weights, layer->gradient, layer->columnGradient);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    zeroMatrix(result);
+    unsigned int positions = layer->outputHeight * layer->outputWidth;
+    const double* row = layer->columnGradient->values;
+    for (unsigned int c = 0; c < s->channels; c++) {
+        double* channel = &result->values[(size_t) c * s->height * s->width];
+        for (unsigned int i = 0; i < s->kernel; i++) {
+            for (unsigned int j = 0; j < s->kernel; j++) {
+                for (unsigned int y = 0; y < layer->outputHeight; y++) {
+                    double* pixels = &channel[(y + i) * s->width + j];
+                    for (unsigned int x = 0; x < layer->outputWidth; x++) {
+                        pixels[x] += row[y * layer->outputWidth + x];
+                    }
+                }
+                row += positions;
+            }
+        }
+    }
+    if (counting) {
+        perfEnd("foldColumns", layer->columns->rows, positions, 0, &counters);
+    }
+    return SUCCESS;
+}
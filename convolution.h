@@ -0,0 +1,100 @@
+#ifndef CONVOLUTION
+#define CONVOLUTION
+
+#include <stdint.h>
+#include "mathLib.h"
+
+/*
+ * Convolutional layers, each a set of square filters slid over every
+ * position of the input with a stride of one and no padding, followed by a
+ * max pool over non-overlapping `pool` by `pool` windows. Inputs and outputs
+ * are the usual column vectors of the network, holding each channel's
+ * pixels row by row, one channel after another, so a convolutional layer
+ * can feed a fully connected one or another convolutional one unchanged.
+ *
+ * Convolution is one matrix product: the input is unfolded (im2col) into a
+ * matrix with a column of every patch the filters cover, and the layer's
+ * weights, a row of each filter, multiply it with any of the network's
+ * kernels. Training folds the gradient of those columns back (col2im) to
+ * get the gradient of the input. Biases are kept per pooled output, which
+ * lets every layer share the fully connected layers' bias handling.
+ */
+
+/**
+ * Shape of a convolutional layer, also how model files store it.
+ */
+typedef struct _ConvShape {
+    uint32_t channels; // Of the input
+    uint32_t height; // Of the input
+    uint32_t width; // Of the input
+    uint32_t kernel; // Filters are kernel by kernel by channels
+    uint32_t filters; // Channels of the output
+    uint32_t pool; // Max pool window and stride, 1 to not pool
+} ConvShape;
+
+/**
+ * A convolutional layer and the matrices it works in, all allocated when it
+ * is made so that training never allocates.
+ */
+typedef struct _ConvLayer {
+    ConvShape shape;
+    unsigned int outputHeight; // Of the convolution, before pooling
+    unsigned int outputWidth;
+    Matrix* columns; // Unfolded input, channels * kernel * kernel by positions
+    Matrix* columnsTransposed; // Scratch for the weight gradient
+    Matrix* convolved; // Filters by positions, the weights times `columns`
+    unsigned int* maxima; // Index into `convolved` of each pooled output
+    Matrix* gradient; // Filters by positions, gradient of `convolved`
+    Matrix* columnGradient; // Shaped like `columns`, gradient of the unfolded input
+    Matrix* weightGradient; // Shaped like the weights
+    Matrix* sample; // Input column of one sample of a batch
+    Matrix* pooled; // Output column of one sample of a batch
+} ConvLayer;
+
+/**
+ * Checks `shape` describes a layer whose pooled output has at least one
+ * pixel, and places its number of inputs and outputs in `inputs` and
+ * `outputs`.
+ */
+int convShapeSize(const ConvShape* shape, unsigned int* inputs, unsigned int* outputs);
+
+/**
+ * Makes a convolutional layer of shape `shape` in the output vector `layer`.
+ * Its weights are `shape->filters` by `shape->channels * kernel * kernel`,
+ * and are kept by the network like any other layer's.
+ */
+int makeConvLayer(const ConvShape* shape, ConvLayer** layer);
+void freeConvLayer(ConvLayer* layer);
+
+/**
+ * Unfolds the input `input` into `layer->columns`, ready to be multiplied by
+ * the weights into `layer->convolved`.
+ */
+int unfoldInput(ConvLayer* layer, Matrix* input);
+
+/**
+ * Max pools `layer->convolved` into the column vector `output`, remembering
+ * which position each output came from.
+ */
+int poolInto(ConvLayer* layer, Matrix* output);
+
+/**
+ * Places the gradient of `layer->convolved` in `layer->gradient`, given the
+ * gradient `delta` of the pooled outputs. Each output's gradient goes to the
+ * position it was pooled from.
+ */
+int unpoolGradient(ConvLayer* layer, Matrix* delta);
+
+/**
+ * Adds the gradient of the weights to `nablaW`, from `layer->gradient` and
+ * the input unfolded by the last `unfoldInput`.
+ */
+int addConvWeightGradientInto(ConvLayer* layer, Matrix* nablaW);
+
+/**
+ * Places the gradient of the layer's input in the column vector `result`,
+ * from `layer->gradient` and the layer's weights `weights`.
+ */
+int convInputGradientInto(ConvLayer* layer, Matrix* weights, Matrix* result);
+
+#endif // CONVOLUTION
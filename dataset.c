@@ -0,0 +1,538 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> // For SIZE_MAX
+#include <limits.h> // For UCHAR_MAX and UINT_MAX
+#include <string.h> // For parsing .npy headers
+#include <fcntl.h> // For open
+#include <unistd.h> // For close
+#include <sys/mman.h> // For mmap
+#include <sys/stat.h> // For the size of mapped files
+#include "err.h"
+#include "dataset.h"
+#include "imageInput.h" // For readMNIST
+#include "utils.h" // For sortBatchIndices
+#include "placement.h" // For interleaving samples
+
+#define NPY_MAGIC "\x93NUMPY"
+#define NPY_MAGIC_LENGTH 6
+#define NPY_MAX_DIMENSIONS 4
+
+// A mapped .npy file and the parts of its header that are used
+typedef struct _NpyArray {
+    void* mapping;
+    size_t mappingLength;
+    const unsigned char* data; // Start of the payload within `mapping`
+    char kind; // 'u', 'i' or 'f'
+    unsigned int itemSize; // Bytes per value
+    unsigned int dimensions;
+    unsigned long shape[NPY_MAX_DIMENSIONS];
+} NpyArray;
+
+// Finds the value of `key` in the header dictionary `header`
+static const char* npyHeaderValue(const char* header, const char* key) {
+    const char* found = strstr(header, key);
+    if (found == NULL) {
+        return NULL;
+    }
+    found = strchr(found + strlen(key), ':');
+    if (found == NULL) {
+        return NULL;
+    }
+    found++;
+    while (*found == ' ') {
+        found++;
+    }
+    return found;
+}
+
+// Parses a header dictionary such as
+// {'descr': '<f4', 'fortran_order': False, 'shape': (60000, 28, 28), }
+static int parseNpyHeader(char* filename, const char* header, NpyArray* array) {
+    // Data type, only little endian or single byte types are accepted
+    const char* descr = npyHeaderValue(header, "'descr'");
+    if (descr == NULL || descr[0] != '\'' || (descr[1] != '<' && descr[1] != '|')) {
+        return reportError(BAD_DATA, filename);
+    }
+    array->kind = descr[2];
+    array->itemSize = (unsigned int) atoi(&descr[3]);
+    if ((array->kind != 'u' && array->kind != 'i' && array->kind != 'f') ||
+        array->itemSize == 0 || array->itemSize > 8) {
+        return reportError(BAD_DATA, filename);
+    }
+
+    // Only C-order arrays can be used without copying
+    const char* order = npyHeaderValue(header, "'fortran_order'");
+    if (order == NULL || strncmp(order, "False", 5) != 0) {
+        return reportError(BAD_DATA, filename);
+    }
+
+    // Shape tuple
+    const char* shape = npyHeaderValue(header, "'shape'");
+    if (shape == NULL || *shape != '(') {
+        return reportError(BAD_DATA, filename);
+    }
+    shape++;
+    array->dimensions = 0;
+    while (*shape != ')') {
+        char* end = NULL;
+        unsigned long length = strtoul(shape, &end, 10);
+        // Datasets count samples and values in unsigned ints
+        if (end == shape || *shape == '-' || length > UINT_MAX) {
+            return reportError(BAD_DATA, filename);
+        }
+        if (array->dimensions == NPY_MAX_DIMENSIONS) {
+            return reportError(BAD_DATA, filename);
+        }
+        array->shape[array->dimensions++] = length;
+        shape = end;
+        while (*shape == ',' || *shape == ' ') {
+            shape++;
+        }
+    }
+    if (array->dimensions == 0) {
+        return reportError(BAD_DATA, filename);
+    }
+    return SUCCESS;
+}
+
+// Maps `filename` and reads its .npy header into `array`
+static int mapNpy(char* filename, NpyArray* array) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return reportError(BAD_FILE_NAME, filename);
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < NPY_MAGIC_LENGTH + 4) {
+        close(fd);
+        return reportError(BAD_DATA, filename);
+    }
+    array->mappingLength = (size_t) status.st_size;
+    array->mapping = mmap(NULL, array->mappingLength, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid
+    if (array->mapping == MAP_FAILED) {
+        array->mapping = NULL;
+        return reportError(MISC, "mapNpy error: file could not be mapped");
+    }
+
+    // Magic string, version and header length
+    const unsigned char* bytes = array->mapping;
+    if (memcmp(bytes, NPY_MAGIC, NPY_MAGIC_LENGTH) != 0) {
+        munmap(array->mapping, array->mappingLength);
+        return reportError(BAD_MAGIC_NUMBER, filename);
+    }
+    size_t headerStart, headerLength;
+    if (bytes[6] == 1) {
+        headerLength = bytes[8] | (bytes[9] << 8);
+        headerStart = 10;
+    } else {
+        headerLength = bytes[8] | (bytes[9] << 8) | (bytes[10] << 16) | ((size_t) bytes[11] << 24);
+        headerStart = 12;
+    }
+    if (headerStart + headerLength > array->mappingLength) {
+        munmap(array->mapping, array->mappingLength);
+        return reportError(BAD_DATA, filename);
+    }
+
+    // Copy the header so that it can be read as a string
+    char* header = malloc(headerLength + 1);
+    if (header == NULL) {
+        munmap(array->mapping, array->mappingLength);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    memcpy(header, bytes + headerStart, headerLength);
+    header[headerLength] = '\0';
+    int returnCode = parseNpyHeader(filename, header, array);
+    free(header);
+    if (returnCode != SUCCESS) {
+        munmap(array->mapping, array->mappingLength);
+        return returnCode;
+    }
+    array->data = bytes + headerStart + headerLength;
+
+    // Check that the whole payload is present, without overflowing its size
+    size_t payload = array->itemSize;
+    int overflow = 0;
+    for (unsigned int i = 0; i < array->dimensions; i++) {
+        if (array->shape[i] != 0 && payload > SIZE_MAX / array->shape[i]) {
+            overflow = 1;
+            break;
+        }
+        payload *= array->shape[i];
+    }
+    if (overflow || payload > array->mappingLength - headerStart - headerLength) {
+        munmap(array->mapping, array->mappingLength);
+        return reportError(BAD_DATA, filename);
+    }
+    return SUCCESS;
+}
+
+// Reads value `index` of an integer .npy array
+static long npyInteger(NpyArray* array, size_t index) {
+    const unsigned char* p = array->data + index * array->itemSize;
+    unsigned long value = 0;
+    for (unsigned int i = 0; i < array->itemSize && i < sizeof(long); i++) {
+        value |= (unsigned long) p[i] << (8 * i);
+    }
+    if (array->kind == 'i' && array->itemSize < sizeof(long) &&
+        (p[array->itemSize - 1] & 0x80)) {
+        value |= ~0UL << (8 * array->itemSize); // Sign extend
+    }
+    return (long) value;
+}
+
+int makeDatasetFromImages(Image** images, unsigned int numberOfImages,
+                          Dataset** dataset) {
+    *dataset = calloc(1, sizeof(Dataset));
+    if (*dataset == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*dataset)->type = DATASET_IMAGES;
+    (*dataset)->numberOfSamples = numberOfImages;
+    (*dataset)->images = images;
+    if (numberOfImages > 0) {
+        (*dataset)->rows = images[0]->rows;
+        (*dataset)->columns = images[0]->columns;
+    }
+    return SUCCESS;
+}
+
+int loadNpyDataset(char* samplesFilename, char* labelsFilename,
+                   Dataset** dataset) {
+    NpyArray samples;
+    int returnCode = mapNpy(samplesFilename, &samples);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    if (!(samples.kind == 'u' && samples.itemSize == 1) &&
+        !(samples.kind == 'f' && samples.itemSize == 4)) {
+        munmap(samples.mapping, samples.mappingLength);
+        return reportError(BAD_DATA, samplesFilename);
+    }
+    if (samples.dimensions != 2 && samples.dimensions != 3) {
+        munmap(samples.mapping, samples.mappingLength);
+        return reportError(BAD_DATA, samplesFilename);
+    }
+    // Each sample's values are counted in an unsigned int too
+    unsigned long sampleRows = samples.dimensions == 3 ? samples.shape[1] : 1;
+    if (sampleRows != 0 && samples.shape[samples.dimensions - 1] > UINT_MAX / sampleRows) {
+        munmap(samples.mapping, samples.mappingLength);
+        return reportError(BAD_DATA, samplesFilename);
+    }
+
+    *dataset = calloc(1, sizeof(Dataset));
+    if (*dataset == NULL) {
+        munmap(samples.mapping, samples.mappingLength);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*dataset)->type = samples.kind == 'u' ? DATASET_UINT8 : DATASET_FLOAT32;
+    (*dataset)->numberOfSamples = (unsigned int) samples.shape[0];
+    (*dataset)->rows = (unsigned int) sampleRows;
+    (*dataset)->columns = (unsigned int) samples.shape[samples.dimensions - 1];
+    (*dataset)->samples = samples.data;
+    (*dataset)->mapping = samples.mapping;
+    (*dataset)->mappingLength = samples.mappingLength;
+
+    // Labels are small, so they are converted to bytes and unmapped
+    NpyArray labels;
+    returnCode = mapNpy(labelsFilename, &labels);
+    if (returnCode != SUCCESS) {
+        freeDataset(*dataset);
+        *dataset = NULL;
+        return returnCode;
+    }
+    if (labels.kind == 'f' || labels.dimensions != 1 ||
+        labels.shape[0] != (*dataset)->numberOfSamples) {
+        munmap(labels.mapping, labels.mappingLength);
+        freeDataset(*dataset);
+        *dataset = NULL;
+        return reportError(BAD_DATA, labelsFilename);
+    }
+    (*dataset)->labels = malloc((*dataset)->numberOfSamples);
+    if ((*dataset)->labels == NULL) {
+        munmap(labels.mapping, labels.mappingLength);
+        freeDataset(*dataset);
+        *dataset = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    for (unsigned int i = 0; i < (*dataset)->numberOfSamples; i++) {
+        long label = npyInteger(&labels, i);
+        if (label < 0 || label > UCHAR_MAX) {
+            munmap(labels.mapping, labels.mappingLength);
+            freeDataset(*dataset);
+            *dataset = NULL;
+            return reportError(BAD_DATA, labelsFilename);
+        }
+        (*dataset)->labels[i] = (unsigned char) label;
+    }
+    munmap(labels.mapping, labels.mappingLength);
+    return SUCCESS;
+}
+
+int makeSyntheticDataset(unsigned int numberOfSamples, unsigned int rows,
+                         unsigned int columns, unsigned int classes,
+                         uint64_t seed, unsigned int part, Dataset** dataset) {
+    size_t size = (size_t) rows * columns;
+    unsigned char* patterns = malloc(classes * size);
+    unsigned char* samples = malloc(numberOfSamples * size);
+    unsigned char* labels = malloc(numberOfSamples);
+    *dataset = calloc(1, sizeof(Dataset));
+    if (patterns == NULL || samples == NULL || labels == NULL || *dataset == NULL) {
+        free(patterns);
+        free(samples);
+        free(labels);
+        free(*dataset);
+        *dataset = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+
+    // A fifth of each pattern's pixels are lit
+    Rng rng;
+    seedRng(&rng, seed);
+    for (size_t i = 0; i < classes * size; i++) {
+        patterns[i] = randomBelow(&rng, 5) == 0 ? 128 + randomBelow(&rng, 128) : 0;
+    }
+
+    // Each sample replaces a quarter of its pattern's pixels with noise
+    seedRng(&rng, seed + 1 + part);
+    for (unsigned int n = 0; n < numberOfSamples; n++) {
+        labels[n] = (unsigned char) randomBelow(&rng, classes);
+        const unsigned char* pattern = patterns + labels[n] * size;
+        unsigned char* sample = samples + n * size;
+        for (size_t i = 0; i < size; i++) {
+            sample[i] = randomBelow(&rng, 4) == 0 ? randomBelow(&rng, 256) : pattern[i];
+        }
+    }
+    free(patterns);
+
+    (*dataset)->type = DATASET_UINT8;
+    (*dataset)->numberOfSamples = numberOfSamples;
+    (*dataset)->rows = rows;
+    (*dataset)->columns = columns;
+    (*dataset)->samples = samples;
+    (*dataset)->ownedSamples = samples;
+    (*dataset)->labels = labels;
+    return SUCCESS;
+}
+
+int readDataset(char* samplesFilename, char* labelsFilename, Dataset** dataset) {
+    size_t length = strlen(samplesFilename);
+    if (length > 4 && strcmp(samplesFilename + length - 4, ".npy") == 0) {
+        return loadNpyDataset(samplesFilename, labelsFilename, dataset);
+    }
+
+    Image** images = NULL;
+    int numberOfImages = 0;
+    int returnCode = readMNIST(samplesFilename, labelsFilename, &images, &numberOfImages);
+    if (returnCode != SUCCESS) {
+        freeAllImages(images, numberOfImages);
+        return returnCode;
+    }
+    returnCode = makeDatasetFromImages(images, numberOfImages, dataset);
+    if (returnCode != SUCCESS) {
+        freeAllImages(images, numberOfImages);
+    }
+    return returnCode;
+}
+
+void freeDataset(Dataset* dataset) {
+    if (dataset == NULL) {
+        return;
+    }
+    if (dataset->type == DATASET_IMAGES) {
+        freeAllImages(dataset->images, dataset->numberOfSamples);
+    }
+    if (dataset->mapping != NULL) {
+        munmap(dataset->mapping, dataset->mappingLength);
+    }
+    free(dataset->ownedSamples);
+    free(dataset->labels);
+    freeSparseMatrix(dataset->sparse);
+    free(dataset);
+}
+
+void datasetSampleInto(Dataset* dataset, unsigned int index, double* output) {
+    size_t size = (size_t) dataset->rows * dataset->columns;
+    switch (dataset->type) {
+        case DATASET_IMAGES:
+            copyImageInto(dataset->images[index], output);
+            break;
+        case DATASET_UINT8: {
+            const unsigned char* sample = (const unsigned char*) dataset->samples + index * size;
+            for (size_t i = 0; i < size; i++) {
+                output[i] = (double) sample[i] / 256; // Same scaling as copyImageInto
+            }
+            break;
+        }
+        case DATASET_FLOAT32: {
+            const float* sample = (const float*) dataset->samples + index * size;
+            for (size_t i = 0; i < size; i++) {
+                output[i] = sample[i];
+            }
+            break;
+        }
+    }
+}
+
+int indexSparseSamples(Dataset* dataset) {
+    size_t size = (size_t) dataset->rows * dataset->columns;
+    double* sample = malloc(size * sizeof(double));
+    if (sample == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+
+    // Count first, so that dense datasets are never copied
+    size_t nonZeros = 0;
+    for (unsigned int i = 0; i < dataset->numberOfSamples; i++) {
+        datasetSampleInto(dataset, i, sample);
+        for (size_t j = 0; j < size; j++) {
+            nonZeros += sample[j] != 0;
+        }
+    }
+    if (nonZeros > SPARSE_MAX_DENSITY * size * dataset->numberOfSamples) {
+        free(sample);
+        return SUCCESS;
+    }
+
+    int returnCode = makeSparseMatrix(dataset->numberOfSamples, size, nonZeros, &dataset->sparse);
+    if (returnCode != SUCCESS) {
+        free(sample);
+        return returnCode;
+    }
+    SparseMatrix* sparse = dataset->sparse;
+    size_t count = 0;
+    for (unsigned int i = 0; i < dataset->numberOfSamples; i++) {
+        datasetSampleInto(dataset, i, sample);
+        sparse->offsets[i] = count;
+        for (size_t j = 0; j < size; j++) {
+            if (sample[j] != 0) {
+                sparse->indices[count] = j;
+                sparse->values[count] = sample[j];
+                count++;
+            }
+        }
+    }
+    sparse->offsets[dataset->numberOfSamples] = count;
+    free(sample);
+    return SUCCESS;
+}
+
+// Copies the images of an IDX dataset into one page aligned buffer of bytes,
+// which is what they hold, turning it into a DATASET_UINT8 one
+static int packImages(Dataset* dataset) {
+    size_t size = (size_t) dataset->rows * dataset->columns;
+    unsigned char* samples = NULL;
+    unsigned char* labels = malloc(dataset->numberOfSamples > 0 ? dataset->numberOfSamples : 1);
+    if (labels == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    int returnCode = allocatePages(dataset->numberOfSamples * size, (void**) &samples);
+    if (returnCode != SUCCESS) {
+        free(labels);
+        return returnCode;
+    }
+    for (unsigned int i = 0; i < dataset->numberOfSamples; i++) {
+        Image* image = dataset->images[i];
+        for (unsigned int r = 0; r < dataset->rows; r++) {
+            memcpy(samples + i * size + r * dataset->columns, image->imageData[r], dataset->columns);
+        }
+        labels[i] = (unsigned char) image->label;
+    }
+    freeAllImages(dataset->images, dataset->numberOfSamples);
+    dataset->images = NULL;
+    dataset->type = DATASET_UINT8;
+    dataset->samples = samples;
+    dataset->ownedSamples = samples;
+    dataset->labels = labels;
+    return SUCCESS;
+}
+
+int interleaveDataset(Dataset* dataset) {
+    int returnCode;
+    if (dataset->type == DATASET_IMAGES && (returnCode = packImages(dataset)) != SUCCESS) {
+        return returnCode;
+    }
+    size_t values = (size_t) dataset->numberOfSamples * dataset->rows * dataset->columns;
+    if (dataset->ownedSamples != NULL &&
+        (returnCode = interleaveMemory(dataset->ownedSamples,
+            values * (dataset->type == DATASET_FLOAT32 ? sizeof(float) : 1))) != SUCCESS) {
+        return returnCode;
+    }
+    SparseMatrix* sparse = dataset->sparse;
+    if (sparse != NULL &&
+        ((returnCode = interleaveMemory(sparse->offsets, (sparse->rows + 1) * sizeof(size_t))) != SUCCESS ||
+         (returnCode = interleaveMemory(sparse->indices, sparse->capacity * sizeof(unsigned int))) != SUCCESS ||
+         (returnCode = interleaveMemory(sparse->values, sparse->capacity * sizeof(double))) != SUCCESS)) {
+        return returnCode;
+    }
+    return SUCCESS;
+}
+
+int datasetLabel(Dataset* dataset, unsigned int index) {
+    if (dataset->type == DATASET_IMAGES) {
+        return (int) dataset->images[index]->label;
+    }
+    return (int) dataset->labels[index];
+}
+
+int checkDatasetFits(Dataset* dataset, unsigned int inputs, unsigned int outputs) {
+    if ((size_t) dataset->rows * dataset->columns != inputs) {
+        return reportError(BAD_DATA, "dataset samples don't match the network's inputs");
+    }
+    for (unsigned int i = 0; i < dataset->numberOfSamples; i++) {
+        int label = datasetLabel(dataset, i);
+        if (label < 0 || (unsigned int) label >= outputs) {
+            return reportError(BAD_DATA, "dataset label is not one of the network's outputs");
+        }
+    }
+    return SUCCESS;
+}
+
+int gatherSamples(Dataset* dataset, unsigned int* indices, unsigned int count,
+                  Matrix* batch, unsigned char* labels) {
+    if (count > batch->rows) {
+        return reportError(MISC, "gatherSamples error: batch matrix has too few rows");
+    }
+    if (dataset->rows * dataset->columns != batch->columns) {
+        return reportError(MISC, "gatherSamples error: sample size does not match batch columns");
+    }
+    sortBatchIndices(indices, count);
+
+    for (unsigned int i = 0; i < count; i++) {
+        datasetSampleInto(dataset, indices[i], &batch->values[i * batch->columns]);
+        labels[i] = (unsigned char) datasetLabel(dataset, indices[i]);
+    }
+    return SUCCESS;
+}
+
+int gatherSparseSamples(Dataset* dataset, unsigned int* indices, unsigned int count,
+                        SparseMatrix* batch, unsigned char* labels) {
+    SparseMatrix* sparse = dataset->sparse;
+    if (sparse == NULL) {
+        return reportError(MISC, "gatherSparseSamples error: dataset has no sparse samples");
+    }
+    if (count > batch->rows) {
+        return reportError(MISC, "gatherSparseSamples error: batch matrix has too few rows");
+    }
+    if (sparse->columns != batch->columns) {
+        return reportError(MISC, "gatherSparseSamples error: sample size does not match batch columns");
+    }
+    sortBatchIndices(indices, count);
+
+    size_t used = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        size_t first = sparse->offsets[indices[i]];
+        size_t length = sparse->offsets[indices[i] + 1] - first;
+        if (used + length > batch->capacity) {
+            return reportError(MISC, "gatherSparseSamples error: batch matrix is full");
+        }
+        batch->offsets[i] = used;
+        memcpy(&batch->indices[used], &sparse->indices[first], length * sizeof(unsigned int));
+        memcpy(&batch->values[used], &sparse->values[first], length * sizeof(double));
+        used += length;
+        labels[i] = (unsigned char) datasetLabel(dataset, indices[i]);
+    }
+    for (unsigned int i = count; i <= batch->rows; i++) {
+        batch->offsets[i] = used;
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,127 @@
+#ifndef DATASET
+#define DATASET
+
+#include <stddef.h> // For size_t
+#include "image.h"
+#include "mathLib.h"
+
+#define SPARSE_MAX_DENSITY 0.5 // Fraction of non-zero inputs above which samples stay dense
+
+typedef enum _DatasetType {
+    DATASET_IMAGES = 0, // Samples are the `Image`s read by readMNIST
+    DATASET_UINT8 = 1, // Samples are contiguous bytes, 0-255
+    DATASET_FLOAT32 = 2 // Samples are contiguous floats, used as they are
+} DatasetType;
+
+/**
+ * A set of samples with their labels, all of `rows * columns` values. The
+ * samples either live in `images`, or in one contiguous C-order tensor
+ * `samples` which may point straight into a mapped file.
+ */
+typedef struct _Dataset {
+    DatasetType type;
+    unsigned int numberOfSamples;
+    unsigned int rows;
+    unsigned int columns;
+
+    Image** images; // Only used by DATASET_IMAGES
+    const void* samples; // Only used by DATASET_UINT8 and DATASET_FLOAT32
+    unsigned char* labels; // Only used by DATASET_UINT8 and DATASET_FLOAT32
+
+    void* mapping; // Mapped file `samples` points into, NULL if not mapped
+    size_t mappingLength;
+    void* ownedSamples; // Allocated `samples` freed with the dataset, or NULL
+
+    SparseMatrix* sparse; // Non-zero inputs of each sample by row, or NULL, see indexSparseSamples
+} Dataset;
+
+/**
+ * Wraps `numberOfImages` images `images` in a dataset, which is placed in the
+ * output vector `dataset`. The dataset takes ownership of the images.
+ */
+int makeDatasetFromImages(Image** images, unsigned int numberOfImages,
+                          Dataset** dataset);
+
+/**
+ * Maps a C-order `.npy` array `samplesFilename` of uint8 or float32 values,
+ * of shape (N, rows, columns) or (N, features), as the samples of a dataset.
+ * The payload is not copied. `labelsFilename` is a `.npy` array of N
+ * integer labels, which are converted to bytes.
+ */
+int loadNpyDataset(char* samplesFilename, char* labelsFilename,
+                   Dataset** dataset);
+
+/**
+ * Generates `numberOfSamples` random byte samples of `rows * columns` pixels
+ * in `classes` classes, placed in the output vector `dataset`. Each class is
+ * a random pattern decided by `seed`, and each sample is its class's pattern
+ * with some pixels replaced by noise. Datasets with the same `seed` but a
+ * different `part` share the patterns but not the samples, like a training
+ * and testing set.
+ */
+int makeSyntheticDataset(unsigned int numberOfSamples, unsigned int rows,
+                         unsigned int columns, unsigned int classes,
+                         uint64_t seed, unsigned int part, Dataset** dataset);
+
+/**
+ * Loads `samplesFilename` with `loadNpyDataset` if it is a `.npy` file, and
+ * otherwise as an IDX dataset with `readMNIST`.
+ */
+int readDataset(char* samplesFilename, char* labelsFilename, Dataset** dataset);
+
+/**
+ * Frees all memory used by `dataset`, including its images or mapping.
+ */
+void freeDataset(Dataset* dataset);
+
+/**
+ * Writes sample `index` of `dataset` as network inputs into `output`, which
+ * must have room for `rows * columns` values. Bytes are scaled to 0-1.
+ */
+void datasetSampleInto(Dataset* dataset, unsigned int index, double* output);
+
+/**
+ * Builds `dataset->sparse`, one row holding the non-zero network inputs of
+ * each sample, if no more than SPARSE_MAX_DENSITY of all inputs are
+ * non-zero. Denser datasets are left without one.
+ */
+int indexSparseSamples(Dataset* dataset);
+
+/**
+ * Spreads the samples of `dataset`, and its sparse index if it has one, over
+ * every NUMA node page by page, as every worker reads them. IDX datasets are
+ * first packed into one buffer of bytes, holding the same values. Mapped
+ * `.npy` files live in the page cache and are left where they are. Does
+ * nothing to the placement until `startPlacement` is called.
+ */
+int interleaveDataset(Dataset* dataset);
+
+/**
+ * Returns the label of sample `index` of `dataset`.
+ */
+int datasetLabel(Dataset* dataset, unsigned int index);
+
+/**
+ * Checks that the samples of `dataset` have `inputs` values and that every
+ * label is below `outputs`, the sizes of a network's first and last layers.
+ */
+int checkDatasetFits(Dataset* dataset, unsigned int inputs, unsigned int outputs);
+
+/**
+ * Gathers the `count` samples `indices[i]` of `dataset` into consecutive rows
+ * of `batch`, and their labels into `labels`. `indices` is sorted first so
+ * that the samples are read in memory order. `batch` must have at least
+ * `count` rows and one column per sample value.
+ */
+int gatherSamples(Dataset* dataset, unsigned int* indices, unsigned int count,
+                  Matrix* batch, unsigned char* labels);
+
+/**
+ * Same as `gatherSamples`, gathering the rows of `dataset->sparse` into the
+ * first `count` rows of `batch`, which must have room for all their values.
+ * The other rows of `batch` are left empty.
+ */
+int gatherSparseSamples(Dataset* dataset, unsigned int* indices, unsigned int count,
+                        SparseMatrix* batch, unsigned char* labels);
+
+#endif // DATASET
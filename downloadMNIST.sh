@@ -12,13 +12,13 @@ if [ ! -d "dataset" ]; then
     mkdir dataset;
 fi
 
-# Check every data piece is present, download it if not
+# Check every data piece is present, download it if not. The archives are
+# kept compressed as readMNIST inflates them whilst reading
 cd dataset;
 for i in {0..3}; do
     dataPiece="${datasets[i]}";
-    if [ ! -f "${dataPiece}" ]; then
+    if [ ! -f "${dataPiece}.gz" ]; then
         wget "${URL}${dataPiece}.gz";
-        gunzip "${dataPiece}.gz";
     fi
 done
 cd ..;
@@ -8,6 +8,7 @@
 #define IMAGE_MALLOC_FAILED_ERROR_STRING "ERROR: Image Malloc Failed\n"
 #define BAD_DATA_ERROR_STRING "ERROR: Bad Data (%s)\n"
 #define OUTPUT_FAILED_ERROR_STRING "ERROR: Output Failed (%s)\n"
+#define UNEXPECTED_ALLOCATION_ERROR_STRING "ERROR: Allocation Where Forbidden (%s)\n"
 #define MISC_ERROR_STRING "ERROR: Miscellaneous (%s)\n"
 
 int reportError(int errorCode, char* string) {
@@ -31,6 +32,9 @@ int reportError(int errorCode, char* string) {
         case OUTPUT_FAILED:
             outputFailed(string);
             break;
+        case UNEXPECTED_ALLOCATION:
+            unexpectedAllocation(string);
+            break;
         case MISC:
             miscError(string);
             break;
@@ -41,23 +45,26 @@ int reportError(int errorCode, char* string) {
 }
 
 void badArgumentCount() {
-    printf(BAD_ARGUMENT_COUNT_ERROR_STRING);
+    fprintf(stderr, BAD_ARGUMENT_COUNT_ERROR_STRING);
 }
 void badFileName(char* string) {
-    printf(BAD_FILE_NAME_ERROR_STRING, string);
+    fprintf(stderr, BAD_FILE_NAME_ERROR_STRING, string);
 }
 void badMagicNumber(char* string) {
-    printf(BAD_MAGIC_NUMBER_ERROR_STRING, string);
+    fprintf(stderr, BAD_MAGIC_NUMBER_ERROR_STRING, string);
 }
 void imageMallocFailed() {
-    printf(IMAGE_MALLOC_FAILED_ERROR_STRING);
+    fprintf(stderr, IMAGE_MALLOC_FAILED_ERROR_STRING);
 }
 void badData(char* string) {
-    printf(BAD_DATA_ERROR_STRING, string);
+    fprintf(stderr, BAD_DATA_ERROR_STRING, string);
 }
 void outputFailed(char* string) {
-    printf(OUTPUT_FAILED_ERROR_STRING, string);
+    fprintf(stderr, OUTPUT_FAILED_ERROR_STRING, string);
+}
+void unexpectedAllocation(char* string) {
+    fprintf(stderr, UNEXPECTED_ALLOCATION_ERROR_STRING, string);
 }
 void miscError(char* string) {
-    printf(MISC_ERROR_STRING, string);
+    fprintf(stderr, MISC_ERROR_STRING, string);
 }
\ No newline at end of file
@@ -9,6 +9,7 @@ typedef enum _error {
     IMAGE_MALLOC_FAILED = 4,
     BAD_DATA = 5,
     OUTPUT_FAILED = 6,
+    UNEXPECTED_ALLOCATION = 7,
     MISC = 100
 } error;
 
@@ -24,6 +25,7 @@ void badMagicNumber(char* string);
 void imageMallocFailed();
 void badData(char* string);
 void outputFailed(char* string);
+void unexpectedAllocation(char* string);
 void miscError(char* string);
 
 #endif // ERR
\ No newline at end of file
@@ -2,7 +2,11 @@
 #include "image.h"
 #include "err.h"
 
-int makeImage(Image** img) {
+int makeImageAt(Image** img, const char* site) {
+    int returnCode = checkAllocation(site);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
     *img = malloc(sizeof(Image));
     if (img == NULL) {
         return reportError(IMAGE_MALLOC_FAILED, "");
@@ -14,10 +18,11 @@ int makeImage(Image** img) {
     (*img)->hasImageDataAllocated = 0;
     (*img)->numberOfRowsAllocated = 0;
     (*img)->label = '\0';
+    recordAllocation(*img, sizeof(Image), site);
     return SUCCESS;
 }
 
-int allocateImageData(Image* img) {
+int allocateImageDataAt(Image* img, const char* site) {
     // Check rows and columns
     if (img == NULL) {
         return reportError(MISC, "Image must be initialised before allocating data to it");
@@ -25,6 +30,10 @@ int allocateImageData(Image* img) {
     if (img->rows == 0 || img->columns == 0) {
         return reportError(MISC, "Rows and columns must be set before malloc");
     }
+    int returnCode = checkAllocation(site);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
 
     // Allocate image data 2D array
     img->imageData = calloc(img->rows, sizeof(unsigned char *));
@@ -41,12 +50,14 @@ int allocateImageData(Image* img) {
         }
         img->numberOfRowsAllocated++;
     }
+    recordAllocation(img->imageData, img->rows * (sizeof(unsigned char*) + img->columns), site);
 
     return SUCCESS;
 }
 
 int freeImageData(Image* img) {
     if (img->hasImageDataAllocated) {
+        recordFree(img->imageData);
         // Free all rows allocated
         for (int i = img->numberOfRowsAllocated - 1; i >= 0; i--) {
             free(img->imageData[i]);
@@ -57,8 +68,15 @@ int freeImageData(Image* img) {
 }
 
 int freeAllImages(Image** images, int numberOfImages) {
+    if (images == NULL) {
+        return SUCCESS;
+    }
     for (int i = numberOfImages - 1; i >= 0; i--) {
+        if (images[i] == NULL) { // Reading stopped before this image was made
+            continue;
+        }
         freeImageData(images[i]);
+        recordFree(images[i]);
         free(images[i]);
     }
     free(images);
@@ -1,6 +1,8 @@
 #ifndef IMAGE
 #define IMAGE
 
+#include "memoryAccounting.h" // For the call sites of allocations
+
 typedef struct _Image {
     unsigned int rows;
     unsigned int columns;
@@ -10,16 +12,21 @@ typedef struct _Image {
     char label;
 } Image;
 
+// Both allocators are called through macros that pass the call site, `site`,
+// for memory accounting
+#define makeImage(outputVector) makeImageAt(outputVector, ALLOCATION_SITE)
+#define allocateImageData(img) allocateImageDataAt(img, ALLOCATION_SITE)
+
 /**
  * Allocates memory to a null pointer for an image
  */
-int makeImage(Image** outputVector);
+int makeImageAt(Image** outputVector, const char* site);
 
 /**
  * Allocates memory for `img->imageData`, and the rows inside it.
  * It requires that columns and rows is set, and not 0.
  */
-int allocateImageData(Image* img);
+int allocateImageDataAt(Image* img, const char* site);
 
 /**
  * Free all memory used by this `img`.
@@ -1,11 +1,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <byteswap.h>
+#include <pthread.h> // For reading labels alongside images
 #include "err.h"
 #include "imageInput.h"
+#include "placement.h"
 
 #define IMAGE_MAGIC_NUMBER 2051
 #define LABEL_MAGIC_NUMBER 2049
+#define GZIP_BUFFER_SIZE (1 << 17) // Bytes zlib reads from disk at a time
+
+// Arguments and result of a label reading thread
+typedef struct _LabelReadJob {
+    char* filename;
+    gzFile file;
+    unsigned int numberOfLabels;
+    unsigned char* labels;
+    int returnCode;
+} LabelReadJob;
+
+static void* labelReadThread(void* arg) {
+    LabelReadJob* job = (LabelReadJob*) arg;
+    unpinThread(); // Off the CPU of the thread reading the images
+    job->returnCode = batchReadLabels(job->filename, job->file,
+                                      job->numberOfLabels, job->labels);
+    return NULL;
+}
 
 int isLittleEndian() {
         /* Get value of a single byte pointer at the lowest byte of x,
@@ -25,17 +45,19 @@ int byteSwap(int num) { // TODO: This is not guaranteed to be 32 bits
 int readMNIST(char* datasetFilename, char* labelsFilename, Image*** images, 
               int* numberOfImages) {
     int returnCode = 0; // Set to 0
-    // Open dataset
-    FILE* dataset = fopen(datasetFilename, "rb");
+    // Open dataset, gzopen transparently reads uncompressed files too
+    gzFile dataset = gzopen(datasetFilename, "rb");
     if (dataset == NULL) {
         return reportError(BAD_FILE_NAME, datasetFilename);
     }
     // Open labels
-    FILE* labels = fopen(labelsFilename, "rb");
+    gzFile labels = gzopen(labelsFilename, "rb");
     if (labels == NULL) {
+        gzclose(dataset);
         return reportError(BAD_FILE_NAME, labelsFilename);
-        fclose(dataset);
     }
+    gzbuffer(dataset, GZIP_BUFFER_SIZE);
+    gzbuffer(labels, GZIP_BUFFER_SIZE);
 
     // Read headers
     int rows = 0;
@@ -57,79 +79,103 @@ int readMNIST(char* datasetFilename, char* labelsFilename, Image*** images,
     }
 
     cleanUp:
-        fclose(dataset);
-        fclose(labels);
+        gzclose(dataset);
+        gzclose(labels);
         return returnCode;
 }
 
 // --- Batch read functions ---
-int batchReadImagesWithLabels(char* datasetFilename, FILE* dataset, char* labelsFilename,
-                    FILE* labels, unsigned int rows, unsigned int columns,
+int batchReadImagesWithLabels(char* datasetFilename, gzFile dataset, char* labelsFilename,
+                    gzFile labels, unsigned int rows, unsigned int columns,
                     unsigned int numberOfImages, Image*** images) {
 
     // Initialise the output vector
     *images = calloc(numberOfImages, sizeof(Image*));
-    if (images == NULL) {
+    if (*images == NULL) {
         return reportError(IMAGE_MALLOC_FAILED, "");
     }
 
-    // Read in all images and give them labels
+    // Inflate the labels on another thread whilst the images are read
+    LabelReadJob job = {labelsFilename, labels, numberOfImages, NULL, SUCCESS};
+    job.labels = malloc(numberOfImages);
+    if (job.labels == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    pthread_t labelThread;
+    if (pthread_create(&labelThread, NULL, labelReadThread, &job) != 0) {
+        free(job.labels);
+        return reportError(MISC, "batchReadImagesWithLabels error: label thread could not be started");
+    }
+
+    // Read in all images
+    int returnCode = SUCCESS;
     for (int i = 0; i < numberOfImages; i++) {
         // Make image
         Image* img = NULL;
-        int allocated = makeImage(&img);
-        if (allocated != SUCCESS) {
-            return allocated;
+        returnCode = makeImage(&img);
+        if (returnCode != SUCCESS) {
+            break;
         }
+        (*images)[i] = img;
 
         // Give it rows and columns
         img->rows = rows;
         img->columns = columns;
 
         // Allocate image data
-        allocated = allocateImageData(img);
-        if (allocated != SUCCESS) {
-            return allocated;
+        returnCode = allocateImageData(img);
+        if (returnCode != SUCCESS) {
+            break;
         }
 
-        // Read label
-        int gotLabel = readNextLabel(labelsFilename, labels, img);
-        if (gotLabel != SUCCESS) {
-            return gotLabel;
+        // Read pixels
+        returnCode = readNextImage(datasetFilename, dataset, img, rows,
+                                   columns);
+        if (returnCode != SUCCESS) {
+            break;
         }
+    }
 
-        // Read pixels
-        int gotPixels = readNextImage(datasetFilename, dataset, img, rows,
-                                      columns);
-        if (gotPixels != SUCCESS) {
-            return gotPixels;
+    // Give every image its label
+    pthread_join(labelThread, NULL);
+    if (returnCode == SUCCESS) {
+        returnCode = job.returnCode;
+    }
+    if (returnCode == SUCCESS) {
+        for (int i = 0; i < numberOfImages; i++) {
+            (*images)[i]->label = job.labels[i];
         }
+    }
+    free(job.labels);
+    return returnCode;
+}
 
-        // Add to image collection
-        (*images)[i] = img;
+int batchReadLabels(char* filename, gzFile file, unsigned int numberOfLabels,
+                    unsigned char* labels) {
+    int read = gzread(file, labels, numberOfLabels);
+    if (read != numberOfLabels) {
+        return reportError(BAD_DATA, filename);
     }
     return SUCCESS;
 }
 
 // --- Single read functions ---
-int readNextImage(char* filename, FILE* file, Image* img, unsigned int rows,
+int readNextImage(char* filename, gzFile file, Image* img, unsigned int rows,
                unsigned int columns) {
     
-    // Read each pixel into image
+    // Read each row of pixels into image
     for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < columns; j++) {
-            int scanCount = fread(&img->imageData[i][j], 1, 1, file);
-            if (scanCount != 1) {
-                return reportError(BAD_DATA, filename);
-            }
+        int scanCount = gzread(file, img->imageData[i], columns);
+        if (scanCount != columns) {
+            return reportError(BAD_DATA, filename);
         }
     }
     return SUCCESS;
 }
 
-int readNextLabel(char* filename, FILE* file, Image* img) {
+int readNextLabel(char* filename, gzFile file, Image* img) {
     unsigned char label;
-    int scanCount = fread(&label, 1, 1, file);
+    int scanCount = gzread(file, &label, 1);
     if (scanCount != 1) {
         return reportError(BAD_DATA, filename);
     }
@@ -140,8 +186,8 @@ int readNextLabel(char* filename, FILE* file, Image* img) {
 }
 
 // --- Header read functions ---
-int readHeaders(char* datasetFilename, FILE* dataset, char* labelsFilename,
-                FILE* labels, int* numberOfImages, int* rows, int* columns) {
+int readHeaders(char* datasetFilename, gzFile dataset, char* labelsFilename,
+                gzFile labels, int* numberOfImages, int* rows, int* columns) {
     int header = readImageFileHeader(datasetFilename, dataset, numberOfImages,
                                      rows, columns);
     if (header != SUCCESS) {
@@ -161,13 +207,13 @@ int readHeaders(char* datasetFilename, FILE* dataset, char* labelsFilename,
     return SUCCESS;
 }
 
-int readImageFileHeader(char* filename, FILE* file, int* numberOfImages,
+int readImageFileHeader(char* filename, gzFile file, int* numberOfImages,
                         int* rows, int* columns) {
     // headerData = {magicNumber, images, rows, columns}
     int headerData[4] = {};
 
-    int scanCount = fread(headerData, 4, 4, file);
-    if (scanCount != 4) {
+    int scanCount = gzread(file, headerData, 4 * 4);
+    if (scanCount != 4 * 4) {
         return reportError(BAD_DATA, filename);
     }
 
@@ -189,12 +235,12 @@ int readImageFileHeader(char* filename, FILE* file, int* numberOfImages,
     return SUCCESS;
 }
 
-int readLabelsFileHeader(char* filename, FILE* file, int* numberOfLabels) {
+int readLabelsFileHeader(char* filename, gzFile file, int* numberOfLabels) {
     // headerData = {magicNumber, labels}
     int headerData[2] = {};
     
-    int scanCount = fread(headerData, 4, 2, file);
-    if (scanCount != 2) {
+    int scanCount = gzread(file, headerData, 4 * 2);
+    if (scanCount != 4 * 2) {
         return reportError(BAD_DATA, filename);
     }
     
@@ -222,10 +268,14 @@ int getMatrixFromImage(Image* img, Matrix** output) {
     }
 
     // Move data from `img` into `output`
+    copyImageInto(img, (*output)->values);
+    return SUCCESS;
+}
+
+void copyImageInto(Image* img, double* output) {
     for (int i = 0; i < img->rows; i++) {
         for (int j = 0; j < img->columns; j++) {
-            (*output)->values[i * img->columns + j] = (double) ((int) img->imageData[i][j]) / 256; // Converts down 0-256 to 0-1
+            output[i * img->columns + j] = (double) ((int) img->imageData[i][j]) / 256; // Converts down 0-256 to 0-1
         }
     }
-    return SUCCESS;
-}
\ No newline at end of file
+}
@@ -1,7 +1,7 @@
 #ifndef IMAGE_INPUT
 #define IMAGE_INPUT
 
-#include <stdio.h>
+#include <zlib.h> // For gzFile, which reads both gzip and uncompressed files
 #include "image.h"
 #include "mathLib.h"
 
@@ -9,29 +9,48 @@ int isLittleEndian();
 
 int byteSwap(int num);
 
+/**
+ * Reads an IDX dataset and its labels into `images`. Either file may be
+ * gzip-compressed (e.g. `train-images-idx3-ubyte.gz`), in which case it is
+ * inflated while it is being read. The labels are read on a separate thread
+ * to the images.
+ */
 int readMNIST(char* datasetFilename, char* labelsFilename, Image*** images, 
               int* numberOfImages);
 
 // --- Batch read functions ---
-int batchReadImagesWithLabels(char* datasetFilename, FILE* dataset, char* labelsFilename,
-                    FILE* labels, unsigned int rows, unsigned int columns,
+int batchReadImagesWithLabels(char* datasetFilename, gzFile dataset, char* labelsFilename,
+                    gzFile labels, unsigned int rows, unsigned int columns,
                     unsigned int numberOfImages, Image*** images);
 
+/**
+ * Reads `numberOfLabels` labels from `file` into the output vector `labels`,
+ * which must already be allocated.
+ */
+int batchReadLabels(char* filename, gzFile file, unsigned int numberOfLabels,
+                    unsigned char* labels);
+
 // --- Single read functions ---
-int readNextImage(char* filename, FILE* file, Image* img, unsigned int rows,
+int readNextImage(char* filename, gzFile file, Image* img, unsigned int rows,
                unsigned int columns);
 
-int readNextLabel(char* filename, FILE* file, Image* img);
+int readNextLabel(char* filename, gzFile file, Image* img);
 
 // --- Header read functions ---
-int readHeaders(char* datasetFilename, FILE* dataset, char* labelsFilename,
-                FILE* labels, int* numberOfImages, int* rows, int* columns);
+int readHeaders(char* datasetFilename, gzFile dataset, char* labelsFilename,
+                gzFile labels, int* numberOfImages, int* rows, int* columns);
 
-int readImageFileHeader(char* filename, FILE* file, int* numberOfImages,
+int readImageFileHeader(char* filename, gzFile file, int* numberOfImages,
                         int* rows, int* columns);
 
-int readLabelsFileHeader(char* filename, FILE* file, int* numberOfLabels);
+int readLabelsFileHeader(char* filename, gzFile file, int* numberOfLabels);
 
 int getMatrixFromImage(Image* img, Matrix** output);
 
-#endif // IMAGE_INPUT
\ No newline at end of file
+/**
+ * Writes the pixels of `img` as doubles in the range 0-1 into `output`, which
+ * must have room for `img->rows * img->columns` values.
+ */
+void copyImageInto(Image* img, double* output);
+
+#endif // IMAGE_INPUT
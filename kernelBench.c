@@ -0,0 +1,430 @@
+#define _POSIX_C_SOURCE 200809L // For clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // For comparing option names
+#include <stdint.h> // For uint16_t reduced precision buffers
+#include <math.h> // For sqrt
+#include <time.h> // For the monotonic clock
+#include "mathLib.h"
+#include "neuralNetwork.h" // For reading the layer shapes
+#include "perfCounters.h"
+#include "err.h"
+
+/*
+ * Microbenchmarks of the mathLib kernels, run by `make bench`. Every kernel is
+ * timed on the shapes of the layers in `network/network`, both for a single
+ * input as in training and for batches of inputs, and on a sweep of square
+ * shapes. Each measurement is warmed up, then repeated, and its ns/op,
+ * GFLOP/s and GB/s are printed and optionally written as JSON.
+ *
+ * FLOP counts of the activation functions are nominal, one per arithmetic
+ * operation and one per exp. Bytes are the values each call must read and
+ * write, not what the caches actually see. `--perf` adds what the hardware
+ * counters saw per kernel and shape, though reading them slows small kernels
+ * so the timings of a run with it are not comparable to one without.
+ */
+
+#define DEFAULT_REPETITIONS 15
+#define MIN_SAMPLE_SECONDS 2e-3 // Calls are batched until a sample takes this long
+#define WARMUP_SECONDS 20e-3
+#define MAX_SHAPES 64
+
+static const unsigned int batchSizes[] = {16, 64, 256};
+static const unsigned int squareSizes[] = {64, 128, 256, 512};
+
+// Operands of one kernel call, all preallocated so kernels never allocate.
+// Inputs are never overwritten, so repeated calls see the same values.
+typedef struct _BenchOperands {
+    Matrix* a; // m x k
+    Matrix* b; // k x n
+    Matrix* c; // m x n
+    Matrix* at; // k x m, for the transpose
+    Matrix* column; // m x 1
+    Matrix* same; // m x n, the second operand of element-wise kernels
+    uint16_t* narrow; // m x n
+} BenchOperands;
+
+typedef void (*KernelFunction)(BenchOperands* operands);
+
+typedef struct _Kernel {
+    const char* name;
+    KernelFunction run;
+    int matrixProduct; // Uses the m x k by k x n shape, otherwise m x n
+    double flopsPerElement; // Of the m x n output, element-wise kernels only
+    double bytesPerElement;
+} Kernel;
+
+typedef struct _BenchShape {
+    const char* source; // "layer", "batched" or "square"
+    unsigned int m, n, k;
+} BenchShape;
+
+typedef struct _BenchResult {
+    double minimum, median, mean, deviation; // ns per call
+    unsigned long callsPerSample;
+} BenchResult;
+
+static double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// --- Kernels ---
+
+static void benchMultiply(BenchOperands* o) {
+    multiplyMatricesInto(o->a, o->b, o->c);
+}
+
+static void benchTranspose(BenchOperands* o) {
+    transposeMatrix(o->a, &o->at);
+}
+
+static void benchAdd(BenchOperands* o) {
+    addMatricesInto(o->same, o->same, o->c);
+}
+
+static void benchScale(BenchOperands* o) {
+    multiplyScalarInto(o->same, 0.5, o->c);
+}
+
+static void benchHadamard(BenchOperands* o) {
+    hadamardProduct(o->same, o->same, &o->c);
+}
+
+static void benchAddColumn(BenchOperands* o) {
+    addColumnInto(o->same, o->column, o->c);
+}
+
+static void benchSigmoid(BenchOperands* o) {
+    sigmoidInto(o->same, o->c);
+}
+
+static void benchDsigmoid(BenchOperands* o) {
+    dsigmoidInto(o->same, o->c);
+}
+
+static void benchRelu(BenchOperands* o) {
+    reluInto(o->same, o->c);
+}
+
+static void benchDrelu(BenchOperands* o) {
+    dreluInto(o->same, o->c);
+}
+
+static void benchNarrowHalf(BenchOperands* o) {
+    narrowToHalf(o->same->values, o->narrow, (size_t) o->same->rows * o->same->columns, 1);
+}
+
+static void benchWidenHalf(BenchOperands* o) {
+    widenHalf(o->narrow, o->c->values, (size_t) o->c->rows * o->c->columns, 1);
+}
+
+static void benchNarrowBfloat16(BenchOperands* o) {
+    narrowToBfloat16(o->same->values, o->narrow, (size_t) o->same->rows * o->same->columns, 1);
+}
+
+static void benchWidenBfloat16(BenchOperands* o) {
+    widenBfloat16(o->narrow, o->c->values, (size_t) o->c->rows * o->c->columns, 1);
+}
+
+static const Kernel kernels[] = {
+    {"multiplyMatricesInto", benchMultiply, 1, 0, 0},
+    {"transposeMatrix", benchTranspose, 1, 0, 0},
+    {"addMatricesInto", benchAdd, 0, 1, 24},
+    {"multiplyScalarInto", benchScale, 0, 1, 16},
+    {"hadamardProduct", benchHadamard, 0, 1, 24},
+    {"addColumnInto", benchAddColumn, 0, 1, 16},
+    {"sigmoidInto", benchSigmoid, 0, 4, 16},
+    {"dsigmoidInto", benchDsigmoid, 0, 6, 16},
+    {"reluInto", benchRelu, 0, 1, 16},
+    {"dreluInto", benchDrelu, 0, 1, 16},
+    {"narrowToHalf", benchNarrowHalf, 0, 0, 10},
+    {"widenHalf", benchWidenHalf, 0, 0, 10},
+    {"narrowToBfloat16", benchNarrowBfloat16, 0, 0, 10},
+    {"widenBfloat16", benchWidenBfloat16, 0, 0, 10},
+};
+
+// FLOPs and bytes of one call of `kernel` on `shape`
+static void kernelWork(const Kernel* kernel, BenchShape* shape, double* flops, double* bytes) {
+    double m = shape->m, n = shape->n, k = shape->k;
+    if (kernel->run == benchMultiply) {
+        *flops = 2 * m * n * k;
+        *bytes = (m * k + k * n + m * n) * sizeof(double);
+    } else if (kernel->run == benchTranspose) {
+        *flops = 0;
+        *bytes = 2 * m * k * sizeof(double);
+    } else {
+        *flops = kernel->flopsPerElement * m * n;
+        *bytes = kernel->bytesPerElement * m * n;
+    }
+}
+
+// --- Operands ---
+
+static void fillMatrix(Matrix* m, Rng* rng) {
+    for (unsigned int i = 0; i < m->rows * m->columns; i++) {
+        m->values[i] = randomUniform(rng) * 2 - 1;
+    }
+}
+
+static void freeOperands(BenchOperands* o) {
+    Matrix* matrices[] = {o->a, o->b, o->c, o->at, o->column, o->same};
+    for (unsigned int i = 0; i < sizeof(matrices) / sizeof(Matrix*); i++) {
+        if (matrices[i] != NULL) {
+            freeMatrix(matrices[i]);
+        }
+    }
+    free(o->narrow);
+    memset(o, 0, sizeof(BenchOperands));
+}
+
+static int makeOperands(BenchShape* shape, Rng* rng, BenchOperands* o) {
+    memset(o, 0, sizeof(BenchOperands));
+    int returnCode = SUCCESS;
+    if ((returnCode = makeMatrix(shape->m, shape->k, &o->a)) != SUCCESS ||
+        (returnCode = makeMatrix(shape->k, shape->n, &o->b)) != SUCCESS ||
+        (returnCode = makeMatrix(shape->m, shape->n, &o->c)) != SUCCESS ||
+        (returnCode = makeMatrix(shape->k, shape->m, &o->at)) != SUCCESS ||
+        (returnCode = makeMatrix(shape->m, 1, &o->column)) != SUCCESS ||
+        (returnCode = makeMatrix(shape->m, shape->n, &o->same)) != SUCCESS) {
+        freeOperands(o);
+        return returnCode;
+    }
+    o->narrow = malloc((size_t) shape->m * shape->n * sizeof(uint16_t));
+    if (o->narrow == NULL) {
+        freeOperands(o);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    fillMatrix(o->a, rng);
+    fillMatrix(o->b, rng);
+    fillMatrix(o->c, rng);
+    fillMatrix(o->column, rng);
+    fillMatrix(o->same, rng);
+    narrowToHalf(o->same->values, o->narrow, (size_t) shape->m * shape->n, 1);
+    return SUCCESS;
+}
+
+// --- Measurement ---
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Times `calls` calls of `kernel`, returning seconds
+static double timeCalls(const Kernel* kernel, BenchOperands* o, unsigned long calls) {
+    double start = monotonicSeconds();
+    for (unsigned long i = 0; i < calls; i++) {
+        kernel->run(o);
+    }
+    return monotonicSeconds() - start;
+}
+
+/**
+ * Warms `kernel` up, picks how many calls make a sample long enough to time,
+ * then times `repetitions` samples into `result`.
+ */
+static void measureKernel(const Kernel* kernel, BenchOperands* o, unsigned int repetitions,
+                          double* samples, BenchResult* result) {
+    // Warm up, doubling the calls until a sample is long enough
+    unsigned long calls = 1;
+    double warmedUp = 0;
+    for (;;) {
+        double elapsed = timeCalls(kernel, o, calls);
+        warmedUp += elapsed;
+        if (elapsed >= MIN_SAMPLE_SECONDS && warmedUp >= WARMUP_SECONDS) {
+            break;
+        }
+        if (elapsed < MIN_SAMPLE_SECONDS) {
+            calls *= 2;
+        }
+    }
+
+    double sum = 0;
+    for (unsigned int r = 0; r < repetitions; r++) {
+        samples[r] = timeCalls(kernel, o, calls) * 1e9 / calls;
+        sum += samples[r];
+    }
+    result->mean = sum / repetitions;
+    double squares = 0;
+    for (unsigned int r = 0; r < repetitions; r++) {
+        squares += (samples[r] - result->mean) * (samples[r] - result->mean);
+    }
+    result->deviation = repetitions > 1 ? sqrt(squares / (repetitions - 1)) : 0;
+    qsort(samples, repetitions, sizeof(double), compareDoubles);
+    result->minimum = samples[0];
+    result->median = samples[repetitions / 2];
+    result->callsPerSample = calls;
+}
+
+// --- Shapes ---
+
+/**
+ * Fills `shapes` with the forward pass shapes of every layer of the network
+ * in `dir`, for one input and for each batch size, then the square sweep.
+ * Their number is placed in `numberOfShapes`.
+ */
+static int collectShapes(char* dir, BenchShape* shapes, unsigned int* numberOfShapes) {
+    NeuralNetwork* network = NULL;
+    int returnCode = loadNetworkHeaderFile(&network, dir, 0);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    unsigned int count = 0;
+    for (int l = 0; l < network->hiddenLayers + 1 && count < MAX_SHAPES; l++) {
+        // W (next x previous) times the previous layer's activations
+        shapes[count++] = (BenchShape) {"layer", network->neurons[l+1], 1, network->neurons[l]};
+        for (unsigned int b = 0; b < sizeof(batchSizes) / sizeof(unsigned int) && count < MAX_SHAPES; b++) {
+            shapes[count++] = (BenchShape) {"batched", network->neurons[l+1], batchSizes[b], network->neurons[l]};
+        }
+    }
+    freeNetwork(network);
+    for (unsigned int s = 0; s < sizeof(squareSizes) / sizeof(unsigned int) && count < MAX_SHAPES; s++) {
+        shapes[count++] = (BenchShape) {"square", squareSizes[s], squareSizes[s], squareSizes[s]};
+    }
+    *numberOfShapes = count;
+    return SUCCESS;
+}
+
+// --- Main ---
+
+int main(int argc, char** argv) {
+    char* dir = "network";
+    char* jsonFilename = NULL;
+    char* only = NULL;
+    unsigned int repetitions = DEFAULT_REPETITIONS;
+    int perf = 0;
+    unsigned int threads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--perf") == 0) {
+            perf = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            printf("Usage: ./kernelBench [--network dir] [--json file] [--repetitions n] [--kernel name] [--threads n] [--perf]\n");
+            return reportError(MISC, argv[i]);
+        }
+        if (strcmp(argv[i], "--network") == 0) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0) {
+            jsonFilename = argv[++i];
+        } else if (strcmp(argv[i], "--kernel") == 0) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            if (sscanf(argv[++i], "%u", &threads) != 1 || threads == 0) {
+                return reportError(MISC, "Conversion of threads argument error");
+            }
+        } else if (strcmp(argv[i], "--repetitions") == 0) {
+            if (sscanf(argv[++i], "%u", &repetitions) != 1 || repetitions == 0) {
+                return reportError(MISC, "Conversion of repetitions argument error");
+            }
+        } else {
+            return reportError(MISC, argv[i]);
+        }
+    }
+
+    BenchShape shapes[MAX_SHAPES];
+    unsigned int numberOfShapes = 0;
+    int returnCode = collectShapes(dir, shapes, &numberOfShapes);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+
+    ThreadPool* pool = NULL;
+    if (threads > 1) {
+        returnCode = makeThreadPool(threads, &pool);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+        setKernelThreadPool(pool);
+    }
+
+    if (perf && startPerfCounters() != SUCCESS) {
+        printf("Hardware counters are not available, timing without them\n");
+        perf = 0;
+    }
+
+    double* samples = malloc(repetitions * sizeof(double));
+    if (samples == NULL) {
+        setKernelThreadPool(NULL);
+        freeThreadPool(pool);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    FILE* json = NULL;
+    if (jsonFilename != NULL) {
+        json = fopen(jsonFilename, "w");
+        if (json == NULL) {
+            free(samples);
+            setKernelThreadPool(NULL);
+            freeThreadPool(pool);
+            return reportError(BAD_FILE_NAME, jsonFilename);
+        }
+        fprintf(json, "{\n  \"compiler\": \"%s\",\n  \"repetitions\": %u,\n  \"threads\": %u,\n  \"results\": [",
+                __VERSION__, repetitions, threads);
+    }
+
+    printf("%-22s %-8s %16s %12s %12s %8s %9s %9s\n",
+           "kernel", "source", "shape", "median ns", "min ns", "stddev", "GFLOP/s", "GB/s");
+    Rng rng;
+    seedRng(&rng, 1);
+    int first = 1;
+    for (unsigned int s = 0; s < numberOfShapes && returnCode == SUCCESS; s++) {
+        BenchShape* shape = &shapes[s];
+        BenchOperands operands;
+        returnCode = makeOperands(shape, &rng, &operands);
+        if (returnCode != SUCCESS) {
+            break;
+        }
+
+        for (unsigned int k = 0; k < sizeof(kernels) / sizeof(Kernel); k++) {
+            const Kernel* kernel = &kernels[k];
+            if (only != NULL && strcmp(only, kernel->name) != 0) {
+                continue;
+            }
+            BenchResult result;
+            measureKernel(kernel, &operands, repetitions, samples, &result);
+            double flops, bytes;
+            kernelWork(kernel, shape, &flops, &bytes);
+            double gflops = flops / result.median; // FLOP per ns is GFLOP/s
+            double gbytes = bytes / result.median;
+
+            char shapeName[48];
+            if (kernel->matrixProduct) {
+                snprintf(shapeName, sizeof(shapeName), "%ux%u*%ux%u", shape->m, shape->k, shape->k, shape->n);
+            } else {
+                snprintf(shapeName, sizeof(shapeName), "%ux%u", shape->m, shape->n);
+            }
+            printf("%-22s %-8s %16s %12.1f %12.1f %7.1f%% %9.3f %9.3f\n",
+                   kernel->name, shape->source, shapeName, result.median, result.minimum,
+                   100 * result.deviation / result.mean, gflops, gbytes);
+            fflush(stdout);
+
+            if (json != NULL) {
+                fprintf(json, "%s\n    {\"kernel\": \"%s\", \"source\": \"%s\", \"m\": %u, \"n\": %u, \"k\": %u, "
+                        "\"calls_per_sample\": %lu, \"ns_per_op\": {\"median\": %.3f, \"min\": %.3f, "
+                        "\"mean\": %.3f, \"stddev\": %.3f}, \"gflops\": %.6f, \"gbytes_per_s\": %.6f}",
+                        first ? "" : ",", kernel->name, shape->source, shape->m, shape->n,
+                        kernel->matrixProduct ? shape->k : 1, result.callsPerSample,
+                        result.median, result.minimum, result.mean, result.deviation, gflops, gbytes);
+                first = 0;
+            }
+        }
+        freeOperands(&operands);
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        if (fclose(json) != 0 && returnCode == SUCCESS) {
+            returnCode = reportError(OUTPUT_FAILED, jsonFilename);
+        }
+    }
+    if (perf) {
+        printPerfReport();
+    }
+    free(samples);
+    setKernelThreadPool(NULL);
+    freeThreadPool(pool);
+    return returnCode;
+}
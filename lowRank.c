@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <string.h> // For copying rows of singular vectors
+#include <math.h> // For the rotations
+#include "err.h"
+#include "lowRank.h"
+
+#define JACOBI_MAX_SWEEPS 64
+#define JACOBI_TOLERANCE 1e-15 // Relative to the Gram matrix's diagonal
+
+// --- Decomposition ---
+
+// Diagonalises the symmetric `n` by `n` matrix `a` in place with cyclic
+// Jacobi rotations, accumulating them into the rows of `vectors`, so that
+// row i of `vectors` is the eigenvector of the eigenvalue a[i][i]
+static void jacobiEigen(double* a, double* vectors, unsigned int n) {
+    for (unsigned int i = 0; i < n; i++) {
+        for (unsigned int j = 0; j < n; j++) {
+            vectors[(size_t) i * n + j] = i == j;
+        }
+    }
+    double trace = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        trace += fabs(a[(size_t) i * n + i]);
+    }
+    for (unsigned int sweep = 0; sweep < JACOBI_MAX_SWEEPS; sweep++) {
+        double off = 0;
+        for (unsigned int p = 0; p < n; p++) {
+            for (unsigned int q = p + 1; q < n; q++) {
+                off += a[(size_t) p * n + q] * a[(size_t) p * n + q];
+            }
+        }
+        if (sqrt(off) <= JACOBI_TOLERANCE * trace) {
+            return;
+        }
+        for (unsigned int p = 0; p < n; p++) {
+            for (unsigned int q = p + 1; q < n; q++) {
+                double apq = a[(size_t) p * n + q];
+                if (apq == 0) {
+                    continue;
+                }
+                // Rotation zeroing a[p][q]
+                double theta = (a[(size_t) q * n + q] - a[(size_t) p * n + p]) / (2 * apq);
+                double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1);
+                double s = t * c;
+                for (unsigned int k = 0; k < n; k++) {
+                    double akp = a[(size_t) k * n + p];
+                    double akq = a[(size_t) k * n + q];
+                    a[(size_t) k * n + p] = c * akp - s * akq;
+                    a[(size_t) k * n + q] = s * akp + c * akq;
+                }
+                for (unsigned int k = 0; k < n; k++) {
+                    double apk = a[(size_t) p * n + k];
+                    double aqk = a[(size_t) q * n + k];
+                    a[(size_t) p * n + k] = c * apk - s * aqk;
+                    a[(size_t) q * n + k] = s * apk + c * aqk;
+                }
+                for (unsigned int k = 0; k < n; k++) {
+                    double vpk = vectors[(size_t) p * n + k];
+                    double vqk = vectors[(size_t) q * n + k];
+                    vectors[(size_t) p * n + k] = c * vpk - s * vqk;
+                    vectors[(size_t) q * n + k] = s * vpk + c * vqk;
+                }
+            }
+        }
+    }
+}
+
+int singularVectors(Matrix* m, Matrix** vectors) {
+    // The Gram matrix of the smaller side, W W^T or W^T W
+    int byRows = m->rows <= m->columns;
+    unsigned int n = byRows ? m->rows : m->columns;
+    unsigned int length = byRows ? m->columns : m->rows;
+    double* gram = malloc(((size_t) n * n + n) * sizeof(double));
+    double* unsorted = malloc(((size_t) n * n + 1) * sizeof(double));
+    unsigned int* order = malloc((n + 1) * sizeof(unsigned int));
+    if (gram == NULL || unsorted == NULL || order == NULL) {
+        free(gram);
+        free(unsorted);
+        free(order);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        for (unsigned int j = i; j < n; j++) {
+            double sum = 0;
+            for (unsigned int k = 0; k < length; k++) {
+                double x = byRows ? m->values[(size_t) i * m->columns + k] : m->values[(size_t) k * m->columns + i];
+                double y = byRows ? m->values[(size_t) j * m->columns + k] : m->values[(size_t) k * m->columns + j];
+                sum += x * y;
+            }
+            gram[(size_t) i * n + j] = sum;
+            gram[(size_t) j * n + i] = sum;
+        }
+    }
+    jacobiEigen(gram, unsorted, n);
+
+    // Order by decreasing eigenvalue, the squares of the singular values
+    for (unsigned int i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    for (unsigned int i = 1; i < n; i++) {
+        unsigned int moving = order[i];
+        double value = gram[(size_t) moving * n + moving];
+        unsigned int j = i;
+        while (j > 0 && gram[(size_t) order[j - 1] * n + order[j - 1]] < value) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = moving;
+    }
+    int returnCode = makeMatrix(n, n, vectors);
+    if (returnCode == SUCCESS) {
+        for (unsigned int i = 0; i < n; i++) {
+            memcpy(&(*vectors)->values[(size_t) i * n], &unsorted[(size_t) order[i] * n], n * sizeof(double));
+        }
+    }
+    free(gram);
+    free(unsorted);
+    free(order);
+    return returnCode;
+}
+
+// --- Layers ---
+
+int makeLowRankLayer(Matrix* weights, Matrix* vectors, unsigned int rank, unsigned int columns,
+                     LowRankLayer** layer) {
+    int byRows = weights->rows <= weights->columns;
+    unsigned int n = byRows ? weights->rows : weights->columns;
+    if (vectors->rows != n || vectors->columns != n) {
+        return reportError(MISC, "makeLowRankLayer error: vectors don't match the weights");
+    }
+    if (rank == 0 || rank > n) {
+        return reportError(MISC, "makeLowRankLayer error: rank must be between 1 and the smaller dimension");
+    }
+    Matrix* u = NULL;
+    Matrix* v = NULL;
+    int returnCode = makeMatrix(weights->rows, rank, &u);
+    if (returnCode == SUCCESS) {
+        returnCode = makeMatrix(rank, weights->columns, &v);
+    }
+    if (returnCode != SUCCESS) {
+        if (u != NULL) {
+            freeMatrix(u);
+        }
+        return returnCode;
+    }
+
+    // Projecting onto the first `rank` singular vectors of one side gives the
+    // other factor, with the singular values folded in
+    if (byRows) {
+        // U = E_k^T, V = E_k W
+        for (unsigned int i = 0; i < weights->rows; i++) {
+            for (unsigned int r = 0; r < rank; r++) {
+                u->values[(size_t) i * rank + r] = vectors->values[(size_t) r * n + i];
+            }
+        }
+        Matrix* leading = NULL;
+        returnCode = makeMatrixView(rank, n, vectors->values, &leading);
+        if (returnCode == SUCCESS) {
+            returnCode = multiplyMatricesInto(leading, weights, v);
+            freeMatrix(leading);
+        }
+    } else {
+        // U = W E_k^T, V = E_k
+        memcpy(v->values, vectors->values, (size_t) rank * n * sizeof(double));
+        for (unsigned int i = 0; i < weights->rows; i++) {
+            for (unsigned int r = 0; r < rank; r++) {
+                double sum = 0;
+                for (unsigned int k = 0; k < n; k++) {
+                    sum += weights->values[(size_t) i * n + k] * vectors->values[(size_t) r * n + k];
+                }
+                u->values[(size_t) i * rank + r] = sum;
+            }
+        }
+    }
+    if (returnCode == SUCCESS) {
+        returnCode = makeLowRankLayerOf(u, v, columns, layer);
+    }
+    if (returnCode != SUCCESS) {
+        freeMatrix(u);
+        freeMatrix(v);
+    }
+    return returnCode;
+}
+
+int makeLowRankLayerOf(Matrix* u, Matrix* v, unsigned int columns, LowRankLayer** layer) {
+    if (u->columns != v->rows) {
+        return reportError(MISC, "makeLowRankLayerOf error: factors cannot be multiplied");
+    }
+    Matrix* hidden = NULL;
+    int returnCode = makeMatrix(u->columns, columns, &hidden);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    *layer = calloc(1, sizeof(LowRankLayer));
+    if (*layer == NULL) {
+        freeMatrix(hidden);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*layer)->rank = u->columns;
+    (*layer)->u = u;
+    (*layer)->v = v;
+    (*layer)->hidden = hidden;
+    return SUCCESS;
+}
+
+void freeLowRankLayer(LowRankLayer* layer) {
+    if (layer == NULL) {
+        return;
+    }
+    freeMatrix(layer->u);
+    freeMatrix(layer->v);
+    if (layer->hidden != NULL) {
+        freeMatrix(layer->hidden);
+    }
+    free(layer);
+}
+
+int multiplyLowRankInto(LowRankLayer* layer, Matrix* input, Matrix* hidden, Matrix* result) {
+    if (hidden == NULL) {
+        hidden = layer->hidden;
+    }
+    if (hidden->rows != layer->rank || hidden->columns < input->columns) {
+        return reportError(MISC, "multiplyLowRankInto error: scratch matrix is too small for the input");
+    }
+    // Values are row major, so a narrower matrix uses the start of the buffer
+    Matrix used = *hidden;
+    used.columns = input->columns;
+    int returnCode = multiplyMatricesInto(layer->v, input, &used);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    return multiplyMatricesInto(layer->u, &used, result);
+}
+
+int lowRankProductInto(LowRankLayer* layer, Matrix* result) {
+    return multiplyMatricesInto(layer->u, layer->v, result);
+}
@@ -0,0 +1,68 @@
+#ifndef LOW_RANK
+#define LOW_RANK
+
+#include "mathLib.h"
+
+/*
+ * Low rank layers replace a `rows` by `columns` matrix of weights W with
+ * the product of two thin factors U (rows x rank) and V (rank x columns),
+ * the truncated singular value decomposition of W with the singular values
+ * folded into one factor. Multiplying by V and then U costs
+ * rank * (rows + columns) multiply-adds per sample instead of
+ * rows * columns, and both are ordinary dense products.
+ *
+ * The singular vectors are found as the eigenvectors of the Gram matrix on
+ * the smaller side of W, by cyclic Jacobi rotations, which takes time cubic
+ * in the smaller of `rows` and `columns`.
+ */
+
+/**
+ * A layer's weights as the product `u` times `v`.
+ */
+typedef struct _LowRankLayer {
+    unsigned int rank;
+    Matrix* u; // rows x rank
+    Matrix* v; // rank x columns
+    Matrix* hidden; // rank x the columns of one input, `v` times it
+} LowRankLayer;
+
+/**
+ * Places the singular vectors of the smaller side of `m` in the output
+ * vector `vectors`, one per row in order of decreasing singular value. They
+ * are the left singular vectors if `m` has no more rows than columns, and
+ * the right ones otherwise.
+ */
+int singularVectors(Matrix* m, Matrix** vectors);
+
+/**
+ * Makes the rank `rank` approximation of `weights` from its `singularVectors`
+ * `vectors` in the output vector `layer`, with scratch space for inputs of
+ * `columns` columns. The approximation is the closest of that rank, and is
+ * `weights` itself to rounding at full rank.
+ */
+int makeLowRankLayer(Matrix* weights, Matrix* vectors, unsigned int rank, unsigned int columns,
+                     LowRankLayer** layer);
+
+/**
+ * Makes a layer of the factors `u` and `v` in the output vector `layer`,
+ * which takes ownership of them, with scratch space for inputs of `columns`
+ * columns.
+ */
+int makeLowRankLayerOf(Matrix* u, Matrix* v, unsigned int columns, LowRankLayer** layer);
+void freeLowRankLayer(LowRankLayer* layer);
+
+/**
+ * Places `layer->u` times `layer->v` times `input` in `result`, each column
+ * of `input` being one sample. `v` times `input` goes in `hidden`, which
+ * must have `layer->rank` rows and at least as many columns as `input`, or
+ * in `layer->hidden` if `hidden` is NULL. Nothing is allocated, so threads
+ * may share `layer` if each passes its own `hidden`.
+ */
+int multiplyLowRankInto(LowRankLayer* layer, Matrix* input, Matrix* hidden, Matrix* result);
+
+/**
+ * Places the dense weights `layer->u` times `layer->v` in `result`.
+ */
+int lowRankProductInto(LowRankLayer* layer, Matrix* result);
+
+#endif // LOW_RANK
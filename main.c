@@ -1,52 +1,525 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h> // For srand
+#include <string.h> // For comparing option names
+#include <time.h> // For the default seed
 #include "utils.h" // For printing of images, matrices, etc
 #include "image.h"
 #include "neuralNetwork.h"
 #include "imageInput.h"
+#include "dataset.h"
+#include "augment.h"
+#include "threadPool.h"
+#include "modelFile.h"
+#include "checkpoint.h"
+#include "phaseTimer.h"
+#include "trace.h"
+#include "perfCounters.h"
+#include "placement.h"
 #include "err.h"
 
 //#define LEARNING_RATE 3
 //#define EPOCHS 50
 //#define MINI_BATCH_SIZE 10 // 1 is SGD, anything else is mini-batch gradient descent
 #define HIDDEN_LAYERS 1
+#define POSITIONAL_ARGUMENTS 8
+#define DEFAULT_CALIBRATION_SAMPLES 1000 // Training images --quantize calibrates with
+#define MAX_CONV_LAYERS 4
+
+// Fixed set up of --benchmark runs, so that their numbers can be compared
+#define BENCHMARK_SEED 1
+#define BENCHMARK_HIDDEN_NEURONS 30
+#define SYNTHETIC_ROWS 28
+#define SYNTHETIC_COLUMNS 28
+#define SYNTHETIC_CLASSES 10
+#define SYNTHETIC_TEST_FRACTION 6 // One testing image per six training images, as MNIST
+
+// Optional arguments given after the positional ones
+typedef struct _Options {
+    uint64_t seed;
+    int seedGiven;
+    unsigned int shuffleBlockSize;
+    unsigned int threads;
+    int augment;
+    char* model; // Single file model, NULL to use the `network` directory
+    ModelDataType modelPrecision; // How `model` stores weights and biases
+    char* checkpoint; // Checkpoint file, NULL to not checkpoint
+    unsigned int checkpointEvery;
+    int resume;
+    char* benchmark; // JSON report of a benchmark run, NULL for normal training
+    unsigned int synthetic; // Number of synthetic training images, 0 to read the datasets
+    double targetAccuracy; // Accuracy whose time to reach is benchmarked, 0-1
+    char* trace; // Chrome trace event file of the run, NULL to not trace
+    unsigned int traceEvents; // Room in each thread's trace buffer
+    int perf; // Count cycles, instructions and misses per kernel and phase
+    int memoryReport; // Account for the memory matrices and images use
+    int forbidAllocations; // Fail if a mini batch of training allocates
+    int denseInputs; // Never index the datasets' non-zero inputs
+    double pruneDensity; // Fraction of weights kept by pruning, 1 to not prune
+    int quantize; // Quantize the trained network to int8
+    int quantizePerChannel; // One weight scale per output neuron rather than per layer
+    unsigned int calibrationSamples;
+    double factorizeAccuracy; // Accuracy factorized layers keep, 0-1, 0 to not factorize
+    ConvShape conv[MAX_CONV_LAYERS]; // Filters, kernel and pool of each convolutional layer
+    unsigned int convLayers; // Convolutional layers before the hidden layer of a new network
+    unsigned int pipelineStages; // Threads training is pipelined between by layer, 0 to not
+    int numa; // Pin threads to nodes and place memory near the threads using it
+    int hugePages; // Ask for transparent huge pages on large regions
+} Options;
+
+/**
+ * Makes a seeded network of `options->convLayers` convolutional layers, then
+ * BENCHMARK_HIDDEN_NEURONS and SYNTHETIC_CLASSES fully connected neurons,
+ * for the images of `trainingData`, in the output vector `network`.
+ */
+static int makeFreshNetwork(Options* options, Dataset* trainingData, double learningRate,
+                            NeuralNetwork** network) {
+    unsigned int hiddenLayers = HIDDEN_LAYERS + options->convLayers;
+    unsigned int* neurons = calloc(hiddenLayers + 2, sizeof(unsigned int));
+    if (neurons == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    // Each convolutional layer takes the pooled channels of the one before
+    unsigned int channels = 1;
+    unsigned int height = trainingData->rows;
+    unsigned int width = trainingData->columns;
+    neurons[0] = channels * height * width;
+    for (unsigned int c = 0; c < options->convLayers; c++) {
+        ConvShape* shape = &options->conv[c];
+        shape->channels = channels;
+        shape->height = height;
+        shape->width = width;
+        unsigned int inputs;
+        int returnCode = convShapeSize(shape, &inputs, &neurons[c + 1]);
+        if (returnCode != SUCCESS) {
+            free(neurons);
+            return returnCode;
+        }
+        channels = shape->filters;
+        height = (height - shape->kernel + 1) / shape->pool;
+        width = (width - shape->kernel + 1) / shape->pool;
+    }
+    neurons[hiddenLayers] = BENCHMARK_HIDDEN_NEURONS;
+    neurons[hiddenLayers + 1] = SYNTHETIC_CLASSES;
+    int returnCode = makeSeededNetwork(hiddenLayers, neurons, learningRate, options->seed, network);
+    for (unsigned int c = 0; c < options->convLayers && returnCode == SUCCESS; c++) {
+        returnCode = setConvLayer(*network, c, &options->conv[c]);
+        if (returnCode == SUCCESS) {
+            // Filters have their own stream, so the dense layers start as without them
+            Rng rng;
+            seedRng(&rng, options->seed + c + 1);
+            randomiseMatrixWith((*network)->weights[c], &rng);
+        }
+    }
+    return returnCode;
+}
+
+/**
+ * Reads the optional `--name value` arguments from `argv[first]` onwards
+ * into `options`, which should already hold the defaults.
+ */
+static int parseOptions(int argc, char** argv, int first, Options* options) {
+    for (int i = first; i < argc; i++) {
+        // Flags without a value
+        if (strcmp(argv[i], "--augment") == 0) {
+            options->augment = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--resume") == 0) {
+            options->resume = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--perf") == 0) {
+            options->perf = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--numa") == 0) {
+            options->numa = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--huge-pages") == 0) {
+            options->hugePages = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--memory-report") == 0) {
+            options->memoryReport = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--forbid-allocations") == 0) {
+            options->forbidAllocations = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--dense-inputs") == 0) {
+            options->denseInputs = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return reportError(MISC, argv[i]);
+        }
+        if (strcmp(argv[i], "--seed") == 0) {
+            unsigned long long seed;
+            if (sscanf(argv[++i], "%llu", &seed) != 1) {
+                return reportError(MISC, "Conversion of seed argument error");
+            }
+            options->seed = (uint64_t) seed;
+            options->seedGiven = 1;
+        } else if (strcmp(argv[i], "--shuffle-block") == 0) {
+            if (sscanf(argv[++i], "%u", &options->shuffleBlockSize) != 1) {
+                return reportError(MISC, "Conversion of shuffle block argument error");
+            }
+        } else if (strcmp(argv[i], "--model") == 0) {
+            options->model = argv[++i];
+        } else if (strcmp(argv[i], "--model-precision") == 0) {
+            char* precision = argv[++i];
+            if (strcmp(precision, "fp64") == 0) {
+                options->modelPrecision = MODEL_FLOAT64;
+            } else if (strcmp(precision, "fp16") == 0) {
+                options->modelPrecision = MODEL_FLOAT16;
+            } else if (strcmp(precision, "bf16") == 0) {
+                options->modelPrecision = MODEL_BFLOAT16;
+            } else {
+                return reportError(MISC, "Model precision must be fp64, fp16 or bf16");
+            }
+        } else if (strcmp(argv[i], "--prune") == 0) {
+            if (sscanf(argv[++i], "%lf", &options->pruneDensity) != 1 ||
+                options->pruneDensity < 0 || options->pruneDensity > 1) {
+                return reportError(MISC, "Prune density must be between 0 and 1");
+            }
+        } else if (strcmp(argv[i], "--quantize") == 0) {
+            char* granularity = argv[++i];
+            options->quantize = 1;
+            if (strcmp(granularity, "channel") == 0) {
+                options->quantizePerChannel = 1;
+            } else if (strcmp(granularity, "layer") == 0) {
+                options->quantizePerChannel = 0;
+            } else {
+                return reportError(MISC, "Quantization must be per channel or layer");
+            }
+        } else if (strcmp(argv[i], "--conv") == 0) {
+            if (options->convLayers == MAX_CONV_LAYERS) {
+                return reportError(MISC, "Too many convolutional layers");
+            }
+            ConvShape* shape = &options->conv[options->convLayers++];
+            if (sscanf(argv[++i], "%u:%u:%u", &shape->filters, &shape->kernel, &shape->pool) != 3 ||
+                shape->filters == 0 || shape->kernel == 0 || shape->pool == 0) {
+                return reportError(MISC, "Convolutional layers must be filters:kernel:pool");
+            }
+        } else if (strcmp(argv[i], "--factorize") == 0) {
+            double percentage;
+            if (sscanf(argv[++i], "%lf", &percentage) != 1 || percentage <= 0 || percentage > 100) {
+                return reportError(MISC, "Factorization accuracy must be a percentage");
+            }
+            options->factorizeAccuracy = percentage / 100;
+        } else if (strcmp(argv[i], "--calibration-samples") == 0) {
+            if (sscanf(argv[++i], "%u", &options->calibrationSamples) != 1 ||
+                options->calibrationSamples == 0) {
+                return reportError(MISC, "Conversion of calibration samples argument error");
+            }
+        } else if (strcmp(argv[i], "--checkpoint") == 0) {
+            options->checkpoint = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0) {
+            if (sscanf(argv[++i], "%u", &options->checkpointEvery) != 1) {
+                return reportError(MISC, "Conversion of checkpoint interval argument error");
+            }
+        } else if (strcmp(argv[i], "--benchmark") == 0) {
+            options->benchmark = argv[++i];
+        } else if (strcmp(argv[i], "--synthetic") == 0) {
+            if (sscanf(argv[++i], "%u", &options->synthetic) != 1) {
+                return reportError(MISC, "Conversion of synthetic images argument error");
+            }
+        } else if (strcmp(argv[i], "--target-accuracy") == 0) {
+            double percentage;
+            if (sscanf(argv[++i], "%lf", &percentage) != 1 || percentage <= 0 || percentage > 100) {
+                return reportError(MISC, "Target accuracy must be a percentage");
+            }
+            options->targetAccuracy = percentage / 100;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            options->trace = argv[++i];
+        } else if (strcmp(argv[i], "--trace-events") == 0) {
+            if (sscanf(argv[++i], "%u", &options->traceEvents) != 1 || options->traceEvents == 0) {
+                return reportError(MISC, "Conversion of trace events argument error");
+            }
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            if (sscanf(argv[++i], "%u", &options->pipelineStages) != 1 || options->pipelineStages < 2) {
+                return reportError(MISC, "Pipelines need at least two stages");
+            }
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            if (sscanf(argv[++i], "%u", &options->threads) != 1 || options->threads == 0) {
+                return reportError(MISC, "Conversion of threads argument error");
+            }
+        } else {
+            return reportError(MISC, argv[i]);
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Spreads the weights and biases of `network`, which every worker of the
+ * thread pool reads, over every NUMA node.
+ */
+static int interleaveNetwork(NeuralNetwork* network) {
+    for (int l = 0; l < network->hiddenLayers + 1; l++) {
+        Matrix* matrices[] = {network->weights[l], network->biases[l]};
+        for (unsigned int m = 0; m < 2; m++) {
+            if (matrices[m] == NULL) {
+                continue;
+            }
+            int returnCode = interleaveMemory(matrices[m]->values,
+                (size_t) matrices[m]->rows * matrices[m]->columns * sizeof(double));
+            if (returnCode != SUCCESS) {
+                return returnCode;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Writes the JSON report of a `--benchmark` run to `filename`. `records` are
+ * the epochs from the start of training at `trainingStart`, on the monotonic
+ * clock.
+ */
+static int writeBenchmarkReport(char* filename, char** argv, Options* options,
+                                NeuralNetwork* network, EpochRecord* records,
+                                unsigned int epochs, unsigned int miniBatchSize,
+                                double trainingStart, double trainingEnd) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        return reportError(BAD_FILE_NAME, filename);
+    }
+    Dataset* trainingData = network->trainingData;
+    Dataset* testingData = network->testingData;
+
+    fprintf(file, "{\n  \"seed\": %llu,\n  \"topology\": [", (unsigned long long) options->seed);
+    for (int i = 0; i < network->hiddenLayers + 2; i++) {
+        fprintf(file, "%s%u", i == 0 ? "" : ", ", network->neurons[i]);
+    }
+    fprintf(file, "],\n  \"learning_rate\": %g,\n  \"epochs\": %u,\n  \"mini_batch_size\": %u,\n",
+            network->learningRate, epochs, miniBatchSize);
+    fprintf(file, "  \"threads\": %u,\n  \"pipeline_stages\": %u,\n  \"augment\": %s,\n",
+            options->threads, options->pipelineStages, options->augment ? "true" : "false");
+    fprintf(file, "  \"numa\": %s,\n  \"huge_pages\": %s,\n",
+            options->numa ? "true" : "false", options->hugePages ? "true" : "false");
+    if (options->synthetic > 0) {
+        fprintf(file, "  \"dataset\": \"synthetic\",\n");
+    } else {
+        fprintf(file, "  \"dataset\": \"%s\",\n", argv[1]);
+    }
+    fprintf(file, "  \"training_images\": %u,\n  \"testing_images\": %u,\n",
+            trainingData->numberOfSamples, testingData->numberOfSamples);
+
+    // Every epoch, then the totals
+    double trainSeconds = 0;
+    double evaluateSeconds = 0;
+    double timeToAccuracy = -1;
+    fprintf(file, "  \"per_epoch\": [");
+    for (unsigned int e = 0; e < epochs; e++) {
+        EpochRecord* record = &records[e];
+        trainSeconds += record->trainSeconds;
+        evaluateSeconds += record->evaluateSeconds;
+        if (timeToAccuracy < 0 && options->targetAccuracy > 0 &&
+            record->accuracy >= options->targetAccuracy) {
+            timeToAccuracy = record->finishedAt - trainingStart;
+        }
+        fprintf(file, "%s\n    {\"epoch\": %u, \"train_seconds\": %.6f, \"evaluate_seconds\": %.6f, "
+                "\"accuracy\": %.6f, \"train_images_per_second\": %.1f, \"evaluate_images_per_second\": %.1f}",
+                e == 0 ? "" : ",", e, record->trainSeconds, record->evaluateSeconds, record->accuracy,
+                trainingData->numberOfSamples / record->trainSeconds,
+                testingData->numberOfSamples / record->evaluateSeconds);
+    }
+    fprintf(file, "\n  ],\n");
+    fprintf(file, "  \"seconds_per_epoch\": %.6f,\n", trainSeconds / epochs);
+    fprintf(file, "  \"train_images_per_second\": %.1f,\n",
+            (double) trainingData->numberOfSamples * epochs / trainSeconds);
+    fprintf(file, "  \"evaluate_seconds\": %.6f,\n", evaluateSeconds / epochs);
+    fprintf(file, "  \"evaluate_images_per_second\": %.1f,\n",
+            (double) testingData->numberOfSamples * epochs / evaluateSeconds);
+    fprintf(file, "  \"final_accuracy\": %.6f,\n", network->accuracy);
+    if (options->targetAccuracy > 0) {
+        fprintf(file, "  \"target_accuracy\": %.6f,\n", options->targetAccuracy);
+    } else {
+        fprintf(file, "  \"target_accuracy\": null,\n");
+    }
+    if (timeToAccuracy >= 0) {
+        fprintf(file, "  \"time_to_accuracy_seconds\": %.6f,\n", timeToAccuracy);
+    } else {
+        fprintf(file, "  \"time_to_accuracy_seconds\": null,\n");
+    }
+    fprintf(file, "  \"total_seconds\": %.6f\n}\n", trainingEnd - trainingStart);
+
+    if (fclose(file) != 0) {
+        return reportError(OUTPUT_FAILED, filename);
+    }
+    return SUCCESS;
+}
 
 /**
  * argv = {main, trainingDatasetFilename, trainingLabelsFilename,
- *         testDatasetFilename, testLabelsFilename}
+ *         testDatasetFilename, testLabelsFilename, learningRate, epochs,
+ *         miniBatchSize, [options]}
  */
 int main(int argc, char** argv) {
     // Check all arguments given
     if (argc == 1) {
-        printf("Usage: ./main trainingDatasetFilename trainingLabelsFilename testDatasetFilename testLabelsFilename learningRate epochs miniBatchSize\n");
+        printf("Usage: ./main trainingDatasetFilename trainingLabelsFilename testDatasetFilename testLabelsFilename learningRate epochs miniBatchSize [options]\n");
+        printf("Datasets are IDX files, which may be gzipped, or .npy arrays with .npy labels\n");
+        printf("Options:\n");
+        printf("  --seed n           Seed for the order training images are visited in\n");
+        printf("  --shuffle-block n  Shuffle blocks of n consecutive images instead of every image\n");
+        printf("  --augment          Randomly shift, rotate and distort each mini batch\n");
+        printf("  --threads n        Number of worker threads for augmentation and large kernels (default 1)\n");
+        printf("  --pipeline n       Split the layers between n threads that train each mini batch as a\n"
+               "                     pipeline, one sample at a time, with identical results\n");
+        printf("  --numa             Pin threads to NUMA nodes, keep each thread's memory on its node and\n"
+               "                     interleave the datasets and shared weights across nodes\n");
+        printf("  --huge-pages       Ask for transparent huge pages on the datasets and large matrices\n");
+        printf("  --model file       Load the network from this model file if it exists, and save it there\n");
+        printf("  --model-precision p  Store the model file as fp64 (default), fp16 or bf16\n");
+        printf("  --checkpoint file  Save a checkpoint to this file during training\n");
+        printf("  --checkpoint-every n  Epochs between checkpoints (default 1)\n");
+        printf("  --resume           Carry on training from the checkpoint file\n");
+        printf("  --benchmark file   Train a new %u-%u-%u network from --seed (default %u) and\n"
+               "                     write throughput and time to accuracy to this JSON file\n",
+               SYNTHETIC_ROWS * SYNTHETIC_COLUMNS, BENCHMARK_HIDDEN_NEURONS, SYNTHETIC_CLASSES, BENCHMARK_SEED);
+        printf("  --synthetic n      Use n synthetic training images and n/%u testing images\n"
+               "                     instead of the dataset files\n", SYNTHETIC_TEST_FRACTION);
+        printf("  --target-accuracy p  Testing accuracy percentage --benchmark times reaching\n");
+        printf("  --trace file       Write a timeline of the run as Chrome trace JSON, for Perfetto\n");
+        printf("  --trace-events n   Events kept per thread when tracing (default %u)\n", DEFAULT_TRACE_EVENTS);
+        printf("  --perf             Report hardware counters of each kernel and phase, where allowed\n");
+        printf("  --memory-report    Report live and peak memory per epoch, phase and call site\n");
+        printf("  --forbid-allocations  Fail if a mini batch of training allocates\n");
+        printf("  --dense-inputs     Feed every input to the first layer, even if most are zero\n");
+        printf("  --prune d          Prune all but the fraction d of largest weights by the last epoch,\n"
+               "                     which are then stored and run as sparse matrices\n");
+        printf("  --conv f:k:p       Start a new network with a layer of f k by k filters then p by p\n"
+               "                     max pooling, repeated for more layers. --model files store them\n");
+        printf("  --factorize p      Factorize each trained layer into the lowest rank pair of thin\n"
+               "                     matrices keeping p%% testing accuracy. --model files store them\n");
+        printf("  --quantize g       Quantize the trained weights to int8 with a scale per channel or\n"
+               "                     layer, and report the accuracy lost. --model files store them\n");
+        printf("  --calibration-samples n  Training images that calibrate input ranges (default %u)\n",
+               DEFAULT_CALIBRATION_SAMPLES);
         return SUCCESS;
     }
-    if (argc != 8) {
+    if (argc < POSITIONAL_ARGUMENTS) {
         return reportError(BAD_ARGUMENT_COUNT, "");
     }
     double learningRate;
     if (!sscanf(argv[5], "%lf", &learningRate)) {
         return reportError(MISC, "Conversion of learning rate argument error");
     }
+    Options options = {(uint64_t) time(NULL), 0, 0, 1, 0, NULL, MODEL_FLOAT64, NULL, 1, 0,
+                       NULL, 0, 0, NULL, DEFAULT_TRACE_EVENTS, 0, 0, 0, 0, 1,
+                       0, 0, DEFAULT_CALIBRATION_SAMPLES, 0, {{0}}, 0, 0, 0, 0};
+    if (parseOptions(argc, argv, POSITIONAL_ARGUMENTS, &options) != SUCCESS) {
+        return MISC;
+    }
+    if (options.resume && options.checkpoint == NULL) {
+        return reportError(MISC, "--resume needs a --checkpoint file");
+    }
+    if (options.convLayers > 0 && options.model == NULL && options.benchmark == NULL) {
+        return reportError(MISC, "--conv needs a --model file, the network directory can't store it");
+    }
+    if (options.benchmark != NULL && (options.resume || options.model != NULL)) {
+        return reportError(MISC, "--benchmark trains a new network, so takes no --model or --resume");
+    }
+    if (options.benchmark != NULL && !options.seedGiven) {
+        options.seed = BENCHMARK_SEED;
+    }
+    unsigned int epochs = atoi(argv[6]);
+    unsigned int miniBatchSize = atoi(argv[7]);
 
-    // --- TRAINING DATASET ---
-    int numberOfTrainingImages = 0;
-    Image** trainingImages = NULL;
-    int returnCode = readMNIST(argv[1], argv[2], &trainingImages, &numberOfTrainingImages);
-    if (returnCode != SUCCESS) {
-        goto cleanUp;
+    // Declared up front as every failure jumps to the clean up
+    Dataset* trainingData = NULL;
+    Dataset* testingData = NULL;
+    NeuralNetwork* network = NULL;
+    ThreadPool* pool = NULL;
+    Augmenter* augmenter = NULL;
+    Checkpointer* checkpointer = NULL;
+    TrainingState resumed;
+    EpochRecord* epochRecords = NULL;
+    int returnCode = SUCCESS;
+    if (options.trace != NULL) {
+        returnCode = startTracing(options.traceEvents);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+        nameTraceThread("main");
     }
-    // --- TESTING DATASET ---
-    int numberOfTestingImages = 0;
-    Image** testingImages = NULL;
-    returnCode = readMNIST(argv[3], argv[4], &testingImages, &numberOfTestingImages);
-    if (returnCode != SUCCESS) {
-        goto cleanUp;
+    if (options.memoryReport || options.forbidAllocations) {
+        // Started first so that the datasets are counted too
+        returnCode = startMemoryAccounting();
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
+    if (options.perf && startPerfCounters() != SUCCESS) {
+        // Profiling is optional, so carry on without it
+        printf("Hardware counters are not available, training without them\n");
     }
+    if ((options.numa || options.hugePages) &&
+        startPlacement(options.numa, options.hugePages) != SUCCESS) {
+        // Placement only changes speed, so carry on without it
+        printf("NUMA placement is not available, training without it\n");
+    }
+    pinThread(0); // Worker 0 of the thread pool and stage 0 of a pipeline
+    uint64_t phaseStart = phaseClock();
+
+    if (options.synthetic > 0) {
+        // Generated from the seed, the dataset arguments are ignored
+        unsigned int testing = options.synthetic / SYNTHETIC_TEST_FRACTION;
+        returnCode = makeSyntheticDataset(options.synthetic, SYNTHETIC_ROWS, SYNTHETIC_COLUMNS,
+                                          SYNTHETIC_CLASSES, options.seed, 0, &trainingData);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+        returnCode = makeSyntheticDataset(testing > 0 ? testing : 1, SYNTHETIC_ROWS, SYNTHETIC_COLUMNS,
+                                          SYNTHETIC_CLASSES, options.seed, 1, &testingData);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+    } else {
+        // --- TRAINING DATASET ---
+        // IDX files (optionally gzipped) or .npy arrays, decided by readDataset
+        returnCode = readDataset(argv[1], argv[2], &trainingData);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+        // --- TESTING DATASET ---
+        returnCode = readDataset(argv[3], argv[4], &testingData);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+    }
+    if (!options.denseInputs) {
+        // Mostly zero inputs are indexed once, for the first layer to skip the zeros
+        returnCode = indexSparseSamples(trainingData);
+        if (returnCode == SUCCESS) {
+            returnCode = indexSparseSamples(testingData);
+        }
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+        if (trainingData->sparse != NULL) {
+            SparseMatrix* sparse = trainingData->sparse;
+            printf("Training inputs are %.1f%% non-zero, only those are fed to the first layer\n",
+                   100.0 * sparse->offsets[sparse->rows] / ((double) sparse->rows * sparse->columns));
+        }
+    }
+    if (options.numa || options.hugePages) {
+        // Every worker reads the samples, so none should be remote to all of them
+        returnCode = interleaveDataset(trainingData);
+        if (returnCode == SUCCESS) {
+            returnCode = interleaveDataset(testingData);
+        }
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+    }
+    endPhase(PHASE_DATA_LOAD, phaseStart);
 
     // --- MAKE NEURAL NETWORK ---
-    NeuralNetwork* network = NULL;
     /*unsigned int* neurons = calloc(sizeof(unsigned int), HIDDEN_LAYERS + 2);
     neurons[0] = 784;
     neurons[1] = 30;
@@ -56,14 +529,94 @@ int main(int argc, char** argv) {
         goto cleanUp;
     }*/
     
-    returnCode = loadNetwork(&network, "network", learningRate);
+    FILE* existingModel = options.model == NULL ? NULL : fopen(options.model, "rb");
+    if (options.benchmark != NULL || (options.convLayers > 0 && existingModel == NULL && !options.resume)) {
+        // A fresh network of a fixed topology, so runs are comparable
+        if (existingModel != NULL) {
+            fclose(existingModel);
+        }
+        returnCode = makeFreshNetwork(&options, trainingData, learningRate, &network);
+    } else if (options.resume) {
+        // Weights, epoch and shuffle order all come from the checkpoint
+        if (existingModel != NULL) {
+            fclose(existingModel);
+        }
+        returnCode = loadNetworkCheckpoint(&network, &resumed, options.checkpoint, learningRate);
+        if (returnCode == SUCCESS && resumed.miniBatchSize != miniBatchSize) {
+            returnCode = reportError(MISC, "miniBatchSize must match the checkpoint being resumed");
+        }
+        options.seed = resumed.seed;
+    } else if (existingModel != NULL) {
+        fclose(existingModel);
+        returnCode = loadNetworkModel(&network, options.model, learningRate);
+    } else {
+        returnCode = loadNetwork(&network, "network", learningRate);
+    }
+    if (returnCode != SUCCESS) {
+        goto cleanUp;
+    }
+    // Samples are copied into matrices the size of the first layer
+    unsigned int outputs = network->neurons[network->hiddenLayers + 1];
+    returnCode = checkDatasetFits(trainingData, network->neurons[0], outputs);
+    if (returnCode == SUCCESS) {
+        returnCode = checkDatasetFits(testingData, network->neurons[0], outputs);
+    }
     if (returnCode != SUCCESS) {
         goto cleanUp;
     }
-    network->trainingImages = trainingImages;
-    network->numberOfTrainingImages = numberOfTrainingImages;
-    network->testingImages = testingImages;
-    network->numberOfTestingImages = numberOfTestingImages;
+    seedNetwork(network, options.seed);
+    if (options.resume) {
+        network->rng.state = resumed.rngState;
+        network->epoch = resumed.epoch;
+        printf("Resuming from epoch %u\n", resumed.epoch);
+    }
+    if (options.checkpoint != NULL) {
+        returnCode = makeCheckpointer(network, options.checkpoint,
+                                      options.checkpointEvery, &checkpointer);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+        network->checkpointer = checkpointer;
+    }
+    network->shuffleBlockSize = options.shuffleBlockSize;
+    if (options.threads > 1) {
+        returnCode = makeThreadPool(options.threads, &pool);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+        setKernelThreadPool(pool);
+    }
+    if (options.augment) {
+        AugmentOptions augmentOptions;
+        defaultAugmentOptions(&augmentOptions);
+        returnCode = makeAugmenter(&augmentOptions, trainingData->rows,
+                                   trainingData->columns, options.seed, pool,
+                                   &augmenter);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+        network->augmenter = augmenter;
+    }
+    network->trainingData = trainingData;
+    network->testingData = testingData;
+    network->forbidAllocations = options.forbidAllocations;
+    network->pruneDensity = options.pruneDensity;
+    network->pipelineStages = options.pipelineStages;
+    if ((options.numa || options.hugePages) && options.pipelineStages == 0) {
+        // Workers share every layer, pipeline stages place their own
+        returnCode = interleaveNetwork(network);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+    }
+    if (options.benchmark != NULL) {
+        epochRecords = calloc(epochs, sizeof(EpochRecord));
+        if (epochRecords == NULL) {
+            returnCode = reportError(IMAGE_MALLOC_FAILED, "");
+            goto cleanUp;
+        }
+        network->epochRecords = epochRecords;
+    }
 
     // --- EVALUATION ---
     returnCode = evaluateNetwork(network, "Initial");
@@ -72,21 +625,91 @@ int main(int argc, char** argv) {
     }
 
     // --- TRAINING --- 
-    returnCode = trainNetworkMiniBatches(network, atoi(argv[6]), atoi(argv[7]));
+    double trainingStart = monotonicSeconds();
+    returnCode = trainNetworkMiniBatches(network, epochs, miniBatchSize);
+    double trainingEnd = monotonicSeconds();
     if (returnCode != SUCCESS) {
         goto cleanUp;
     }
+    if (options.pruneDensity < 1 && network->sparseWeights[0] == NULL) {
+        // No epoch was left to prune after, so prune the trained network
+        returnCode = pruneNetwork(network, options.pruneDensity);
+        if (returnCode == SUCCESS) {
+            returnCode = evaluateNetwork(network, "Pruned");
+        }
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+    }
+    if (options.factorizeAccuracy > 0) {
+        returnCode = factorizeNetwork(network, options.factorizeAccuracy);
+        if (returnCode == SUCCESS) {
+            returnCode = evaluateNetwork(network, "Factorized");
+        }
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+    }
+    if (options.quantize) {
+        returnCode = quantizeNetwork(network, trainingData, options.calibrationSamples,
+                                     options.quantizePerChannel);
+        if (returnCode == SUCCESS) {
+            returnCode = evaluateNetwork(network, "Int8");
+        }
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+    }
 
     // --- SAVING ---
-    returnCode = saveNetwork(network, "network");
+    phaseStart = phaseClock();
+    if (options.benchmark != NULL) {
+        // Benchmarked networks are thrown away
+        returnCode = writeBenchmarkReport(options.benchmark, argv, &options, network, epochRecords,
+                                          epochs, miniBatchSize, trainingStart, trainingEnd);
+    } else if (options.model != NULL) {
+        returnCode = saveNetworkModelAs(network, options.model, options.modelPrecision);
+    } else {
+        returnCode = saveNetwork(network, "network");
+    }
     if (returnCode != SUCCESS) {
         goto cleanUp;
     }
+    endPhase(PHASE_SAVE, phaseStart);
+
+    // The last checkpoint is timed too, so wait for it before the breakdown
+    if (checkpointer != NULL) {
+        returnCode = waitForCheckpoint(checkpointer);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+    }
+    PhaseTotals totals;
+    collectPhaseTotals(&totals);
+    printPhaseTotals(&totals, "Cumulative");
+    if (options.perf) {
+        printPerfReport();
+    }
+    if (options.memoryReport) {
+        printAllocationSites();
+    }
 
     // Cleanup and exit execution
     cleanUp:
+        freeCheckpointer(checkpointer); // Waits for the last checkpoint
         freeNetwork(network);
-        freeAllImages(trainingImages, numberOfTrainingImages);
-        freeAllImages(testingImages, numberOfTestingImages);
+        freeDataset(trainingData);
+        freeDataset(testingData);
+        freeAugmenter(augmenter);
+        setKernelThreadPool(NULL);
+        freeThreadPool(pool);
+        free(epochRecords);
+        if (options.trace != NULL) {
+            // Written even if the run failed, as that may be what it shows
+            int traceCode = writeTrace(options.trace);
+            if (returnCode == SUCCESS) {
+                returnCode = traceCode;
+            }
+        }
         return returnCode;
 }
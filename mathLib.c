@@ -1,10 +1,206 @@
 #include <stdlib.h>
+#include <string.h> // For memcpy of float bits
 #include <time.h> // For srand
 #include <math.h> // For exp()
 #include "err.h"
 #include "mathLib.h"
+#include "perfCounters.h"
 
-int makeMatrix(unsigned int rows, unsigned int columns, Matrix** m) {
+#define PARALLEL_MIN_PRODUCTS (1 << 18) // Multiply-adds before a product is split between threads
+#define PARALLEL_MIN_ELEMENTS (1 << 15) // Values before an element-wise kernel is split
+#define ELEMENT_CHUNK 4096 // Values each item of a split element-wise kernel covers
+#define TILE_ROWS 16 // Tiles of a split product's result
+#define TILE_COLUMNS 64
+
+// --- Parallel kernels ---
+static ThreadPool* kernelPool = NULL;
+
+void setKernelThreadPool(ThreadPool* pool) {
+    kernelPool = pool;
+}
+
+typedef enum _ElementOperation {
+    ELEMENT_ADD,
+    ELEMENT_ADD_COLUMN,
+    ELEMENT_ADD_SCALED,
+    ELEMENT_SCALE,
+    ELEMENT_HADAMARD,
+    ELEMENT_RELU,
+    ELEMENT_DRELU,
+    ELEMENT_SIGMOID,
+    ELEMENT_DSIGMOID
+} ElementOperation;
+
+// One element-wise kernel call. `m2` is only used by operations of two
+// matrices, and is the column of ELEMENT_ADD_COLUMN
+typedef struct _ElementTask {
+    ElementOperation operation;
+    Matrix* m1;
+    Matrix* m2;
+    double scalar;
+    Matrix* result;
+} ElementTask;
+
+// Applies the task's operation to values [begin, end)
+static void elementRange(ElementTask* task, unsigned int begin, unsigned int end) {
+    const double* x = task->m1->values;
+    const double* y = task->m2 != NULL ? task->m2->values : NULL;
+    double* out = task->result->values;
+    double scalar = task->scalar;
+    switch (task->operation) {
+        case ELEMENT_ADD:
+            for (unsigned int i = begin; i < end; i++) {
+                out[i] = x[i] + y[i];
+            }
+            break;
+        case ELEMENT_ADD_COLUMN: {
+            unsigned int columns = task->m1->columns;
+            for (unsigned int i = begin; i < end; i++) {
+                out[i] = x[i] + y[i / columns];
+            }
+            break;
+        }
+        case ELEMENT_ADD_SCALED:
+            for (unsigned int i = begin; i < end; i++) {
+                out[i] = x[i] + scalar * y[i];
+            }
+            break;
+        case ELEMENT_SCALE:
+            for (unsigned int i = begin; i < end; i++) {
+                out[i] = scalar * x[i];
+            }
+            break;
+        case ELEMENT_HADAMARD:
+            for (unsigned int i = begin; i < end; i++) {
+                out[i] = x[i] * y[i];
+            }
+            break;
+        case ELEMENT_RELU:
+            for (unsigned int i = begin; i < end; i++) {
+                out[i] = (double) x[i] * (x[i] > 0);
+            }
+            break;
+        case ELEMENT_DRELU:
+            for (unsigned int i = begin; i < end; i++) {
+                out[i] = (x[i] > 0);
+            }
+            break;
+        case ELEMENT_SIGMOID:
+            for (unsigned int i = begin; i < end; i++) {
+                out[i] = 1/(1+exp(-x[i]));
+            }
+            break;
+        case ELEMENT_DSIGMOID:
+            for (unsigned int i = begin; i < end; i++) {
+                double s = 1/(1+exp(-x[i]));
+                out[i] = s*(1-s);
+            }
+            break;
+    }
+}
+
+// Runs chunks [begin, end) of an element-wise task on a pool thread
+static void elementChunks(void* arg, unsigned int begin, unsigned int end, unsigned int worker) {
+    ElementTask* task = (ElementTask*) arg;
+    unsigned int n = task->m1->rows * task->m1->columns;
+    unsigned int last = end * ELEMENT_CHUNK < n ? end * ELEMENT_CHUNK : n;
+    elementRange(task, begin * ELEMENT_CHUNK, last);
+}
+
+// Applies `operation` to every value of `m1`, split between threads if large
+static void runElementWise(ElementOperation operation, Matrix* m1, Matrix* m2, double scalar,
+                           Matrix* result) {
+    ElementTask task = {operation, m1, m2, scalar, result};
+    unsigned int n = m1->rows * m1->columns;
+    if (kernelPool != NULL && n >= PARALLEL_MIN_ELEMENTS) {
+        parallelFor(kernelPool, (n + ELEMENT_CHUNK - 1) / ELEMENT_CHUNK, elementChunks, &task);
+    } else {
+        elementRange(&task, 0, n);
+    }
+}
+
+// Places rows [rowBegin, rowEnd) and columns [columnBegin, columnEnd) of
+// `m1` times `m2` in `result`
+static void multiplyBlock(Matrix* m1, Matrix* m2, Matrix* result, unsigned int rowBegin,
+                          unsigned int rowEnd, unsigned int columnBegin, unsigned int columnEnd) {
+    for (unsigned int i = columnBegin; i < columnEnd; i++) {
+        for (unsigned int j = rowBegin; j < rowEnd; j++) {
+            double sum = 0;
+            for (unsigned int k = 0; k < m1->columns; k++) {
+                // Add m1[j][k] * m2[k][i] to sum
+                double first_element = m1->values[j * m1->columns + k];
+                double second_element = m2->values[k * m2->columns + i];
+                sum += (first_element * second_element);
+            }
+            // Put into result[j][i]
+            result->values[j * result->columns + i] = sum;
+        }
+    }
+}
+
+// Places rows [rowBegin, rowEnd) of the sparse `m1` times `m2` in `result`
+static void multiplySparseRows(SparseMatrix* m1, Matrix* m2, Matrix* result,
+                               unsigned int rowBegin, unsigned int rowEnd) {
+    unsigned int columns = m2->columns;
+    for (unsigned int i = rowBegin; i < rowEnd; i++) {
+        double* resultRow = &result->values[(size_t) i * columns];
+        for (unsigned int j = 0; j < columns; j++) {
+            resultRow[j] = 0;
+        }
+        // Each value of the row adds its scaled row of m2, so every sum
+        // still runs over k in ascending order
+        for (size_t p = m1->offsets[i]; p < m1->offsets[i + 1]; p++) {
+            double value = m1->values[p];
+            const double* m2Row = &m2->values[(size_t) m1->indices[p] * columns];
+            for (unsigned int j = 0; j < columns; j++) {
+                resultRow[j] += value * m2Row[j];
+            }
+        }
+    }
+}
+
+typedef struct _SparseMultiplyTask {
+    SparseMatrix* m1;
+    Matrix* m2;
+    Matrix* result;
+} SparseMultiplyTask;
+
+// Computes bands [begin, end) of TILE_ROWS rows of a sparse product
+static void multiplySparseBands(void* arg, unsigned int begin, unsigned int end, unsigned int worker) {
+    SparseMultiplyTask* task = (SparseMultiplyTask*) arg;
+    unsigned int rows = task->m1->rows;
+    unsigned int rowEnd = end * TILE_ROWS < rows ? end * TILE_ROWS : rows;
+    multiplySparseRows(task->m1, task->m2, task->result, begin * TILE_ROWS, rowEnd);
+}
+
+typedef struct _MultiplyTask {
+    Matrix* m1;
+    Matrix* m2;
+    Matrix* result;
+    unsigned int columnTiles; // Tiles across each row of the result
+} MultiplyTask;
+
+// Computes tiles [begin, end) of the result, numbered along its rows
+static void multiplyTiles(void* arg, unsigned int begin, unsigned int end, unsigned int worker) {
+    MultiplyTask* task = (MultiplyTask*) arg;
+    unsigned int rows = task->result->rows;
+    unsigned int columns = task->result->columns;
+    for (unsigned int t = begin; t < end; t++) {
+        unsigned int rowBegin = t / task->columnTiles * TILE_ROWS;
+        unsigned int columnBegin = t % task->columnTiles * TILE_COLUMNS;
+        unsigned int rowEnd = rowBegin + TILE_ROWS < rows ? rowBegin + TILE_ROWS : rows;
+        unsigned int columnEnd = columnBegin + TILE_COLUMNS < columns ? columnBegin + TILE_COLUMNS : columns;
+        multiplyBlock(task->m1, task->m2, task->result, rowBegin, rowEnd, columnBegin, columnEnd);
+    }
+}
+
+// --- Matrix functions ---
+
+int makeMatrixAt(unsigned int rows, unsigned int columns, Matrix** m, const char* site) {
+    int returnCode = checkAllocation(site);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
     *m = malloc(sizeof(Matrix));
     if (*m == NULL) {
         return reportError(IMAGE_MALLOC_FAILED, "");
@@ -12,17 +208,45 @@ int makeMatrix(unsigned int rows, unsigned int columns, Matrix** m) {
 
     (*m)->rows = rows;
     (*m)->columns = columns;
-    (*m)->values = calloc(rows*columns, sizeof(double));
+    (*m)->values = calloc((size_t) rows * columns, sizeof(double));
+    if ((*m)->values == NULL && (size_t) rows * columns > 0) {
+        free(*m);
+        *m = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*m)->ownsValues = 1;
     zeroMatrix(*m);
+    recordAllocation(*m, sizeof(Matrix) + (size_t) rows * columns * sizeof(double), site);
     return SUCCESS;
 }
 
 int freeMatrix(Matrix* m) {
-    free(m->values);
+    recordFree(m);
+    if (m->ownsValues) {
+        free(m->values);
+    }
     free(m);
     return SUCCESS;
 }
 
+int makeMatrixViewAt(unsigned int rows, unsigned int columns, double* values,
+                     Matrix** m, const char* site) {
+    int returnCode = checkAllocation(site);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    *m = malloc(sizeof(Matrix));
+    if (*m == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*m)->rows = rows;
+    (*m)->columns = columns;
+    (*m)->values = values;
+    (*m)->ownsValues = 0;
+    recordAllocation(*m, sizeof(Matrix), site);
+    return SUCCESS;
+}
+
 int loadMatrixInto(Matrix* m, char* inputFilename) {
     // Open input file
     FILE* file = fopen(inputFilename, "rb");
@@ -30,16 +254,23 @@ int loadMatrixInto(Matrix* m, char* inputFilename) {
         return reportError(MISC, "loadMatrix error: matrix input file could not be opened");
     }
 
-    // Read header (rows and columns)
-    int read = fread(&m->rows, sizeof(unsigned int), 1, file);
-    read += fread(&m->columns, sizeof(unsigned int), 1, file);
+    // Read header (rows and columns), which must match `m`
+    unsigned int rows, columns;
+    int read = fread(&rows, sizeof(unsigned int), 1, file);
+    read += fread(&columns, sizeof(unsigned int), 1, file);
     if (read != 2) {
+        fclose(file);
         return reportError(MISC, "loadMatrix error: fread header error");
     }
+    if (rows != m->rows || columns != m->columns) {
+        fclose(file);
+        return reportError(MISC, "loadMatrix error: matrix dimensions do not match");
+    }
 
     // Read data
     read = fread(m->values, sizeof(double), m->rows * m->columns, file);
     if (read != m->rows * m->columns) {
+        fclose(file);
         return reportError(MISC, "loadMatrix error: fread data error");
     }
 
@@ -81,15 +312,251 @@ int addMatricesInto(Matrix* m1, Matrix* m2, Matrix* result) {
     }
 
     // Move addition into result vector
-    for (int i = 0; i < m1->rows * m1->columns; i++) {
-       result->values[i] = m1->values[i] + m2->values[i];
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    runElementWise(ELEMENT_ADD, m1, m2, 0, result);
+    if (counting) {
+        perfEnd("addMatricesInto", m1->rows, m1->columns, 0, &counters);
+    }
+    return SUCCESS;
+}
+
+int addColumnInto(Matrix* m1, Matrix* column, Matrix* result) {
+    // Check dimensions
+    if (column->columns != 1 || column->rows != m1->rows) {
+        return reportError(MISC, "addColumnInto error: column must have one column and the same rows");
+    }
+    if (m1->rows != result->rows || m1->columns != result->columns) {
+        return reportError(MISC, "addColumnInto error: result matrix doesn't have appropriate dimensions");
+    }
+
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    runElementWise(ELEMENT_ADD_COLUMN, m1, column, 0, result);
+    if (counting) {
+        perfEnd("addColumnInto", m1->rows, m1->columns, 0, &counters);
+    }
+    return SUCCESS;
+}
+
+int multiplyTransposedInto(Matrix* m1, Matrix* m2, Matrix* result) {
+    // Check dimensions
+    if (m1->rows != m2->rows) {
+        return reportError(MISC, "multiplyTransposedInto error: matrices cannot be multiplied");
+    }
+    if (m1->columns != result->rows || m2->columns != result->columns) {
+        return reportError(MISC, "multiplyTransposedInto error: result matrix doesn't have appropriate dimensions");
+    }
+
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    for (int i = 0; i < m2->columns; i++) {
+        for (int j = 0; j < m1->columns; j++) {
+            double sum = 0;
+            for (int k = 0; k < m1->rows; k++) {
+                // Add m1[k][j] * m2[k][i] to sum
+                sum += m1->values[k * m1->columns + j] * m2->values[k * m2->columns + i];
+            }
+            result->values[j * result->columns + i] = sum;
+        }
+    }
+    if (counting) {
+        perfEnd("multiplyTransposedInto", m1->columns, m2->columns, m1->rows, &counters);
+    }
+    return SUCCESS;
+}
+
+int addScaledInto(Matrix* m1, double scalar, Matrix* m2, Matrix* result) {
+    // Check dimensions
+    if (m1->rows != m2->rows || m1->columns != m2->columns) {
+        return reportError(MISC, "addScaledInto error: must have same dimensions");
+    }
+    if (m1->rows != result->rows || m1->columns != result->columns) {
+        return reportError(MISC, "addScaledInto error: result matrix doesn't have appropriate dimensions");
+    }
+
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    runElementWise(ELEMENT_ADD_SCALED, m1, m2, scalar, result);
+    if (counting) {
+        perfEnd("addScaledInto", m1->rows, m1->columns, 0, &counters);
+    }
+    return SUCCESS;
+}
+
+int addOuterProductInto(Matrix* m1, Matrix* m2, Matrix* result) {
+    // Check dimensions
+    if (m1->columns != 1 || m2->columns != 1) {
+        return reportError(MISC, "addOuterProductInto error: both vectors must have one column");
+    }
+    if (m1->rows != result->rows || m2->rows != result->columns) {
+        return reportError(MISC, "addOuterProductInto error: result matrix doesn't have appropriate dimensions");
+    }
+
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    for (int i = 0; i < m1->rows; i++) {
+        double value = m1->values[i];
+        double* row = &result->values[i * result->columns];
+        for (int j = 0; j < m2->rows; j++) {
+            row[j] += value * m2->values[j];
+        }
+    }
+    if (counting) {
+        perfEnd("addOuterProductInto", m1->rows, m2->rows, 0, &counters);
+    }
+    return SUCCESS;
+}
+
+// --- Sparse matrix functions ---
+int makeSparseMatrixAt(unsigned int rows, unsigned int columns, size_t capacity,
+                       SparseMatrix** m, const char* site) {
+    int returnCode = checkAllocation(site);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    *m = calloc(1, sizeof(SparseMatrix));
+    if (*m == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*m)->rows = rows;
+    (*m)->columns = columns;
+    (*m)->capacity = capacity;
+    (*m)->offsets = calloc((size_t) rows + 1, sizeof(size_t));
+    (*m)->indices = malloc((capacity > 0 ? capacity : 1) * sizeof(unsigned int));
+    (*m)->values = malloc((capacity > 0 ? capacity : 1) * sizeof(double));
+    if ((*m)->offsets == NULL || (*m)->indices == NULL || (*m)->values == NULL) {
+        freeSparseMatrix(*m);
+        *m = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    recordAllocation(*m, sizeof(SparseMatrix) + ((size_t) rows + 1) * sizeof(size_t) +
+                     capacity * (sizeof(unsigned int) + sizeof(double)), site);
+    return SUCCESS;
+}
+
+void freeSparseMatrix(SparseMatrix* m) {
+    if (m == NULL) {
+        return;
+    }
+    recordFree(m);
+    free(m->offsets);
+    free(m->indices);
+    free(m->values);
+    free(m);
+}
+
+int sparseFromDense(Matrix* dense, SparseMatrix* sparse) {
+    if (dense->rows != sparse->rows || dense->columns != sparse->columns) {
+        return reportError(MISC, "sparseFromDense error: matrices don't have the same dimensions");
+    }
+    size_t count = 0;
+    for (unsigned int i = 0; i < dense->rows; i++) {
+        sparse->offsets[i] = count;
+        const double* row = &dense->values[(size_t) i * dense->columns];
+        for (unsigned int j = 0; j < dense->columns; j++) {
+            if (row[j] != 0) {
+                if (count == sparse->capacity) {
+                    return reportError(MISC, "sparseFromDense error: sparse matrix is full");
+                }
+                sparse->indices[count] = j;
+                sparse->values[count] = row[j];
+                count++;
+            }
+        }
+    }
+    sparse->offsets[dense->rows] = count;
+    return SUCCESS;
+}
+
+int multiplySparseInto(SparseMatrix* m1, Matrix* m2, Matrix* result) {
+    // Check dimensions
+    if (m1->columns != m2->rows) {
+        return reportError(MISC, "multiplySparseInto error: matrices can't be multiplied");
+    }
+    if (result->rows != m1->rows || result->columns != m2->columns) {
+        return reportError(MISC, "multiplySparseInto error: result matrix doesn't have appropriate dimensions");
+    }
+
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    size_t products = m1->offsets[m1->rows] * m2->columns;
+    unsigned int bands = (m1->rows + TILE_ROWS - 1) / TILE_ROWS;
+    if (kernelPool != NULL && products >= PARALLEL_MIN_PRODUCTS && bands > 1) {
+        SparseMultiplyTask task = {m1, m2, result};
+        parallelFor(kernelPool, bands, multiplySparseBands, &task);
+    } else {
+        multiplySparseRows(m1, m2, result, 0, m1->rows);
+    }
+    if (counting) {
+        perfEnd("multiplySparseInto", m1->rows, m2->columns, m1->columns, &counters);
+    }
+    return SUCCESS;
+}
+
+int multiplySparseRowInto(Matrix* m1, SparseMatrix* m2, unsigned int row, Matrix* result) {
+    // Check dimensions
+    if (row >= m2->rows || m1->columns != m2->columns) {
+        return reportError(MISC, "multiplySparseRowInto error: matrices can't be multiplied");
+    }
+    if (result->rows != m1->rows || result->columns != 1) {
+        return reportError(MISC, "multiplySparseRowInto error: result matrix doesn't have appropriate dimensions");
+    }
+
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    size_t first = m2->offsets[row];
+    size_t last = m2->offsets[row + 1];
+    const unsigned int* indices = m2->indices;
+    const double* values = m2->values;
+    for (unsigned int i = 0; i < m1->rows; i++) {
+        const double* weights = &m1->values[(size_t) i * m1->columns];
+        double sum = 0;
+        for (size_t j = first; j < last; j++) {
+            sum += weights[indices[j]] * values[j];
+        }
+        result->values[i] = sum;
+    }
+    if (counting) {
+        perfEnd("multiplySparseRowInto", m1->rows, 1, last - first, &counters);
+    }
+    return SUCCESS;
+}
+
+int addSparseOuterProductInto(Matrix* m1, SparseMatrix* m2, unsigned int row, Matrix* result) {
+    // Check dimensions
+    if (row >= m2->rows || m1->columns != 1) {
+        return reportError(MISC, "addSparseOuterProductInto error: m1 must be a column vector of a row of m2");
+    }
+    if (m1->rows != result->rows || m2->columns != result->columns) {
+        return reportError(MISC, "addSparseOuterProductInto error: result matrix doesn't have appropriate dimensions");
+    }
+
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    size_t first = m2->offsets[row];
+    size_t last = m2->offsets[row + 1];
+    const unsigned int* indices = m2->indices;
+    const double* values = m2->values;
+    for (unsigned int i = 0; i < m1->rows; i++) {
+        double value = m1->values[i];
+        double* resultRow = &result->values[(size_t) i * result->columns];
+        for (size_t j = first; j < last; j++) {
+            resultRow[indices[j]] += value * values[j];
+        }
+    }
+    if (counting) {
+        perfEnd("addSparseOuterProductInto", m1->rows, last - first, 0, &counters);
     }
     return SUCCESS;
 }
 
 int multiplyScalarInto(Matrix* m1, double scalar, Matrix* result) {
-    for (int i = 0; i < m1->rows * m1->columns; i++) {
-        result->values[i] = scalar * m1->values[i];
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    runElementWise(ELEMENT_SCALE, m1, NULL, scalar, result);
+    if (counting) {
+        perfEnd("multiplyScalarInto", m1->rows, m1->columns, 0, &counters);
     }
     return SUCCESS;
 }
@@ -103,18 +570,19 @@ int multiplyMatricesInto(Matrix* m1, Matrix* m2, Matrix* result) {
         return reportError(MISC, "multiplyMatricesInto error: result matrix doesn't have appropriate dimensions");
     }
 
-    for (int i = 0; i < m2->columns; i++) {
-        for (int j = 0; j < m1->rows; j++) {
-            double sum = 0;
-            for (int k = 0; k < m1->columns; k++) {
-                // Add m1[j][k] * m2[k][i] to sum
-                double first_element = m1->values[j * m1->columns + k];
-                double second_element = m2->values[k * m2->columns + i];
-                sum += (first_element * second_element);
-            }
-            // Put into result[j][i]
-            result->values[j * result->columns + i] = sum;
-        }
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    size_t products = (size_t) m1->rows * m2->columns * m1->columns;
+    unsigned int rowTiles = (m1->rows + TILE_ROWS - 1) / TILE_ROWS;
+    unsigned int columnTiles = (m2->columns + TILE_COLUMNS - 1) / TILE_COLUMNS;
+    if (kernelPool != NULL && products >= PARALLEL_MIN_PRODUCTS && rowTiles * columnTiles > 1) {
+        MultiplyTask task = {m1, m2, result, columnTiles};
+        parallelFor(kernelPool, rowTiles * columnTiles, multiplyTiles, &task);
+    } else {
+        multiplyBlock(m1, m2, result, 0, m1->rows, 0, m2->columns);
+    }
+    if (counting) {
+        perfEnd("multiplyMatricesInto", m1->rows, m2->columns, m1->columns, &counters);
     }
     return SUCCESS;
 }
@@ -128,6 +596,8 @@ int transposeMatrix(Matrix* m1, Matrix** result) {
         }
     }
 
+    PerfReading counters;
+    int counting = perfBegin(&counters);
     for (int i = 0; i < m1->rows; i++) {
         for (int j = 0; j < m1->columns; j++) {
             int originalIndex = i * m1->columns + j;
@@ -135,6 +605,9 @@ int transposeMatrix(Matrix* m1, Matrix** result) {
             (*result)->values[toIndex] = m1->values[originalIndex];
         }
     }
+    if (counting) {
+        perfEnd("transposeMatrix", m1->rows, m1->columns, 0, &counters);
+    }
     return SUCCESS;
 }
 
@@ -152,8 +625,11 @@ int hadamardProduct(Matrix* m1, Matrix* m2, Matrix** result) {
     }
 
     // Move hadamard products into result vector
-    for (int i = 0; i < m1->rows * m1->columns; i++) {
-        (*result)->values[i] = m1->values[i] * m2->values[i];
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    runElementWise(ELEMENT_HADAMARD, m1, m2, 0, *result);
+    if (counting) {
+        perfEnd("hadamardProduct", m1->rows, m1->columns, 0, &counters);
     }
     return SUCCESS;
 }
@@ -165,6 +641,12 @@ void randomiseMatrix(Matrix* m) {
     }
 }
 
+void randomiseMatrixWith(Matrix* m, Rng* rng) {
+    for (int i = 0; i < m->rows * m->columns; i++) {
+        m->values[i] = randomNormal(rng);
+    }
+}
+
 void zeroMatrix(Matrix* m) {
     for (int i = 0; i < m->rows * m->columns; i++) {
         m->values[i] = 0;
@@ -183,9 +665,11 @@ int reluInto(Matrix* m, Matrix* output) {
         return reportError(MISC, "reluInto error: output matrix must have the same dimensions as the input");
     }
 
-    for (int i = 0; i < m->rows * m->columns; i++) {
-        double x = m->values[i];
-        output->values[i] = (double) x * (x > 0);
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    runElementWise(ELEMENT_RELU, m, NULL, 0, output);
+    if (counting) {
+        perfEnd("reluInto", m->rows, m->columns, 0, &counters);
     }
     return SUCCESS;
 }
@@ -193,9 +677,12 @@ int dreluInto(Matrix* m, Matrix* output) {
     if (m->rows != output->rows || m->columns != output->columns) {
         return reportError(MISC, "dreluInto error: output matrix must have the same dimensions as the input");
     }
-    
-    for (int i = 0 ; i < m->rows * m->columns; i++) {
-        output->values[i] = (m->values[i] > 0);
+
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    runElementWise(ELEMENT_DRELU, m, NULL, 0, output);
+    if (counting) {
+        perfEnd("dreluInto", m->rows, m->columns, 0, &counters);
     }
     return SUCCESS;
 }
@@ -205,9 +692,11 @@ int sigmoidInto(Matrix* m, Matrix* output) {
         return reportError(MISC, "sigmoidInto error: output matrix must have the same dimensions as the input");
     }
 
-    for (int i = 0; i < m->rows * m->columns; i++) {
-        double x = m->values[i];
-        output->values[i] = 1/(1+exp(-x));
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    runElementWise(ELEMENT_SIGMOID, m, NULL, 0, output);
+    if (counting) {
+        perfEnd("sigmoidInto", m->rows, m->columns, 0, &counters);
     }
     return SUCCESS;
 }
@@ -216,14 +705,148 @@ int dsigmoidInto(Matrix* m, Matrix* output) {
         return reportError(MISC, "dsigmoidInto error: output matrix must have the same dimensions as the input");
     }
 
-    for (int i = 0 ; i < m->rows * m->columns; i++) {
-        double x = m->values[i];
-        double s = 1/(1+exp(-x));
-        output->values[i] = s*(1-s);
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    runElementWise(ELEMENT_DSIGMOID, m, NULL, 0, output);
+    if (counting) {
+        perfEnd("dsigmoidInto", m->rows, m->columns, 0, &counters);
     }
     return SUCCESS;
 }
 
+// --- Random number generation ---
+void seedRng(Rng* rng, uint64_t seed) {
+    rng->state = seed;
+}
+
+uint64_t nextRandom(Rng* rng) {
+    uint64_t z = (rng->state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+unsigned int randomBelow(Rng* rng, unsigned int bound) {
+    // Multiply-shift of 32 random bits, rejecting the biased low products
+    uint64_t product = (nextRandom(rng) >> 32) * bound;
+    uint32_t low = (uint32_t) product;
+    if (low < bound) {
+        uint32_t threshold = (uint32_t) -bound % bound;
+        while (low < threshold) {
+            product = (nextRandom(rng) >> 32) * bound;
+            low = (uint32_t) product;
+        }
+    }
+    return (unsigned int) (product >> 32);
+}
+
+double randomUniform(Rng* rng) {
+    return (nextRandom(rng) >> 11) * (1.0 / 9007199254740992.0); // 53 bits / 2^53
+}
+
+double randomNormal(Rng* rng) {
+    // Marsaglia polar method, as randn, keeping no spare so `rng` is the only state
+    double u, v, s;
+    do {
+        u = randomUniform(rng) * 2.0 - 1.0;
+        v = randomUniform(rng) * 2.0 - 1.0;
+        s = u * u + v * v;
+    } while (s >= 1.0 || s == 0.0);
+    return u * sqrt(-2.0 * log(s) / s);
+}
+
+// --- Reduced precision conversion ---
+uint16_t doubleToHalf(double value) {
+    float f = (float) value;
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t mantissa = x & 0x7FFFFF;
+    int exponent = (int) ((x >> 23) & 0xFF) - 127 + 15;
+
+    if (((x >> 23) & 0xFF) == 0xFF) { // Infinity or NaN
+        return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+    }
+    if (exponent >= 0x1F) { // Too large, becomes infinity
+        return sign | 0x7C00;
+    }
+    if (exponent <= 0) { // Subnormal half, or too small and becomes 0
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1U << shift) - 1);
+        uint32_t middle = 1U << (shift - 1);
+        if (remainder > middle || (remainder == middle && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = ((uint32_t) exponent << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1FFF;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+        half++; // A carry into the exponent is still correct
+    }
+    return sign | half;
+}
+
+double halfToDouble(uint16_t half) {
+    uint32_t sign = (uint32_t) (half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    // Subnormals are mantissa * 2^-24, everything else is rebiased
+    double subnormal = mantissa * 5.9604644775390625e-8;
+    uint32_t bits = sign | ((exponent == 31 ? 255 : exponent + 112) << 23) | (mantissa << 13);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return exponent == 0 ? (sign ? -subnormal : subnormal) : f;
+}
+
+uint16_t doubleToBfloat16(double value) {
+    float f = (float) value;
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7F800000) == 0x7F800000 && (x & 0x7FFFFF)) { // NaN stays NaN
+        return (x >> 16) | 0x40;
+    }
+    return (x + 0x7FFF + ((x >> 16) & 1)) >> 16;
+}
+
+double bfloat16ToDouble(uint16_t bfloat) {
+    uint32_t bits = (uint32_t) bfloat << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+void narrowToHalf(const double* input, uint16_t* output, size_t n, double scale) {
+    for (size_t i = 0; i < n; i++) {
+        output[i] = doubleToHalf(input[i] / scale);
+    }
+}
+
+void narrowToBfloat16(const double* input, uint16_t* output, size_t n, double scale) {
+    for (size_t i = 0; i < n; i++) {
+        output[i] = doubleToBfloat16(input[i] / scale);
+    }
+}
+
+void widenHalf(const uint16_t* restrict input, double* restrict output, size_t n,
+               double scale) {
+    for (size_t i = 0; i < n; i++) {
+        output[i] = halfToDouble(input[i]) * scale;
+    }
+}
+
+void widenBfloat16(const uint16_t* restrict input, double* restrict output,
+                   size_t n, double scale) {
+    for (size_t i = 0; i < n; i++) {
+        output[i] = bfloat16ToDouble(input[i]) * scale;
+    }
+}
+
 // --- Helper functions ---
 int indexOfMaxValue(Matrix* m, int* indx) {
     if (m->columns != 1) {
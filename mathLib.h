@@ -2,17 +2,99 @@
 #define MATH_LIB
 
 #include <stdio.h>
+#include <stdint.h> // For the 64 bit random number generator state
+#include "memoryAccounting.h" // For the call sites of allocations
+#include "threadPool.h" // For splitting large kernels between threads
 
 typedef struct _Matrix {
     double* values; // Stores all the values in a 1D matrix
     unsigned int rows;
     unsigned int columns;
+    unsigned int ownsValues; // 0 if `values` is a view into other memory
 } Matrix;
 
+/**
+ * A matrix in compressed sparse rows, holding only its non-zero values. Row
+ * i's values are [offsets[i], offsets[i + 1]) of `values`, and their columns
+ * the same range of `indices`, in ascending order. There is room for
+ * `capacity` values.
+ */
+typedef struct _SparseMatrix {
+    unsigned int rows;
+    unsigned int columns;
+    size_t capacity;
+    size_t* offsets; // One per row and one past the last
+    unsigned int* indices;
+    double* values;
+} SparseMatrix;
+
 // --- Matrix functions ---
-int makeMatrix(unsigned int rows, unsigned int columns, Matrix** m);
+// Both makers are called through macros that pass the call site, `site`, for
+// memory accounting
+#define makeMatrix(rows, columns, m) makeMatrixAt(rows, columns, m, ALLOCATION_SITE)
+#define makeMatrixView(rows, columns, values, m) makeMatrixViewAt(rows, columns, values, m, ALLOCATION_SITE)
+
+int makeMatrixAt(unsigned int rows, unsigned int columns, Matrix** m, const char* site);
 int freeMatrix(Matrix* m);
 
+/**
+ * Makes a `rows` by `columns` matrix in the output vector `m` whose values
+ * are not allocated, for pointing at memory owned by something else.
+ * `freeMatrix` will not free the values.
+ */
+int makeMatrixViewAt(unsigned int rows, unsigned int columns, double* values,
+                     Matrix** m, const char* site);
+
+/**
+ * Makes the kernels split large calls between the threads of `pool`, or
+ * run on the calling thread alone if it is NULL, as by default. Products of
+ * at least PARALLEL_MIN_PRODUCTS multiply-adds are split into tiles of the
+ * result, and element-wise kernels of at least PARALLEL_MIN_ELEMENTS values
+ * into chunks, so small layers never pay for waking the pool. Every value is
+ * computed as it would be on one thread, so results are identical.
+ */
+void setKernelThreadPool(ThreadPool* pool);
+
+// --- Sparse matrix functions ---
+#define makeSparseMatrix(rows, columns, capacity, m) makeSparseMatrixAt(rows, columns, capacity, m, ALLOCATION_SITE)
+
+/**
+ * Makes a `rows` by `columns` sparse matrix with no values and room for
+ * `capacity` of them in the output vector `m`.
+ */
+int makeSparseMatrixAt(unsigned int rows, unsigned int columns, size_t capacity,
+                       SparseMatrix** m, const char* site);
+void freeSparseMatrix(SparseMatrix* m);
+
+/**
+ * Places the non-zero values of `dense` in `sparse`, which must have the same
+ * dimensions and room for them.
+ */
+int sparseFromDense(Matrix* dense, SparseMatrix* sparse);
+
+/**
+ * Places `m1` multiplied by the transpose of row `row` of `m2` in the column
+ * vector `result`, visiting only the row's non-zero values. The sums are
+ * those of `multiplyMatricesInto` with the zero terms left out, so the
+ * result is identical to the dense product.
+ */
+int multiplySparseRowInto(Matrix* m1, SparseMatrix* m2, unsigned int row, Matrix* result);
+
+/**
+ * Places the sparse matrix `m1` multiplied by `m2` in `result`, visiting
+ * only the non-zero values of `m1`. The sums are those of
+ * `multiplyMatricesInto` with the zero terms left out, so the result is
+ * identical to the dense product. Split into bands of rows between the
+ * kernel threads like `multiplyMatricesInto`.
+ */
+int multiplySparseInto(SparseMatrix* m1, Matrix* m2, Matrix* result);
+
+/**
+ * Adds the outer product of the column vector `m1` and row `row` of `m2` to
+ * `result`, updating only the columns of the row's non-zero values.
+ */
+int addSparseOuterProductInto(Matrix* m1, SparseMatrix* m2, unsigned int row, Matrix* result);
+
 // --- IO Functions ---
 int loadMatrixInto(Matrix* m, char* inputFilename);
 int saveMatrix(Matrix* m, char* outputFilename);
@@ -24,6 +106,30 @@ int multiplyMatricesInto(Matrix* m1, Matrix* m2, Matrix* result);
 int transposeMatrix(Matrix* m1, Matrix** result);
 int hadamardProduct(Matrix* m1, Matrix* m2, Matrix** result);
 
+/**
+ * Adds the column vector `column` to every column of `m1`, placing the
+ * result in `result`, which may be `m1`.
+ */
+int addColumnInto(Matrix* m1, Matrix* column, Matrix* result);
+
+/**
+ * Places the product of the transpose of `m1` and `m2` in `result`, without
+ * making the transpose. Sums are in the same order as `multiplyMatricesInto`.
+ */
+int multiplyTransposedInto(Matrix* m1, Matrix* m2, Matrix* result);
+
+/**
+ * Places `m1 + scalar * m2` in `result`, which may be `m1`. This is the
+ * gradient descent update when `m2` is a gradient.
+ */
+int addScaledInto(Matrix* m1, double scalar, Matrix* m2, Matrix* result);
+
+/**
+ * Adds the outer product of the column vectors `m1` and `m2`, that is `m1`
+ * multiplied by the transpose of `m2`, to `result`.
+ */
+int addOuterProductInto(Matrix* m1, Matrix* m2, Matrix* result);
+
 void randomiseMatrix(Matrix* m);
 void zeroMatrix(Matrix* m);
 void negateMatrix(Matrix* m);
@@ -34,6 +140,65 @@ int dreluInto(Matrix* m, Matrix* output);
 int sigmoidInto(Matrix* m, Matrix* output);
 int dsigmoidInto(Matrix* m, Matrix* output);
 
+// --- Random number generation ---
+typedef struct _Rng {
+    uint64_t state;
+} Rng;
+
+/**
+ * Seeds `rng` so that the same `seed` always produces the same sequence.
+ */
+void seedRng(Rng* rng, uint64_t seed);
+
+/**
+ * Returns the next 64 random bits from `rng` (SplitMix64).
+ */
+uint64_t nextRandom(Rng* rng);
+
+/**
+ * Returns an unbiased random integer in the range [0, `bound`).
+ */
+unsigned int randomBelow(Rng* rng, unsigned int bound);
+
+/**
+ * Returns a random double in the range [0, 1).
+ */
+double randomUniform(Rng* rng);
+
+/**
+ * Returns a standard normally distributed value drawn from `rng`.
+ */
+double randomNormal(Rng* rng);
+
+/**
+ * Same as `randomiseMatrix`, but drawn from `rng` so that it is reproducible.
+ */
+void randomiseMatrixWith(Matrix* m, Rng* rng);
+
+// --- Reduced precision conversion ---
+/**
+ * Converts between doubles and IEEE 754 half precision (fp16) or bfloat16
+ * (bf16) bit patterns, rounding to the nearest even value.
+ */
+uint16_t doubleToHalf(double value);
+double halfToDouble(uint16_t half);
+uint16_t doubleToBfloat16(double value);
+double bfloat16ToDouble(uint16_t bfloat);
+
+/**
+ * Converts `n` values of `input` divided by `scale` into fp16 or bf16
+ * `output`.
+ */
+void narrowToHalf(const double* input, uint16_t* output, size_t n, double scale);
+void narrowToBfloat16(const double* input, uint16_t* output, size_t n, double scale);
+
+/**
+ * Converts `n` fp16 or bf16 values of `input` into doubles multiplied by
+ * `scale`. The loops have no branches so that they vectorise.
+ */
+void widenHalf(const uint16_t* input, double* output, size_t n, double scale);
+void widenBfloat16(const uint16_t* input, double* output, size_t n, double scale);
+
 // --- Helper functions ---
 int indexOfMaxValue(Matrix* m, int* indx);
 
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // For comparing call sites
+#include <pthread.h> // For the shared tables
+#include "memoryAccounting.h"
+#include "err.h"
+
+#define MAX_ALLOCATION_SITES 256
+#define INITIAL_RECORDS 1024 // Must be a power of two
+
+// Totals of one call site
+typedef struct _AllocationSite {
+    const char* site;
+    uint64_t allocations;
+    uint64_t bytes;
+    size_t liveBytes;
+    size_t peakBytes;
+} AllocationSite;
+
+// One live allocation, found by its pointer
+typedef struct _AllocationRecord {
+    const void* pointer; // NULL if the slot is empty
+    size_t bytes;
+    unsigned int site;
+} AllocationRecord;
+
+static int enabled = 0;
+static pthread_mutex_t accountingLock = PTHREAD_MUTEX_INITIALIZER;
+static AllocationSite sites[MAX_ALLOCATION_SITES];
+static unsigned int numberOfSites = 0;
+static MemoryUsage usage = {0, 0, 0, 0};
+
+// Open addressing table of live allocations, kept at most half full
+static AllocationRecord* records = NULL;
+static size_t recordCapacity = 0;
+static size_t numberOfRecords = 0;
+
+static __thread int forbiddenHere = 0;
+static __thread uint64_t allocationsHere = 0;
+static __thread uint64_t bytesHere = 0;
+
+static size_t recordSlot(const void* pointer) {
+    uint64_t hash = ((uint64_t) (uintptr_t) pointer >> 4) * 0x9E3779B97F4A7C15ULL;
+    return (size_t) (hash >> 32) & (recordCapacity - 1);
+}
+
+// Places `record` in the table, with `accountingLock` held and room left
+static void insertRecord(AllocationRecord record) {
+    size_t slot = recordSlot(record.pointer);
+    while (records[slot].pointer != NULL) {
+        slot = (slot + 1) & (recordCapacity - 1);
+    }
+    records[slot] = record;
+    numberOfRecords++;
+}
+
+// Doubles the table, with `accountingLock` held. Its own memory isn't counted
+static int growRecords(void) {
+    AllocationRecord* old = records;
+    size_t oldCapacity = recordCapacity;
+    size_t capacity = oldCapacity == 0 ? INITIAL_RECORDS : oldCapacity * 2;
+    AllocationRecord* grown = calloc(capacity, sizeof(AllocationRecord));
+    if (grown == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    records = grown;
+    recordCapacity = capacity;
+    numberOfRecords = 0;
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (old[i].pointer != NULL) {
+            insertRecord(old[i]);
+        }
+    }
+    free(old);
+    return SUCCESS;
+}
+
+// Finds or adds the index of `site`, with `accountingLock` held
+static unsigned int findSite(const char* site) {
+    for (unsigned int i = 0; i < numberOfSites; i++) {
+        if (sites[i].site == site || strcmp(sites[i].site, site) == 0) {
+            return i;
+        }
+    }
+    if (numberOfSites == MAX_ALLOCATION_SITES) {
+        // Everything past the last site is lumped in with it
+        return MAX_ALLOCATION_SITES - 1;
+    }
+    memset(&sites[numberOfSites], 0, sizeof(AllocationSite));
+    sites[numberOfSites].site = site;
+    return numberOfSites++;
+}
+
+int startMemoryAccounting(void) {
+    pthread_mutex_lock(&accountingLock);
+    int returnCode = records == NULL ? growRecords() : SUCCESS;
+    pthread_mutex_unlock(&accountingLock);
+    if (returnCode == SUCCESS) {
+        __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    }
+    return returnCode;
+}
+
+int accountingMemory(void) {
+    return __atomic_load_n(&enabled, __ATOMIC_ACQUIRE);
+}
+
+int setAllocationsForbidden(int forbidden) {
+    if (forbidden && !accountingMemory()) {
+        int returnCode = startMemoryAccounting();
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
+    forbiddenHere = forbidden;
+    return SUCCESS;
+}
+
+int checkAllocation(const char* site) {
+    if (forbiddenHere) {
+        return reportError(UNEXPECTED_ALLOCATION, (char*) site);
+    }
+    return SUCCESS;
+}
+
+void recordAllocation(const void* pointer, size_t bytes, const char* site) {
+    if (!accountingMemory() || pointer == NULL) {
+        return;
+    }
+    allocationsHere++;
+    bytesHere += bytes;
+
+    pthread_mutex_lock(&accountingLock);
+    if (2 * (numberOfRecords + 1) > recordCapacity && growRecords() != SUCCESS) {
+        pthread_mutex_unlock(&accountingLock);
+        return;
+    }
+    unsigned int index = findSite(site);
+    insertRecord((AllocationRecord) {pointer, bytes, index});
+
+    AllocationSite* totals = &sites[index];
+    totals->allocations++;
+    totals->bytes += bytes;
+    totals->liveBytes += bytes;
+    if (totals->liveBytes > totals->peakBytes) {
+        totals->peakBytes = totals->liveBytes;
+    }
+    usage.allocations++;
+    usage.liveBytes += bytes;
+    if (usage.liveBytes > usage.peakBytes) {
+        usage.peakBytes = usage.liveBytes;
+    }
+    pthread_mutex_unlock(&accountingLock);
+}
+
+void recordFree(const void* pointer) {
+    if (!accountingMemory() || pointer == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&accountingLock);
+    size_t slot = recordSlot(pointer);
+    while (records[slot].pointer != NULL && records[slot].pointer != pointer) {
+        slot = (slot + 1) & (recordCapacity - 1);
+    }
+    if (records[slot].pointer == NULL) {
+        // Allocated before accounting started
+        pthread_mutex_unlock(&accountingLock);
+        return;
+    }
+    AllocationRecord record = records[slot];
+    sites[record.site].liveBytes -= record.bytes;
+    usage.liveBytes -= record.bytes;
+    usage.frees++;
+
+    // Shift back the records after it that would no longer be found
+    records[slot].pointer = NULL;
+    numberOfRecords--;
+    size_t next = (slot + 1) & (recordCapacity - 1);
+    while (records[next].pointer != NULL) {
+        AllocationRecord moved = records[next];
+        records[next].pointer = NULL;
+        numberOfRecords--;
+        insertRecord(moved);
+        next = (next + 1) & (recordCapacity - 1);
+    }
+    pthread_mutex_unlock(&accountingLock);
+}
+
+void threadAllocations(uint64_t* allocations, uint64_t* bytes) {
+    *allocations = allocationsHere;
+    *bytes = bytesHere;
+}
+
+void memoryUsage(MemoryUsage* result) {
+    pthread_mutex_lock(&accountingLock);
+    *result = usage;
+    pthread_mutex_unlock(&accountingLock);
+}
+
+void resetPeakMemory(void) {
+    pthread_mutex_lock(&accountingLock);
+    usage.peakBytes = usage.liveBytes;
+    pthread_mutex_unlock(&accountingLock);
+}
+
+void printMemoryUsage(char* title) {
+    MemoryUsage now;
+    memoryUsage(&now);
+    printf("----MEMORY (%s)----\n", title);
+    printf("%.3lf MB live, %.3lf MB peak, %llu allocations, %llu frees\n",
+           now.liveBytes / 1e6, now.peakBytes / 1e6,
+           (unsigned long long) now.allocations, (unsigned long long) now.frees);
+}
+
+static int compareSites(const void* a, const void* b) {
+    const AllocationSite* x = a;
+    const AllocationSite* y = b;
+    if (x->liveBytes != y->liveBytes) {
+        return x->liveBytes < y->liveBytes ? 1 : -1;
+    }
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+void printAllocationSites(void) {
+    pthread_mutex_lock(&accountingLock);
+    AllocationSite sorted[MAX_ALLOCATION_SITES];
+    memcpy(sorted, sites, numberOfSites * sizeof(AllocationSite));
+    unsigned int count = numberOfSites;
+    pthread_mutex_unlock(&accountingLock);
+    qsort(sorted, count, sizeof(AllocationSite), compareSites);
+
+    printf("----ALLOCATION SITES----\n");
+    printf("%-28s %12s %14s %12s %12s\n", "site", "allocations", "bytes", "live MB", "peak MB");
+    for (unsigned int i = 0; i < count; i++) {
+        printf("%-28s %12llu %14llu %12.3lf %12.3lf\n", sorted[i].site,
+               (unsigned long long) sorted[i].allocations, (unsigned long long) sorted[i].bytes,
+               sorted[i].liveBytes / 1e6, sorted[i].peakBytes / 1e6);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef MEMORY_ACCOUNTING
+#define MEMORY_ACCOUNTING
+
+#include <stddef.h> // For size_t
+#include <stdint.h> // For counters
+
+/*
+ * Opt in accounting of the memory made by `makeMatrix`, `makeMatrixView`,
+ * `makeImage` and `allocateImageData`, which are macros passing their call
+ * site here. Live and peak bytes are kept overall and per call site, and
+ * each thread counts what it allocates so that the phase timers can
+ * attribute allocations to phases.
+ *
+ * A thread may forbid allocations, after which the allocators fail with
+ * UNEXPECTED_ALLOCATION rather than allocate. Training uses this to check
+ * that its steady state loop never allocates.
+ */
+
+#define ALLOCATION_LINE_STRING(line) #line
+#define ALLOCATION_LINE(line) ALLOCATION_LINE_STRING(line)
+#define ALLOCATION_SITE (__FILE__ ":" ALLOCATION_LINE(__LINE__))
+
+typedef struct _MemoryUsage {
+    size_t liveBytes;
+    size_t peakBytes; // Most live at once since accounting started or `resetPeakMemory`
+    uint64_t allocations;
+    uint64_t frees;
+} MemoryUsage;
+
+/**
+ * Turns accounting on. Only memory allocated from then on is counted.
+ */
+int startMemoryAccounting(void);
+
+/**
+ * Returns 1 if accounting is on.
+ */
+int accountingMemory(void);
+
+/**
+ * Forbids the calling thread from allocating if `forbidden` is 1, and allows
+ * it again if 0. Forbidding turns accounting on.
+ */
+int setAllocationsForbidden(int forbidden);
+
+/**
+ * Returns SUCCESS if the calling thread may allocate, otherwise reports the
+ * allocation at `site` and returns UNEXPECTED_ALLOCATION.
+ */
+int checkAllocation(const char* site);
+
+/**
+ * Counts `bytes` at `pointer` as allocated by `site` if accounting is on.
+ * `site` must live as long as the process.
+ */
+void recordAllocation(const void* pointer, size_t bytes, const char* site);
+
+/**
+ * Counts the memory recorded at `pointer` as freed. Memory that was never
+ * recorded is ignored, so everything may be passed here.
+ */
+void recordFree(const void* pointer);
+
+/**
+ * Places the number and bytes of allocations the calling thread has made
+ * since accounting started in `allocations` and `bytes`.
+ */
+void threadAllocations(uint64_t* allocations, uint64_t* bytes);
+
+void memoryUsage(MemoryUsage* usage);
+
+/**
+ * Starts a new peak from the bytes live now, for peaks per epoch.
+ */
+void resetPeakMemory(void);
+
+/**
+ * Prints the live and peak bytes and the allocations so far under `title`.
+ */
+void printMemoryUsage(char* title);
+
+/**
+ * Prints the allocations, bytes, live bytes and peak live bytes of every call
+ * site, most live first.
+ */
+void printAllocationSites(void);
+
+#endif // MEMORY_ACCOUNTING
@@ -0,0 +1,717 @@
+#define _POSIX_C_SOURCE 200809L // For fileno and fsync
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // For memcpy and memcmp
+#include <fcntl.h> // For open
+#include <unistd.h> // For close
+#include <sys/mman.h> // For mmap
+#include <sys/stat.h> // For the size of the model file
+#include <math.h> // For the scales of reduced precision tensors
+#include <zlib.h> // For crc32
+#include "err.h"
+#include "modelFile.h"
+
+// Rounds `offset` up to the next multiple of MODEL_ALIGNMENT
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + MODEL_ALIGNMENT - 1) / MODEL_ALIGNMENT * MODEL_ALIGNMENT;
+}
+
+// CRC-32 of `length` bytes, in chunks small enough for zlib's uInt
+static uLong checksumBytes(uLong crc, const unsigned char* bytes, uint64_t length) {
+    while (length > 0) {
+        uInt chunk = length > (1U << 30) ? (1U << 30) : (uInt) length;
+        crc = crc32(crc, bytes, chunk);
+        bytes += chunk;
+        length -= chunk;
+    }
+    return crc;
+}
+
+// Writes `length` bytes to `file` and adds them to the checksum `crc`
+static int writeChecked(FILE* file, const void* bytes, uint64_t length, uLong* crc) {
+    if (length > 0 && fwrite(bytes, 1, length, file) != length) {
+        return reportError(OUTPUT_FAILED, "model file");
+    }
+    *crc = checksumBytes(*crc, bytes, length);
+    return SUCCESS;
+}
+
+// Writes zeros up to `offset`, where `position` is the current offset
+static int padTo(FILE* file, uint64_t position, uint64_t offset, uLong* crc) {
+    static const unsigned char zeros[MODEL_ALIGNMENT] = {0};
+    return writeChecked(file, zeros, offset - position, crc);
+}
+
+// Bytes used by each value of a tensor stored as `dataType`
+static uint64_t dataTypeSize(uint32_t dataType) {
+    switch (dataType) {
+        case MODEL_FLOAT64:
+        case MODEL_CSR_FLOAT64: // Per value, the offsets and indices are extra
+        case MODEL_LOW_RANK_FLOAT64: // Per value of the factors
+            return sizeof(double);
+        case MODEL_FLOAT16:
+        case MODEL_BFLOAT16:
+            return sizeof(uint16_t);
+        case MODEL_BYTES:
+        case MODEL_INT8: // Per value, the scales are extra
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Bytes of a MODEL_CSR_FLOAT64 tensor of `rows` rows and `nonZeros` values
+static uint64_t csrBytes(uint32_t rows, uint32_t nonZeros) {
+    return ((uint64_t) rows + 1) * sizeof(uint64_t)
+         + (uint64_t) nonZeros * (sizeof(double) + sizeof(uint32_t));
+}
+
+// Bytes of a MODEL_INT8 tensor of `rows` by `columns` values
+static uint64_t int8Bytes(uint32_t rows, uint32_t columns) {
+    return ((uint64_t) rows * columns + 7) / 8 * 8 + ((uint64_t) rows + 1) * sizeof(double);
+}
+
+// Bytes of a MODEL_LOW_RANK_FLOAT64 tensor of `rows` by `columns` values
+static uint64_t lowRankBytes(uint32_t rows, uint32_t columns, uint32_t rank) {
+    return (uint64_t) rank * ((uint64_t) rows + columns) * sizeof(double);
+}
+
+// Smallest power of two at least as large as every magnitude in `m`
+static double tensorScale(Matrix* m) {
+    double largest = 0;
+    for (size_t i = 0; i < (size_t) m->rows * m->columns; i++) {
+        double magnitude = fabs(m->values[i]);
+        if (magnitude > largest) {
+            largest = magnitude;
+        }
+    }
+    return largest > 0 ? ldexp(1.0, (int) ceil(log2(largest))) : 1.0;
+}
+
+// Writes the sparse tensor `sparse` as described by `entry`
+static int writeSparseTensor(FILE* file, SparseMatrix* sparse, ModelEntry* entry, uLong* crc) {
+    uint64_t* offsets = malloc(((size_t) sparse->rows + 1) * sizeof(uint64_t));
+    uint32_t* indices = malloc(((size_t) entry->nonZeros + 1) * sizeof(uint32_t));
+    if (offsets == NULL || indices == NULL) {
+        free(offsets);
+        free(indices);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    for (unsigned int i = 0; i <= sparse->rows; i++) {
+        offsets[i] = sparse->offsets[i];
+    }
+    for (uint32_t i = 0; i < entry->nonZeros; i++) {
+        indices[i] = sparse->indices[i];
+    }
+    int returnCode = writeChecked(file, offsets, ((uint64_t) sparse->rows + 1) * sizeof(uint64_t), crc);
+    if (returnCode == SUCCESS) {
+        returnCode = writeChecked(file, sparse->values, (uint64_t) entry->nonZeros * sizeof(double), crc);
+    }
+    if (returnCode == SUCCESS) {
+        returnCode = writeChecked(file, indices, (uint64_t) entry->nonZeros * sizeof(uint32_t), crc);
+    }
+    free(offsets);
+    free(indices);
+    return returnCode;
+}
+
+// Writes the int8 layer `layer` as described by `entry`
+static int writeQuantizedTensor(FILE* file, QuantizedLayer* layer, ModelEntry* entry, uLong* crc) {
+    uint64_t levels = (uint64_t) layer->rows * layer->columns;
+    uint64_t padded = (levels + 7) / 8 * 8;
+    int8_t* stored = calloc(padded > 0 ? padded : 1, 1);
+    if (stored == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    for (unsigned int r = 0; r < layer->rows; r++) {
+        memcpy(&stored[(size_t) r * layer->columns], &layer->weights[(size_t) r * layer->stride],
+               layer->columns);
+    }
+    int returnCode = writeChecked(file, stored, padded, crc);
+    if (returnCode == SUCCESS) {
+        returnCode = writeChecked(file, layer->weightScales, layer->rows * sizeof(double), crc);
+    }
+    if (returnCode == SUCCESS) {
+        returnCode = writeChecked(file, &layer->inputScale, sizeof(double), crc);
+    }
+    free(stored);
+    return returnCode;
+}
+
+// Writes the tensor `m` as described by `entry`
+static int writeTensor(FILE* file, Matrix* m, ModelEntry* entry, uLong* crc) {
+    if (entry->dataType == MODEL_FLOAT64) {
+        return writeChecked(file, m->values, entry->bytes, crc);
+    }
+    size_t n = (size_t) m->rows * m->columns;
+    uint16_t* narrowed = malloc(n * sizeof(uint16_t));
+    if (narrowed == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    if (entry->dataType == MODEL_FLOAT16) {
+        narrowToHalf(m->values, narrowed, n, entry->scale);
+    } else {
+        narrowToBfloat16(m->values, narrowed, n, entry->scale);
+    }
+    int returnCode = writeChecked(file, narrowed, entry->bytes, crc);
+    free(narrowed);
+    return returnCode;
+}
+
+// Saves `network` as a model file with its weights and biases stored as
+// `dataType`, and with `state` if it is not NULL
+static int writeModelFile(NeuralNetwork* network, TrainingState* state,
+                          ModelDataType dataType, char* filename) {
+    if (dataType != MODEL_FLOAT64 && dataType != MODEL_FLOAT16 &&
+        dataType != MODEL_BFLOAT16) {
+        return reportError(MISC, "saveNetworkModel error: unsupported data type");
+    }
+    unsigned int layers = network->hiddenLayers + 1;
+    unsigned int convLayers = 0;
+    for (unsigned int l = 0; l < layers; l++) {
+        convLayers += network->conv[l] != NULL;
+    }
+    // Weights and biases, then the training state, then convolution shapes
+    unsigned int numberOfEntries = 2 * layers + (state != NULL) + convLayers;
+    unsigned int nextConv = 0;
+    ModelEntry* entries = calloc(numberOfEntries, sizeof(ModelEntry));
+    if (entries == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+
+    // Lay out the offset table, then every tensor on an aligned offset
+    uint64_t offset = sizeof(ModelHeader)
+                    + (network->hiddenLayers + 2) * sizeof(uint32_t)
+                    + numberOfEntries * sizeof(ModelEntry);
+    for (unsigned int i = 0; i < numberOfEntries; i++) {
+        if (i >= 2 * layers + (state != NULL)) {
+            while (network->conv[nextConv] == NULL) {
+                nextConv++;
+            }
+            entries[i].kind = MODEL_CONV_SHAPE;
+            entries[i].layer = nextConv++;
+            entries[i].dataType = MODEL_BYTES;
+            entries[i].rows = 1;
+            entries[i].columns = sizeof(ConvShape);
+            entries[i].offset = alignOffset(offset);
+            entries[i].bytes = sizeof(ConvShape);
+            entries[i].scale = 1;
+            offset = entries[i].offset + entries[i].bytes;
+            continue;
+        }
+        if (i == 2 * layers) {
+            entries[i].kind = MODEL_TRAINING_STATE;
+            entries[i].dataType = MODEL_BYTES;
+            entries[i].rows = 1;
+            entries[i].columns = sizeof(TrainingState);
+            entries[i].offset = alignOffset(offset);
+            entries[i].bytes = sizeof(TrainingState);
+            entries[i].scale = 1;
+            offset = entries[i].offset + entries[i].bytes;
+            continue;
+        }
+        Matrix* m = (i % 2 == 0) ? network->weights[i / 2] : network->biases[i / 2];
+        entries[i].kind = (i % 2 == 0) ? MODEL_WEIGHTS : MODEL_BIASES;
+        entries[i].layer = i / 2;
+        entries[i].dataType = dataType;
+        entries[i].rows = m->rows;
+        entries[i].columns = m->columns;
+        entries[i].offset = alignOffset(offset);
+        entries[i].bytes = (uint64_t) m->rows * m->columns * dataTypeSize(dataType);
+        entries[i].scale = dataType == MODEL_FLOAT64 ? 1 : tensorScale(m);
+        SparseMatrix* sparse = (i % 2 == 0) ? network->sparseWeights[i / 2] : NULL;
+        QuantizedLayer* quantized = (i % 2 == 0 && network->quantized != NULL)
+                                  ? network->quantized[i / 2] : NULL;
+        LowRankLayer* lowRank = (i % 2 == 0 && network->lowRank != NULL)
+                              ? network->lowRank[i / 2] : NULL;
+        if (quantized != NULL && dataType == MODEL_FLOAT64 && state == NULL) {
+            // Checkpoints keep full precision weights so that resuming is exact
+            entries[i].dataType = MODEL_INT8;
+            entries[i].bytes = int8Bytes(m->rows, m->columns);
+        } else if (lowRank != NULL && dataType == MODEL_FLOAT64) {
+            entries[i].dataType = MODEL_LOW_RANK_FLOAT64;
+            entries[i].bytes = lowRankBytes(m->rows, m->columns, lowRank->rank);
+        } else if (sparse != NULL && dataType == MODEL_FLOAT64) {
+            // Pruned weights only keep their non-zero values
+            entries[i].dataType = MODEL_CSR_FLOAT64;
+            entries[i].nonZeros = (uint32_t) sparse->offsets[sparse->rows];
+            entries[i].bytes = csrBytes(m->rows, entries[i].nonZeros);
+        }
+        offset = entries[i].offset + entries[i].bytes;
+    }
+
+    ModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.headerSize = sizeof(ModelHeader);
+    header.entrySize = sizeof(ModelEntry);
+    header.numberOfEntries = numberOfEntries;
+    header.hiddenLayers = network->hiddenLayers;
+    header.fileSize = offset;
+
+    // Written next to `filename` then renamed over it, so a network that is
+    // mapped from `filename` can be saved back to it
+    char* temporary = malloc(strlen(filename) + sizeof(".tmp"));
+    if (temporary == NULL) {
+        free(entries);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    sprintf(temporary, "%s.tmp", filename);
+    FILE* file = fopen(temporary, "wb");
+    if (file == NULL) {
+        reportError(BAD_FILE_NAME, temporary);
+        free(entries);
+        free(temporary);
+        return BAD_FILE_NAME;
+    }
+
+    // The header is written again once the checksum is known
+    uLong crc = crc32(0L, Z_NULL, 0);
+    int returnCode = fwrite(&header, sizeof(header), 1, file) == 1 ? SUCCESS
+                   : reportError(OUTPUT_FAILED, filename);
+    uint32_t* neurons = malloc((network->hiddenLayers + 2) * sizeof(uint32_t));
+    if (returnCode == SUCCESS && neurons == NULL) {
+        returnCode = reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    if (returnCode == SUCCESS) {
+        for (unsigned int i = 0; i < network->hiddenLayers + 2; i++) {
+            neurons[i] = network->neurons[i];
+        }
+        returnCode = writeChecked(file, neurons, (network->hiddenLayers + 2) * sizeof(uint32_t), &crc);
+    }
+    if (returnCode == SUCCESS) {
+        returnCode = writeChecked(file, entries, numberOfEntries * sizeof(ModelEntry), &crc);
+    }
+    uint64_t position = sizeof(ModelHeader)
+                      + (network->hiddenLayers + 2) * sizeof(uint32_t)
+                      + numberOfEntries * sizeof(ModelEntry);
+    for (unsigned int i = 0; i < numberOfEntries && returnCode == SUCCESS; i++) {
+        returnCode = padTo(file, position, entries[i].offset, &crc);
+        if (returnCode == SUCCESS && entries[i].kind == MODEL_CONV_SHAPE) {
+            returnCode = writeChecked(file, &network->conv[entries[i].layer]->shape, entries[i].bytes, &crc);
+        } else if (returnCode == SUCCESS && entries[i].kind == MODEL_TRAINING_STATE) {
+            returnCode = writeChecked(file, state, entries[i].bytes, &crc);
+        } else if (returnCode == SUCCESS && entries[i].dataType == MODEL_INT8) {
+            returnCode = writeQuantizedTensor(file, network->quantized[i / 2], &entries[i], &crc);
+        } else if (returnCode == SUCCESS && entries[i].dataType == MODEL_LOW_RANK_FLOAT64) {
+            LowRankLayer* lowRank = network->lowRank[i / 2];
+            returnCode = writeChecked(file, lowRank->u->values,
+                                      (uint64_t) lowRank->u->rows * lowRank->rank * sizeof(double), &crc);
+            if (returnCode == SUCCESS) {
+                returnCode = writeChecked(file, lowRank->v->values,
+                                          (uint64_t) lowRank->rank * lowRank->v->columns * sizeof(double), &crc);
+            }
+        } else if (returnCode == SUCCESS && entries[i].dataType == MODEL_CSR_FLOAT64) {
+            returnCode = writeSparseTensor(file, network->sparseWeights[i / 2], &entries[i], &crc);
+        } else if (returnCode == SUCCESS) {
+            Matrix* m = (i % 2 == 0) ? network->weights[i / 2] : network->biases[i / 2];
+            returnCode = writeTensor(file, m, &entries[i], &crc);
+        }
+        position = entries[i].offset + entries[i].bytes;
+    }
+
+    // Rewrite the header with the checksum
+    if (returnCode == SUCCESS) {
+        header.checksum = (uint32_t) crc;
+        if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1) {
+            returnCode = reportError(OUTPUT_FAILED, filename);
+        }
+    }
+    // Make sure the data is on disk before the rename makes it visible
+    if (returnCode == SUCCESS && (fflush(file) != 0 || fsync(fileno(file)) != 0)) {
+        returnCode = reportError(OUTPUT_FAILED, filename);
+    }
+    if (fclose(file) != 0 && returnCode == SUCCESS) {
+        returnCode = reportError(OUTPUT_FAILED, filename);
+    }
+    if (returnCode == SUCCESS && rename(temporary, filename) != 0) {
+        returnCode = reportError(OUTPUT_FAILED, filename);
+    }
+    if (returnCode != SUCCESS) {
+        remove(temporary);
+    }
+    free(temporary);
+    free(neurons);
+    free(entries);
+    return returnCode;
+}
+
+int saveNetworkModel(NeuralNetwork* network, char* filename) {
+    return writeModelFile(network, NULL, MODEL_FLOAT64, filename);
+}
+
+int saveNetworkModelAs(NeuralNetwork* network, char* filename, ModelDataType dataType) {
+    return writeModelFile(network, NULL, dataType, filename);
+}
+
+int saveNetworkCheckpoint(NeuralNetwork* network, TrainingState* state,
+                          char* filename) {
+    // Always full precision, so that resuming is exact
+    return writeModelFile(network, state, MODEL_FLOAT64, filename);
+}
+
+// Checks the header of the mapped model file `bytes` of `length` bytes
+static int readModelHeader(char* filename, const unsigned char* bytes,
+                           uint64_t length, ModelHeader* header) {
+    if (length < sizeof(ModelHeader)) {
+        return reportError(BAD_DATA, filename);
+    }
+    memcpy(header, bytes, sizeof(ModelHeader));
+    if (memcmp(header->magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0) {
+        return reportError(BAD_MAGIC_NUMBER, filename);
+    }
+    if (header->version == 0 || header->version > MODEL_VERSION) {
+        return reportError(MISC, "loadNetworkModel error: unsupported model file version");
+    }
+    if (header->headerSize < sizeof(ModelHeader) || header->headerSize > length ||
+        header->fileSize != length) {
+        return reportError(BAD_DATA, filename);
+    }
+    // Every layer's size is stored after the header, which bounds the layers
+    if ((uint64_t) header->hiddenLayers + 2 > (length - header->headerSize) / sizeof(uint32_t)) {
+        return reportError(BAD_DATA, filename);
+    }
+    uint64_t tableEnd = header->headerSize
+                      + ((uint64_t) header->hiddenLayers + 2) * sizeof(uint32_t)
+                      + (uint64_t) header->numberOfEntries * header->entrySize;
+    if (tableEnd > length) {
+        return reportError(BAD_DATA, filename);
+    }
+    uLong crc = checksumBytes(crc32(0L, Z_NULL, 0), bytes + header->headerSize,
+                              length - header->headerSize);
+    if ((uint32_t) crc != header->checksum) {
+        return reportError(MISC, "loadNetworkModel error: checksum does not match, the file is damaged");
+    }
+    return SUCCESS;
+}
+
+// Expands the CSR weights `stored` of `layer` into their own dense memory,
+// and indexes them as the layer's sparse weights
+static int expandSparseWeights(char* filename, NeuralNetwork* network, unsigned int layer,
+                               const unsigned char* stored, uint32_t nonZeros) {
+    Matrix* m = network->weights[layer];
+    const uint64_t* offsets = (const uint64_t*) stored;
+    const double* values = (const double*) (offsets + m->rows + 1);
+    const uint32_t* indices = (const uint32_t*) (values + nonZeros);
+    if (offsets[0] != 0 || offsets[m->rows] != nonZeros) {
+        return reportError(BAD_DATA, filename);
+    }
+    m->values = calloc((size_t) m->rows * m->columns, sizeof(double));
+    if (m->values == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    m->ownsValues = 1;
+    for (unsigned int i = 0; i < m->rows; i++) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > nonZeros) {
+            return reportError(BAD_DATA, filename);
+        }
+        for (uint64_t p = offsets[i]; p < offsets[i + 1]; p++) {
+            if (indices[p] >= m->columns) {
+                return reportError(BAD_DATA, filename);
+            }
+            m->values[(size_t) i * m->columns + indices[p]] = values[p];
+        }
+    }
+    return indexSparseWeights(network, layer);
+}
+
+// Makes the int8 layer of `layer` from the MODEL_INT8 tensor `stored`, and
+// dequantizes it into dense weights of their own
+static int expandQuantizedWeights(char* filename, NeuralNetwork* network, unsigned int layer,
+                                  const unsigned char* stored) {
+    Matrix* m = network->weights[layer];
+    size_t levels = (size_t) m->rows * m->columns;
+    const int8_t* weights = (const int8_t*) stored;
+    const double* scales = (const double*) (stored + (levels + 7) / 8 * 8);
+    double inputScale = scales[m->rows];
+    if (!(inputScale > 0)) {
+        return reportError(BAD_DATA, filename);
+    }
+    if (network->quantized == NULL) {
+        network->quantized = calloc(network->hiddenLayers + 1, sizeof(QuantizedLayer*));
+        if (network->quantized == NULL) {
+            return reportError(IMAGE_MALLOC_FAILED, "");
+        }
+    }
+    int returnCode = makeQuantizedLayer(m->rows, m->columns, &network->quantized[layer]);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    QuantizedLayer* q = network->quantized[layer];
+    q->inputScale = inputScale;
+    m->values = malloc(levels * sizeof(double));
+    if (m->values == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    m->ownsValues = 1;
+    for (unsigned int r = 0; r < m->rows; r++) {
+        q->weightScales[r] = scales[r];
+        for (unsigned int c = 0; c < m->columns; c++) {
+            int8_t level = weights[(size_t) r * m->columns + c];
+            if (level < -QUANTIZED_WEIGHT_LEVELS) {
+                return reportError(BAD_DATA, filename);
+            }
+            q->weights[(size_t) r * q->stride + c] = level;
+            m->values[(size_t) r * m->columns + c] = level * scales[r];
+        }
+    }
+    return SUCCESS;
+}
+
+// Points the factors of `layer` at the MODEL_LOW_RANK_FLOAT64 tensor
+// `stored` of rank `rank`, and multiplies them out into dense weights of
+// their own
+static int mapLowRankWeights(NeuralNetwork* network, unsigned int layer, unsigned char* stored,
+                             unsigned int rank) {
+    Matrix* m = network->weights[layer];
+    if (network->lowRank == NULL) {
+        network->lowRank = calloc(network->hiddenLayers + 1, sizeof(LowRankLayer*));
+        if (network->lowRank == NULL) {
+            return reportError(IMAGE_MALLOC_FAILED, "");
+        }
+    }
+    Matrix* u = NULL;
+    Matrix* v = NULL;
+    int returnCode = makeMatrixView(m->rows, rank, (double*) stored, &u);
+    if (returnCode == SUCCESS) {
+        returnCode = makeMatrixView(rank, m->columns, (double*) stored + (size_t) m->rows * rank, &v);
+    }
+    if (returnCode == SUCCESS) {
+        // Scratch for one sample, which is every position of a convolution
+        ConvLayer* conv = network->conv[layer];
+        returnCode = makeLowRankLayerOf(u, v, conv != NULL ? conv->columns->columns : 1,
+                                        &network->lowRank[layer]);
+    }
+    if (returnCode != SUCCESS) {
+        if (u != NULL) {
+            freeMatrix(u);
+        }
+        if (v != NULL) {
+            freeMatrix(v);
+        }
+        return returnCode;
+    }
+    m->values = malloc((size_t) m->rows * m->columns * sizeof(double));
+    if (m->values == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    m->ownsValues = 1;
+    return lowRankProductInto(network->lowRank[layer], m);
+}
+
+// Whether the tensor of `entry` lies within the file, checked so that a
+// damaged offset can't wrap the sum around
+static int entryInFile(const ModelEntry* entry, const ModelHeader* header) {
+    return entry->offset <= header->fileSize && entry->bytes <= header->fileSize - entry->offset;
+}
+
+// Reads entry `i` of the offset table `table` into `entry`
+static void readModelEntry(const unsigned char* table, ModelHeader* header, unsigned int i,
+                           ModelEntry* entry) {
+    // Entries written by other versions may be smaller or larger
+    memset(entry, 0, sizeof(ModelEntry));
+    memcpy(entry, table + (uint64_t) i * header->entrySize,
+           header->entrySize < sizeof(ModelEntry) ? header->entrySize : sizeof(ModelEntry));
+    if (header->entrySize < sizeof(ModelEntry)) {
+        entry->scale = 1; // Written before entries had a scale
+    }
+}
+
+// Points the weights and biases of `network` at the tensors of the mapping,
+// and copies the training state into `state` if it is not NULL
+static int pointNetworkAtEntries(char* filename, NeuralNetwork* network,
+                                 unsigned char* bytes, ModelHeader* header,
+                                 TrainingState* state) {
+    int foundState = 0;
+    const unsigned char* table = bytes + header->headerSize
+                               + ((size_t) header->hiddenLayers + 2) * sizeof(uint32_t);
+    // Convolutional layers are shaped first, as that decides their weights' shape
+    for (unsigned int i = 0; i < header->numberOfEntries; i++) {
+        ModelEntry entry;
+        readModelEntry(table, header, i, &entry);
+        if (entry.kind != MODEL_CONV_SHAPE) {
+            continue;
+        }
+        if (!entryInFile(&entry, header) || entry.bytes != sizeof(ConvShape) ||
+            entry.layer > network->hiddenLayers) {
+            return reportError(BAD_DATA, filename);
+        }
+        ConvShape shape;
+        memcpy(&shape, bytes + entry.offset, sizeof(ConvShape));
+        int returnCode = setConvLayer(network, entry.layer, &shape);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
+    for (unsigned int i = 0; i < header->numberOfEntries; i++) {
+        ModelEntry entry;
+        readModelEntry(table, header, i, &entry);
+        if (!entryInFile(&entry, header)) {
+            return reportError(BAD_DATA, filename);
+        }
+        if (entry.kind == MODEL_CONV_SHAPE) {
+            continue;
+        }
+        if (entry.kind == MODEL_TRAINING_STATE) {
+            if (entry.bytes != sizeof(TrainingState)) {
+                return reportError(BAD_DATA, filename);
+            }
+            if (state != NULL) {
+                memcpy(state, bytes + entry.offset, sizeof(TrainingState));
+            }
+            foundState = 1;
+            continue;
+        }
+        if (entry.layer > network->hiddenLayers || dataTypeSize(entry.dataType) == 0 ||
+            entry.offset % dataTypeSize(entry.dataType) != 0) {
+            return reportError(BAD_DATA, filename);
+        }
+        Matrix* m = NULL;
+        if (entry.kind == MODEL_WEIGHTS) {
+            m = network->weights[entry.layer];
+        } else if (entry.kind == MODEL_BIASES) {
+            m = network->biases[entry.layer];
+        } else {
+            continue; // Unknown kinds are skipped
+        }
+        size_t n = (size_t) m->rows * m->columns;
+        if (entry.dataType == MODEL_INT8 && entry.kind == MODEL_WEIGHTS) {
+            if (entry.rows != m->rows || entry.columns != m->columns || m->values != NULL ||
+                entry.bytes != int8Bytes(entry.rows, entry.columns) ||
+                entry.offset % sizeof(double) != 0) {
+                return reportError(BAD_DATA, filename);
+            }
+            int returnCode = expandQuantizedWeights(filename, network, entry.layer,
+                                                    bytes + entry.offset);
+            if (returnCode != SUCCESS) {
+                return returnCode;
+            }
+            continue;
+        }
+        if (entry.dataType == MODEL_LOW_RANK_FLOAT64 && entry.kind == MODEL_WEIGHTS) {
+            uint64_t perRank = lowRankBytes(entry.rows, entry.columns, 1);
+            if (entry.rows != m->rows || entry.columns != m->columns || m->values != NULL ||
+                entry.bytes == 0 || entry.bytes % perRank != 0 ||
+                entry.bytes / perRank > (entry.rows < entry.columns ? entry.rows : entry.columns)) {
+                return reportError(BAD_DATA, filename);
+            }
+            int returnCode = mapLowRankWeights(network, entry.layer, bytes + entry.offset,
+                                               (unsigned int) (entry.bytes / perRank));
+            if (returnCode != SUCCESS) {
+                return returnCode;
+            }
+            continue;
+        }
+        if (entry.dataType == MODEL_CSR_FLOAT64 && entry.kind == MODEL_WEIGHTS) {
+            if (entry.rows != m->rows || entry.columns != m->columns || m->values != NULL ||
+                entry.bytes != csrBytes(entry.rows, entry.nonZeros)) {
+                return reportError(BAD_DATA, filename);
+            }
+            int returnCode = expandSparseWeights(filename, network, entry.layer,
+                                                 bytes + entry.offset, entry.nonZeros);
+            if (returnCode != SUCCESS) {
+                return returnCode;
+            }
+            continue;
+        }
+        if (entry.rows != m->rows || entry.columns != m->columns ||
+            entry.bytes != n * dataTypeSize(entry.dataType) || m->values != NULL) {
+            return reportError(BAD_DATA, filename);
+        }
+        if (entry.dataType == MODEL_FLOAT64) {
+            m->values = (double*) (bytes + entry.offset);
+            continue;
+        }
+
+        // Reduced precision tensors are widened into their own memory
+        if (entry.dataType != MODEL_FLOAT16 && entry.dataType != MODEL_BFLOAT16) {
+            return reportError(BAD_DATA, filename);
+        }
+        m->values = malloc(n * sizeof(double));
+        if (m->values == NULL) {
+            return reportError(IMAGE_MALLOC_FAILED, "");
+        }
+        m->ownsValues = 1;
+        const uint16_t* stored = (const uint16_t*) (bytes + entry.offset);
+        if (entry.dataType == MODEL_FLOAT16) {
+            widenHalf(stored, m->values, n, entry.scale);
+        } else {
+            widenBfloat16(stored, m->values, n, entry.scale);
+        }
+    }
+
+    // Every layer must have been given its parameters
+    for (unsigned int i = 0; i < network->hiddenLayers + 1; i++) {
+        if (network->weights[i]->values == NULL || network->biases[i]->values == NULL) {
+            return reportError(BAD_DATA, filename);
+        }
+    }
+    if (state != NULL && !foundState) {
+        return reportError(MISC, "loadNetworkCheckpoint error: model file is not a checkpoint");
+    }
+    return SUCCESS;
+}
+
+// Loads a model file, and its training state into `state` if not NULL
+static int loadModelFile(NeuralNetwork** network, TrainingState* state,
+                         char* filename, double learningRate) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return reportError(BAD_FILE_NAME, filename);
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        close(fd);
+        return reportError(BAD_FILE_NAME, filename);
+    }
+    // Private and writable, so training changes copies of the touched pages
+    size_t length = (size_t) status.st_size;
+    void* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid
+    if (mapping == MAP_FAILED) {
+        return reportError(MISC, "loadNetworkModel error: file could not be mapped");
+    }
+
+    ModelHeader header;
+    int returnCode = readModelHeader(filename, mapping, length, &header);
+    if (returnCode != SUCCESS) {
+        munmap(mapping, length);
+        return returnCode;
+    }
+
+    // The network owns and frees its neurons array
+    unsigned int* neurons = calloc((size_t) header.hiddenLayers + 2, sizeof(unsigned int));
+    if (neurons == NULL) {
+        munmap(mapping, length);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    const uint32_t* storedNeurons = (const uint32_t*) ((unsigned char*) mapping + header.headerSize);
+    for (size_t i = 0; i < (size_t) header.hiddenLayers + 2; i++) {
+        neurons[i] = storedNeurons[i];
+    }
+
+    returnCode = makeEmptyNetwork(header.hiddenLayers, neurons, learningRate, network);
+    if (returnCode != SUCCESS) {
+        munmap(mapping, length);
+        return returnCode;
+    }
+    (*network)->mapping = mapping; // Unmapped by freeNetwork
+    (*network)->mappingLength = length;
+
+    returnCode = pointNetworkAtEntries(filename, *network, mapping, &header, state);
+    if (returnCode != SUCCESS) {
+        freeNetwork(*network);
+        *network = NULL;
+    }
+    return returnCode;
+}
+
+int loadNetworkModel(NeuralNetwork** network, char* filename, double learningRate) {
+    return loadModelFile(network, NULL, filename, learningRate);
+}
+
+int loadNetworkCheckpoint(NeuralNetwork** network, TrainingState* state,
+                          char* filename, double learningRate) {
+    return loadModelFile(network, state, filename, learningRate);
+}
@@ -0,0 +1,131 @@
+#ifndef MODEL_FILE
+#define MODEL_FILE
+
+#include <stdint.h>
+#include "neuralNetwork.h"
+
+/*
+ * A model file holds a whole network in one file, laid out as:
+ *   ModelHeader
+ *   neurons[hiddenLayers + 2] (uint32)
+ *   ModelEntry[numberOfEntries], the offset table
+ *   tensor payloads, each starting on a MODEL_ALIGNMENT byte boundary
+ * Convolutional layers have a MODEL_CONV_SHAPE entry holding their
+ * ConvShape, and their weights are one row of each filter.
+ * Values are stored in the byte order of the machine that saved the file.
+ * Weights and biases may be stored as fp16 or bf16 to shrink the file, in
+ * which case they are widened to doubles when loaded rather than mapped.
+ * Pruned weights are stored as compressed sparse rows: `rows + 1` uint64
+ * row offsets, then the `nonZeros` values as doubles, then their uint32
+ * column indices. They are expanded when loaded, and the network keeps them
+ * as sparse weights for feeding forward.
+ * Quantized weights are stored as int8: `rows * columns` levels padded to a
+ * multiple of 8 bytes, then a double scale for each row, then the double
+ * input scale. Loading dequantizes them for the floating point weights and
+ * gives the network the int8 layer to feed forward through.
+ * Factorized weights are stored as their two factors, U (`rows` by rank)
+ * then V (rank by `columns`), as doubles, the rank following from `bytes`.
+ * The factors are mapped like other tensors, and multiplied out for the
+ * dense weights.
+ * `checksum` is the CRC-32 of every byte after the header, so any damaged
+ * part of the file is detected when it is loaded.
+ */
+#define MODEL_MAGIC "NNMODEL"
+#define MODEL_VERSION 6 // Version 2 added fp16/bf16 tensors and ModelEntry.scale, 3 CSR weights,
+                        // 4 int8 weights, 5 low rank weights, 6 convolutional layers
+#define MODEL_ALIGNMENT 64
+
+typedef enum _ModelEntryKind {
+    MODEL_WEIGHTS = 0,
+    MODEL_BIASES = 1,
+    MODEL_TRAINING_STATE = 2, // Only present in checkpoints
+    MODEL_CONV_SHAPE = 3 // Only present for convolutional layers
+} ModelEntryKind;
+
+typedef enum _ModelDataType {
+    MODEL_FLOAT64 = 0,
+    MODEL_BYTES = 1,
+    MODEL_FLOAT16 = 2,
+    MODEL_BFLOAT16 = 3,
+    MODEL_CSR_FLOAT64 = 4, // Only written for pruned weights, see pruneNetwork
+    MODEL_INT8 = 5, // Only written for quantized weights, see quantizeNetwork
+    MODEL_LOW_RANK_FLOAT64 = 6 // Only written for factorized weights, see factorizeNetwork
+} ModelDataType;
+
+/**
+ * Where training had got to when a checkpoint was saved, enough to carry on
+ * as if training had never stopped.
+ */
+typedef struct _TrainingState {
+    uint32_t epoch; // Number of epochs completed
+    uint32_t miniBatchSize;
+    uint64_t seed; // Seed the run was started with
+    uint64_t rngState; // State of `network->rng` for the next epoch
+} TrainingState;
+
+typedef struct _ModelHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize; // sizeof(ModelHeader) when the file was written
+    uint32_t entrySize; // sizeof(ModelEntry) when the file was written
+    uint32_t numberOfEntries;
+    uint32_t hiddenLayers;
+    uint32_t checksum;
+    uint64_t fileSize;
+} ModelHeader;
+
+typedef struct _ModelEntry {
+    uint32_t kind; // ModelEntryKind
+    uint32_t layer;
+    uint32_t dataType; // ModelDataType
+    uint32_t rows;
+    uint32_t columns;
+    uint32_t nonZeros; // Values of a MODEL_CSR_FLOAT64 tensor, 0 otherwise
+    uint64_t offset; // From the start of the file
+    uint64_t bytes;
+    double scale; // Stored values are multiplied by this when loaded
+} ModelEntry;
+
+/**
+ * Saves `network` as a single model file `filename`. The file is replaced
+ * in one step, so readers never see a partly written model. Quantized
+ * layers are stored as MODEL_INT8, factorized ones as
+ * MODEL_LOW_RANK_FLOAT64, and other layers with sparse weights as
+ * MODEL_CSR_FLOAT64.
+ */
+int saveNetworkModel(NeuralNetwork* network, char* filename);
+
+/**
+ * Same as `saveNetworkModel`, but stores the weights and biases as
+ * `dataType`, which is MODEL_FLOAT64, MODEL_FLOAT16 or MODEL_BFLOAT16. Each
+ * reduced precision tensor is divided by a power of two scale, so that its
+ * largest value is close to 1 and fp16 neither overflows nor loses small
+ * values to underflow.
+ */
+int saveNetworkModelAs(NeuralNetwork* network, char* filename, ModelDataType dataType);
+
+/**
+ * Maps the model file `filename` and makes a network from it in the output
+ * vector `network`, with the weights and biases pointing straight into the
+ * mapping rather than being copied. The mapping is private, so training
+ * the network never changes the file. `learningRate` is the intended
+ * learning rate of the network.
+ */
+int loadNetworkModel(NeuralNetwork** network, char* filename, double learningRate);
+
+/**
+ * Saves `network` and the training progress `state` as a checkpoint, which
+ * is a model file with an extra entry. The file is flushed to disk before
+ * it replaces `filename`.
+ */
+int saveNetworkCheckpoint(NeuralNetwork* network, TrainingState* state,
+                          char* filename);
+
+/**
+ * Loads a checkpoint saved by `saveNetworkCheckpoint` in the same way as
+ * `loadNetworkModel`, and reads its training progress into `state`.
+ */
+int loadNetworkCheckpoint(NeuralNetwork** network, TrainingState* state,
+                          char* filename, double learningRate);
+
+#endif // MODEL_FILE
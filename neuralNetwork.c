@@ -1,14 +1,25 @@
 #include <stdio.h> // For printing evaluations and loading/saving networks
 #include <stdlib.h> // For mallocs and frees
+#include <string.h> // For clearing evaluation counts
+#include <math.h> // For the magnitudes of pruned weights
 #include <time.h> // For random number generation
-#include <unistd.h> // For change directory and getting current directory
-#include <sys/stat.h> // For mkdir
+#include <errno.h> // For checking why mkdir failed
+#include <sys/mman.h> // For unmapping model files
+#include <sys/stat.h> // For mkdir and stat
 #include "neuralNetwork.h" // TODO: Remove all includes and put them in headers
 #include "imageInput.h" // Used for implementation of evaluateNetwork
 #include "mathLib.h" // For zeroMatrix in gradient descent
-#include "utils.h" // For shuffle
+#include "utils.h" // For EpochShuffler and timing epochs
+#include "modelFile.h" // For loading single file models
+#include "checkpoint.h" // For checkpointing during training
+#include "phaseTimer.h" // For the time breakdown of each epoch
+#include "trace.h" // For the timeline of a run
+#include "memoryAccounting.h" // For checking mini batches don't allocate
+#include "pipeline.h" // For training layers on threads of their own
 
+#ifndef PATH_MAX // May already be defined through zlib.h
 #define PATH_MAX 128
+#endif
 
 // Coloured text
 #define BLK "\e[1;30m"
@@ -21,52 +32,87 @@
 #define WHT "\e[1;37m"
 #define CLR "\e[0;0m"
 
-int makeNetwork(unsigned int hiddenLayers, unsigned int* neurons,
-                double learningRate, NeuralNetwork** network) {
+// Shared by makeNetwork and makeEmptyNetwork. If `parameters` is 0 the
+// weights and biases are made as views with no values
+static int makeNetworkStructure(unsigned int hiddenLayers, unsigned int* neurons,
+                                double learningRate, int parameters,
+                                NeuralNetwork** network) {
     // Allocate memory
-    (*network) = malloc(sizeof(NeuralNetwork));
+    (*network) = calloc(1, sizeof(NeuralNetwork));
     if (*network == NULL) {
         return reportError(IMAGE_MALLOC_FAILED, "");
     }
     (*network)->hiddenLayers = hiddenLayers;
     (*network)->learningRate = learningRate;
     (*network)->neurons = neurons;
+    (*network)->shuffleBlockSize = 0;
+    (*network)->augmenter = NULL;
+    (*network)->trainingData = NULL;
+    (*network)->testingData = NULL;
+    (*network)->mapping = NULL;
+    (*network)->checkpointer = NULL;
+    (*network)->epoch = 0;
+    (*network)->epochRecords = NULL;
+    (*network)->forbidAllocations = 0;
+    (*network)->pruneDensity = 1;
+    seedNetwork(*network, (uint64_t) time(NULL));
 
     // n hidden layers -> n+1 sets of weights & n+1 sets of biases
-    (*network)->weights = malloc((hiddenLayers + 1) * sizeof(Matrix));
-    (*network)->biases = malloc((hiddenLayers + 1) * sizeof(Matrix));
-    if ((*network)->weights == NULL || (*network)->biases == NULL) {
+    (*network)->weights = calloc(hiddenLayers + 1, sizeof(Matrix*));
+    (*network)->biases = calloc(hiddenLayers + 1, sizeof(Matrix*));
+    (*network)->sparseWeights = calloc(hiddenLayers + 1, sizeof(SparseMatrix*));
+    (*network)->conv = calloc(hiddenLayers + 1, sizeof(ConvLayer*));
+    if ((*network)->weights == NULL || (*network)->biases == NULL ||
+        (*network)->sparseWeights == NULL || (*network)->conv == NULL) {
         return reportError(IMAGE_MALLOC_FAILED, "");
     }
 
     // Allocate activations and sum matrices
-    (*network)->a = malloc((hiddenLayers + 2) * sizeof(Matrix));
-    (*network)->z = malloc((hiddenLayers + 2) * sizeof(Matrix));
+    (*network)->a = calloc(hiddenLayers + 2, sizeof(Matrix*));
+    (*network)->z = calloc(hiddenLayers + 2, sizeof(Matrix*));
     if ((*network)->a == NULL || (*network)->z == NULL) {
         return reportError(IMAGE_MALLOC_FAILED, "");
     }
 
+    // Allocate backpropagation's matrices, shaped like the biases
+    (*network)->delta = calloc(hiddenLayers + 1, sizeof(Matrix*));
+    (*network)->derivative = calloc(hiddenLayers + 1, sizeof(Matrix*));
+    if ((*network)->delta == NULL || (*network)->derivative == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+
     // Make weight and bias matrix arrays
     int returnCode = SUCCESS;
     for (int i = 0; i < hiddenLayers + 1; i++) {
         Matrix* weights = NULL;
         Matrix* biases = NULL;
-        returnCode = makeMatrix(neurons[i+1], neurons[i], &weights);
+        if (parameters) {
+            returnCode = makeMatrix(neurons[i+1], neurons[i], &weights);
+        } else {
+            returnCode = makeMatrixView(neurons[i+1], neurons[i], NULL, &weights);
+        }
         if (returnCode != SUCCESS) {
             return returnCode;
         }
-        returnCode = makeMatrix(neurons[i+1], 1, &biases);
+        (*network)->weights[i] = weights;
+        if (parameters) {
+            returnCode = makeMatrix(neurons[i+1], 1, &biases);
+        } else {
+            returnCode = makeMatrixView(neurons[i+1], 1, NULL, &biases);
+        }
         if (returnCode != SUCCESS) {
             return returnCode;
         }
-
-        // Assign random values to matrices
-        randomiseMatrix(weights);
-        randomiseMatrix(biases);
-
-        // Put into neural network
-        (*network)->weights[i] = weights;
         (*network)->biases[i] = biases;
+
+        returnCode = makeMatrix(neurons[i+1], 1, &(*network)->delta[i]);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+        returnCode = makeMatrix(neurons[i+1], 1, &(*network)->derivative[i]);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
     }
 
     // Make activation and sum arrays
@@ -78,217 +124,500 @@ int makeNetwork(unsigned int hiddenLayers, unsigned int* neurons,
         if (returnCode != SUCCESS) {
             return returnCode;
         }
+        (*network)->a[i] = a;
         returnCode = makeMatrix(neurons[i], 1, &z);
         if (returnCode != SUCCESS) {
             return returnCode;
         }
-        (*network)->a[i] = a;
         (*network)->z[i] = z;
     }
     return SUCCESS;
 }
 
+int makeNetwork(unsigned int hiddenLayers, unsigned int* neurons,
+                double learningRate, NeuralNetwork** network) {
+    int returnCode = makeNetworkStructure(hiddenLayers, neurons, learningRate,
+                                          1, network);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+
+    // Assign random values to matrices
+    for (int i = 0; i < hiddenLayers + 1; i++) {
+        randomiseMatrix((*network)->weights[i]);
+        randomiseMatrix((*network)->biases[i]);
+    }
+    return SUCCESS;
+}
+
+int makeSeededNetwork(unsigned int hiddenLayers, unsigned int* neurons,
+                      double learningRate, uint64_t seed, NeuralNetwork** network) {
+    int returnCode = makeNetworkStructure(hiddenLayers, neurons, learningRate,
+                                          1, network);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+
+    // Initialisation has its own stream so it doesn't shift the shuffle order
+    Rng rng;
+    seedRng(&rng, seed ^ 0x9E3779B97F4A7C15ULL);
+    for (int i = 0; i < hiddenLayers + 1; i++) {
+        randomiseMatrixWith((*network)->weights[i], &rng);
+        randomiseMatrixWith((*network)->biases[i], &rng);
+    }
+    seedNetwork(*network, seed);
+    return SUCCESS;
+}
+
+int makeEmptyNetwork(unsigned int hiddenLayers, unsigned int* neurons,
+                     double learningRate, NeuralNetwork** network) {
+    return makeNetworkStructure(hiddenLayers, neurons, learningRate, 0, network);
+}
+
+int setConvLayer(NeuralNetwork* network, unsigned int layer, const ConvShape* shape) {
+    unsigned int inputs, outputs;
+    if (layer > network->hiddenLayers) {
+        return reportError(MISC, "setConvLayer error: no such layer");
+    }
+    int returnCode = convShapeSize(shape, &inputs, &outputs);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    if (inputs != network->neurons[layer] || outputs != network->neurons[layer + 1]) {
+        return reportError(MISC, "setConvLayer error: shape doesn't match the layer's neurons");
+    }
+    ConvLayer* conv = NULL;
+    returnCode = makeConvLayer(shape, &conv);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    unsigned int patch = shape->channels * shape->kernel * shape->kernel;
+    Matrix* weights = NULL;
+    if (network->weights[layer]->ownsValues) {
+        returnCode = makeMatrix(shape->filters, patch, &weights);
+        if (returnCode == SUCCESS) {
+            zeroMatrix(weights);
+        }
+    } else {
+        returnCode = makeMatrixView(shape->filters, patch, NULL, &weights);
+    }
+    if (returnCode != SUCCESS) {
+        freeConvLayer(conv);
+        return returnCode;
+    }
+    freeMatrix(network->weights[layer]);
+    network->weights[layer] = weights;
+    freeConvLayer(network->conv[layer]);
+    network->conv[layer] = conv;
+    return SUCCESS;
+}
+
+void seedNetwork(NeuralNetwork* network, uint64_t seed) {
+    network->seed = seed;
+    seedRng(&network->rng, seed);
+}
+
 void freeNetwork(NeuralNetwork* network) {
+    if (network == NULL) {
+        return;
+    }
     // Free weight and bias matrix arrays
     for (int i = 0; i < network->hiddenLayers + 1; i++) {
-        freeMatrix(network->weights[i]);
-        freeMatrix(network->biases[i]);
+        if (network->weights != NULL && network->weights[i] != NULL) {
+            freeMatrix(network->weights[i]);
+        }
+        if (network->biases != NULL && network->biases[i] != NULL) {
+            freeMatrix(network->biases[i]);
+        }
+        if (network->delta != NULL && network->delta[i] != NULL) {
+            freeMatrix(network->delta[i]);
+        }
+        if (network->derivative != NULL && network->derivative[i] != NULL) {
+            freeMatrix(network->derivative[i]);
+        }
+        if (network->sparseWeights != NULL) {
+            freeSparseMatrix(network->sparseWeights[i]);
+        }
+        if (network->conv != NULL) {
+            freeConvLayer(network->conv[i]);
+        }
     }
     // Free activation and sum arrays
     for (int i = 0; i < network->hiddenLayers + 2; i++) {
-        freeMatrix(network->a[i]);
-        freeMatrix(network->z[i]);
+        if (network->a != NULL && network->a[i] != NULL) {
+            freeMatrix(network->a[i]);
+        }
+        if (network->z != NULL && network->z[i] != NULL) {
+            freeMatrix(network->z[i]);
+        }
     }
     // Free pointer arrays
     free(network->weights);
     free(network->biases);
     free(network->a);
     free(network->z);
+    free(network->delta);
+    free(network->derivative);
+    free(network->sparseWeights);
+    free(network->conv);
+    dropQuantizedLayers(network);
+    dropLowRankLayers(network);
     free(network->neurons);
+    // Unmap the model file the weights and biases pointed into
+    if (network->mapping != NULL) {
+        munmap(network->mapping, network->mappingLength);
+    }
     // Free network itself
     free(network);
 }
 
-int saveNetworkHeaderFile(NeuralNetwork* network) {
-    FILE* file = fopen("network", "wb");
+int saveNetworkHeaderFile(NeuralNetwork* network, char* dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/network", dir);
+    FILE* file = fopen(path, "wb");
     if (file == NULL) {
         return reportError(MISC, "saveNetworkHeaderFile error: network file could not be opened");
     }
 
     int written = fwrite(&network->hiddenLayers, sizeof(unsigned int), 1, file);
     written += fwrite(network->neurons, sizeof(unsigned int), network->hiddenLayers + 2, file);
+    fclose(file);
     if (written != network->hiddenLayers + 3) {
         return reportError(MISC, "saveNetworkHeaderFile error: fwrite error");
     }
-    fclose(file);
     return SUCCESS;
 }
 
-int saveNetworkLayerFiles(NeuralNetwork* network) {
+int saveNetworkLayerFiles(NeuralNetwork* network, char* dir) {
     int returnCode = SUCCESS;
     char buffer[PATH_MAX]; // Output buffer
     for (int i = 0; i < network->hiddenLayers + 1; i++) {
         // Write a weight file
-        sprintf(buffer, "weight%i", i);
+        snprintf(buffer, sizeof(buffer), "%s/weight%i", dir, i);
         returnCode = saveMatrix(network->weights[i], buffer);
         if (returnCode != SUCCESS) {
             return returnCode;
         }
-        buffer[0] = '\0';
 
         // Write a bias file
-        sprintf(buffer, "bias%i", i);
+        snprintf(buffer, sizeof(buffer), "%s/bias%i", dir, i);
         returnCode = saveMatrix(network->biases[i], buffer);
         if (returnCode != SUCCESS) {
             return returnCode;
         }
-        buffer[0] = '\0';
     }
     return returnCode;
 }
 
 int saveNetwork(NeuralNetwork* network, char* dir) {
-    // Make new directory
-    if (!chdir(dir)) {
-        if (!mkdir(dir, 0777)) {
-            return reportError(MISC, "saveNetwork error: `dir` cannot be made");
-        }
-        if (!chdir(dir)) {
-            return reportError(MISC, "saveNetwork error: `dir` does not exist");
+    for (int i = 0; i < network->hiddenLayers + 1; i++) {
+        if (network->conv[i] != NULL) {
+            return reportError(MISC, "saveNetwork error: convolutional networks must be saved as model files");
         }
     }
-
-    // Now in directory, save the network to a file
-    int returnCode = saveNetworkHeaderFile(network);
-    if (returnCode != SUCCESS) {
-        return returnCode;
+    // Make the directory if it does not already exist
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        return reportError(MISC, "saveNetwork error: `dir` cannot be made");
     }
 
-    // Write weight and bias for each layers
-    returnCode = saveNetworkLayerFiles(network);
+    // Save the network header to a file in the directory
+    int returnCode = saveNetworkHeaderFile(network, dir);
     if (returnCode != SUCCESS) {
         return returnCode;
     }
 
-    // Go back to root directory
-    if (!chdir("-")) {
-        return reportError(MISC, "saveNetwork error: directory could not be changed");
-    }
-    return returnCode;
+    // Write weight and bias for each layers
+    return saveNetworkLayerFiles(network, dir);
 }
 
-int loadNetworkHeaderFile(NeuralNetwork** network, double learningRate) {
-    FILE* file = fopen("network", "rb");
+int loadNetworkHeaderFile(NeuralNetwork** network, char* dir, double learningRate) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/network", dir);
+    FILE* file = fopen(path, "rb");
     if (file == NULL) {
         return reportError(MISC, "loadNetworkHeaderFile error: network file could not be opened");
     }
 
     // Read header from network file
     unsigned int hiddenLayers;
-    unsigned int* neurons = calloc(sizeof(unsigned int), hiddenLayers + 2);
     if (fread(&hiddenLayers, sizeof(unsigned int), 1, file) != 1) {
+        fclose(file);
         return reportError(MISC, "loadNetworkHeaderFile error: fread error (layers)");
     }
+    unsigned int* neurons = calloc(hiddenLayers + 2, sizeof(unsigned int));
+    if (neurons == NULL) {
+        fclose(file);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
     int read = fread(neurons, sizeof(unsigned int), hiddenLayers + 2, file);
+    fclose(file);
     if (read != hiddenLayers + 2) {
+        free(neurons);
         return reportError(MISC, "loadNetworkHeaderFile error: fread error (neurons)");
     }
 
-    // Set up NN
-    int returnCode = makeNetwork(hiddenLayers, neurons, learningRate, network);
-    if (returnCode != SUCCESS) {
-        return returnCode;
-    }
-    fclose(file);
-    return returnCode;
+    // Set up NN, the layer files are read straight into the weights and
+    // biases so they are not randomised first
+    return makeEmptyNetwork(hiddenLayers, neurons, learningRate, network);
 }
 
-int loadNetworkLayerFiles(NeuralNetwork** network) {
+int loadNetworkLayerFiles(NeuralNetwork** network, char* dir) {
     int returnCode = SUCCESS;
-    char buffer[128]; // Input buffer
+    char buffer[PATH_MAX]; // Input buffer
     for (int i = 0; i < (*network)->hiddenLayers + 1; i++) {
-        // Read a weight filename
-        sprintf(buffer, "weight%i", i);
-        returnCode = loadMatrixInto((*network)->weights[i], buffer);
-        if (returnCode != SUCCESS) {
-            return returnCode;
-        }
-        buffer[0] = '\0';
+        Matrix* matrices[2] = {(*network)->weights[i], (*network)->biases[i]};
+        for (int j = 0; j < 2; j++) {
+            // Allocate the values the file is read into
+            Matrix* m = matrices[j];
+            m->values = malloc((size_t) m->rows * m->columns * sizeof(double));
+            if (m->values == NULL) {
+                return reportError(IMAGE_MALLOC_FAILED, "");
+            }
+            m->ownsValues = 1;
 
-        // Read a bias filename
-        sprintf(buffer, "bias%i", i);
-        returnCode = loadMatrixInto((*network)->biases[i], buffer);
-        if (returnCode != SUCCESS) {
-            return returnCode;
+            // Read a weight or bias file
+            snprintf(buffer, sizeof(buffer), j == 0 ? "%s/weight%i" : "%s/bias%i", dir, i);
+            returnCode = loadMatrixInto(m, buffer);
+            if (returnCode != SUCCESS) {
+                return returnCode;
+            }
         }
-        buffer[0] = '\0';
     }
     return returnCode;
 }
 
 int loadNetwork(NeuralNetwork** network, char* dir, double learningRate) {
-    // Save current directory
-    char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd)) == NULL) {
-        return reportError(MISC, "loadNetwork error: current directory could not be saved");
-    }
-
-    if (chdir(dir) != SUCCESS) {
+    // A single file is a model file rather than a directory of layer files
+    struct stat status;
+    if (stat(dir, &status) != 0) {
         return reportError(MISC, "loadNetwork error: `dir` does not exist");
     }
+    if (S_ISREG(status.st_mode)) {
+        return loadNetworkModel(network, dir, learningRate);
+    }
 
-    // Now in directory, save the network to a file
-    int returnCode = loadNetworkHeaderFile(network, learningRate);
+    // Read the network header in the directory
+    int returnCode = loadNetworkHeaderFile(network, dir, learningRate);
     if (returnCode != SUCCESS) {
         return returnCode;
     }
 
     // Read weight and bias for each layers
-    returnCode = loadNetworkLayerFiles(network);
-    if (returnCode != SUCCESS) {
-        return returnCode;
+    return loadNetworkLayerFiles(network, dir);
+}
+
+// Places the product of layer `layer`'s weights and `input` in `result`,
+// through its int8 weights, factors or sparse weights if it has them. Factors
+// work in `hidden`, or in the network's own scratch if it is NULL
+static int multiplyLayerInto(NeuralNetwork* network, int layer, Matrix* hidden,
+                             Matrix* input, Matrix* result) {
+    if (network->quantized != NULL && network->quantized[layer] != NULL) {
+        return multiplyQuantizedInto(network->quantized[layer], input, result);
+    }
+    if (network->lowRank != NULL && network->lowRank[layer] != NULL) {
+        return multiplyLowRankInto(network->lowRank[layer], input, hidden, result);
+    }
+    if (network->sparseWeights[layer] != NULL) {
+        return multiplySparseInto(network->sparseWeights[layer], input, result);
     }
+    return multiplyMatricesInto(network->weights[layer], input, result);
+}
 
-    if (!chdir("-")) { // Go back to root directory
-        return reportError(MISC, "loadNetwork error: directory could not be changed");
+// Places layer `layer`'s weighted inputs for the column vector `input` in
+// `output`, convolving and pooling it in `conv` if the layer is convolutional
+static int forwardLayer(NeuralNetwork* network, int layer, ConvLayer* conv, Matrix* hidden,
+                        Matrix* input, Matrix* output) {
+    if (conv == NULL) {
+        return multiplyLayerInto(network, layer, hidden, input, output);
     }
-    return SUCCESS;
+    int returnCode = unfoldInput(conv, input);
+    if (returnCode == SUCCESS) {
+        returnCode = multiplyLayerInto(network, layer, hidden, conv->columns, conv->convolved);
+    }
+    if (returnCode == SUCCESS) {
+        returnCode = poolInto(conv, output);
+    }
+    return returnCode;
 }
 
-int feedForwardNetwork(NeuralNetwork* network, Matrix* input) {
-    // Move input values to network->z[0]
-    zeroMatrix(network->z[0]);
-    int returnCode = addMatricesInto(network->z[0], input, network->z[0]);
+// Whether the first layer can't take only the non-zero inputs of a sparse row
+static int needsDenseInput(NeuralNetwork* network) {
+    return network->conv[0] != NULL ||
+           (network->quantized != NULL && network->quantized[0] != NULL) ||
+           (network->lowRank != NULL && network->lowRank[0] != NULL);
+}
+
+int forwardNetworkLayer(NeuralNetwork* network, unsigned int layer, Matrix** z, Matrix** a,
+                        SparseMatrix* sparse, unsigned int row) {
+    int returnCode;
+    if (layer == 0 && sparse != NULL && !needsDenseInput(network)) {
+        returnCode = multiplySparseRowInto(network->weights[0], sparse, row, z[1]);
+    } else {
+        if (layer == 0 && sparse != NULL) {
+            zeroMatrix(a[0]);
+            for (size_t p = sparse->offsets[row]; p < sparse->offsets[row + 1]; p++) {
+                a[0]->values[sparse->indices[p]] = sparse->values[p];
+            }
+        }
+        returnCode = forwardLayer(network, layer, network->conv[layer], NULL, a[layer], z[layer+1]);
+    }
     if (returnCode != SUCCESS) {
         return returnCode;
     }
-    // Set activations of network->a[0]
-    zeroMatrix(network->a[0]);
-    returnCode = addMatricesInto(network->a[0], input, network->a[0]);
+    returnCode = addMatricesInto(z[layer+1], network->biases[layer], z[layer+1]);
     if (returnCode != SUCCESS) {
         return returnCode;
     }
+
+    // Perform activation function on the column matrix
+    return sigmoidInto(z[layer+1], a[layer+1]);
+}
+
+// Feeds either the column vector `input` or, if it is NULL, row `row` of
+// `sparse` forward. Only the first layer's product differs, visiting just the
+// non-zero inputs of a sparse row, which also leaves z[0] and a[0] unset
+// unless the first layer is quantized, factorized or convolutional and needs
+// the dense row.
+static int feedForward(NeuralNetwork* network, Matrix* input, SparseMatrix* sparse,
+                       unsigned int row) {
+    int returnCode = SUCCESS;
+    if (input != NULL) {
+        // Move input values to network->z[0]
+        zeroMatrix(network->z[0]);
+        returnCode = addMatricesInto(network->z[0], input, network->z[0]);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+        // Set activations of network->a[0]
+        zeroMatrix(network->a[0]);
+        returnCode = addMatricesInto(network->a[0], input, network->a[0]);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
     
-    // Feed-forward through all layers
+    // Feed-forward through all layers, the first taking the sparse row if
+    // there is no input matrix
     for (int i = 0; i < network->hiddenLayers + 1; i++) {
-        Matrix* weights = network->weights[i];
-        Matrix* biases = network->biases[i];
-        
-        // Use input matrix on first iteration, else use the prev. activations
-        returnCode = multiplyMatricesInto(weights, network->a[i], network->z[i+1]);
+        traceBegin("forward layer", i);
+        returnCode = forwardNetworkLayer(network, i, network->z, network->a,
+                                         input == NULL ? sparse : NULL, row);
         if (returnCode != SUCCESS) {
             return returnCode;
         }
-        returnCode = addMatricesInto(network->z[i+1], biases, network->z[i+1]);
+        traceEnd("forward layer");
+    }
+    return SUCCESS;
+}
+
+int feedForwardNetwork(NeuralNetwork* network, Matrix* input) {
+    return feedForward(network, input, NULL, 0);
+}
+
+int feedForwardNetworkSparse(NeuralNetwork* network, SparseMatrix* inputs, unsigned int row) {
+    return feedForward(network, NULL, inputs, row);
+}
+
+int makeBatchActivations(NeuralNetwork* network, unsigned int maxBatch,
+                         BatchActivations** activations) {
+    *activations = calloc(1, sizeof(BatchActivations));
+    if (*activations == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    BatchActivations* b = *activations;
+    b->layers = calloc(network->hiddenLayers + 2, sizeof(Matrix*));
+    b->conv = calloc(network->hiddenLayers + 1, sizeof(ConvLayer*));
+    b->lowRank = calloc(network->hiddenLayers + 1, sizeof(Matrix*));
+    if (b->layers == NULL || b->conv == NULL || b->lowRank == NULL) {
+        freeBatchActivations(network, b);
+        *activations = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    for (int i = 0; i < network->hiddenLayers + 2; i++) {
+        int returnCode = makeMatrix(network->neurons[i], maxBatch, &b->layers[i]);
+        // Convolutional layers work in their own copy, never the network's
+        if (returnCode == SUCCESS && i < network->hiddenLayers + 1 && network->conv[i] != NULL) {
+            returnCode = makeConvLayer(&network->conv[i]->shape, &b->conv[i]);
+        }
+        // And so do low rank layers, over a batch or one sample's positions
+        if (returnCode == SUCCESS && i < network->hiddenLayers + 1 &&
+            network->lowRank != NULL && network->lowRank[i] != NULL) {
+            returnCode = makeMatrix(network->lowRank[i]->rank,
+                                    b->conv[i] != NULL ? b->conv[i]->columns->columns : maxBatch,
+                                    &b->lowRank[i]);
+        }
         if (returnCode != SUCCESS) {
+            freeBatchActivations(network, b);
+            *activations = NULL;
             return returnCode;
         }
+    }
+    return SUCCESS;
+}
 
-        // Perform activation function on the column matrix
-        returnCode = sigmoidInto(network->z[i+1], network->a[i+1]);
+void setBatchSize(NeuralNetwork* network, BatchActivations* activations, unsigned int batchSize) {
+    // Values are row major, so a narrower matrix uses the start of the buffer
+    for (int i = 0; i < network->hiddenLayers + 2; i++) {
+        activations->layers[i]->columns = batchSize;
+    }
+}
+
+void freeBatchActivations(NeuralNetwork* network, BatchActivations* activations) {
+    if (activations == NULL) {
+        return;
+    }
+    for (int i = 0; activations->layers != NULL && i < network->hiddenLayers + 2; i++) {
+        if (activations->layers[i] != NULL) {
+            freeMatrix(activations->layers[i]);
+        }
+    }
+    for (int i = 0; activations->conv != NULL && i < network->hiddenLayers + 1; i++) {
+        freeConvLayer(activations->conv[i]);
+    }
+    for (int i = 0; activations->lowRank != NULL && i < network->hiddenLayers + 1; i++) {
+        if (activations->lowRank[i] != NULL) {
+            freeMatrix(activations->lowRank[i]);
+        }
+    }
+    free(activations->layers);
+    free(activations->conv);
+    free(activations->lowRank);
+    free(activations);
+}
+
+int feedForwardNetworkBatch(NeuralNetwork* network, BatchActivations* activations) {
+    Matrix** layers = activations->layers;
+    for (int i = 0; i < network->hiddenLayers + 1; i++) {
+        traceBegin("forward layer", i);
+        // z = W a + b for every column at once, then the activation in place
+        int returnCode = SUCCESS;
+        ConvLayer* conv = activations->conv[i];
+        if (conv == NULL) {
+            returnCode = multiplyLayerInto(network, i, activations->lowRank[i], layers[i], layers[i+1]);
+        }
+        // Convolutional layers take one sample's column at a time
+        unsigned int samples = layers[i]->columns;
+        for (unsigned int j = 0; conv != NULL && j < samples && returnCode == SUCCESS; j++) {
+            for (unsigned int r = 0; r < conv->sample->rows; r++) {
+                conv->sample->values[r] = layers[i]->values[(size_t) r * samples + j];
+            }
+            returnCode = forwardLayer(network, i, conv, activations->lowRank[i], conv->sample, conv->pooled);
+            for (unsigned int r = 0; r < conv->pooled->rows; r++) {
+                layers[i+1]->values[(size_t) r * samples + j] = conv->pooled->values[r];
+            }
+        }
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+        returnCode = addColumnInto(layers[i+1], network->biases[i], layers[i+1]);
         if (returnCode != SUCCESS) {
             return returnCode;
         }
+        returnCode = sigmoidInto(layers[i+1], layers[i+1]);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+        traceEnd("forward layer");
     }
     return SUCCESS;
 }
@@ -312,22 +641,23 @@ int feedForwardNetworkImage(NeuralNetwork* network, Image* input) {
     return SUCCESS; 
 }
 
-int evaluateNetwork(NeuralNetwork* network, char* string) {
-    int outputNeurons = network->neurons[network->hiddenLayers + 1];
-    int correctImages = 0;
-    double cost = 0;
-    int* o = calloc(outputNeurons, sizeof(int)); // Stores number of correct outputs for each digit
-    int* e = calloc(outputNeurons, sizeof(int)); // Stores expected outputs
-    if (o == NULL || e == NULL) {
-        return reportError(IMAGE_MALLOC_FAILED, "");
-    }
-
-    for (int i = 0; i < network->numberOfTestingImages; i++) {
-        // Feedforward
-        Image* img = network->testingImages[i];
-        int returnCode = feedForwardNetworkImage(network, img);
+// Feeds every testing sample of `network` forward, counting the correct
+// outputs in `correctImages`, and per expected neuron in `o` and `e`, and
+// adding up the cost in `cost`
+static int scoreNetwork(NeuralNetwork* network, Matrix* input, int* correctImages,
+                        double* cost, int* o, int* e) {
+    Dataset* testingData = network->testingData;
+    for (int i = 0; i < testingData->numberOfSamples; i++) {
+        // Feedforward, from just the non-zero inputs if they were indexed
+        int returnCode;
+        if (testingData->sparse != NULL) {
+            returnCode = feedForwardNetworkSparse(network, testingData->sparse, i);
+        } else {
+            datasetSampleInto(testingData, i, input->values);
+            returnCode = feedForwardNetwork(network, input);
+        }
         if (returnCode != SUCCESS) {
-            goto cleanUp;
+            return returnCode;
         }
         Matrix* networkOutput = network->a[network->hiddenLayers + 1];
         
@@ -338,24 +668,74 @@ int evaluateNetwork(NeuralNetwork* network, char* string) {
             return returnCode;
         }
 
-        int expected = (int) img->label; // Convert char to int
+        int expected = datasetLabel(testingData, i);
         e[expected]++;
         if (output == expected) {
             o[output]++;
-            correctImages++;
+            (*correctImages)++;
         }
 
         // Work out cost
-        returnCode = costFunction(networkOutput, (int) img->label, &cost);
+        returnCode = costFunction(networkOutput, expected, cost);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
+    return SUCCESS;
+}
+
+int evaluateNetwork(NeuralNetwork* network, char* string) {
+    uint64_t evaluationStart = phaseClock();
+    traceBegin("evaluation", TRACE_NO_ARGUMENT);
+    int outputNeurons = network->neurons[network->hiddenLayers + 1];
+    int correctImages = 0;
+    double cost = 0;
+    int* o = calloc(outputNeurons, sizeof(int)); // Stores number of correct outputs for each digit
+    int* e = calloc(outputNeurons, sizeof(int)); // Stores expected outputs
+    if (o == NULL || e == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+
+    Dataset* testingData = network->testingData;
+    Matrix* input = NULL;
+    if (makeMatrix(network->neurons[0], 1, &input) != SUCCESS) {
+        free(o);
+        free(e);
+        return IMAGE_MALLOC_FAILED;
+    }
+
+    // A quantized network is scored through its floating point weights first
+    QuantizedLayer** quantized = network->quantized;
+    int floatCorrect = 0;
+    double floatCost = 0;
+    if (quantized != NULL) {
+        network->quantized = NULL;
+        int returnCode = scoreNetwork(network, input, &floatCorrect, &floatCost, o, e);
+        network->quantized = quantized;
         if (returnCode != SUCCESS) {
             goto cleanUp;
         }
+        floatCost /= testingData->numberOfSamples;
+        memset(o, 0, outputNeurons * sizeof(int));
+        memset(e, 0, outputNeurons * sizeof(int));
     }
-    cost /= network->numberOfTestingImages;
+    if (scoreNetwork(network, input, &correctImages, &cost, o, e) != SUCCESS) {
+        goto cleanUp;
+    }
+    cost /= testingData->numberOfSamples;
+    network->accuracy = (double) correctImages / testingData->numberOfSamples;
+    network->cost = cost;
 
     printf(RED "----NETWORK EVALUATION (%s)----\n" CLR, string);
-    printf(GRN "%.3lf%%" CLR " testing accuracy\n", (double) 100*correctImages/network->numberOfTestingImages);
+    printf(GRN "%.3lf%%" CLR " testing accuracy\n", (double) 100*correctImages/testingData->numberOfSamples);
     printf(GRN "%.3lf" CLR " cost\n", cost);
+    if (quantized != NULL) {
+        printf(GRN "%+.3lf" CLR " points of accuracy and " GRN "%+.3lf" CLR " cost from int8 (%s), "
+               "against %.3lf%% in floating point\n",
+               (double) 100 * (correctImages - floatCorrect) / testingData->numberOfSamples,
+               cost - floatCost, quantizedKernelName(),
+               (double) 100 * floatCorrect / testingData->numberOfSamples);
+    }
 
     // For each output neuron, print its accuracy
     for (int i = 0; i < outputNeurons; i++) {
@@ -363,220 +743,618 @@ int evaluateNetwork(NeuralNetwork* network, char* string) {
     }
 
     cleanUp:
+        freeMatrix(input);
         free(o);
         free(e);
+        endPhase(PHASE_EVALUATION, evaluationStart);
+        traceEnd("evaluation");
         return SUCCESS;
 }
 
 int trainNetworkMiniBatches(NeuralNetwork* network, unsigned int epochs, unsigned int miniBatchSize) {
     // Check mini batch size
-    if (network->numberOfTrainingImages % miniBatchSize != 0) {
-        return reportError(MISC, "miniBatchSize must equally divide numberOfTrainingImages");
+    Dataset* trainingData = network->trainingData;
+    if (miniBatchSize == 0 || trainingData->numberOfSamples % miniBatchSize != 0) {
+        return reportError(MISC, "miniBatchSize must equally divide the number of training samples");
     }
     
     // Initialise variables
-    int numberOfMiniBatches = network->numberOfTestingImages / miniBatchSize;
+    int numberOfMiniBatches = trainingData->numberOfSamples / miniBatchSize;
     int returnCode = SUCCESS;
     int H = network->hiddenLayers;
+    unsigned int inputs = network->neurons[0];
+    Pipeline* pipeline = NULL;
+
+    // Allocate the shuffled order and the mini batch buffer once for all epochs
+    EpochShuffler* shuffler = NULL;
+    returnCode = makeEpochShuffler(trainingData->numberOfSamples,
+                                   network->shuffleBlockSize, &shuffler);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    Matrix* batch = NULL;
+    returnCode = makeMatrix(miniBatchSize, inputs, &batch);
+    unsigned char* labels = malloc(miniBatchSize);
+    if (returnCode != SUCCESS || labels == NULL) {
+        freeEpochShuffler(shuffler);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    // Indexed inputs are trained from their non-zero values, gathered or
+    // compressed after augmenting into a batch with room for every input
+    SparseMatrix* sparseBatch = NULL;
+    if (trainingData->sparse != NULL) {
+        returnCode = makeSparseMatrix(miniBatchSize, inputs, (size_t) miniBatchSize * inputs, &sparseBatch);
+        if (returnCode != SUCCESS) {
+            freeEpochShuffler(shuffler);
+            freeMatrix(batch);
+            free(labels);
+            return returnCode;
+        }
+    }
+
+    // Sum matrices - nablaB and nablaW have same shape of network->biases and
+    // network->weights, and are zeroed at the start of each mini batch
+    Matrix** nablaB = calloc(H + 1, sizeof(Matrix*));
+    Matrix** nablaW = calloc(H + 1, sizeof(Matrix*));
+    if (nablaB == NULL || nablaW == NULL) {
+        returnCode = reportError(IMAGE_MALLOC_FAILED, "");
+        goto cleanUp;
+    }
+    for (int i = 0; i < H + 1; i++) {
+        returnCode = makeMatrix(network->weights[i]->rows, network->weights[i]->columns, &nablaW[i]);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+        returnCode = makeMatrix(network->neurons[i+1], 1, &nablaB[i]);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+    }
+    if (network->pipelineStages > 1) {
+        returnCode = makePipeline(network, network->pipelineStages, &pipeline);
+        if (returnCode != SUCCESS) {
+            goto cleanUp;
+        }
+        printf("Training pipelined between %u threads, from layers", pipeline->stages);
+        for (unsigned int s = 0; s < pipeline->stages; s++) {
+            printf(" %u", pipeline->firstLayers[s]);
+        }
+        printf("\n");
+    }
 
     // For each epoch
-    for (int e = 0; e < epochs; e++) {
+    // Carries on from `network->epoch` if training was resumed
+    for (int e = network->epoch; e < epochs; e++) {
         // For each mini batch
-        shuffle(network->trainingImages, network->numberOfTrainingImages);
+        double epochStart = monotonicSeconds();
+        traceBegin("epoch", e);
+        // Training changes the weights, so pruned layers are dense until pruned again
+        dropSparseWeights(network);
+        dropQuantizedLayers(network);
+        dropLowRankLayers(network);
+        PhaseTotals epochStartTotals;
+        collectPhaseTotals(&epochStartTotals);
+        uint64_t phaseStart = phaseClock();
+        shuffleEpoch(shuffler, &network->rng);
+        endPhase(PHASE_DATA_LOAD, phaseStart);
+        if (network->forbidAllocations) {
+            returnCode = setAllocationsForbidden(1);
+            if (returnCode != SUCCESS) {
+                break;
+            }
+        }
         for (int x = 0; x < numberOfMiniBatches; x++){ // TODO: Line limits of 80 chars
-            // Initialise sum matrices - nablaB and nablaW have same shape of network->weights
-            Matrix** nablaB = malloc((H + 1) * sizeof(Matrix));
-            Matrix** nablaW = malloc((H + 1) * sizeof(Matrix));
-            if (nablaB == NULL || nablaW == NULL) {
-                return reportError(IMAGE_MALLOC_FAILED, "");
+            traceBegin("mini batch", x);
+            // Pipeline stages zero their own layers' gradients
+            for (int i = 0; pipeline == NULL && i < H + 1; i++) {
+                zeroMatrix(nablaW[i]);
+                zeroMatrix(nablaB[i]);
+            }
+
+            // Gather the mini batch into consecutive rows of `batch`
+            phaseStart = phaseClock();
+            if (sparseBatch != NULL && network->augmenter == NULL) {
+                returnCode = gatherSparseSamples(trainingData,
+                                                 &shuffler->indices[miniBatchSize * x],
+                                                 miniBatchSize, sparseBatch, labels);
+            } else {
+                returnCode = gatherSamples(trainingData,
+                                           &shuffler->indices[miniBatchSize * x],
+                                           miniBatchSize, batch, labels);
             }
-            for (int i = 0; i < H + 1; i++) {
-                returnCode = makeMatrix(network->neurons[i+1], network->neurons[i], &nablaW[i]);
+            if (returnCode != SUCCESS) {
+                goto cleanUp;
+            }
+            if (network->augmenter != NULL) {
+                returnCode = augmentBatch(network->augmenter, batch, miniBatchSize,
+                                          (uint64_t) e * numberOfMiniBatches + x);
+                if (returnCode == SUCCESS && sparseBatch != NULL) {
+                    returnCode = sparseFromDense(batch, sparseBatch);
+                }
                 if (returnCode != SUCCESS) {
-                    return returnCode;
+                    goto cleanUp;
                 }
-                returnCode = makeMatrix(network->neurons[i+1], 1, &nablaB[i]);
+            }
+            endPhase(PHASE_CONVERSION, phaseStart);
+
+            double scale = (double) -network->learningRate/miniBatchSize;
+            if (pipeline != NULL) {
+                // Each stage updates its own layers once it has every gradient
+                returnCode = trainPipelinedBatch(pipeline, batch, sparseBatch, labels, miniBatchSize,
+                                                 nablaW, nablaB, scale);
                 if (returnCode != SUCCESS) {
-                    return returnCode;
+                    goto cleanUp;
                 }
+                traceEnd("mini batch");
+                continue;
             }
 
             // Train all images
             for (int i = 0; i < miniBatchSize; i++) {
-                // Forward prop, storing activations and outputs
-                Image* img = network->trainingImages[miniBatchSize * x + i];
-                returnCode = trainNetworkSingleImage(network, img, nablaW, nablaB);
+                if (sparseBatch != NULL) {
+                    returnCode = trainNetworkSparseInput(network, sparseBatch, i, labels[i], nablaW, nablaB);
+                } else {
+                    // Each row of the batch is viewed as a column vector input
+                    Matrix input = {&batch->values[i * inputs], inputs, 1, 0};
+                    returnCode = trainNetworkSingleInput(network, &input, labels[i], nablaW, nablaB);
+                }
+                if (returnCode != SUCCESS) {
+                    goto cleanUp;
+                }
             }
             
             // For each layer change the weights and biases
+            phaseStart = phaseClock();
             for (int l = 0; l < H + 1; l++) {
-                // Change nablaW to represent -deltaW and nablaB to represent -deltaB
-                multiplyScalarInto(nablaW[l], (double) -network->learningRate/miniBatchSize, nablaW[l]);
-                multiplyScalarInto(nablaB[l], (double) -network->learningRate/miniBatchSize, nablaB[l]);
-                // Add deltaW and deltaB to weights and biases
-                addMatricesInto(network->weights[l], nablaW[l], network->weights[l]);
-                addMatricesInto(network->biases[l], nablaB[l], network->biases[l]);
+                // Add deltaW and deltaB, the scaled -nablaW and -nablaB, to weights and biases
+                addScaledInto(network->weights[l], scale, nablaW[l], network->weights[l]);
+                addScaledInto(network->biases[l], scale, nablaB[l], network->biases[l]);
             }
-            
-            // Free nablaW and nablaB
-            for (int l = 0; l < H + 1; l++) {
-                freeMatrix(nablaB[l]);
-                freeMatrix(nablaW[l]);
+            endPhase(PHASE_UPDATE, phaseStart);
+            traceEnd("mini batch");
+        }
+        setAllocationsForbidden(0);
+
+        double trainSeconds = monotonicSeconds() - epochStart;
+
+        // Prune down a cubic schedule that reaches the density at the last
+        // epoch, the pruned weights being free to grow back in the next
+        if (network->pruneDensity < 1) {
+            double remaining = 1 - (double) (e + 1) / epochs;
+            double density = network->pruneDensity +
+                             (1 - network->pruneDensity) * remaining * remaining * remaining;
+            returnCode = pruneNetwork(network, density);
+            if (returnCode != SUCCESS) {
+                break;
             }
-            // Free pointer arrays
-            free(nablaB);
-            free(nablaW);
         }
 
         char string[128] = "";
+        // Start saving a checkpoint, which is written during the evaluation
+        network->epoch = e + 1;
+        if (network->checkpointer != NULL) {
+            TrainingState state = {network->epoch, miniBatchSize, network->seed,
+                                   network->rng.state};
+            phaseStart = phaseClock();
+            returnCode = checkpointEpoch(network->checkpointer, network, &state);
+            endPhase(PHASE_SAVE, phaseStart);
+            if (returnCode != SUCCESS) {
+                break;
+            }
+        }
+
         sprintf(string, "End of epoch %d", e);
+        double evaluateStart = monotonicSeconds();
         returnCode = evaluateNetwork(network, string);
         if (returnCode != SUCCESS) {
-            return SUCCESS;
+            break;
         }
+        if (network->epochRecords != NULL) {
+            EpochRecord* record = &network->epochRecords[e];
+            record->trainSeconds = trainSeconds;
+            record->finishedAt = monotonicSeconds();
+            record->evaluateSeconds = record->finishedAt - evaluateStart;
+            record->accuracy = network->accuracy;
+            record->cost = network->cost;
+        }
+
+        PhaseTotals epochEndTotals, epochTotals;
+        collectPhaseTotals(&epochEndTotals);
+        subtractPhaseTotals(&epochEndTotals, &epochStartTotals, &epochTotals);
+        sprintf(string, "Epoch %d", e);
+        printPhaseTotals(&epochTotals, string);
+        if (accountingMemory()) {
+            printMemoryUsage(string);
+            resetPeakMemory();
+        }
+        traceEnd("epoch");
     }
-    return SUCCESS;
+
+    cleanUp:
+        setAllocationsForbidden(0);
+        freePipeline(pipeline);
+        for (int l = 0; l < H + 1; l++) {
+            if (nablaB != NULL && nablaB[l] != NULL) {
+                freeMatrix(nablaB[l]);
+            }
+            if (nablaW != NULL && nablaW[l] != NULL) {
+                freeMatrix(nablaW[l]);
+            }
+        }
+        free(nablaB);
+        free(nablaW);
+        freeEpochShuffler(shuffler);
+        freeMatrix(batch);
+        freeSparseMatrix(sparseBatch);
+        free(labels);
+        return returnCode;
 }
 
 int trainNetworkSingleImage(NeuralNetwork* network, Image* img, Matrix** nablaW, Matrix** nablaB) {
-    int returnCode = feedForwardNetworkImage(network, img);
+    Matrix* input = NULL;
+    int returnCode = getMatrixFromImage(img, &input);
     if (returnCode != SUCCESS) {
         return returnCode;
     }
+    returnCode = trainNetworkSingleInput(network, input, (int) img->label, nablaW, nablaB);
+    freeMatrix(input);
+    return returnCode;
+}
 
-    // For each layer
-    Matrix* delta = NULL;
-    for (int l = network->hiddenLayers; l >= 0; l--) {
-        // Calculate error of output layer
-        Matrix* sum = network->z[l + 1];
-        Matrix* firstTerm = NULL;
-        // If output layer, set first term of delta to cost derivative
-        if (l == network->hiddenLayers) {
-            Matrix* output = network->a[l + 1];
-            returnCode = costDerivative(output, (int) img->label, &firstTerm);
-            if (returnCode != SUCCESS) {
-                return returnCode;
-            }
-            
-        } else {
-            Matrix* transposed = NULL;
-            returnCode = transposeMatrix(network->weights[l+1], &transposed);
-            if (returnCode != SUCCESS) {
-                return returnCode;
-            }
-            returnCode = makeMatrix(sum->rows, 1, &firstTerm);
-            if (returnCode != SUCCESS) {
-                return returnCode;
-            }
-            returnCode = multiplyMatricesInto(transposed, delta, firstTerm);
-            if (returnCode != SUCCESS) {
-                return returnCode;
-            }
-            freeMatrix(transposed);
-        }
+// Trains either the column vector `input` or, if it is NULL, row `row` of
+// `sparse`, whose first layer gradient only has the non-zero inputs' columns
+static int trainInput(NeuralNetwork* network, Matrix* input, SparseMatrix* sparse,
+                      unsigned int row, int label, Matrix** nablaW, Matrix** nablaB) {
+    uint64_t phaseStart = phaseClock();
+    int returnCode = feedForward(network, input, sparse, row);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    endPhase(PHASE_FORWARD, phaseStart);
 
-        //delta = hadamardProduct(firstTerm, sigmoidPrime(sum));
-        Matrix* sumD = NULL;
-        returnCode = makeMatrix(sum->rows, 1, &sumD);
-        if (returnCode != SUCCESS) {
-            return returnCode;
-        }
-        returnCode = dsigmoidInto(sum, sumD);
+    // If output layer, set first term of delta to cost derivative
+    Matrix* output = network->a[network->hiddenLayers + 1];
+    returnCode = costDerivative(output, label, &network->delta[network->hiddenLayers]);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+
+    // For each layer, working into the network's matrices so nothing is allocated
+    for (int l = network->hiddenLayers; l >= 0; l--) {
+        traceBegin("backward layer", l);
+        returnCode = backpropagateNetworkLayer(network, l, network->z, network->a, network->delta,
+                                               input == NULL ? sparse : NULL, row, nablaW, nablaB);
         if (returnCode != SUCCESS) {
             return returnCode;
         }
-        
-        // If delta has already been initialised (if not on the output layer)
-        if (l != network->hiddenLayers) {
-            freeMatrix(delta);
-            delta = NULL;
+        traceEnd("backward layer");
+    }
+    return returnCode;
+}
+
+int backpropagateNetworkLayer(NeuralNetwork* network, unsigned int layer, Matrix** z, Matrix** a,
+                              Matrix** delta, SparseMatrix* sparse, unsigned int row,
+                              Matrix** nablaW, Matrix** nablaB) {
+    uint64_t phaseStart = phaseClock();
+    unsigned int l = layer;
+
+    //delta = hadamardProduct(firstTerm, sigmoidPrime(sum));
+    Matrix* sumD = network->derivative[l];
+    int returnCode = dsigmoidInto(z[l + 1], sumD);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    returnCode = hadamardProduct(delta[l], sumD, &delta[l]);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+
+    //nablaB[outputLayer] += delta
+    phaseStart = endPhase(PHASE_BACKWARD, phaseStart);
+    returnCode = addMatricesInto(nablaB[l], delta[l], nablaB[l]);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+
+    //nablaW[outputLayer] += delta dotted w/ a[outputLayer - 1]^T; (where ^T means transpose)
+    if (network->conv[l] != NULL) {
+        // Every position the pooled outputs came from adds its patch
+        returnCode = unpoolGradient(network->conv[l], delta[l]);
+        if (returnCode == SUCCESS) {
+            returnCode = addConvWeightGradientInto(network->conv[l], nablaW[l]);
         }
-        
-        returnCode = hadamardProduct(firstTerm, sumD, &delta);
-        if (returnCode != SUCCESS) {
-            return returnCode;
+    } else if (l == 0 && sparse != NULL) {
+        returnCode = addSparseOuterProductInto(delta[l], sparse, row, nablaW[0]);
+    } else {
+        returnCode = addOuterProductInto(delta[l], a[l], nablaW[l]);
+    }
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    phaseStart = endPhase(PHASE_REDUCTION, phaseStart);
+    if (l == 0) {
+        return SUCCESS;
+    }
+
+    // First term of the previous layer's delta
+    if (network->conv[l] != NULL) {
+        // This layer's delta convolved back onto its input
+        returnCode = convInputGradientInto(network->conv[l], network->weights[l], delta[l - 1]);
+    } else {
+        // weights[l]^T dotted w/ this layer's delta
+        returnCode = multiplyTransposedInto(network->weights[l], delta[l], delta[l - 1]);
+    }
+    endPhase(PHASE_BACKWARD, phaseStart);
+    return returnCode;
+}
+
+int trainNetworkSingleInput(NeuralNetwork* network, Matrix* input, int label,
+                            Matrix** nablaW, Matrix** nablaB) {
+    return trainInput(network, input, NULL, 0, label, nablaW, nablaB);
+}
+
+int trainNetworkSparseInput(NeuralNetwork* network, SparseMatrix* inputs, unsigned int row,
+                            int label, Matrix** nablaW, Matrix** nablaB) {
+    return trainInput(network, NULL, inputs, row, label, nablaW, nablaB);
+}
+
+static int compareMagnitudes(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+int indexSparseWeights(NeuralNetwork* network, unsigned int layer) {
+    Matrix* weights = network->weights[layer];
+    size_t n = (size_t) weights->rows * weights->columns;
+    size_t nonZeros = 0;
+    for (size_t i = 0; i < n; i++) {
+        nonZeros += weights->values[i] != 0;
+    }
+    freeSparseMatrix(network->sparseWeights[layer]);
+    network->sparseWeights[layer] = NULL;
+    int returnCode = makeSparseMatrix(weights->rows, weights->columns, nonZeros,
+                                      &network->sparseWeights[layer]);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    return sparseFromDense(weights, network->sparseWeights[layer]);
+}
+
+void dropSparseWeights(NeuralNetwork* network) {
+    for (int i = 0; i < network->hiddenLayers + 1; i++) {
+        freeSparseMatrix(network->sparseWeights[i]);
+        network->sparseWeights[i] = NULL;
+    }
+}
+
+void dropQuantizedLayers(NeuralNetwork* network) {
+    if (network->quantized == NULL) {
+        return;
+    }
+    for (int i = 0; i < network->hiddenLayers + 1; i++) {
+        freeQuantizedLayer(network->quantized[i]);
+    }
+    free(network->quantized);
+    network->quantized = NULL;
+}
+
+int quantizeNetwork(NeuralNetwork* network, Dataset* calibration, unsigned int samples,
+                    int perChannel) {
+    if (samples == 0 || calibration->numberOfSamples == 0) {
+        return reportError(MISC, "quantizeNetwork error: no samples to calibrate with");
+    }
+    if (samples > calibration->numberOfSamples) {
+        samples = calibration->numberOfSamples;
+    }
+    // Calibrated through the floating point weights
+    dropQuantizedLayers(network);
+    int layers = network->hiddenLayers + 1;
+    double* largest = calloc(layers, sizeof(double));
+    Matrix* input = NULL;
+    int returnCode = makeMatrix(network->neurons[0], 1, &input);
+    if (returnCode != SUCCESS || largest == NULL) {
+        free(largest);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    for (unsigned int s = 0; s < samples && returnCode == SUCCESS; s++) {
+        unsigned int sample = (unsigned int) ((uint64_t) s * calibration->numberOfSamples / samples);
+        datasetSampleInto(calibration, sample, input->values);
+        returnCode = feedForwardNetwork(network, input);
+        for (int l = 0; l < layers && returnCode == SUCCESS; l++) {
+            Matrix* a = network->a[l];
+            for (unsigned int i = 0; i < a->rows; i++) {
+                largest[l] = a->values[i] > largest[l] ? a->values[i] : largest[l];
+            }
         }
+    }
+    freeMatrix(input);
 
-        //nablaB[outputLayer] += delta
-        returnCode = addMatricesInto(nablaB[l], delta, nablaB[l]);
-        if (returnCode != SUCCESS) {
-            return returnCode;
+    QuantizedLayer** quantized = NULL;
+    if (returnCode == SUCCESS) {
+        quantized = calloc(layers, sizeof(QuantizedLayer*));
+        if (quantized == NULL) {
+            returnCode = reportError(IMAGE_MALLOC_FAILED, "");
         }
+    }
+    for (int l = 0; l < layers && returnCode == SUCCESS; l++) {
+        if (network->lowRank == NULL || network->lowRank[l] == NULL) {
+            returnCode = quantizeWeights(network->weights[l], perChannel, largest[l], &quantized[l]);
+        }
+    }
+    free(largest);
+    network->quantized = quantized;
+    if (returnCode != SUCCESS) {
+        dropQuantizedLayers(network);
+    }
+    return returnCode;
+}
+
+void dropLowRankLayers(NeuralNetwork* network) {
+    if (network->lowRank == NULL) {
+        return;
+    }
+    for (int i = 0; i < network->hiddenLayers + 1; i++) {
+        freeLowRankLayer(network->lowRank[i]);
+    }
+    free(network->lowRank);
+    network->lowRank = NULL;
+}
+
+// Places the testing accuracy of `network` in `accuracy`, without printing
+static int testingAccuracy(NeuralNetwork* network, double* accuracy) {
+    int outputNeurons = network->neurons[network->hiddenLayers + 1];
+    int correctImages = 0;
+    double cost = 0;
+    int* o = calloc(outputNeurons, sizeof(int));
+    int* e = calloc(outputNeurons, sizeof(int));
+    Matrix* input = NULL;
+    int returnCode = makeMatrix(network->neurons[0], 1, &input);
+    if (returnCode != SUCCESS || o == NULL || e == NULL) {
+        free(o);
+        free(e);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    returnCode = scoreNetwork(network, input, &correctImages, &cost, o, e);
+    *accuracy = (double) correctImages / network->testingData->numberOfSamples;
+    freeMatrix(input);
+    free(o);
+    free(e);
+    return returnCode;
+}
 
-        //toAddToNablaW = delta dotted w/ a[outputLayer - 1]^T; (where ^T means transpose)
-        Matrix* toAddToNablaW = NULL;
-        returnCode = makeMatrix(nablaW[l]->rows, nablaW[l]->columns, &toAddToNablaW);
+int factorizeNetwork(NeuralNetwork* network, double targetAccuracy) {
+    dropQuantizedLayers(network);
+    dropLowRankLayers(network);
+    network->lowRank = calloc(network->hiddenLayers + 1, sizeof(LowRankLayer*));
+    if (network->lowRank == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    int returnCode = SUCCESS;
+    for (int l = 0; l < network->hiddenLayers + 1 && returnCode == SUCCESS; l++) {
+        Matrix* weights = network->weights[l];
+        // Only ranks below rows * columns / (rows + columns) save multiply-adds
+        unsigned int maxRank = (unsigned int) (((uint64_t) weights->rows * weights->columns - 1) /
+                                               (weights->rows + weights->columns));
+        if (maxRank == 0) {
+            continue;
+        }
+        // Scratch for one sample, which is every position of a convolution
+        unsigned int columns = network->conv[l] != NULL ? network->conv[l]->columns->columns : 1;
+        Matrix* vectors = NULL;
+        returnCode = singularVectors(weights, &vectors);
         if (returnCode != SUCCESS) {
-            return returnCode;
+            break;
         }
+        // Lowest rank accurate enough, assuming accuracy grows with the rank
+        LowRankLayer* best = NULL;
+        unsigned int low = 1;
+        unsigned int high = maxRank;
+        while (low <= high && returnCode == SUCCESS) {
+            unsigned int rank = low + (high - low) / 2;
+            returnCode = makeLowRankLayer(weights, vectors, rank, columns, &network->lowRank[l]);
+            double accuracy = 0;
+            if (returnCode == SUCCESS) {
+                returnCode = testingAccuracy(network, &accuracy);
+            }
+            if (returnCode == SUCCESS && accuracy >= targetAccuracy) {
+                freeLowRankLayer(best);
+                best = network->lowRank[l];
+                high = rank - 1;
+            } else {
+                freeLowRankLayer(network->lowRank[l]);
+                low = rank + 1;
+            }
+            network->lowRank[l] = NULL;
+        }
+        freeMatrix(vectors);
+        network->lowRank[l] = best;
+        if (best != NULL && returnCode == SUCCESS) {
+            // The dense weights become what the factors multiply by
+            returnCode = lowRankProductInto(best, weights);
+            printf("Layer %i: rank %u of %u, %.1lf%% of the multiply-adds\n", l, best->rank,
+                   weights->rows < weights->columns ? weights->rows : weights->columns,
+                   100.0 * best->rank * (weights->rows + weights->columns) / ((double) weights->rows * weights->columns));
+        } else if (returnCode == SUCCESS) {
+            printf("Layer %i: no rank reaches the target accuracy, left dense\n", l);
+        }
+    }
+    if (returnCode != SUCCESS) {
+        dropLowRankLayers(network);
+    }
+    return returnCode;
+}
 
-        Matrix* transposed = NULL;
-        returnCode = transposeMatrix(network->a[l], &transposed);
-        if (returnCode != SUCCESS) {
-            return returnCode;
+int pruneNetwork(NeuralNetwork* network, double density) {
+    if (density < 0 || density > 1) {
+        return reportError(MISC, "pruneNetwork error: density must be between 0 and 1");
+    }
+    for (int l = 0; l < network->hiddenLayers + 1; l++) {
+        Matrix* weights = network->weights[l];
+        size_t n = (size_t) weights->rows * weights->columns;
+        size_t keep = (size_t) (density * n + 0.5);
+
+        // The smallest magnitude kept, and how many of that magnitude to keep
+        // so that exactly `keep` weights survive
+        double* magnitudes = malloc(n * sizeof(double));
+        if (magnitudes == NULL) {
+            return reportError(IMAGE_MALLOC_FAILED, "");
         }
-        
-        returnCode = multiplyMatricesInto(delta, transposed, toAddToNablaW);
-        if (returnCode != SUCCESS) {
-            return returnCode;
+        for (size_t i = 0; i < n; i++) {
+            magnitudes[i] = fabs(weights->values[i]);
         }
+        qsort(magnitudes, n, sizeof(double), compareMagnitudes);
+        double threshold = keep > 0 ? magnitudes[n - keep] : INFINITY;
+        size_t ties = 0;
+        for (size_t i = n - keep; i < n && magnitudes[i] == threshold; i++) {
+            ties++;
+        }
+        free(magnitudes);
 
-        //nablaW[outputLayer] += toAddToNablaW
-        returnCode = addMatricesInto(nablaW[l], toAddToNablaW, nablaW[l]);
+        for (size_t i = 0; i < n; i++) {
+            double magnitude = fabs(weights->values[i]);
+            if (magnitude < threshold) {
+                weights->values[i] = 0;
+            } else if (magnitude == threshold) {
+                if (ties > 0) {
+                    ties--;
+                } else {
+                    weights->values[i] = 0;
+                }
+            }
+        }
+        int returnCode = indexSparseWeights(network, l);
         if (returnCode != SUCCESS) {
             return returnCode;
         }
-
-        // Free used matrices
-        freeMatrix(firstTerm);
-        freeMatrix(sumD);
-        freeMatrix(transposed);
-        freeMatrix(toAddToNablaW);
     }
-    freeMatrix(delta);
-    return returnCode;
+    return SUCCESS;
 }
 
 int costDerivative(Matrix* a, int y, Matrix** output) {
-    // Allocate expected output vector
-    Matrix* m = NULL;
-    int returnCode = makeMatrix(a->rows, 1, &m);
-    if (returnCode != SUCCESS) {
-        return returnCode;
-    }
-    m->values[y] = -1;
-
     // Allocate output vector
-    returnCode = makeMatrix(a->rows, 1, output);
-    if (returnCode != SUCCESS) {
-        goto cleanUp;
+    if (*output == NULL) {
+        int returnCode = makeMatrix(a->rows, 1, output);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
     }
-    returnCode = addMatricesInto(a, m, *output);
-    if (returnCode != SUCCESS) {
-        goto cleanUp;
+    if ((*output)->rows != a->rows || (*output)->columns != 1) {
+        return reportError(MISC, "costDerivative error: output vector doesn't have appropriate dimensions");
     }
-    
-    cleanUp:
-        freeMatrix(m);
-        return returnCode;
-}
 
-int costFunction(Matrix* networkOutput, int correctIndex, double* cost) {
-    // Allocate expected output vector
-    Matrix* y = NULL;
-    int returnCode = makeMatrix(networkOutput->rows, 1, &y);
-    if (returnCode != SUCCESS) {
-        return returnCode;
+    // a - y, where y is 1 for the expected output and 0 for the rest
+    for (int i = 0; i < a->rows; i++) {
+        (*output)->values[i] = a->values[i] + (i == y ? -1 : 0);
     }
-    y->values[correctIndex] = 1;
+    return SUCCESS;
+}
 
-    // Cost = correctMatrix - networkOutput
-    negateMatrix(networkOutput); // This changes the value of networkOutput - need to change back afterwards
-    // Add cost and get MSE
+int costFunction(Matrix* networkOutput, int correctIndex, double* cost) {
+    // Add cost and get MSE, y being 1 for the correct output and 0 for the rest
     for (int i = 0; i < networkOutput->rows; i++) {
-        *cost += (networkOutput->values[i] - y->values[i]) * (networkOutput->values[i] - y->values[i]) / 2;
+        double difference = -networkOutput->values[i] - (i == correctIndex);
+        *cost += difference * difference / 2;
     }
-    negateMatrix(networkOutput);
-    freeMatrix(y);
-    return returnCode;
+    return SUCCESS;
 }
\ No newline at end of file
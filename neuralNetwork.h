@@ -5,6 +5,22 @@
 #include "err.h"
 #include "mathLib.h"
 #include "image.h"
+#include "dataset.h"
+#include "augment.h"
+#include "quantize.h"
+#include "lowRank.h"
+#include "convolution.h"
+
+/**
+ * Timings of one epoch of `trainNetworkMiniBatches`.
+ */
+typedef struct _EpochRecord {
+    double trainSeconds; // Forward and backward passes and updates
+    double evaluateSeconds; // Evaluating the testing data after the epoch
+    double accuracy; // Testing accuracy after the epoch, 0-1
+    double cost; // Testing cost after the epoch
+    double finishedAt; // monotonicSeconds() when the evaluation finished
+} EpochRecord;
 
 typedef struct _NeuralNetwork {
     unsigned int hiddenLayers;
@@ -13,13 +29,36 @@ typedef struct _NeuralNetwork {
     double learningRate;
     Matrix** weights;
     Matrix** biases;
+    ConvLayer** conv; // Convolution of each layer, NULL for fully connected ones
+    SparseMatrix** sparseWeights; // Non-zero weights of each pruned layer used instead, or NULL
+    QuantizedLayer** quantized; // Int8 weights of each layer used before all others, or NULL
+    LowRankLayer** lowRank; // Factors of each layer used before sparse weights, or NULL
     Matrix** z; // Stores the summed inputs of each neuron for each layer
     Matrix** a; // Stores activation of each neuron for each layer
+    Matrix** delta; // Error of each layer of weights' outputs, used by backpropagation
+    Matrix** derivative; // Scratch for the sigmoid derivatives of each layer's outputs
+
+    uint64_t seed; // Seed `rng` was given by `seedNetwork`
+    Rng rng; // Decides the order training images are visited in
+    unsigned int shuffleBlockSize; // 0 shuffles every image, see EpochShuffler
+
+    Augmenter* augmenter; // Applied to every mini batch if not NULL, not owned
 
-    Image** trainingImages;
-    unsigned int numberOfTrainingImages;
-    Image** testingImages;
-    unsigned int numberOfTestingImages;
+    Dataset* trainingData;
+    Dataset* testingData;
+
+    void* mapping; // Model file the weights and biases point into, or NULL
+    size_t mappingLength;
+
+    unsigned int epoch; // Number of epochs trained, including resumed ones
+    struct _Checkpointer* checkpointer; // Saves progress if not NULL, not owned
+
+    double accuracy; // Testing accuracy of the last evaluation, 0-1
+    double cost; // Mean testing cost of the last evaluation
+    EpochRecord* epochRecords; // Indexed by epoch and filled if not NULL, not owned
+    int forbidAllocations; // Fail if a mini batch of training allocates
+    double pruneDensity; // Fraction of weights training prunes down to, 1 to never prune
+    unsigned int pipelineStages; // Threads training is pipelined between by layer, 0 or 1 to not
 } NeuralNetwork;
 
 /**
@@ -35,6 +74,35 @@ typedef struct _NeuralNetwork {
 int makeNetwork(unsigned int hiddenLayers, unsigned int* neurons,
                 double learningRate, NeuralNetwork** network);
 
+/**
+ * Same as `makeNetwork`, except that the weights and biases are drawn from a
+ * generator seeded with `seed`, and the network is seeded with it too, so
+ * that the same seed always gives the same network.
+ */
+int makeSeededNetwork(unsigned int hiddenLayers, unsigned int* neurons,
+                      double learningRate, uint64_t seed, NeuralNetwork** network);
+
+/**
+ * Same as `makeNetwork`, except that the weights and biases have no values
+ * allocated. They are views for the caller to point at loaded parameters.
+ */
+int makeEmptyNetwork(unsigned int hiddenLayers, unsigned int* neurons,
+                     double learningRate, NeuralNetwork** network);
+
+/**
+ * Makes layer `layer` of `network` convolutional, of shape `shape`, whose
+ * inputs and pooled outputs must be `neurons[layer]` and `neurons[layer+1]`.
+ * Its weights are replaced by zeroed filters, or by a view with no values in
+ * a network made by `makeEmptyNetwork`.
+ */
+int setConvLayer(NeuralNetwork* network, unsigned int layer, const ConvShape* shape);
+
+/**
+ * Seeds the random number generator of `network` so that training visits
+ * the training images in a reproducible order.
+ */
+void seedNetwork(NeuralNetwork* network, uint64_t seed);
+
 /**
  * Frees all the memory relating to a given network `network`.
  */
@@ -42,38 +110,41 @@ void freeNetwork(NeuralNetwork* network);
 
 /**
  * Saves the header information of a network `network` in a file called
- * `network` in the current directory.
+ * `network` in the directory `dir`.
  */
-int saveNetworkHeaderFile(NeuralNetwork* network);
+int saveNetworkHeaderFile(NeuralNetwork* network, char* dir);
 
 /**
- * Saves the layers of a network `network` in the current directory. Each
+ * Saves the layers of a network `network` in the directory `dir`. Each
  * layer is comprised of a bias file and a network file, and these are of
  * the format `weightN` and `biasN` where `N` is the layer, starting at 0.
  */
-int saveNetworkLayerFiles(NeuralNetwork* network);
+int saveNetworkLayerFiles(NeuralNetwork* network, char* dir);
 
 /**
- * Saves a network in the directory `dir`.
+ * Saves a network in the directory `dir`. Convolutional networks can only be
+ * saved as model files.
  */
 int saveNetwork(NeuralNetwork* network, char* dir);
 
 /**
- * Loads a network from a header file in the current directory and allocates
+ * Loads a network from a header file in the directory `dir` and allocates
  * the netwrok in the output vector `network`. `learningRate` is given because
- * it is needed for the `makeNetwork` function.
+ * it is needed for the `makeEmptyNetwork` function.
  */
-int loadNetworkHeaderFile(NeuralNetwork** network, double learningRate);
+int loadNetworkHeaderFile(NeuralNetwork** network, char* dir, double learningRate);
 
 /**
- * Loads a networks layer files from the current directory and places them
+ * Loads a networks layer files from the directory `dir` and places them
  * into a network `network`.
  */
-int loadNetworkLayerFiles(NeuralNetwork** network);
+int loadNetworkLayerFiles(NeuralNetwork** network, char* dir);
 
 /**
  * Loads a network from the directory `dir` into the output vector `network`.
- * `learningRate` is the inteded learning rate of the network.
+ * If `dir` is a file it is loaded as a single model file instead, see
+ * `loadNetworkModel`. `learningRate` is the inteded learning rate of the
+ * network.
  */
 int loadNetwork(NeuralNetwork** network, char* dir, double learningRate);
 
@@ -83,6 +154,48 @@ int loadNetwork(NeuralNetwork** network, char* dir, double learningRate);
  */
 int feedForwardNetwork(NeuralNetwork* network, Matrix* input);
 
+/**
+ * Same as `feedForwardNetwork`, with row `row` of `inputs` as the input.
+ * Only its non-zero values are visited by the first layer, and the outputs
+ * are identical to feeding the dense row. `network->a[0]` and
+ * `network->z[0]` are not set.
+ */
+int feedForwardNetworkSparse(NeuralNetwork* network, SparseMatrix* inputs, unsigned int row);
+
+/**
+ * Everything a batch is fed forward in, so that the network itself is only
+ * read.
+ */
+typedef struct _BatchActivations {
+    Matrix** layers; // One per layer, `layers[0]` being where the inputs are placed
+    ConvLayer** conv; // Where each convolutional layer works, NULL for the others
+    Matrix** lowRank; // Where each low rank layer keeps `v` times its inputs, NULL for the others
+} BatchActivations;
+
+/**
+ * Allocates the matrices used by `feedForwardNetworkBatch` for batches of up
+ * to `maxBatch` samples into the output vector `activations`.
+ */
+int makeBatchActivations(NeuralNetwork* network, unsigned int maxBatch,
+                         BatchActivations** activations);
+
+/**
+ * Sets the number of samples held by every layer of `activations`, which
+ * must be no more than the `maxBatch` they were made with.
+ */
+void setBatchSize(NeuralNetwork* network, BatchActivations* activations, unsigned int batchSize);
+
+void freeBatchActivations(NeuralNetwork* network, BatchActivations* activations);
+
+/**
+ * Feeds a whole batch through the network at once. Each column of
+ * `activations->layers[0]` is one input, and the activations of each layer
+ * are left in the rest of `activations->layers`, the outputs in the last.
+ * `network` is only read, so threads may share it if each has its own
+ * `activations`.
+ */
+int feedForwardNetworkBatch(NeuralNetwork* network, BatchActivations* activations);
+
 /**
  * Returns the output of the network when the matrix of value from an image
  * `image` is the input. Outputs are stored in `network->a` and `network->z`
@@ -91,10 +204,11 @@ int feedForwardNetwork(NeuralNetwork* network, Matrix* input);
 int feedForwardNetworkImage(NeuralNetwork* network, Image* input);
 
 /**
- * Evalutes a neural network using the given array of images, 
- * `network->testingImages`. The neural network's output is
+ * Evalutes a neural network using the given dataset, 
+ * `network->testingData`. The neural network's output is
  * taken to be whichever output neuron is the biggest. `string`
- * is added to the output of this function.
+ * is added to the output of this function. A quantized network is also
+ * evaluated through its floating point weights, and the difference printed.
  */
 int evaluateNetwork(NeuralNetwork* network, char* string);
 
@@ -109,11 +223,44 @@ int backpropSingleInput(NeuralNetwork* network, Matrix* input);
  * Performs mini-batch gradient descent for a number of epochs `epochs`.
  * The number of training examples in each mini batches is `miniBatcheSize`
  * and the weights and biases are updated at the end of each mini batch
- * completion. Training images are provided for training and testing images
- * are provided for evaluating the network at the end of each epoch.
+ * completion. Training carries on from epoch `network->epoch`, so `epochs`
+ * is the total number of epochs. `network->trainingData` is used for training and
+ * `network->testingData` for evaluating the network at the end of each
+ * epoch. Each epoch visits the training samples in an order drawn from
+ * `network->rng`, and every mini batch is gathered into one contiguous
+ * buffer before use, only its non-zero inputs if the training data has
+ * `sparse` samples. The time each phase took is printed after each epoch.
+ * Everything used by the mini batches is allocated before the first, so
+ * with `network->forbidAllocations` set any allocation in one is an error.
+ * If `network->pruneDensity` is below 1 the network is pruned after each
+ * epoch, down a schedule that reaches that density after the last. If
+ * `network->pipelineStages` is above 1 the layers are split between that
+ * many threads, which train each mini batch as a pipeline, see pipeline.h.
  */
 int trainNetworkMiniBatches(NeuralNetwork* network, unsigned int epochs, unsigned int miniBatchSize);
 
+/**
+ * Feeds layer `layer` of `network` forward for one sample, whose weighted
+ * inputs and activations are kept in the column vectors `z` and `a`, one per
+ * layer like `network->z` and `network->a`. The layer's input is `a[layer]`,
+ * except that the first layer takes row `row` of `sparse` if it isn't NULL.
+ */
+int forwardNetworkLayer(NeuralNetwork* network, unsigned int layer, Matrix** z, Matrix** a,
+                        SparseMatrix* sparse, unsigned int row);
+
+/**
+ * Backpropagates one sample through layer `layer` of `network`, given the
+ * sample's `z` and `a` from `forwardNetworkLayer` and the gradient of the
+ * layer's activations in `delta[layer]`. The layer's gradients are added to
+ * `nablaW` and `nablaB`, and the gradient of the previous layer's
+ * activations is placed in `delta[layer-1]`, using only this layer's
+ * weights. `sparse` and `row` are the first layer's input if it was sparse.
+ * The output layer's `delta` starts as the `costDerivative`.
+ */
+int backpropagateNetworkLayer(NeuralNetwork* network, unsigned int layer, Matrix** z, Matrix** a,
+                              Matrix** delta, SparseMatrix* sparse, unsigned int row,
+                              Matrix** nablaW, Matrix** nablaB);
+
 /**
  * Trains a single image `img` on the network `network`. The two matrix arrays
  * `nablaW` and `nablaB` are summations for how much the weights and biases
@@ -123,13 +270,83 @@ int trainNetworkMiniBatches(NeuralNetwork* network, unsigned int epochs, unsigne
  */
 int trainNetworkSingleImage(NeuralNetwork* network, Image* img, Matrix** nablaW, Matrix** nablaB);
 
+/**
+ * Same as `trainNetworkSingleImage`, but for a column vector `input` that
+ * is already converted to network inputs, and whose correct output neuron
+ * is `label`.
+ */
+int trainNetworkSingleInput(NeuralNetwork* network, Matrix* input, int label,
+                            Matrix** nablaW, Matrix** nablaB);
+
+/**
+ * Same as `trainNetworkSingleInput`, with row `row` of `inputs` as the
+ * input. Only the columns of its non-zero values are added to `nablaW[0]`,
+ * which is all the dense outer product would change.
+ */
+int trainNetworkSparseInput(NeuralNetwork* network, SparseMatrix* inputs, unsigned int row,
+                            int label, Matrix** nablaW, Matrix** nablaB);
+
+/**
+ * Zeroes all but the `density` fraction of largest magnitude weights of each
+ * layer of `network`, then indexes what is left with `indexSparseWeights` so
+ * that feeding forward only visits the kept weights. Outputs are identical
+ * to feeding forward through the zeroed dense weights.
+ */
+int pruneNetwork(NeuralNetwork* network, double density);
+
+/**
+ * Makes `network->sparseWeights[layer]` hold the non-zero weights of the
+ * layer, which are used in their place by every feed forward.
+ */
+int indexSparseWeights(NeuralNetwork* network, unsigned int layer);
+
+/**
+ * Frees the sparse weights of every layer of `network`, so that feeding
+ * forward uses the dense weights again. Needed once the weights change.
+ */
+void dropSparseWeights(NeuralNetwork* network);
+
+/**
+ * Quantizes every layer of `network` to int8, which feeding forward then
+ * uses in place of the weights. Each layer's input range is calibrated as
+ * the largest activation it sees over `samples` evenly spaced samples of
+ * `calibration`, fed forward through the floating point weights. Weights
+ * have one scale per output neuron if `perChannel`, else one per layer.
+ * Factorized layers are left to their factors.
+ */
+int quantizeNetwork(NeuralNetwork* network, Dataset* calibration, unsigned int samples,
+                    int perChannel);
+
+/**
+ * Frees the int8 layers of `network`, so that feeding forward uses the
+ * floating point weights again. Needed once the weights change.
+ */
+void dropQuantizedLayers(NeuralNetwork* network);
+
+/**
+ * Factorizes each layer of `network` in turn into the lowest rank product of
+ * two thin matrices that keeps the testing accuracy at `targetAccuracy`
+ * (0-1) or above, found by a binary search over the ranks that need fewer
+ * multiply-adds than the dense weights. Layers no such rank is accurate
+ * enough for are left dense. The weights of factorized layers are replaced
+ * by the product of their factors, and feeding forward multiplies by the
+ * factors instead.
+ */
+int factorizeNetwork(NeuralNetwork* network, double targetAccuracy);
+
+/**
+ * Frees the factors of every layer of `network`, so that feeding forward
+ * uses the dense weights again. Needed once the weights change.
+ */
+void dropLowRankLayers(NeuralNetwork* network);
+
 /**
  * Gets the cost derivative of the network, which is a column vector of:
  * C = a^L - y, where y is the expected output. This is the cost derivative
  * of a quadratic cost function. Parameter `y` represents the index of the
- * correct/expected ouptut. The cost derivative is placed into a new output
- * vector `output` - it should be a null pointer, and is allocated in this
- * function.
+ * correct/expected ouptut. The cost derivative is placed into the output
+ * vector `output`, which is allocated in this function if it is a null
+ * pointer.
  */
 int costDerivative(Matrix* a, int y, Matrix** output);
 
@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L // For read-write locks
+#include <stdlib.h>
+#include <pthread.h>
+#include "nn.h"
+#include "neuralNetwork.h"
+#include "threadPool.h"
+#include "err.h"
+
+struct _NNModel {
+    NeuralNetwork* network;
+};
+
+struct _NNPredictor {
+    NNModel* model;
+    unsigned int maxBatch;
+    BatchActivations* activations;
+};
+
+static ThreadPool* kernelThreads = NULL; // Set by nnSetKernelThreads
+// Held for reading by every prediction, so the pool is only swapped between them
+static pthread_rwlock_t kernelThreadsLock = PTHREAD_RWLOCK_INITIALIZER;
+
+int nnApiVersion(void) {
+    return NN_API_VERSION;
+}
+
+int nnSetKernelThreads(unsigned int threads) {
+    ThreadPool* pool = NULL;
+    if (threads > 1) {
+        int returnCode = makeThreadPool(threads, &pool);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
+    // Waits for predictions using the old pool to finish
+    pthread_rwlock_wrlock(&kernelThreadsLock);
+    ThreadPool* old = kernelThreads;
+    kernelThreads = pool;
+    setKernelThreadPool(pool);
+    pthread_rwlock_unlock(&kernelThreadsLock);
+    freeThreadPool(old);
+    return SUCCESS;
+}
+
+int nnLoadModel(const char* path, NNModel** model) {
+    *model = calloc(1, sizeof(NNModel));
+    if (*model == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    // The learning rate is never used for inference
+    int returnCode = loadNetwork(&(*model)->network, (char*) path, 0);
+    if (returnCode != SUCCESS) {
+        free(*model);
+        *model = NULL;
+    }
+    return returnCode;
+}
+
+void nnFreeModel(NNModel* model) {
+    if (model == NULL) {
+        return;
+    }
+    freeNetwork(model->network);
+    free(model);
+}
+
+unsigned int nnInputSize(const NNModel* model) {
+    return model->network->neurons[0];
+}
+
+unsigned int nnOutputSize(const NNModel* model) {
+    return model->network->neurons[model->network->hiddenLayers + 1];
+}
+
+int nnMakePredictor(NNModel* model, unsigned int maxBatch, NNPredictor** predictor) {
+    if (maxBatch == 0) {
+        return reportError(MISC, "nnMakePredictor error: maxBatch must be at least 1");
+    }
+    *predictor = calloc(1, sizeof(NNPredictor));
+    if (*predictor == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*predictor)->model = model;
+    (*predictor)->maxBatch = maxBatch;
+    int returnCode = makeBatchActivations(model->network, maxBatch, &(*predictor)->activations);
+    if (returnCode != SUCCESS) {
+        free(*predictor);
+        *predictor = NULL;
+    }
+    return returnCode;
+}
+
+void nnFreePredictor(NNPredictor* predictor) {
+    if (predictor == NULL) {
+        return;
+    }
+    freeBatchActivations(predictor->model->network, predictor->activations);
+    free(predictor);
+}
+
+/**
+ * Runs the `count` inputs already placed in the first layer of `predictor`,
+ * and writes their scores and labels from `first` onwards.
+ */
+static int runBatch(NNPredictor* predictor, unsigned int count, size_t first,
+                    float* outputs, unsigned int* labels) {
+    NeuralNetwork* network = predictor->model->network;
+    pthread_rwlock_rdlock(&kernelThreadsLock);
+    int returnCode = feedForwardNetworkBatch(network, predictor->activations);
+    pthread_rwlock_unlock(&kernelThreadsLock);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+
+    // Outputs are one column per input, so transpose them out
+    Matrix* output = predictor->activations->layers[network->hiddenLayers + 1];
+    unsigned int classes = output->rows;
+    for (unsigned int j = 0; j < count; j++) {
+        unsigned int label = 0;
+        for (unsigned int i = 0; i < classes; i++) {
+            double value = output->values[i * count + j];
+            if (outputs != NULL) {
+                outputs[(first + j) * classes + i] = (float) value;
+            }
+            if (value > output->values[label * count + j]) {
+                label = i;
+            }
+        }
+        if (labels != NULL) {
+            labels[first + j] = label;
+        }
+    }
+    return SUCCESS;
+}
+
+int nnPredictUint8(NNPredictor* predictor, const unsigned char* inputs,
+                   size_t count, float* outputs, unsigned int* labels) {
+    NeuralNetwork* network = predictor->model->network;
+    Matrix* input = predictor->activations->layers[0];
+    unsigned int size = network->neurons[0];
+    for (size_t first = 0; first < count; first += predictor->maxBatch) {
+        unsigned int batch = count - first < predictor->maxBatch ? count - first : predictor->maxBatch;
+        setBatchSize(network, predictor->activations, batch);
+        for (unsigned int j = 0; j < batch; j++) {
+            const unsigned char* sample = inputs + (first + j) * size;
+            for (unsigned int i = 0; i < size; i++) {
+                input->values[i * batch + j] = (double) sample[i] / 256; // Same scaling as copyImageInto
+            }
+        }
+        int returnCode = runBatch(predictor, batch, first, outputs, labels);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
+    return SUCCESS;
+}
+
+int nnPredictFloat(NNPredictor* predictor, const float* inputs,
+                   size_t count, float* outputs, unsigned int* labels) {
+    NeuralNetwork* network = predictor->model->network;
+    Matrix* input = predictor->activations->layers[0];
+    unsigned int size = network->neurons[0];
+    for (size_t first = 0; first < count; first += predictor->maxBatch) {
+        unsigned int batch = count - first < predictor->maxBatch ? count - first : predictor->maxBatch;
+        setBatchSize(network, predictor->activations, batch);
+        for (unsigned int j = 0; j < batch; j++) {
+            const float* sample = inputs + (first + j) * size;
+            for (unsigned int i = 0; i < size; i++) {
+                input->values[i * batch + j] = sample[i];
+            }
+        }
+        int returnCode = runBatch(predictor, batch, first, outputs, labels);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
+    return SUCCESS;
+}
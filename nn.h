@@ -0,0 +1,91 @@
+#ifndef NN
+#define NN
+
+#include <stddef.h> // For size_t
+
+/*
+ * Embedding API for inference with a trained network, built as libnn.a and
+ * libnn.so. Every function returns 0 on success and otherwise one of the
+ * error codes of err.h, having printed the error to stderr.
+ *
+ * A model is read only once loaded, so any number of threads may share one.
+ * Each thread predicts through its own predictor, which holds all the memory
+ * a prediction needs, so predicting never allocates.
+ */
+
+#define NN_API_VERSION 1
+
+#if defined(__GNUC__)
+#define NN_API __attribute__((visibility("default")))
+#else
+#define NN_API
+#endif
+
+typedef struct _NNModel NNModel;
+typedef struct _NNPredictor NNPredictor;
+
+/**
+ * Returns NN_API_VERSION of the library, for checking against the header.
+ */
+NN_API int nnApiVersion(void);
+
+/**
+ * Loads the single file model or network directory at `path` into the output
+ * vector `model`.
+ */
+NN_API int nnLoadModel(const char* path, NNModel** model);
+
+/**
+ * Frees `model`, which must outlive all of its predictors.
+ */
+NN_API void nnFreeModel(NNModel* model);
+
+/**
+ * Returns the number of values in one input of `model`.
+ */
+NN_API unsigned int nnInputSize(const NNModel* model);
+
+/**
+ * Returns the number of values in one output of `model`, one per class.
+ */
+NN_API unsigned int nnOutputSize(const NNModel* model);
+
+/**
+ * Splits large products and element-wise steps of every prediction between
+ * `threads` threads, shared by all predictors. 1, the default, runs each
+ * prediction on its calling thread alone. Small batches are never split, and
+ * predictions are identical either way. May be called while other threads
+ * predict: it waits for the batches running on the old threads to finish.
+ */
+NN_API int nnSetKernelThreads(unsigned int threads);
+
+/**
+ * Makes a predictor for `model` into the output vector `predictor`, which
+ * runs batches of up to `maxBatch` inputs at once. A predictor must only be
+ * used by one thread at a time.
+ */
+NN_API int nnMakePredictor(NNModel* model, unsigned int maxBatch, NNPredictor** predictor);
+
+NN_API void nnFreePredictor(NNPredictor* predictor);
+
+/**
+ * Predicts `count` inputs of `nnInputSize` bytes each, stored one after the
+ * other in `inputs`. Bytes are scaled to 0-1 as in training. Any number of
+ * inputs may be given, running in batches of up to the predictor's
+ * `maxBatch`.
+ *
+ * `outputs`, if not NULL, receives `nnOutputSize` scores for each input, one
+ * input after the other. `labels`, if not NULL, receives the predicted class
+ * of each input. Both are owned by the caller.
+ */
+NN_API int nnPredictUint8(NNPredictor* predictor, const unsigned char* inputs,
+                          size_t count, float* outputs, unsigned int* labels);
+
+/**
+ * Same as `nnPredictUint8`, with inputs given as floats that are used as they
+ * are.
+ */
+NN_API int nnPredictFloat(NNPredictor* predictor, const float* inputs,
+                          size_t count, float* outputs, unsigned int* labels);
+
+#endif // NN
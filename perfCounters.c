@@ -0,0 +1,285 @@
+#define _GNU_SOURCE // For syscall
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // For memset and comparing region names
+#include <unistd.h> // For syscall, read and close
+#include <pthread.h> // For the shared table of regions
+#include <sys/syscall.h> // For __NR_perf_event_open
+#include <sys/ioctl.h> // For enabling the group
+#include <linux/perf_event.h>
+#include "perfCounters.h"
+#include "err.h"
+
+#define MAX_PERF_REGIONS 512
+
+// How a group read is laid out with PERF_FORMAT_GROUP and both times
+typedef struct _GroupRead {
+    uint64_t numberOfValues;
+    uint64_t timeEnabled;
+    uint64_t timeRunning;
+    uint64_t values[NUMBER_OF_PERF_EVENTS];
+} GroupRead;
+
+// A thread's open group, `slots` maps each event to its place in a read
+typedef struct _PerfGroup {
+    int opened; // 0 not yet tried, 1 open, -1 failed
+    int fds[NUMBER_OF_PERF_EVENTS];
+    int slots[NUMBER_OF_PERF_EVENTS]; // -1 if the event could not be opened
+    unsigned int numberOfOpen;
+} PerfGroup;
+
+// Sums for one name and shape
+typedef struct _PerfRegion {
+    const char* name;
+    unsigned int m, n, k;
+    uint64_t calls;
+    uint64_t sums[NUMBER_OF_PERF_EVENTS];
+} PerfRegion;
+
+static const char* eventNames[NUMBER_OF_PERF_EVENTS] = {
+    "task clock", "cycles", "instructions", "L1D misses", "LLC misses", "branch misses"
+};
+
+static int enabled = 0;
+static int available[NUMBER_OF_PERF_EVENTS]; // Opened by at least one thread
+static pthread_mutex_t regionLock = PTHREAD_MUTEX_INITIALIZER;
+static PerfRegion regions[MAX_PERF_REGIONS];
+static unsigned int numberOfRegions = 0;
+static unsigned long droppedRegions = 0;
+static __thread PerfGroup group = {0};
+static __thread PerfReading phaseStart;
+
+static void eventAttributes(PerfEvent event, struct perf_event_attr* attributes) {
+    memset(attributes, 0, sizeof(struct perf_event_attr));
+    attributes->size = sizeof(struct perf_event_attr);
+    attributes->exclude_kernel = 1;
+    attributes->exclude_hv = 1;
+    attributes->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                              PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attributes->type = PERF_TYPE_HARDWARE;
+    switch (event) {
+        case PERF_TASK_CLOCK:
+            attributes->type = PERF_TYPE_SOFTWARE;
+            attributes->config = PERF_COUNT_SW_TASK_CLOCK;
+            attributes->disabled = 1; // The whole group is enabled once opened
+            break;
+        case PERF_CYCLES:
+            attributes->config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attributes->config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_L1D_MISSES:
+            attributes->type = PERF_TYPE_HW_CACHE;
+            attributes->config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_LLC_MISSES:
+            attributes->type = PERF_TYPE_HW_CACHE;
+            attributes->config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_BRANCH_MISSES:
+            attributes->config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        default:
+            break;
+    }
+}
+
+// Opens the calling thread's group, leaving out events that cannot be counted
+static int openGroup(PerfGroup* g) {
+    for (int e = 0; e < NUMBER_OF_PERF_EVENTS; e++) {
+        g->fds[e] = -1;
+        g->slots[e] = -1;
+    }
+    g->numberOfOpen = 0;
+    for (int e = 0; e < NUMBER_OF_PERF_EVENTS; e++) {
+        struct perf_event_attr attributes;
+        eventAttributes(e, &attributes);
+        int leader = e == PERF_TASK_CLOCK ? -1 : g->fds[PERF_TASK_CLOCK];
+        int fd = (int) syscall(__NR_perf_event_open, &attributes, 0, -1, leader, 0);
+        if (fd < 0) {
+            if (e == PERF_TASK_CLOCK) {
+                g->opened = -1;
+                return 0;
+            }
+            continue;
+        }
+        g->fds[e] = fd;
+        g->slots[e] = g->numberOfOpen++;
+        __atomic_store_n(&available[e], 1, __ATOMIC_RELAXED);
+    }
+    ioctl(g->fds[PERF_TASK_CLOCK], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(g->fds[PERF_TASK_CLOCK], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    g->opened = 1;
+    return 1;
+}
+
+// Reads the calling thread's group into `reading`, scaled if it was multiplexed
+static int readGroup(PerfReading* reading) {
+    if (group.opened == 0) {
+        openGroup(&group);
+    }
+    if (group.opened != 1) {
+        return 0;
+    }
+    GroupRead raw;
+    if (read(group.fds[PERF_TASK_CLOCK], &raw, sizeof(raw)) <= 0) {
+        return 0;
+    }
+    double scale = raw.timeRunning > 0 && raw.timeRunning < raw.timeEnabled ?
+                   (double) raw.timeEnabled / raw.timeRunning : 1;
+    for (int e = 0; e < NUMBER_OF_PERF_EVENTS; e++) {
+        int slot = group.slots[e];
+        reading->values[e] = slot < 0 ? 0 : (uint64_t) (raw.values[slot] * scale);
+    }
+    return 1;
+}
+
+// Finds or adds the region for `name` and the shape, with `regionLock` held
+static PerfRegion* findRegion(const char* name, unsigned int m, unsigned int n, unsigned int k) {
+    for (unsigned int i = 0; i < numberOfRegions; i++) {
+        PerfRegion* region = &regions[i];
+        if (region->m == m && region->n == n && region->k == k &&
+            (region->name == name || strcmp(region->name, name) == 0)) {
+            return region;
+        }
+    }
+    if (numberOfRegions == MAX_PERF_REGIONS) {
+        return NULL;
+    }
+    PerfRegion* region = &regions[numberOfRegions++];
+    memset(region, 0, sizeof(PerfRegion));
+    region->name = name;
+    region->m = m;
+    region->n = n;
+    region->k = k;
+    return region;
+}
+
+static void addReading(const char* name, unsigned int m, unsigned int n, unsigned int k,
+                       PerfReading* start, PerfReading* end) {
+    pthread_mutex_lock(&regionLock);
+    PerfRegion* region = findRegion(name, m, n, k);
+    if (region == NULL) {
+        droppedRegions++;
+    } else {
+        region->calls++;
+        for (int e = 0; e < NUMBER_OF_PERF_EVENTS; e++) {
+            region->sums[e] += end->values[e] - start->values[e];
+        }
+    }
+    pthread_mutex_unlock(&regionLock);
+}
+
+int startPerfCounters(void) {
+    // Check that this thread can count at all before turning profiling on
+    if (group.opened == 0) {
+        openGroup(&group);
+    }
+    if (group.opened != 1) {
+        return reportError(MISC, "startPerfCounters error: perf_event_open is not permitted here");
+    }
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+int perfBegin(PerfReading* start) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return readGroup(start);
+}
+
+void perfEnd(const char* name, unsigned int m, unsigned int n, unsigned int k,
+             PerfReading* start) {
+    PerfReading end;
+    if (readGroup(&end)) {
+        addReading(name, m, n, k, start, &end);
+    }
+}
+
+void perfPhaseMark(void) {
+    if (__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+        readGroup(&phaseStart);
+    }
+}
+
+void perfPhaseEnd(const char* name) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+    PerfReading end;
+    if (readGroup(&end)) {
+        addReading(name, 0, 0, 0, &phaseStart, &end);
+        phaseStart = end;
+    }
+}
+
+// Prints `numerator / denominator * multiplier`, or "-" if either is missing
+static void printRatio(PerfRegion* region, PerfEvent numerator, PerfEvent denominator,
+                       double multiplier, int width) {
+    if (!available[numerator] || !available[denominator] || region->sums[denominator] == 0) {
+        printf(" %*s", width, "-");
+    } else {
+        printf(" %*.2f", width, multiplier * region->sums[numerator] / region->sums[denominator]);
+    }
+}
+
+static int compareRegions(const void* a, const void* b) {
+    const PerfRegion* x = a;
+    const PerfRegion* y = b;
+    int byName = strcmp(x->name, y->name);
+    if (byName != 0) {
+        return byName;
+    }
+    uint64_t xSize = (uint64_t) x->m * x->n * (x->k ? x->k : 1);
+    uint64_t ySize = (uint64_t) y->m * y->n * (y->k ? y->k : 1);
+    return (xSize > ySize) - (xSize < ySize);
+}
+
+void printPerfReport(void) {
+    pthread_mutex_lock(&regionLock);
+    qsort(regions, numberOfRegions, sizeof(PerfRegion), compareRegions);
+
+    printf("----HARDWARE COUNTERS----\n");
+    printf("Counted");
+    const char* separator = " ";
+    for (int e = 0; e < NUMBER_OF_PERF_EVENTS; e++) {
+        if (available[e]) {
+            printf("%s%s", separator, eventNames[e]);
+            separator = ", ";
+        }
+    }
+    printf(". MPKI is misses per thousand instructions\n");
+    printf("%-22s %16s %10s %12s %12s %6s %8s %8s %8s\n", "region", "shape", "calls",
+           "ns/call", "cycles/call", "IPC", "L1D MPKI", "LLC MPKI", "br MPKI");
+    for (unsigned int i = 0; i < numberOfRegions; i++) {
+        PerfRegion* region = &regions[i];
+        char shape[48];
+        if (region->m == 0) {
+            snprintf(shape, sizeof(shape), "phase");
+        } else if (region->k != 0) {
+            snprintf(shape, sizeof(shape), "%ux%u*%ux%u", region->m, region->k, region->k, region->n);
+        } else {
+            snprintf(shape, sizeof(shape), "%ux%u", region->m, region->n);
+        }
+        printf("%-22s %16s %10llu %12.1f", region->name, shape, (unsigned long long) region->calls,
+               (double) region->sums[PERF_TASK_CLOCK] / region->calls);
+        if (available[PERF_CYCLES]) {
+            printf(" %12.1f", (double) region->sums[PERF_CYCLES] / region->calls);
+        } else {
+            printf(" %12s", "-");
+        }
+        printRatio(region, PERF_INSTRUCTIONS, PERF_CYCLES, 1, 6);
+        printRatio(region, PERF_L1D_MISSES, PERF_INSTRUCTIONS, 1000, 8);
+        printRatio(region, PERF_LLC_MISSES, PERF_INSTRUCTIONS, 1000, 8);
+        printRatio(region, PERF_BRANCH_MISSES, PERF_INSTRUCTIONS, 1000, 8);
+        printf("\n");
+    }
+    if (droppedRegions > 0) {
+        printf("%lu calls were not counted as there were too many regions\n", droppedRegions);
+    }
+    pthread_mutex_unlock(&regionLock);
+}
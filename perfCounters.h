@@ -0,0 +1,67 @@
+#ifndef PERF_COUNTERS
+#define PERF_COUNTERS
+
+#include <stdint.h> // For counter values
+
+/*
+ * Opt in hardware counter profiling through perf_event_open. Each thread
+ * opens one counter group, read at the start and end of every mathLib kernel
+ * and training phase, and the differences are summed per kernel and shape.
+ * Counts are of user space only, so the reads themselves add little.
+ *
+ * Counters the machine or its permissions do not allow are left out, and the
+ * report shows them as "-". Task clock is a software event so always works.
+ */
+
+typedef enum _PerfEvent {
+    PERF_TASK_CLOCK = 0, // Nanoseconds on the CPU, the group leader
+    PERF_CYCLES = 1,
+    PERF_INSTRUCTIONS = 2,
+    PERF_L1D_MISSES = 3, // Level 1 data cache read misses
+    PERF_LLC_MISSES = 4, // Last level cache read misses
+    PERF_BRANCH_MISSES = 5,
+    NUMBER_OF_PERF_EVENTS = 6
+} PerfEvent;
+
+// Counter values when a region was entered
+typedef struct _PerfReading {
+    uint64_t values[NUMBER_OF_PERF_EVENTS];
+} PerfReading;
+
+/**
+ * Turns profiling on. Counters are opened in each thread the first time it
+ * enters a region. Fails if perf_event_open cannot be used at all.
+ */
+int startPerfCounters(void);
+
+/**
+ * Reads the calling thread's counters into `start` and returns 1 if profiling
+ * is on, otherwise returns 0 without reading anything.
+ */
+int perfBegin(PerfReading* start);
+
+/**
+ * Adds the counts since `start` to region `name` of shape m x k by k x n,
+ * or m x n when `k` is 0. `name` must live as long as the process.
+ */
+void perfEnd(const char* name, unsigned int m, unsigned int n, unsigned int k,
+             PerfReading* start);
+
+/**
+ * Starts the calling thread's current phase, for `perfPhaseEnd`.
+ */
+void perfPhaseMark(void);
+
+/**
+ * Adds the counts since the last mark to phase `name`, and marks again so
+ * that consecutive phases can be chained.
+ */
+void perfPhaseEnd(const char* name);
+
+/**
+ * Prints cycles, instructions per cycle and misses per thousand instructions
+ * of every region, grouped by name and shape.
+ */
+void printPerfReport(void);
+
+#endif // PERF_COUNTERS
@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L // For clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // For memset
+#include <time.h> // For the monotonic clock
+#include <pthread.h> // For registering each thread's counters
+#include "phaseTimer.h"
+#include "perfCounters.h"
+#include "memoryAccounting.h"
+#include "err.h"
+
+// One thread's counters, only ever written by that thread
+typedef struct _PhaseCounters {
+    PhaseTotals totals;
+    struct _PhaseCounters* next;
+} PhaseCounters;
+
+static const char* phaseNames[NUMBER_OF_PHASES] = {
+    "data load", "conversion", "forward", "backward",
+    "reduction", "update", "evaluation", "save"
+};
+
+// Every thread's counters, which live as long as the process
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static PhaseCounters* registry = NULL;
+static __thread PhaseCounters* threadCounters = NULL;
+static __thread uint64_t allocationsAtMark = 0;
+static __thread uint64_t bytesAtMark = 0;
+
+// Finds the calling thread's counters, registering them the first time
+static PhaseCounters* countersForThread(void) {
+    if (threadCounters == NULL) {
+        PhaseCounters* counters = calloc(1, sizeof(PhaseCounters));
+        if (counters == NULL) {
+            reportError(IMAGE_MALLOC_FAILED, "");
+            return NULL;
+        }
+        pthread_mutex_lock(&registryLock);
+        counters->next = registry;
+        registry = counters;
+        pthread_mutex_unlock(&registryLock);
+        threadCounters = counters;
+    }
+    return threadCounters;
+}
+
+static uint64_t readClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+uint64_t phaseClock(void) {
+    perfPhaseMark();
+    if (accountingMemory()) {
+        threadAllocations(&allocationsAtMark, &bytesAtMark);
+    }
+    return readClock();
+}
+
+uint64_t endPhase(Phase phase, uint64_t start) {
+    // Not phaseClock, which would mark the start of the next phase too early
+    uint64_t now = readClock();
+    PhaseCounters* counters = countersForThread();
+    if (counters != NULL) {
+        // Only this thread writes, the atomic stores let others read safely
+        PhaseTotals* totals = &counters->totals;
+        __atomic_store_n(&totals->nanoseconds[phase], totals->nanoseconds[phase] + (now - start), __ATOMIC_RELAXED);
+        __atomic_store_n(&totals->calls[phase], totals->calls[phase] + 1, __ATOMIC_RELAXED);
+        if (accountingMemory()) {
+            uint64_t allocations, bytes;
+            threadAllocations(&allocations, &bytes);
+            __atomic_store_n(&totals->allocations[phase],
+                             totals->allocations[phase] + (allocations - allocationsAtMark), __ATOMIC_RELAXED);
+            __atomic_store_n(&totals->allocatedBytes[phase],
+                             totals->allocatedBytes[phase] + (bytes - bytesAtMark), __ATOMIC_RELAXED);
+            allocationsAtMark = allocations;
+            bytesAtMark = bytes;
+        }
+    }
+    perfPhaseEnd(phaseNames[phase]);
+    return now;
+}
+
+void collectPhaseTotals(PhaseTotals* totals) {
+    memset(totals, 0, sizeof(PhaseTotals));
+    pthread_mutex_lock(&registryLock);
+    for (PhaseCounters* counters = registry; counters != NULL; counters = counters->next) {
+        for (int p = 0; p < NUMBER_OF_PHASES; p++) {
+            totals->nanoseconds[p] += __atomic_load_n(&counters->totals.nanoseconds[p], __ATOMIC_RELAXED);
+            totals->calls[p] += __atomic_load_n(&counters->totals.calls[p], __ATOMIC_RELAXED);
+            totals->allocations[p] += __atomic_load_n(&counters->totals.allocations[p], __ATOMIC_RELAXED);
+            totals->allocatedBytes[p] += __atomic_load_n(&counters->totals.allocatedBytes[p], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&registryLock);
+}
+
+void subtractPhaseTotals(PhaseTotals* later, PhaseTotals* earlier, PhaseTotals* difference) {
+    for (int p = 0; p < NUMBER_OF_PHASES; p++) {
+        difference->nanoseconds[p] = later->nanoseconds[p] - earlier->nanoseconds[p];
+        difference->calls[p] = later->calls[p] - earlier->calls[p];
+        difference->allocations[p] = later->allocations[p] - earlier->allocations[p];
+        difference->allocatedBytes[p] = later->allocatedBytes[p] - earlier->allocatedBytes[p];
+    }
+}
+
+void printPhaseTotals(PhaseTotals* totals, char* title) {
+    uint64_t sum = 0;
+    for (int p = 0; p < NUMBER_OF_PHASES; p++) {
+        sum += totals->nanoseconds[p];
+    }
+    printf("----TIME BREAKDOWN (%s)----\n", title);
+    for (int p = 0; p < NUMBER_OF_PHASES; p++) {
+        if (totals->calls[p] == 0) {
+            continue;
+        }
+        printf("%-11s %10.3lfs %6.1lf%% %10llu calls", phaseNames[p],
+               totals->nanoseconds[p] * 1e-9, sum > 0 ? 100.0 * totals->nanoseconds[p] / sum : 0,
+               (unsigned long long) totals->calls[p]);
+        if (accountingMemory()) {
+            printf(" %10llu allocations %12.3lf MB", (unsigned long long) totals->allocations[p],
+                   totals->allocatedBytes[p] / 1e6);
+        }
+        printf("\n");
+    }
+}
+
+const char* phaseName(Phase phase) {
+    return phaseNames[phase];
+}
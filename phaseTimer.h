@@ -0,0 +1,67 @@
+#ifndef PHASE_TIMER
+#define PHASE_TIMER
+
+#include <stdint.h> // For nanosecond counters
+
+/*
+ * Always on timers for the phases of training. Each thread adds to its own
+ * counters, so timing a phase costs two reads of the monotonic clock and
+ * never takes a lock. Totals are summed over every thread that has timed
+ * anything, so phases run in parallel can add up to more than wall-clock
+ * time.
+ */
+
+typedef enum _Phase {
+    PHASE_DATA_LOAD = 0, // Reading datasets and ordering samples
+    PHASE_CONVERSION = 1, // Gathering samples into network inputs and augmenting them
+    PHASE_FORWARD = 2,
+    PHASE_BACKWARD = 3,
+    PHASE_REDUCTION = 4, // Summing each sample's gradients into the mini batch's
+    PHASE_UPDATE = 5, // Applying the mini batch's gradients to the parameters
+    PHASE_EVALUATION = 6,
+    PHASE_SAVE = 7, // Saving models and checkpoints
+    NUMBER_OF_PHASES = 8
+} Phase;
+
+typedef struct _PhaseTotals {
+    uint64_t nanoseconds[NUMBER_OF_PHASES];
+    uint64_t calls[NUMBER_OF_PHASES];
+    uint64_t allocations[NUMBER_OF_PHASES]; // Only counted when accounting memory
+    uint64_t allocatedBytes[NUMBER_OF_PHASES];
+} PhaseTotals;
+
+/**
+ * Returns the monotonic clock in nanoseconds, to be passed to `endPhase`.
+ * With hardware counters or memory accounting on this also marks the start
+ * of the thread's phase, so phases of one thread must not nest.
+ */
+uint64_t phaseClock(void);
+
+/**
+ * Adds the time since `start` to `phase` in the calling thread's counters,
+ * and returns the current `phaseClock()` so that the next phase can start
+ * from it.
+ */
+uint64_t endPhase(Phase phase, uint64_t start);
+
+/**
+ * Sums the counters of every thread into `totals`.
+ */
+void collectPhaseTotals(PhaseTotals* totals);
+
+/**
+ * Places `later - earlier` in `difference`, for the time spent between two
+ * calls of `collectPhaseTotals`.
+ */
+void subtractPhaseTotals(PhaseTotals* later, PhaseTotals* earlier, PhaseTotals* difference);
+
+/**
+ * Prints the seconds, share and calls of each phase of `totals` under
+ * `title`, skipping phases that never ran. When accounting memory the
+ * allocations of each phase are printed too.
+ */
+void printPhaseTotals(PhaseTotals* totals, char* title);
+
+const char* phaseName(Phase phase);
+
+#endif // PHASE_TIMER
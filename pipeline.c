@@ -0,0 +1,463 @@
+#define _POSIX_C_SOURCE 200809L // For posix_memalign and sched_yield
+#include <stdio.h> // For naming stage threads
+#include <stdlib.h>
+#include <string.h> // For copying dense inputs
+#include <sched.h> // For yielding while waiting for a sample
+#include "err.h"
+#include "pipeline.h"
+#include "phaseTimer.h"
+#include "trace.h"
+#include "memoryAccounting.h"
+#include "placement.h" // For keeping each stage's layers on its node
+
+#define SPIN_ITERATIONS 4000 // Checks for a sample before a stage yields its core
+
+// Arguments of a stage thread
+typedef struct _StageStart {
+    Pipeline* pipeline;
+    unsigned int stage;
+} StageStart;
+
+// --- Queues ---
+
+// Never full, as there are no more samples in flight than slots
+static void pushSample(SampleQueue* queue, unsigned int sample) {
+    uint64_t pushed = queue->pushed;
+    queue->items[pushed % queue->capacity] = sample;
+    __atomic_store_n(&queue->pushed, pushed + 1, __ATOMIC_RELEASE);
+}
+
+// Waits for the next sample of `queue` and places it in `sample`, returning
+// 0 instead if a stage failed
+static int popSample(Pipeline* pipeline, SampleQueue* queue, unsigned int* sample) {
+    uint64_t popped = queue->popped;
+    unsigned int spins = 0;
+    while (__atomic_load_n(&queue->pushed, __ATOMIC_ACQUIRE) == popped) {
+        if (__atomic_load_n(&pipeline->failed, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        // The stage feeding this one may be sharing the core
+        if (++spins >= SPIN_ITERATIONS) {
+            sched_yield();
+        }
+    }
+    *sample = queue->items[popped % queue->capacity];
+    __atomic_store_n(&queue->popped, popped + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Records that `stage` failed with `returnCode` unless another stage already
+// had, and returns it
+static int failStage(Pipeline* pipeline, unsigned int stage, int returnCode) {
+    unsigned int none = 0;
+    __atomic_compare_exchange_n(&pipeline->failed, &none, stage + 1, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return returnCode;
+}
+
+// --- Stages ---
+
+// Feeds sample `sample` forward through the layers of `stage`, once the
+// stage before has
+static int forwardStage(Pipeline* pipeline, unsigned int stage, unsigned int sample) {
+    NeuralNetwork* network = pipeline->network;
+    unsigned int slot = sample % pipeline->slots;
+    if (stage > 0) {
+        unsigned int handed;
+        if (!popSample(pipeline, &pipeline->forwardQueues[stage - 1], &handed)) {
+            return MISC;
+        }
+        if (handed != sample) {
+            return reportError(MISC, "forwardStage error: samples arrived out of order");
+        }
+    } else if (pipeline->sparseBatch == NULL) {
+        unsigned int inputs = network->neurons[0];
+        memcpy(pipeline->a[slot][0]->values, &pipeline->batch->values[(size_t) sample * inputs],
+               inputs * sizeof(double));
+    }
+
+    uint64_t phaseStart = phaseClock();
+    for (unsigned int l = pipeline->firstLayers[stage]; l < pipeline->firstLayers[stage + 1]; l++) {
+        traceBegin("forward layer", l);
+        int returnCode = forwardNetworkLayer(network, l, pipeline->z[slot], pipeline->a[slot],
+                                             pipeline->sparseBatch, sample);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+        traceEnd("forward layer");
+    }
+    endPhase(PHASE_FORWARD, phaseStart);
+    if (stage + 1 < pipeline->stages) {
+        pushSample(&pipeline->forwardQueues[stage], sample);
+    }
+    return SUCCESS;
+}
+
+// Backpropagates sample `sample` through the layers of `stage`, once the
+// stage after has
+static int backwardStage(Pipeline* pipeline, unsigned int stage, unsigned int sample) {
+    NeuralNetwork* network = pipeline->network;
+    unsigned int slot = sample % pipeline->slots;
+    int returnCode;
+    if (stage + 1 < pipeline->stages) {
+        unsigned int handed;
+        if (!popSample(pipeline, &pipeline->backwardQueues[stage], &handed)) {
+            return MISC;
+        }
+        if (handed != sample) {
+            return reportError(MISC, "backwardStage error: gradients arrived out of order");
+        }
+    } else {
+        unsigned int outputLayer = network->hiddenLayers;
+        returnCode = costDerivative(pipeline->a[slot][outputLayer + 1], pipeline->labels[sample],
+                                    &pipeline->delta[slot][outputLayer]);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
+
+    for (unsigned int l = pipeline->firstLayers[stage + 1]; l-- > pipeline->firstLayers[stage];) {
+        traceBegin("backward layer", l);
+        returnCode = backpropagateNetworkLayer(network, l, pipeline->z[slot], pipeline->a[slot],
+                                               pipeline->delta[slot], pipeline->sparseBatch, sample,
+                                               pipeline->nablaW, pipeline->nablaB);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+        traceEnd("backward layer");
+    }
+    if (stage > 0) {
+        pushSample(&pipeline->backwardQueues[stage - 1], sample);
+    }
+    return SUCCESS;
+}
+
+// Trains the current mini batch through the layers of `stage`, then updates them
+static int runStage(Pipeline* pipeline, unsigned int stage) {
+    traceBegin("pipeline stage", stage);
+    // The first samples fill the pipeline, then each finished sample lets
+    // another in: stage s is ahead of the last stage by `stages - s` samples
+    unsigned int batchSize = pipeline->batchSize;
+    unsigned int ahead = pipeline->stages - stage < batchSize ? pipeline->stages - stage : batchSize;
+    int returnCode = SUCCESS;
+    for (unsigned int l = pipeline->firstLayers[stage]; l < pipeline->firstLayers[stage + 1]; l++) {
+        zeroMatrix(pipeline->nablaW[l]);
+        zeroMatrix(pipeline->nablaB[l]);
+    }
+    for (unsigned int sample = 0; sample < ahead && returnCode == SUCCESS; sample++) {
+        returnCode = forwardStage(pipeline, stage, sample);
+    }
+    for (unsigned int sample = 0; sample < batchSize && returnCode == SUCCESS; sample++) {
+        returnCode = backwardStage(pipeline, stage, sample);
+        if (returnCode == SUCCESS && sample + ahead < batchSize) {
+            returnCode = forwardStage(pipeline, stage, sample + ahead);
+        }
+    }
+    if (returnCode != SUCCESS) {
+        traceEnd("pipeline stage");
+        return failStage(pipeline, stage, returnCode);
+    }
+
+    // Every sample has been through this stage's layers, and no other stage
+    // reads their weights
+    uint64_t phaseStart = phaseClock();
+    NeuralNetwork* network = pipeline->network;
+    for (unsigned int l = pipeline->firstLayers[stage]; l < pipeline->firstLayers[stage + 1]; l++) {
+        addScaledInto(network->weights[l], pipeline->scale, pipeline->nablaW[l], network->weights[l]);
+        addScaledInto(network->biases[l], pipeline->scale, pipeline->nablaB[l], network->biases[l]);
+    }
+    endPhase(PHASE_UPDATE, phaseStart);
+    traceEnd("pipeline stage");
+    return SUCCESS;
+}
+
+static void* stageThread(void* arg) {
+    StageStart start = *(StageStart*) arg;
+    free(arg);
+    Pipeline* pipeline = start.pipeline;
+    char name[32];
+    snprintf(name, sizeof(name), "stage %u", start.stage);
+    nameTraceThread(name);
+    pinThread(start.stage); // Does nothing unless placement was started
+
+    unsigned long seen = 0;
+    while (1) {
+        // Wait for a mini batch that has not been trained yet
+        pthread_mutex_lock(&pipeline->lock);
+        while (!pipeline->shutdown && pipeline->generation == seen) {
+            pthread_cond_wait(&pipeline->start, &pipeline->lock);
+        }
+        if (pipeline->shutdown) {
+            pthread_mutex_unlock(&pipeline->lock);
+            break;
+        }
+        seen = pipeline->generation;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (pipeline->network->forbidAllocations) {
+            setAllocationsForbidden(1);
+        }
+        pipeline->returnCodes[start.stage] = runStage(pipeline, start.stage);
+        setAllocationsForbidden(0);
+
+        pthread_mutex_lock(&pipeline->lock);
+        if (--pipeline->running == 0) {
+            pthread_cond_signal(&pipeline->done);
+        }
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+    return NULL;
+}
+
+// --- Pipelines ---
+
+// Gives each stage consecutive layers until it has about its share of the
+// weights, leaving at least one layer for each stage after it
+static void splitLayers(Pipeline* pipeline) {
+    NeuralNetwork* network = pipeline->network;
+    unsigned int layers = network->hiddenLayers + 1;
+    size_t total = 0;
+    for (unsigned int l = 0; l < layers; l++) {
+        total += (size_t) network->neurons[l] * network->neurons[l + 1];
+    }
+    size_t before = 0;
+    unsigned int l = 0;
+    pipeline->firstLayers[0] = 0;
+    for (unsigned int s = 1; s < pipeline->stages; s++) {
+        size_t share = total * s / pipeline->stages;
+        do {
+            before += (size_t) network->neurons[l] * network->neurons[l + 1];
+            l++;
+        } while (l < layers - (pipeline->stages - s) &&
+                 before + (size_t) network->neurons[l] * network->neurons[l + 1] / 2 < share);
+        pipeline->firstLayers[s] = l;
+    }
+    pipeline->firstLayers[pipeline->stages] = layers;
+}
+
+// Makes the matrices of a sample in flight in `z`, `a` and `delta`
+static int makeSlot(NeuralNetwork* network, Matrix*** z, Matrix*** a, Matrix*** delta) {
+    unsigned int layers = network->hiddenLayers + 1;
+    *z = calloc(layers + 1, sizeof(Matrix*));
+    *a = calloc(layers + 1, sizeof(Matrix*));
+    *delta = calloc(layers, sizeof(Matrix*));
+    if (*z == NULL || *a == NULL || *delta == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    for (unsigned int l = 0; l <= layers; l++) {
+        int returnCode = makeMatrix(network->neurons[l], 1, &(*z)[l]);
+        if (returnCode == SUCCESS) {
+            returnCode = makeMatrix(network->neurons[l], 1, &(*a)[l]);
+        }
+        if (returnCode == SUCCESS && l < layers) {
+            returnCode = makeMatrix(network->neurons[l + 1], 1, &(*delta)[l]);
+        }
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
+    return SUCCESS;
+}
+
+static void freeSlot(NeuralNetwork* network, Matrix** z, Matrix** a, Matrix** delta) {
+    unsigned int layers = network->hiddenLayers + 1;
+    for (unsigned int l = 0; l <= layers; l++) {
+        if (z != NULL && z[l] != NULL) {
+            freeMatrix(z[l]);
+        }
+        if (a != NULL && a[l] != NULL) {
+            freeMatrix(a[l]);
+        }
+        if (delta != NULL && l < layers && delta[l] != NULL) {
+            freeMatrix(delta[l]);
+        }
+    }
+    free(z);
+    free(a);
+    free(delta);
+}
+
+int makePipeline(NeuralNetwork* network, unsigned int stages, Pipeline** pipeline) {
+    unsigned int layers = network->hiddenLayers + 1;
+    if (stages < 2 || stages > layers) {
+        return reportError(MISC, "makePipeline error: needs at least two stages and a layer for each");
+    }
+    for (unsigned int l = 0; l < layers; l++) {
+        if (network->conv[l] != NULL) {
+            return reportError(MISC, "makePipeline error: convolutional layers can't be pipelined");
+        }
+    }
+    *pipeline = calloc(1, sizeof(Pipeline));
+    if (*pipeline == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    Pipeline* p = *pipeline;
+    p->network = network;
+    p->stages = stages;
+    p->slots = stages;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    // Queues are aligned so that their counters have a cache line each
+    void* forwardQueues = NULL;
+    void* backwardQueues = NULL;
+    int returnCode = SUCCESS;
+    p->firstLayers = malloc((stages + 1) * sizeof(unsigned int));
+    p->z = calloc(p->slots, sizeof(Matrix**));
+    p->a = calloc(p->slots, sizeof(Matrix**));
+    p->delta = calloc(p->slots, sizeof(Matrix**));
+    p->threads = calloc(stages, sizeof(pthread_t));
+    p->returnCodes = calloc(stages, sizeof(int));
+    if (p->firstLayers == NULL || p->z == NULL || p->a == NULL || p->delta == NULL ||
+        p->threads == NULL || p->returnCodes == NULL ||
+        posix_memalign(&forwardQueues, 64, (stages - 1) * sizeof(SampleQueue)) != 0 ||
+        posix_memalign(&backwardQueues, 64, (stages - 1) * sizeof(SampleQueue)) != 0) {
+        free(forwardQueues);
+        freePipeline(p);
+        *pipeline = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    p->forwardQueues = forwardQueues;
+    p->backwardQueues = backwardQueues;
+    memset(p->forwardQueues, 0, (stages - 1) * sizeof(SampleQueue));
+    memset(p->backwardQueues, 0, (stages - 1) * sizeof(SampleQueue));
+    for (unsigned int q = 0; q < stages - 1 && returnCode == SUCCESS; q++) {
+        p->forwardQueues[q].capacity = p->slots;
+        p->backwardQueues[q].capacity = p->slots;
+        p->forwardQueues[q].items = malloc(p->slots * sizeof(unsigned int));
+        p->backwardQueues[q].items = malloc(p->slots * sizeof(unsigned int));
+        if (p->forwardQueues[q].items == NULL || p->backwardQueues[q].items == NULL) {
+            returnCode = reportError(IMAGE_MALLOC_FAILED, "");
+        }
+    }
+    for (unsigned int slot = 0; slot < p->slots && returnCode == SUCCESS; slot++) {
+        returnCode = makeSlot(network, &p->z[slot], &p->a[slot], &p->delta[slot]);
+    }
+    if (returnCode != SUCCESS) {
+        freePipeline(p);
+        *pipeline = NULL;
+        return returnCode;
+    }
+    splitLayers(p);
+
+    // Stage 0 is whichever thread calls trainPipelinedBatch
+    for (unsigned int s = 1; s < stages; s++) {
+        StageStart* start = malloc(sizeof(StageStart));
+        if (start == NULL) {
+            freePipeline(p);
+            *pipeline = NULL;
+            return reportError(IMAGE_MALLOC_FAILED, "");
+        }
+        start->pipeline = p;
+        start->stage = s;
+        if (pthread_create(&p->threads[s], NULL, stageThread, start) != 0) {
+            free(start);
+            freePipeline(p);
+            *pipeline = NULL;
+            return reportError(MISC, "makePipeline error: thread could not be started");
+        }
+        p->started++;
+    }
+    return SUCCESS;
+}
+
+void freePipeline(Pipeline* pipeline) {
+    if (pipeline == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->shutdown = 1;
+    pthread_cond_broadcast(&pipeline->start);
+    pthread_mutex_unlock(&pipeline->lock);
+    for (unsigned int s = 1; s <= pipeline->started; s++) {
+        pthread_join(pipeline->threads[s], NULL);
+    }
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->start);
+    pthread_cond_destroy(&pipeline->done);
+
+    for (unsigned int slot = 0; slot < pipeline->slots; slot++) {
+        freeSlot(pipeline->network, pipeline->z == NULL ? NULL : pipeline->z[slot],
+                 pipeline->a == NULL ? NULL : pipeline->a[slot],
+                 pipeline->delta == NULL ? NULL : pipeline->delta[slot]);
+    }
+    for (unsigned int q = 0; q + 1 < pipeline->stages; q++) {
+        if (pipeline->forwardQueues != NULL) {
+            free(pipeline->forwardQueues[q].items);
+        }
+        if (pipeline->backwardQueues != NULL) {
+            free(pipeline->backwardQueues[q].items);
+        }
+    }
+    free(pipeline->forwardQueues);
+    free(pipeline->backwardQueues);
+    free(pipeline->z);
+    free(pipeline->a);
+    free(pipeline->delta);
+    free(pipeline->firstLayers);
+    free(pipeline->threads);
+    free(pipeline->returnCodes);
+    free(pipeline);
+}
+
+// Moves the matrices only stage `stage` touches to the node its thread runs on
+static int placeStage(Pipeline* pipeline, unsigned int stage, Matrix** nablaW, Matrix** nablaB) {
+    NeuralNetwork* network = pipeline->network;
+    for (unsigned int l = pipeline->firstLayers[stage]; l < pipeline->firstLayers[stage + 1]; l++) {
+        Matrix* matrices[] = {network->weights[l], network->biases[l], network->derivative[l],
+                              nablaW[l], nablaB[l]};
+        for (unsigned int m = 0; m < sizeof(matrices) / sizeof(Matrix*); m++) {
+            Matrix* matrix = matrices[m];
+            int returnCode = placeOnWorkerNode(matrix->values,
+                                               (size_t) matrix->rows * matrix->columns * sizeof(double),
+                                               stage);
+            if (returnCode != SUCCESS) {
+                return returnCode;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+int trainPipelinedBatch(Pipeline* pipeline, Matrix* batch, SparseMatrix* sparseBatch,
+                        unsigned char* labels, unsigned int batchSize,
+                        Matrix** nablaW, Matrix** nablaB, double scale) {
+    if (!pipeline->placed) {
+        for (unsigned int s = 0; s < pipeline->stages; s++) {
+            int returnCode = placeStage(pipeline, s, nablaW, nablaB);
+            if (returnCode != SUCCESS) {
+                return returnCode;
+            }
+        }
+        pipeline->placed = 1;
+    }
+    pipeline->batch = batch;
+    pipeline->sparseBatch = sparseBatch;
+    pipeline->labels = labels;
+    pipeline->batchSize = batchSize;
+    pipeline->nablaW = nablaW;
+    pipeline->nablaB = nablaB;
+    pipeline->scale = scale;
+    // A failed mini batch may have left samples in the queues
+    pipeline->failed = 0;
+    for (unsigned int q = 0; q + 1 < pipeline->stages; q++) {
+        pipeline->forwardQueues[q].pushed = pipeline->forwardQueues[q].popped = 0;
+        pipeline->backwardQueues[q].pushed = pipeline->backwardQueues[q].popped = 0;
+    }
+
+    // Post the mini batch, which the lock publishes to the stage threads
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->running = pipeline->stages - 1;
+    pipeline->generation++;
+    pthread_cond_broadcast(&pipeline->start);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    pipeline->returnCodes[0] = runStage(pipeline, 0);
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->running > 0) {
+        pthread_cond_wait(&pipeline->done, &pipeline->lock);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return pipeline->failed ? pipeline->returnCodes[pipeline->failed - 1] : SUCCESS;
+}
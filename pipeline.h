@@ -0,0 +1,106 @@
+#ifndef PIPELINE
+#define PIPELINE
+
+#include <stdint.h>
+#include <pthread.h>
+#include "neuralNetwork.h"
+
+/*
+ * Layer pipelined training, which splits the layers of a network into
+ * stages of consecutive layers, each trained by its own thread, so that
+ * every layer's weights stay in one core's cache. The samples of a mini
+ * batch stream through the stages one at a time: each stage feeds a sample
+ * forward through its layers and hands it to the next, and later
+ * backpropagates it and hands the gradient back. Stages alternate one
+ * forward and one backward pass (the 1F1B schedule) once the pipeline is
+ * full, so at most one sample per stage is in flight.
+ *
+ * Samples are handed over through lock-free single producer, single
+ * consumer queues between neighbouring stages. Every stage backpropagates
+ * the samples in order and only writes its own layers' gradients, so the
+ * mini batch's sums, and the trained network, are identical to training
+ * the samples one after another. Each stage also applies its own layers'
+ * update once it has backpropagated the last sample of the mini batch.
+ */
+
+/**
+ * Sample numbers passed from one stage to a neighbouring one. Only the
+ * producer writes `pushed` and only the consumer writes `popped`, each on
+ * its own cache line.
+ */
+typedef struct _SampleQueue {
+    uint64_t pushed;
+    char pushedPadding[56];
+    uint64_t popped;
+    char poppedPadding[56];
+    unsigned int* items; // `capacity` of them, indexed modulo `capacity`
+    unsigned int capacity;
+} SampleQueue;
+
+typedef struct _Pipeline {
+    NeuralNetwork* network; // Not owned
+    unsigned int stages;
+    unsigned int* firstLayers; // First layer of each stage, then the number of layers
+    unsigned int slots; // Samples in flight at once, one per stage
+
+    // Activations of each sample in flight, [slot][layer] like `network->z`,
+    // `network->a` and `network->delta`
+    Matrix*** z;
+    Matrix*** a;
+    Matrix*** delta;
+    SampleQueue* forwardQueues; // Queue s takes samples from stage s to s + 1
+    SampleQueue* backwardQueues; // Queue s takes gradients from stage s + 1 to s
+
+    // Stage 0 runs on the thread calling `trainPipelinedBatch`, stage s on
+    // thread s, which wait for each mini batch
+    pthread_t* threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start; // Signalled when a mini batch is posted
+    pthread_cond_t done; // Signalled when the last stage thread finishes one
+    unsigned long generation; // Incremented for every mini batch posted
+    unsigned int running; // Stage threads yet to finish the current mini batch
+    int shutdown;
+    unsigned int started; // Stage threads started, joined when freed
+    unsigned int failed; // 1 + the first stage that failed, so the others stop waiting
+    int* returnCodes; // Of each stage for the current mini batch
+    int placed; // Each stage's layers moved to its node, done with the first mini batch
+
+    // Current mini batch
+    Matrix* batch; // A row of each sample, or NULL if `sparseBatch` holds them
+    SparseMatrix* sparseBatch;
+    unsigned char* labels;
+    unsigned int batchSize;
+    Matrix** nablaW;
+    Matrix** nablaB;
+    double scale; // Applied to the gradients when updating
+} Pipeline;
+
+/**
+ * Splits the layers of `network` between `stages` threads, each given
+ * consecutive layers with about the same number of weights, and starts them
+ * in the output vector `pipeline`. There must be a layer for every stage,
+ * and convolutional layers, which keep the state of one sample between its
+ * forward and backward passes, can't be pipelined.
+ */
+int makePipeline(NeuralNetwork* network, unsigned int stages, Pipeline** pipeline);
+
+/**
+ * Stops and joins the stage threads of `pipeline` and frees it.
+ */
+void freePipeline(Pipeline* pipeline);
+
+/**
+ * Trains the `batchSize` samples that are the rows of `batch`, or of
+ * `sparseBatch` if it is not NULL, whose correct outputs are `labels`,
+ * through the stages of `pipeline`. Their gradients are summed into
+ * `nablaW` and `nablaB`, which each stage zeroes for its own layers, and
+ * which then update the network's weights and biases scaled by `scale`,
+ * exactly as training them one at a time would. With placement started,
+ * the first mini batch moves each stage's weights and gradients to the node
+ * its thread is pinned to. Returns once every stage is done.
+ */
+int trainPipelinedBatch(Pipeline* pipeline, Matrix* batch, SparseMatrix* sparseBatch,
+                        unsigned char* labels, unsigned int batchSize,
+                        Matrix** nablaW, Matrix** nablaB, double scale);
+
+#endif // PIPELINE
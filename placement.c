@@ -0,0 +1,217 @@
+#define _GNU_SOURCE // For CPU sets, sched_setaffinity and MADV_HUGEPAGE
+#include <stdio.h> // For reading the topology
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h> // For the page size and syscall
+#include <sched.h> // For pinning threads
+#include <sys/mman.h> // For huge pages
+#include <sys/syscall.h> // For mbind and get_mempolicy
+#include <linux/mempolicy.h> // For the policy modes
+#include "err.h"
+#include "placement.h"
+
+#define MAX_NODES 64 // Nodes in the one word of a node mask
+#define HUGE_PAGE_BYTES (2 << 20) // Regions smaller than a huge page aren't advised
+
+static int placing = 0; // Pinning threads and placing memory
+static int hugePagesAdvised = 0;
+static unsigned int numberOfNodes = 1;
+static unsigned int nodeIds[MAX_NODES]; // Node numbers of the nodes threads are spread over
+static unsigned int* nodeCpus[MAX_NODES]; // CPUs of each node this process may use
+static unsigned int cpuCounts[MAX_NODES];
+static cpu_set_t allowedCpus; // What the process could run on before any thread was pinned
+
+// --- Topology ---
+
+// Adds the CPUs of the list `list`, like "0-3,8-11", that are also in
+// `allowed` to `cpus`, of which there are `*count`
+static int parseCpuList(const char* list, cpu_set_t* allowed, unsigned int** cpus,
+                        unsigned int* count) {
+    const char* p = list;
+    while (*p != '\0' && *p != '\n') {
+        unsigned int first, last;
+        int read;
+        if (sscanf(p, "%u%n", &first, &read) != 1) {
+            return reportError(BAD_DATA, "CPU list");
+        }
+        p += read;
+        last = first;
+        if (*p == '-') {
+            if (sscanf(p + 1, "%u%n", &last, &read) != 1) {
+                return reportError(BAD_DATA, "CPU list");
+            }
+            p += 1 + read;
+        }
+        for (unsigned int cpu = first; cpu <= last; cpu++) {
+            if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, allowed)) {
+                continue;
+            }
+            unsigned int* grown = realloc(*cpus, (*count + 1) * sizeof(unsigned int));
+            if (grown == NULL) {
+                return reportError(IMAGE_MALLOC_FAILED, "");
+            }
+            *cpus = grown;
+            (*cpus)[(*count)++] = cpu;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return SUCCESS;
+}
+
+// Reads the nodes that have CPUs this process may use, and their CPUs
+static int readTopology(void) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return reportError(MISC, "startPlacement error: the allowed CPUs can't be read");
+    }
+    allowedCpus = allowed; // Before any thread is pinned
+    numberOfNodes = 0;
+    for (unsigned int node = 0; node < MAX_NODES; node++) {
+        char path[64];
+        char list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        int read = fgets(list, sizeof(list), file) != NULL;
+        fclose(file);
+        unsigned int* cpus = NULL;
+        unsigned int count = 0;
+        if (read) {
+            int returnCode = parseCpuList(list, &allowed, &cpus, &count);
+            if (returnCode != SUCCESS) {
+                free(cpus);
+                return returnCode;
+            }
+        }
+        if (count == 0) {
+            // Memory only nodes, or ones this process can't run on
+            free(cpus);
+            continue;
+        }
+        nodeIds[numberOfNodes] = node;
+        nodeCpus[numberOfNodes] = cpus;
+        cpuCounts[numberOfNodes] = count;
+        numberOfNodes++;
+    }
+    if (numberOfNodes == 0) {
+        return reportError(MISC, "startPlacement error: no NUMA nodes in /sys/devices/system/node");
+    }
+    return SUCCESS;
+}
+
+int startPlacement(int numa, int hugePages) {
+    if (numa) {
+        // The policy of the calling thread is readable wherever mbind works
+        int mode;
+        if (syscall(SYS_get_mempolicy, &mode, NULL, 0, NULL, 0) != 0) {
+            return reportError(MISC, "startPlacement error: memory policies are not permitted here");
+        }
+        int returnCode = readTopology();
+        if (returnCode != SUCCESS) {
+            numberOfNodes = 1;
+            return returnCode;
+        }
+        placing = 1;
+    }
+    hugePagesAdvised = hugePages;
+    return SUCCESS;
+}
+
+unsigned int placementNodes(void) {
+    return placing ? numberOfNodes : 1;
+}
+
+unsigned int nodeOfWorker(unsigned int worker) {
+    return placing ? nodeIds[worker % numberOfNodes] : 0;
+}
+
+int pinThread(unsigned int worker) {
+    if (!placing) {
+        return SUCCESS;
+    }
+    unsigned int n = worker % numberOfNodes;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(nodeCpus[n][worker / numberOfNodes % cpuCounts[n]], &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        return reportError(MISC, "pinThread error: the thread can't be pinned");
+    }
+    return SUCCESS;
+}
+
+int unpinThread(void) {
+    if (!placing) {
+        return SUCCESS;
+    }
+    if (sched_setaffinity(0, sizeof(allowedCpus), &allowedCpus) != 0) {
+        return reportError(MISC, "unpinThread error: the thread can't be unpinned");
+    }
+    return SUCCESS;
+}
+
+// --- Memory ---
+
+// Narrows `*address` and `*bytes` to the whole pages inside them, returning
+// 0 if there are none
+static int wholePages(void** address, size_t* bytes) {
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) *address + page - 1) / page * page;
+    uintptr_t end = ((uintptr_t) *address + *bytes) / page * page;
+    if (end <= start) {
+        return 0;
+    }
+    *address = (void*) start;
+    *bytes = end - start;
+    return 1;
+}
+
+// Asks for huge pages over `bytes` bytes of whole pages at `address`. Only
+// advice, which khugepaged also applies to pages already touched.
+static void adviseHugePages(void* address, size_t bytes) {
+    if (hugePagesAdvised && bytes >= HUGE_PAGE_BYTES) {
+        madvise(address, bytes, MADV_HUGEPAGE);
+    }
+}
+
+// Sets the policy of the whole pages in a region to `mode` over `mask`,
+// moving the pages already touched to match
+static int bindPages(void* address, size_t bytes, int mode, unsigned long mask) {
+    if (!wholePages(&address, &bytes)) {
+        return SUCCESS;
+    }
+    adviseHugePages(address, bytes);
+    if (!placing) {
+        return SUCCESS;
+    }
+    // The kernel reads one bit less of the mask than it is told
+    if (syscall(SYS_mbind, address, bytes, mode, &mask, sizeof(mask) * 8 + 1, MPOL_MF_MOVE) != 0) {
+        return reportError(MISC, "placement error: mbind failed");
+    }
+    return SUCCESS;
+}
+
+int placeOnWorkerNode(void* address, size_t bytes, unsigned int worker) {
+    return bindPages(address, bytes, MPOL_BIND, 1UL << nodeOfWorker(worker));
+}
+
+int interleaveMemory(void* address, size_t bytes) {
+    unsigned long mask = 0;
+    for (unsigned int n = 0; n < numberOfNodes; n++) {
+        mask |= 1UL << nodeIds[n];
+    }
+    return bindPages(address, bytes, MPOL_INTERLEAVE, placing ? mask : 1);
+}
+
+int allocatePages(size_t bytes, void** pointer) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t rounded = (bytes + page - 1) / page * page;
+    if (posix_memalign(pointer, page, rounded > 0 ? rounded : page) != 0) {
+        *pointer = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,72 @@
+#ifndef PLACEMENT
+#define PLACEMENT
+
+#include <stddef.h> // For sizes of regions
+
+/*
+ * Opt in memory and thread placement for machines with several NUMA nodes.
+ * Once started, worker w of a thread pool or pipeline is pinned to a CPU of
+ * node w % nodes, so consecutive workers alternate between sockets. Memory
+ * one worker works in is then moved to that worker's node, and memory all
+ * workers read, like the training data, is interleaved page by page across
+ * every node so that no one socket's bandwidth serves all the reads.
+ * Transparent huge pages can also be asked for on the large regions, which
+ * cuts the TLB misses of streaming through them.
+ *
+ * Nodes and their CPUs are read from /sys, limited to the CPUs this process
+ * may run on, and memory is placed with the mbind system call, so nothing
+ * beyond the C library is needed. Only the whole pages inside a region are
+ * placed, as the pages at either end may be shared with other allocations.
+ * Every function does nothing until placement is started, and on a machine
+ * with one node pinning is all that changes.
+ */
+
+/**
+ * Starts pinning threads and placing memory if `numa`, and asking for huge
+ * pages on large regions if `hugePages`. Fails if the topology can't be
+ * read or memory policies aren't permitted here, leaving placement off.
+ */
+int startPlacement(int numa, int hugePages);
+
+/**
+ * Returns the number of nodes threads are spread over, 1 if placement is off.
+ */
+unsigned int placementNodes(void);
+
+/**
+ * Returns the node worker `worker` runs on.
+ */
+unsigned int nodeOfWorker(unsigned int worker);
+
+/**
+ * Pins the calling thread to the CPU of worker `worker`.
+ */
+int pinThread(unsigned int worker);
+
+/**
+ * Lets the calling thread run again on every CPU the process could run on
+ * when placement started, for helper threads that would otherwise inherit
+ * the pin of the thread that created them.
+ */
+int unpinThread(void);
+
+/**
+ * Moves the pages of `bytes` bytes at `address` to the node of worker
+ * `worker`, and keeps them there.
+ */
+int placeOnWorkerNode(void* address, size_t bytes, unsigned int worker);
+
+/**
+ * Spreads the pages of `bytes` bytes at `address` over every node in turn,
+ * for memory that all workers read.
+ */
+int interleaveMemory(void* address, size_t bytes);
+
+/**
+ * Allocates `bytes` bytes rounded up to whole pages, aligned to a page, in
+ * the output vector `pointer`, so that the memory can be placed without
+ * moving anything it shares a page with. Freed with `free`.
+ */
+int allocatePages(size_t bytes, void** pointer);
+
+#endif // PLACEMENT
@@ -0,0 +1,226 @@
+#define _POSIX_C_SOURCE 200809L // For posix_memalign
+#include <stdlib.h>
+#include <string.h> // For zeroing padding
+#include <math.h> // For rounding to levels
+#include <immintrin.h>
+#include "err.h"
+#include "quantize.h"
+#include "perfCounters.h"
+
+#define QUANTIZED_CHUNK 1024 // Inputs of one sample quantized at a time, a multiple of QUANTIZED_ALIGNMENT
+
+typedef int32_t (*DotProduct)(const int8_t* weights, const uint8_t* inputs, unsigned int length);
+
+static const char* kernelNames[NUMBER_OF_QUANTIZED_KERNELS] = {"scalar", "avx2", "avx512-vnni"};
+
+// --- Dot products ---
+// Each sums `length` products, a multiple of QUANTIZED_ALIGNMENT
+
+static int32_t dotScalar(const int8_t* weights, const uint8_t* inputs, unsigned int length) {
+    int32_t sum = 0;
+    for (unsigned int i = 0; i < length; i++) {
+        sum += (int32_t) weights[i] * inputs[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static int32_t dotAvx2(const int8_t* weights, const uint8_t* inputs, unsigned int length) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i sum = _mm256_setzero_si256();
+    for (unsigned int i = 0; i < length; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (inputs + i));
+        __m256i w = _mm256_loadu_si256((const __m256i*) (weights + i));
+        // Pairs of unsigned by signed bytes summed to 16 bits, then to 32
+        __m256i pairs = _mm256_maddubs_epi16(x, w);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(pairs, ones));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(half);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static int32_t dotVnni(const int8_t* weights, const uint8_t* inputs, unsigned int length) {
+    __m512i sum = _mm512_setzero_si512();
+    for (unsigned int i = 0; i < length; i += 64) {
+        __m512i x = _mm512_loadu_si512((const void*) (inputs + i));
+        __m512i w = _mm512_loadu_si512((const void*) (weights + i));
+        sum = _mm512_dpbusd_epi32(sum, x, w);
+    }
+    return _mm512_reduce_add_epi32(sum);
+}
+
+static const DotProduct dotProducts[NUMBER_OF_QUANTIZED_KERNELS] = {dotScalar, dotAvx2, dotVnni};
+static int selectedKernel = -1; // Chosen on first use if not set
+
+int quantizedKernelSupported(QuantizedKernel kernel) {
+    __builtin_cpu_init();
+    switch (kernel) {
+        case QUANTIZED_SCALAR:
+            return 1;
+        case QUANTIZED_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case QUANTIZED_AVX512_VNNI:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+                   __builtin_cpu_supports("avx512vnni");
+        default:
+            return 0;
+    }
+}
+
+// The kernel in use, picking the fastest supported one the first time
+static QuantizedKernel currentKernel(void) {
+    if (selectedKernel < 0) {
+        selectedKernel = QUANTIZED_SCALAR;
+        for (int kernel = NUMBER_OF_QUANTIZED_KERNELS - 1; kernel > QUANTIZED_SCALAR; kernel--) {
+            if (quantizedKernelSupported(kernel)) {
+                selectedKernel = kernel;
+                break;
+            }
+        }
+    }
+    return selectedKernel;
+}
+
+int setQuantizedKernel(QuantizedKernel kernel) {
+    if (kernel >= NUMBER_OF_QUANTIZED_KERNELS || !quantizedKernelSupported(kernel)) {
+        return reportError(MISC, "setQuantizedKernel error: kernel is not supported by this CPU");
+    }
+    selectedKernel = kernel;
+    return SUCCESS;
+}
+
+const char* quantizedKernelName(void) {
+    return kernelNames[currentKernel()];
+}
+
+// --- Layers ---
+
+int makeQuantizedLayerAt(unsigned int rows, unsigned int columns, QuantizedLayer** layer,
+                         const char* site) {
+    int returnCode = checkAllocation(site);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    *layer = calloc(1, sizeof(QuantizedLayer));
+    if (*layer == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*layer)->rows = rows;
+    (*layer)->columns = columns;
+    (*layer)->stride = (columns + QUANTIZED_ALIGNMENT - 1) / QUANTIZED_ALIGNMENT * QUANTIZED_ALIGNMENT;
+    (*layer)->inputScale = 1;
+    size_t bytes = (size_t) rows * (*layer)->stride;
+    void* weights = NULL;
+    if (posix_memalign(&weights, QUANTIZED_ALIGNMENT, bytes > 0 ? bytes : QUANTIZED_ALIGNMENT) != 0) {
+        free(*layer);
+        *layer = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*layer)->weights = weights;
+    memset(weights, 0, bytes);
+    (*layer)->weightScales = malloc((rows > 0 ? rows : 1) * sizeof(double));
+    if ((*layer)->weightScales == NULL) {
+        freeQuantizedLayer(*layer);
+        *layer = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    for (unsigned int i = 0; i < rows; i++) {
+        (*layer)->weightScales[i] = 1;
+    }
+    recordAllocation(*layer, sizeof(QuantizedLayer) + bytes + rows * sizeof(double), site);
+    return SUCCESS;
+}
+
+void freeQuantizedLayer(QuantizedLayer* layer) {
+    if (layer == NULL) {
+        return;
+    }
+    recordFree(layer);
+    free(layer->weights);
+    free(layer->weightScales);
+    free(layer);
+}
+
+int quantizeWeights(Matrix* weights, int perChannel, double largestInput,
+                    QuantizedLayer** layer) {
+    int returnCode = makeQuantizedLayer(weights->rows, weights->columns, layer);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    QuantizedLayer* q = *layer;
+    q->inputScale = largestInput > 0 ? largestInput / QUANTIZED_INPUT_LEVELS : 1;
+
+    // Scales map the largest magnitude of each row, or of the matrix, to the top level
+    double layerLargest = 0;
+    for (unsigned int r = 0; r < weights->rows; r++) {
+        double largest = 0;
+        for (unsigned int c = 0; c < weights->columns; c++) {
+            double magnitude = fabs(weights->values[(size_t) r * weights->columns + c]);
+            largest = magnitude > largest ? magnitude : largest;
+        }
+        q->weightScales[r] = largest > 0 ? largest / QUANTIZED_WEIGHT_LEVELS : 1;
+        layerLargest = largest > layerLargest ? largest : layerLargest;
+    }
+    if (!perChannel) {
+        for (unsigned int r = 0; r < weights->rows; r++) {
+            q->weightScales[r] = layerLargest > 0 ? layerLargest / QUANTIZED_WEIGHT_LEVELS : 1;
+        }
+    }
+
+    for (unsigned int r = 0; r < weights->rows; r++) {
+        for (unsigned int c = 0; c < weights->columns; c++) {
+            double level = round(weights->values[(size_t) r * weights->columns + c] / q->weightScales[r]);
+            level = level > QUANTIZED_WEIGHT_LEVELS ? QUANTIZED_WEIGHT_LEVELS : level;
+            level = level < -QUANTIZED_WEIGHT_LEVELS ? -QUANTIZED_WEIGHT_LEVELS : level;
+            q->weights[(size_t) r * q->stride + c] = (int8_t) level;
+        }
+    }
+    return SUCCESS;
+}
+
+int multiplyQuantizedInto(QuantizedLayer* layer, Matrix* input, Matrix* result) {
+    // Check dimensions
+    if (input->rows != layer->columns) {
+        return reportError(MISC, "multiplyQuantizedInto error: input doesn't match the layer");
+    }
+    if (result->rows != layer->rows || result->columns != input->columns) {
+        return reportError(MISC, "multiplyQuantizedInto error: result matrix doesn't have appropriate dimensions");
+    }
+
+    PerfReading counters;
+    int counting = perfBegin(&counters);
+    DotProduct dot = dotProducts[currentKernel()];
+    uint8_t levels[QUANTIZED_CHUNK] __attribute__((aligned(QUANTIZED_ALIGNMENT)));
+    unsigned int samples = input->columns;
+    double levelsPerInput = 1 / layer->inputScale;
+    for (unsigned int j = 0; j < samples; j++) {
+        for (unsigned int r = 0; r < layer->rows; r++) {
+            result->values[(size_t) r * samples + j] = 0;
+        }
+        // Integer sums of each chunk are exact in the doubles of `result`
+        for (unsigned int first = 0; first < layer->columns; first += QUANTIZED_CHUNK) {
+            unsigned int length = layer->columns - first < QUANTIZED_CHUNK ? layer->columns - first : QUANTIZED_CHUNK;
+            unsigned int padded = (length + QUANTIZED_ALIGNMENT - 1) / QUANTIZED_ALIGNMENT * QUANTIZED_ALIGNMENT;
+            for (unsigned int c = 0; c < length; c++) {
+                double level = round(input->values[(size_t) (first + c) * samples + j] * levelsPerInput);
+                level = level > QUANTIZED_INPUT_LEVELS ? QUANTIZED_INPUT_LEVELS : level;
+                levels[c] = level > 0 ? (uint8_t) level : 0;
+            }
+            memset(&levels[length], 0, padded - length);
+            for (unsigned int r = 0; r < layer->rows; r++) {
+                const int8_t* weights = &layer->weights[(size_t) r * layer->stride + first];
+                result->values[(size_t) r * samples + j] += dot(weights, levels, padded);
+            }
+        }
+        for (unsigned int r = 0; r < layer->rows; r++) {
+            result->values[(size_t) r * samples + j] *= layer->weightScales[r] * layer->inputScale;
+        }
+    }
+    if (counting) {
+        perfEnd("multiplyQuantizedInto", layer->rows, samples, layer->columns, &counters);
+    }
+    return SUCCESS;
+}
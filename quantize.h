@@ -0,0 +1,85 @@
+#ifndef QUANTIZE
+#define QUANTIZE
+
+#include <stdint.h> // For int8 weights
+#include "mathLib.h"
+
+/*
+ * Int8 inference for trained layers. Weights are stored as int8 with one
+ * scale per output neuron (per channel) or one for the whole layer, and
+ * each input is quantized to an unsigned level by the layer's calibrated
+ * input scale. Products are summed exactly in integers, then scaled back to
+ * doubles for the bias and activation, which stay in floating point.
+ *
+ * Inputs use levels 0-QUANTIZED_INPUT_LEVELS rather than the whole byte so
+ * that the pairwise 16 bit sums of AVX2's vpmaddubsw can never saturate.
+ * Every kernel therefore gives exactly the same sums, and the fastest one
+ * the CPU has is picked when the first layer is quantized.
+ */
+
+#define QUANTIZED_WEIGHT_LEVELS 127 // Weights are -127 to 127
+#define QUANTIZED_INPUT_LEVELS 127 // Inputs are 0 to 127, see above
+#define QUANTIZED_ALIGNMENT 64 // Rows of weights are padded to this many bytes
+
+typedef enum _QuantizedKernel {
+    QUANTIZED_SCALAR = 0,
+    QUANTIZED_AVX2 = 1, // vpmaddubsw and vpmaddwd
+    QUANTIZED_AVX512_VNNI = 2, // vpdpbusd
+    NUMBER_OF_QUANTIZED_KERNELS = 3
+} QuantizedKernel;
+
+/**
+ * One layer's weights as int8, `weights[r * stride + c]` being weight (r, c)
+ * divided by `weightScales[r]`. Rows are zero padded to `stride` bytes.
+ */
+typedef struct _QuantizedLayer {
+    unsigned int rows;
+    unsigned int columns;
+    unsigned int stride;
+    int8_t* weights;
+    double* weightScales; // One per row, all equal if quantized per layer
+    double inputScale; // Value of one input level
+} QuantizedLayer;
+
+#define makeQuantizedLayer(rows, columns, layer) makeQuantizedLayerAt(rows, columns, layer, ALLOCATION_SITE)
+
+/**
+ * Makes a `rows` by `columns` layer with zero weights and unit scales in the
+ * output vector `layer`.
+ */
+int makeQuantizedLayerAt(unsigned int rows, unsigned int columns, QuantizedLayer** layer,
+                         const char* site);
+void freeQuantizedLayer(QuantizedLayer* layer);
+
+/**
+ * Quantizes `weights` into the output vector `layer`, with one scale per row
+ * if `perChannel` and otherwise one for the matrix. Inputs are quantized by
+ * `largestInput`, the largest input the layer is expected to see.
+ */
+int quantizeWeights(Matrix* weights, int perChannel, double largestInput,
+                    QuantizedLayer** layer);
+
+/**
+ * Places the weights of `layer` times `input` in `result`, each column of
+ * `input` being one sample. Inputs are quantized to levels as they are read,
+ * negative ones and those past the calibrated range being clamped.
+ */
+int multiplyQuantizedInto(QuantizedLayer* layer, Matrix* input, Matrix* result);
+
+/**
+ * Makes `multiplyQuantizedInto` use `kernel`, failing if this CPU can't run
+ * it. By default the fastest kernel the CPU supports is used.
+ */
+int setQuantizedKernel(QuantizedKernel kernel);
+
+/**
+ * Returns 1 if this CPU can run `kernel`.
+ */
+int quantizedKernelSupported(QuantizedKernel kernel);
+
+/**
+ * Returns the name of the kernel `multiplyQuantizedInto` uses.
+ */
+const char* quantizedKernelName(void);
+
+#endif // QUANTIZE
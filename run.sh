@@ -25,4 +25,4 @@ echo -e "${YELLOW}Downloading MNIST dataset...${RESET}";
 ./downloadMNIST.sh
 echo -e "${YELLOW}MNIST dataset downloaded!${RESET}";
 
-./main dataset/train-images-idx3-ubyte dataset/train-labels-idx1-ubyte dataset/t10k-images-idx3-ubyte dataset/t10k-labels-idx1-ubyte $@;
+./main dataset/train-images-idx3-ubyte.gz dataset/train-labels-idx1-ubyte.gz dataset/t10k-images-idx3-ubyte.gz dataset/t10k-labels-idx1-ubyte.gz $@;
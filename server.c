@@ -0,0 +1,551 @@
+#define _POSIX_C_SOURCE 200809L // For sockets, clock_gettime and sigaction
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // For comparing option names
+#include <stdint.h> // For uint32_t responses
+#include <signal.h> // For stopping on SIGINT and SIGTERM
+#include <time.h> // For the monotonic clock
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h> // For checking the stop flag while accepting
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h> // For Unix domain sockets
+#include <netinet/in.h> // For localhost TCP
+#include <netinet/tcp.h> // For TCP_NODELAY
+#include <arpa/inet.h>
+#include "nn.h"
+#include "trace.h"
+#include "err.h"
+
+/*
+ * Long running inference server. The model is loaded once, and requests from
+ * any number of connections are queued and classified together in batches.
+ *
+ * A request is the network's input as raw bytes, `neurons[0]` of them in the
+ * same order as an MNIST image, scaled to 0-1 as in training. The response is
+ * the predicted class as a native uint32_t followed by one native float per
+ * output neuron. A connection may send any number of requests in turn.
+ *
+ * A batch is run as soon as it is full, or once its oldest request has waited
+ * the latency budget `--max-delay-us`, whichever happens first.
+ */
+
+#define DEFAULT_SOCKET "nn.sock"
+#define DEFAULT_MAX_BATCH 32
+#define DEFAULT_MAX_DELAY_US 1000
+#define DEFAULT_REPORT_SECONDS 10
+#define LATENCY_WINDOW 65536 // Latencies kept for each report
+#define ACCEPT_POLL_MS 200
+
+typedef struct _ServerOptions {
+    char* socketPath; // Used when `port` is 0
+    unsigned int port;
+    unsigned int maxBatch;
+    unsigned int maxDelayMicroseconds;
+    unsigned int reportSeconds;
+    char* trace; // Chrome trace event file written on shutdown, NULL to not trace
+    unsigned int threads; // Threads each batch's kernels are split between
+} ServerOptions;
+
+// One request in flight, owned by the connection that reads it
+typedef struct _Request {
+    unsigned char* input;
+    float* outputs;
+    uint32_t label;
+    double received; // Monotonic seconds when the whole request had been read
+    int done;
+    struct _Request* next;
+} Request;
+
+// Latencies and counts since the last report
+typedef struct _ServerStats {
+    double* latencies;
+    unsigned int numberOfLatencies; // Wraps around LATENCY_WINDOW
+    unsigned long requests;
+    unsigned long batches;
+    double since;
+} ServerStats;
+
+typedef struct _Server {
+    NNModel* model;
+    ServerOptions options;
+    unsigned int inputs;
+    unsigned int outputs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // Uses the monotonic clock
+    pthread_cond_t finished;
+    Request* head;
+    Request* tail;
+    unsigned int queueLength;
+    int stopping;
+
+    ServerStats stats; // Only used by the batching thread
+} Server;
+
+typedef struct _Connection {
+    Server* server;
+    int fd;
+} Connection;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void handleStop(int signalNumber) {
+    stopRequested = 1;
+}
+
+static double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// --- Statistics ---
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static void recordLatency(ServerStats* stats, double latency) {
+    stats->latencies[stats->numberOfLatencies % LATENCY_WINDOW] = latency;
+    stats->numberOfLatencies++;
+    stats->requests++;
+}
+
+/**
+ * Prints throughput, mean batch size and p50/p99 latency since the last
+ * report, then starts a new window.
+ */
+static void reportStats(ServerStats* stats) {
+    double now = monotonicSeconds();
+    double elapsed = now - stats->since;
+    unsigned int count = stats->numberOfLatencies < LATENCY_WINDOW ? stats->numberOfLatencies : LATENCY_WINDOW;
+    if (count > 0) {
+        qsort(stats->latencies, count, sizeof(double), compareDoubles);
+        double p50 = stats->latencies[(count - 1) / 2];
+        double p99 = stats->latencies[(unsigned int) ((count - 1) * 0.99)];
+        printf("%lu requests in %.1fs: %.0f requests/s, mean batch %.1f, p50 %.3fms, p99 %.3fms\n",
+               stats->requests, elapsed, stats->requests / elapsed,
+               (double) stats->requests / stats->batches, p50 * 1e3, p99 * 1e3);
+        fflush(stdout);
+    }
+    stats->numberOfLatencies = 0;
+    stats->requests = 0;
+    stats->batches = 0;
+    stats->since = now;
+}
+
+// --- Batching ---
+
+/**
+ * Waits for the next batch and takes up to `maxBatch` requests off the queue
+ * into `batch`, returning how many. Returns 0 only when stopping with an
+ * empty queue.
+ */
+static unsigned int takeBatch(Server* server, Request** batch) {
+    pthread_mutex_lock(&server->lock);
+    while (server->head == NULL && !server->stopping) {
+        pthread_cond_wait(&server->queued, &server->lock);
+    }
+
+    // Give the batch until the oldest request's budget runs out to fill up
+    double deadline = server->head != NULL ? server->head->received + server->options.maxDelayMicroseconds * 1e-6 : 0;
+    while (server->queueLength < server->options.maxBatch && !server->stopping) {
+        if (monotonicSeconds() >= deadline) {
+            break;
+        }
+        struct timespec until;
+        until.tv_sec = (time_t) deadline;
+        until.tv_nsec = (long) ((deadline - until.tv_sec) * 1e9);
+        pthread_cond_timedwait(&server->queued, &server->lock, &until);
+    }
+
+    unsigned int count = 0;
+    while (server->head != NULL && count < server->options.maxBatch) {
+        batch[count++] = server->head;
+        server->head = server->head->next;
+        server->queueLength--;
+    }
+    if (server->head == NULL) {
+        server->tail = NULL;
+    }
+    pthread_mutex_unlock(&server->lock);
+    return count;
+}
+
+static void* batchThread(void* arg) {
+    Server* server = arg;
+    unsigned int maxBatch = server->options.maxBatch;
+    Request** batch = malloc(maxBatch * sizeof(Request*));
+    unsigned char* inputs = malloc((size_t) maxBatch * server->inputs);
+    float* outputs = malloc((size_t) maxBatch * server->outputs * sizeof(float));
+    unsigned int* labels = malloc(maxBatch * sizeof(unsigned int));
+    NNPredictor* predictor = NULL;
+    if (batch == NULL || inputs == NULL || outputs == NULL || labels == NULL) {
+        reportError(IMAGE_MALLOC_FAILED, "");
+        exit(IMAGE_MALLOC_FAILED);
+    }
+    int returnCode = nnMakePredictor(server->model, maxBatch, &predictor);
+    if (returnCode != SUCCESS) {
+        exit(returnCode);
+    }
+    nameTraceThread("batcher");
+
+    unsigned int count;
+    while ((count = takeBatch(server, batch)) > 0) {
+        traceBegin("batch", count);
+        for (unsigned int j = 0; j < count; j++) {
+            memcpy(inputs + (size_t) j * server->inputs, batch[j]->input, server->inputs);
+        }
+        returnCode = nnPredictUint8(predictor, inputs, count, outputs, labels);
+        if (returnCode != SUCCESS) {
+            exit(returnCode);
+        }
+        for (unsigned int j = 0; j < count; j++) {
+            memcpy(batch[j]->outputs, outputs + (size_t) j * server->outputs, server->outputs * sizeof(float));
+            batch[j]->label = labels[j];
+        }
+
+        double now = monotonicSeconds();
+        pthread_mutex_lock(&server->lock);
+        for (unsigned int j = 0; j < count; j++) {
+            recordLatency(&server->stats, now - batch[j]->received);
+            batch[j]->done = 1;
+        }
+        pthread_cond_broadcast(&server->finished);
+        pthread_mutex_unlock(&server->lock);
+        traceEnd("batch");
+
+        server->stats.batches++;
+        if (now - server->stats.since >= server->options.reportSeconds) {
+            reportStats(&server->stats);
+        }
+    }
+
+    nnFreePredictor(predictor);
+    free(batch);
+    free(inputs);
+    free(outputs);
+    free(labels);
+    return NULL;
+}
+
+// --- Connections ---
+
+// Reads exactly `length` bytes, returning 0 at the end of the stream
+static int readFully(int fd, void* buffer, size_t length) {
+    unsigned char* bytes = buffer;
+    while (length > 0) {
+        ssize_t got = read(fd, bytes, length);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return 0;
+        }
+        bytes += got;
+        length -= got;
+    }
+    return 1;
+}
+
+static int writeFully(int fd, const void* buffer, size_t length) {
+    const unsigned char* bytes = buffer;
+    while (length > 0) {
+        ssize_t wrote = write(fd, bytes, length);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            return 0;
+        }
+        bytes += wrote;
+        length -= wrote;
+    }
+    return 1;
+}
+
+static void* connectionThread(void* arg) {
+    Connection* connection = arg;
+    Server* server = connection->server;
+    size_t responseLength = sizeof(uint32_t) + server->outputs * sizeof(float);
+    unsigned char* response = malloc(responseLength);
+    Request request = {0};
+    request.input = malloc(server->inputs);
+    request.outputs = malloc(server->outputs * sizeof(float));
+    if (response == NULL || request.input == NULL || request.outputs == NULL) {
+        reportError(IMAGE_MALLOC_FAILED, "");
+    } else {
+        nameTraceThread("connection");
+        while (readFully(connection->fd, request.input, server->inputs)) {
+            traceBegin("request", TRACE_NO_ARGUMENT);
+            request.received = monotonicSeconds();
+            request.done = 0;
+            request.next = NULL;
+
+            pthread_mutex_lock(&server->lock);
+            if (server->tail != NULL) {
+                server->tail->next = &request;
+            } else {
+                server->head = &request;
+            }
+            server->tail = &request;
+            server->queueLength++;
+            pthread_cond_signal(&server->queued);
+            while (!request.done) {
+                pthread_cond_wait(&server->finished, &server->lock);
+            }
+            pthread_mutex_unlock(&server->lock);
+
+            memcpy(response, &request.label, sizeof(uint32_t));
+            memcpy(response + sizeof(uint32_t), request.outputs, server->outputs * sizeof(float));
+            int written = writeFully(connection->fd, response, responseLength);
+            traceEnd("request");
+            if (!written) {
+                break;
+            }
+        }
+    }
+
+    close(connection->fd);
+    free(request.input);
+    free(request.outputs);
+    free(response);
+    free(connection);
+    return NULL;
+}
+
+/**
+ * Opens the listening socket described by `options` into `fd`, on localhost
+ * TCP if a port is given and otherwise on a Unix domain socket.
+ */
+static int openListener(ServerOptions* options, int* fd) {
+    if (options->port != 0) {
+        *fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (*fd < 0) {
+            return reportError(MISC, "Server error: socket could not be created");
+        }
+        int yes = 1;
+        setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(options->port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(*fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+            close(*fd);
+            return reportError(MISC, "Server error: port could not be bound");
+        }
+    } else {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (strlen(options->socketPath) >= sizeof(address.sun_path)) {
+            return reportError(BAD_FILE_NAME, options->socketPath);
+        }
+        strcpy(address.sun_path, options->socketPath);
+        *fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (*fd < 0) {
+            return reportError(MISC, "Server error: socket could not be created");
+        }
+        unlink(options->socketPath); // Left behind by a previous run
+        if (bind(*fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+            close(*fd);
+            return reportError(BAD_FILE_NAME, options->socketPath);
+        }
+    }
+    if (listen(*fd, 64) != 0) {
+        close(*fd);
+        return reportError(MISC, "Server error: socket could not listen");
+    }
+    return SUCCESS;
+}
+
+// Accepts connections until SIGINT or SIGTERM, one thread each
+static int acceptConnections(Server* server, int listener) {
+    struct pollfd waiting = {listener, POLLIN, 0};
+    while (!stopRequested) {
+        int ready = poll(&waiting, 1, ACCEPT_POLL_MS);
+        if (ready <= 0) {
+            continue; // Timed out or interrupted, so check the flag again
+        }
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        if (server->options.port != 0) {
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+
+        Connection* connection = malloc(sizeof(Connection));
+        if (connection == NULL) {
+            close(fd);
+            return reportError(IMAGE_MALLOC_FAILED, "");
+        }
+        connection->server = server;
+        connection->fd = fd;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connectionThread, connection) != 0) {
+            close(fd);
+            free(connection);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return SUCCESS;
+}
+
+// --- Main ---
+
+static int parseServerOptions(int argc, char** argv, int first, ServerOptions* options) {
+    for (int i = first; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return reportError(MISC, argv[i]);
+        }
+        if (strcmp(argv[i], "--socket") == 0) {
+            options->socketPath = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0) {
+            if (sscanf(argv[++i], "%u", &options->port) != 1 || options->port > 65535) {
+                return reportError(MISC, "Conversion of port argument error");
+            }
+        } else if (strcmp(argv[i], "--max-batch") == 0) {
+            if (sscanf(argv[++i], "%u", &options->maxBatch) != 1 || options->maxBatch == 0) {
+                return reportError(MISC, "Conversion of max batch argument error");
+            }
+        } else if (strcmp(argv[i], "--max-delay-us") == 0) {
+            if (sscanf(argv[++i], "%u", &options->maxDelayMicroseconds) != 1) {
+                return reportError(MISC, "Conversion of max delay argument error");
+            }
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            options->trace = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            if (sscanf(argv[++i], "%u", &options->threads) != 1 || options->threads == 0) {
+                return reportError(MISC, "Conversion of threads argument error");
+            }
+        } else if (strcmp(argv[i], "--report-every") == 0) {
+            if (sscanf(argv[++i], "%u", &options->reportSeconds) != 1) {
+                return reportError(MISC, "Conversion of report interval argument error");
+            }
+        } else {
+            return reportError(MISC, argv[i]);
+        }
+    }
+    return SUCCESS;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: ./server model [--socket path] [--port n] [--max-batch n]\n"
+               "                      [--max-delay-us n] [--report-every seconds] [--trace file]\n"
+               "                      [--threads n]\n"
+               "`model` is a model file or network directory. Requests are served on\n"
+               "the Unix domain socket `path` (default " DEFAULT_SOCKET "), or on localhost\n"
+               "TCP port `n` if given. Large batches are split between `--threads` threads.\n");
+        return reportError(BAD_ARGUMENT_COUNT, "");
+    }
+
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.options = (ServerOptions) {DEFAULT_SOCKET, 0, DEFAULT_MAX_BATCH,
+                                      DEFAULT_MAX_DELAY_US, DEFAULT_REPORT_SECONDS, NULL, 1};
+    int returnCode = parseServerOptions(argc, argv, 2, &server.options);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+
+    if (server.options.trace != NULL) {
+        returnCode = startTracing(DEFAULT_TRACE_EVENTS);
+        if (returnCode != SUCCESS) {
+            return returnCode;
+        }
+    }
+    returnCode = nnLoadModel(argv[1], &server.model);
+    if (returnCode != SUCCESS) {
+        return returnCode;
+    }
+    returnCode = nnSetKernelThreads(server.options.threads);
+    if (returnCode != SUCCESS) {
+        nnFreeModel(server.model);
+        return returnCode;
+    }
+    server.inputs = nnInputSize(server.model);
+    server.outputs = nnOutputSize(server.model);
+
+    server.stats.latencies = malloc(LATENCY_WINDOW * sizeof(double));
+    if (server.stats.latencies == NULL) {
+        nnFreeModel(server.model);
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    server.stats.since = monotonicSeconds();
+
+    pthread_condattr_t monotonic;
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.queued, &monotonic);
+    pthread_cond_init(&server.finished, NULL);
+    pthread_condattr_destroy(&monotonic);
+
+    // Stop cleanly on SIGINT and SIGTERM, and survive clients hanging up
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener;
+    returnCode = openListener(&server.options, &listener);
+    if (returnCode != SUCCESS) {
+        nnFreeModel(server.model);
+        free(server.stats.latencies);
+        return returnCode;
+    }
+
+    pthread_t batcher;
+    if (pthread_create(&batcher, NULL, batchThread, &server) != 0) {
+        close(listener);
+        nnFreeModel(server.model);
+        free(server.stats.latencies);
+        return reportError(MISC, "Server error: batching thread could not be started");
+    }
+    if (server.options.port != 0) {
+        printf("Serving %u-%u network on 127.0.0.1:%u, batches of up to %u within %uus\n",
+               server.inputs, server.outputs, server.options.port,
+               server.options.maxBatch, server.options.maxDelayMicroseconds);
+    } else {
+        printf("Serving %u-%u network on %s, batches of up to %u within %uus\n",
+               server.inputs, server.outputs, server.options.socketPath,
+               server.options.maxBatch, server.options.maxDelayMicroseconds);
+    }
+    fflush(stdout);
+
+    returnCode = acceptConnections(&server, listener);
+    close(listener);
+    if (server.options.port == 0) {
+        unlink(server.options.socketPath);
+    }
+
+    // Finish whatever is queued, then report the last window
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    pthread_cond_signal(&server.queued);
+    pthread_mutex_unlock(&server.lock);
+    pthread_join(batcher, NULL);
+    reportStats(&server.stats);
+    if (server.options.trace != NULL) {
+        int traceCode = writeTrace(server.options.trace);
+        if (returnCode == SUCCESS) {
+            returnCode = traceCode;
+        }
+    }
+
+    // Connection threads still blocked reading are ended by exiting
+    nnFreeModel(server.model);
+    free(server.stats.latencies);
+    return returnCode;
+}
@@ -0,0 +1,241 @@
+#define _POSIX_C_SOURCE 200809L // For posix_memalign
+#include <stdio.h> // For naming workers
+#include <stdlib.h>
+#include "err.h"
+#include "threadPool.h"
+#include "trace.h"
+#include "placement.h" // For pinning workers
+
+#define SPIN_ITERATIONS 4000 // Checks for a new task before a worker sleeps
+#define CHUNKS_PER_WORKER 4 // Grain is chosen so each share is about this many chunks
+
+// Arguments of a worker thread
+typedef struct _WorkerStart {
+    ThreadPool* pool;
+    unsigned int worker;
+} WorkerStart;
+
+// The pool whose task the calling thread is running, to run nested tasks inline
+static __thread ThreadPool* runningIn = NULL;
+
+static inline uint64_t packRange(unsigned int begin, unsigned int end) {
+    return (uint64_t) end << 32 | begin;
+}
+
+static inline unsigned int rangeBegin(uint64_t range) {
+    return (unsigned int) range;
+}
+
+static inline unsigned int rangeEnd(uint64_t range) {
+    return (unsigned int) (range >> 32);
+}
+
+/**
+ * Takes up to `grain` items from the front of `worker`'s own range into
+ * `begin` and `end`, returning 0 if it is empty.
+ */
+static int takeOwn(ThreadPool* pool, unsigned int worker, unsigned int* begin, unsigned int* end) {
+    uint64_t* range = &pool->ranges[worker].range;
+    uint64_t current = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        unsigned int b = rangeBegin(current), e = rangeEnd(current);
+        if (b >= e) {
+            return 0;
+        }
+        unsigned int taken = e - b < pool->grain ? e : b + pool->grain;
+        if (__atomic_compare_exchange_n(range, &current, packRange(taken, e), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *begin = b;
+            *end = taken;
+            return 1;
+        }
+    }
+}
+
+/**
+ * Steals the back half of another worker's range into `worker`'s own,
+ * returning 0 if every other range is empty.
+ */
+static int steal(ThreadPool* pool, unsigned int worker) {
+    for (unsigned int i = 1; i < pool->threads; i++) {
+        unsigned int victim = (worker + i) % pool->threads;
+        uint64_t* range = &pool->ranges[victim].range;
+        uint64_t current = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+        for (;;) {
+            unsigned int b = rangeBegin(current), e = rangeEnd(current);
+            if (b >= e) {
+                break;
+            }
+            unsigned int middle = b + (e - b) / 2;
+            if (__atomic_compare_exchange_n(range, &current, packRange(b, middle), 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                // Only this worker fills its own range, and only once it is empty
+                __atomic_store_n(&pool->ranges[worker].range, packRange(middle, e), __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Runs items of the current task of `pool` as worker `worker` until none are left
+static void runShare(ThreadPool* pool, unsigned int worker) {
+    runningIn = pool;
+    traceBegin("parallel task", worker);
+    unsigned int begin, end;
+    do {
+        while (takeOwn(pool, worker, &begin, &end)) {
+            pool->task(pool->arg, begin, end, worker);
+        }
+    } while (steal(pool, worker));
+    traceEnd("parallel task");
+    runningIn = NULL;
+}
+
+static void* workerThread(void* arg) {
+    WorkerStart start = *(WorkerStart*) arg;
+    free(arg);
+    ThreadPool* pool = start.pool;
+    char name[32];
+    snprintf(name, sizeof(name), "worker %u", start.worker);
+    nameTraceThread(name);
+    pinThread(start.worker); // Does nothing unless placement was started
+
+    unsigned long seen = 0;
+    while (1) {
+        // Kernels post many short tasks, so spin briefly before sleeping
+        for (unsigned int i = 0; i < SPIN_ITERATIONS; i++) {
+            if (__atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE) != seen ||
+                __atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+        }
+
+        // Wait for a task that has not been run yet
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        runShare(pool, start.worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+int makeThreadPool(unsigned int threads, ThreadPool** pool) {
+    if (threads == 0) {
+        return reportError(MISC, "makeThreadPool error: a pool needs at least one thread");
+    }
+    *pool = calloc(1, sizeof(ThreadPool));
+    if (*pool == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*pool)->threads = threads;
+    (*pool)->workers = calloc(threads, sizeof(pthread_t));
+    void* ranges = NULL;
+    if ((*pool)->workers == NULL || posix_memalign(&ranges, 64, threads * sizeof(WorkerRange)) != 0) {
+        free((*pool)->workers);
+        free(*pool);
+        *pool = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*pool)->ranges = ranges;
+    for (unsigned int i = 0; i < threads; i++) {
+        (*pool)->ranges[i].range = 0;
+    }
+    pthread_mutex_init(&(*pool)->lock, NULL);
+    pthread_cond_init(&(*pool)->start, NULL);
+    pthread_cond_init(&(*pool)->done, NULL);
+    pthread_mutex_init(&(*pool)->submit, NULL);
+
+    // Worker 0 is whichever thread calls parallelFor
+    for (unsigned int i = 1; i < threads; i++) {
+        WorkerStart* start = malloc(sizeof(WorkerStart));
+        if (start == NULL) {
+            (*pool)->threads = i; // Only join the threads that were started
+            freeThreadPool(*pool);
+            *pool = NULL;
+            return reportError(IMAGE_MALLOC_FAILED, "");
+        }
+        start->pool = *pool;
+        start->worker = i;
+        if (pthread_create(&(*pool)->workers[i], NULL, workerThread, start) != 0) {
+            free(start);
+            (*pool)->threads = i;
+            freeThreadPool(*pool);
+            *pool = NULL;
+            return reportError(MISC, "makeThreadPool error: thread could not be started");
+        }
+    }
+    return SUCCESS;
+}
+
+void freeThreadPool(ThreadPool* pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->shutdown, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned int i = 1; i < pool->threads; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->submit);
+    free(pool->workers);
+    free(pool->ranges);
+    free(pool);
+}
+
+void parallelFor(ThreadPool* pool, unsigned int count, ParallelTask task, void* arg) {
+    if (pool == NULL || pool->threads == 1 || count < 2 || runningIn != NULL ||
+        pthread_mutex_trylock(&pool->submit) != 0) {
+        if (count > 0) {
+            task(arg, 0, count, 0);
+        }
+        return;
+    }
+
+    // Deal out even shares, then post the task and wake every worker
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->count = count;
+    pool->grain = count / (pool->threads * CHUNKS_PER_WORKER);
+    if (pool->grain == 0) {
+        pool->grain = 1;
+    }
+    for (unsigned int w = 0; w < pool->threads; w++) {
+        unsigned int begin = (unsigned long) count * w / pool->threads;
+        unsigned int end = (unsigned long) count * (w + 1) / pool->threads;
+        __atomic_store_n(&pool->ranges[w].range, packRange(begin, end), __ATOMIC_RELAXED);
+    }
+    pool->running = pool->threads - 1;
+    __atomic_store_n(&pool->generation, pool->generation + 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Do this thread's share, then wait for the others
+    runShare(pool, 0);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submit);
+}
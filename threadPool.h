@@ -0,0 +1,68 @@
+#ifndef THREAD_POOL
+#define THREAD_POOL
+
+#include <stdint.h> // For the packed ranges of work
+#include <pthread.h>
+
+/**
+ * A task run by `parallelFor` over the items [`begin`, `end`). `worker` is
+ * the index of the thread running it, from 0 to `threads - 1`, and can be
+ * used to index per thread scratch memory. A worker may be given several
+ * ranges of one task, but never two at once.
+ */
+typedef void (*ParallelTask)(void* arg, unsigned int begin, unsigned int end,
+                             unsigned int worker);
+
+// Items of the current task left to one worker, [begin, end) packed as
+// begin in the low and end in the high 32 bits so both change atomically.
+// Padded to a cache line so that workers don't share them.
+typedef struct _WorkerRange {
+    uint64_t range;
+    char padding[56];
+} WorkerRange;
+
+typedef struct _ThreadPool {
+    unsigned int threads; // Includes the calling thread, which is worker 0
+    pthread_t* workers;
+    WorkerRange* ranges; // One per worker
+
+    pthread_mutex_t lock;
+    pthread_cond_t start; // Signalled when a new task is posted
+    pthread_cond_t done; // Signalled when the last worker finishes a task
+    pthread_mutex_t submit; // Held by the thread whose task is running
+    unsigned long generation; // Incremented for every task posted
+    unsigned int running; // Workers yet to finish the current task
+    int shutdown;
+
+    // Current task
+    ParallelTask task;
+    void* arg;
+    unsigned int count;
+    unsigned int grain; // Items taken from a range at a time
+} ThreadPool;
+
+/**
+ * Starts a pool of `threads` threads, including the calling thread, and
+ * places it in the output vector `pool`. The threads wait for work until
+ * `freeThreadPool` is called, so they are only created once.
+ */
+int makeThreadPool(unsigned int threads, ThreadPool** pool);
+
+/**
+ * Stops and joins the threads of `pool` and frees it.
+ */
+void freeThreadPool(ThreadPool* pool);
+
+/**
+ * Runs `task` over the items [0, `count`) on the threads of `pool`, and
+ * returns once every item is done. Each worker starts with an even share,
+ * and workers that finish theirs steal half of what is left of another's,
+ * so uneven items still keep every thread busy.
+ *
+ * The task is run on the calling thread alone if `pool` is NULL, if the
+ * caller is itself running a task of a pool, or if another thread's task is
+ * running on `pool`, so `parallelFor` may be called from anywhere.
+ */
+void parallelFor(ThreadPool* pool, unsigned int count, ParallelTask task, void* arg);
+
+#endif // THREAD_POOL
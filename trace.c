@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L // For clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // For copying thread names
+#include <time.h> // For the monotonic clock
+#include <pthread.h> // For registering each thread's buffer
+#include "trace.h"
+#include "err.h"
+
+#define TRACE_THREAD_NAME_LENGTH 32
+
+typedef struct _TraceEvent {
+    const char* name;
+    int64_t argument;
+    uint64_t nanoseconds; // Since tracing started
+    char phase; // 'B' or 'E', as in the trace event format
+} TraceEvent;
+
+// One thread's events, only ever appended to by that thread
+typedef struct _TraceBuffer {
+    TraceEvent* events;
+    unsigned int count; // Published with release stores once an event is written
+    unsigned long dropped;
+    unsigned int threadId;
+    char name[TRACE_THREAD_NAME_LENGTH];
+    struct _TraceBuffer* next;
+} TraceBuffer;
+
+static int enabled = 0;
+static unsigned int capacity = 0;
+static uint64_t origin = 0;
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer* registry = NULL;
+static unsigned int numberOfThreads = 0;
+static __thread TraceBuffer* threadBuffer = NULL;
+
+static uint64_t traceClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+// Finds the calling thread's buffer, registering one the first time
+static TraceBuffer* bufferForThread(void) {
+    if (threadBuffer == NULL) {
+        TraceBuffer* buffer = calloc(1, sizeof(TraceBuffer));
+        if (buffer == NULL) {
+            return NULL;
+        }
+        buffer->events = malloc((size_t) capacity * sizeof(TraceEvent));
+        if (buffer->events == NULL) {
+            free(buffer);
+            return NULL;
+        }
+        pthread_mutex_lock(&registryLock);
+        buffer->threadId = ++numberOfThreads;
+        snprintf(buffer->name, sizeof(buffer->name), "thread %u", buffer->threadId);
+        buffer->next = registry;
+        registry = buffer;
+        pthread_mutex_unlock(&registryLock);
+        threadBuffer = buffer;
+    }
+    return threadBuffer;
+}
+
+static void appendEvent(char phase, const char* name, int64_t argument) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+    TraceBuffer* buffer = bufferForThread();
+    if (buffer == NULL) {
+        return;
+    }
+    if (buffer->count == capacity) {
+        buffer->dropped++;
+        return;
+    }
+    TraceEvent* event = &buffer->events[buffer->count];
+    event->name = name;
+    event->argument = argument;
+    event->nanoseconds = traceClock() - origin;
+    event->phase = phase;
+    __atomic_store_n(&buffer->count, buffer->count + 1, __ATOMIC_RELEASE);
+}
+
+int startTracing(unsigned int eventsPerThread) {
+    if (eventsPerThread == 0) {
+        return reportError(MISC, "startTracing error: buffers need room for at least one event");
+    }
+    if (registry != NULL) {
+        return reportError(MISC, "startTracing error: tracing can only be started once");
+    }
+    capacity = eventsPerThread;
+    origin = traceClock();
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+int tracing(void) {
+    return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+void traceBegin(const char* name, int64_t argument) {
+    appendEvent('B', name, argument);
+}
+
+void traceEnd(const char* name) {
+    appendEvent('E', name, TRACE_NO_ARGUMENT);
+}
+
+void nameTraceThread(const char* name) {
+    if (!tracing()) {
+        return;
+    }
+    TraceBuffer* buffer = bufferForThread();
+    if (buffer != NULL) {
+        pthread_mutex_lock(&registryLock); // Names are read while writing the trace
+        snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+        pthread_mutex_unlock(&registryLock);
+    }
+}
+
+// Writes `string` as a JSON string, escaping what needs escaping
+static void writeJsonString(FILE* file, const char* string) {
+    fputc('"', file);
+    for (const char* c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+int writeTrace(char* filename) {
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        return reportError(BAD_FILE_NAME, filename);
+    }
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    int first = 1;
+    unsigned long dropped = 0;
+    pthread_mutex_lock(&registryLock);
+    for (TraceBuffer* buffer = registry; buffer != NULL; buffer = buffer->next) {
+        // Thread name metadata, then the events in the order they happened
+        fprintf(file, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": ",
+                first ? "" : ",", buffer->threadId);
+        writeJsonString(file, buffer->name);
+        fprintf(file, "}}");
+        first = 0;
+
+        unsigned int count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+        for (unsigned int i = 0; i < count; i++) {
+            TraceEvent* event = &buffer->events[i];
+            fprintf(file, ",\n{\"name\": ");
+            writeJsonString(file, event->name);
+            fprintf(file, ", \"ph\": \"%c\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f",
+                    event->phase, buffer->threadId, event->nanoseconds / 1000.0);
+            if (event->argument != TRACE_NO_ARGUMENT) {
+                fprintf(file, ", \"args\": {\"value\": %lld}", (long long) event->argument);
+            }
+            fprintf(file, "}");
+        }
+        dropped += buffer->dropped;
+    }
+    pthread_mutex_unlock(&registryLock);
+    fprintf(file, "\n]}\n");
+
+    if (dropped > 0) {
+        fprintf(stderr, "Trace buffers were full, %lu events were dropped\n", dropped);
+    }
+    if (fclose(file) != 0) {
+        return reportError(OUTPUT_FAILED, filename);
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,50 @@
+#ifndef TRACE
+#define TRACE
+
+#include <stdint.h> // For event timestamps
+
+/*
+ * Opt in timeline of a run, written as Chrome trace event JSON that Perfetto
+ * and chrome://tracing can load. Every thread appends begin and end events to
+ * its own buffer without locking, so tracing can be left in hot paths; while
+ * it is off each call only checks a flag.
+ */
+
+#define DEFAULT_TRACE_EVENTS (1 << 20) // Per thread, about 32MB
+#define TRACE_NO_ARGUMENT INT64_MIN
+
+/**
+ * Turns tracing on, with room for `eventsPerThread` events in each thread's
+ * buffer. Events after a buffer fills are dropped and counted.
+ */
+int startTracing(unsigned int eventsPerThread);
+
+/**
+ * Returns whether tracing is on.
+ */
+int tracing(void);
+
+/**
+ * Records the start of `name` on the calling thread. `name` must be a string
+ * that lives until the trace is written, normally a literal. `argument` is
+ * shown with the event, or is TRACE_NO_ARGUMENT.
+ */
+void traceBegin(const char* name, int64_t argument);
+
+/**
+ * Records the end of the innermost `name` begun on the calling thread.
+ */
+void traceEnd(const char* name);
+
+/**
+ * Names the calling thread in the timeline. `name` is copied.
+ */
+void nameTraceThread(const char* name);
+
+/**
+ * Turns tracing off and writes every thread's events to `filename`. Buffers
+ * are kept until the process exits, as threads may still hold them.
+ */
+int writeTrace(char* filename);
+
+#endif // TRACE
@@ -1,10 +1,13 @@
+#define _POSIX_C_SOURCE 200809L // For clock_gettime
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <time.h> // For the monotonic clock
 
+#include "err.h"
 #include "image.h"
 #include "mathLib.h"
 #include "neuralNetwork.h"
+#include "utils.h"
 
 void printImage(Image* img) {
     for (int i = 0; i < img->rows; i++) {
@@ -35,15 +38,99 @@ void printNetwork(NeuralNetwork* network) {
     }
 }
 
-void shuffle(Image** array, int n) {
-    srand(time(NULL));
+// --- Epoch shuffling ---
+int makeEpochShuffler(unsigned int n, unsigned int blockSize,
+                      EpochShuffler** shuffler) {
+    *shuffler = malloc(sizeof(EpochShuffler));
+    if (*shuffler == NULL) {
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    (*shuffler)->n = n;
+    (*shuffler)->blockSize = blockSize;
+    if (blockSize >= n) {
+        (*shuffler)->blockSize = 0; // A single block is a full shuffle
+    }
+    unsigned int blocks = (*shuffler)->blockSize ? (n + blockSize - 1) / blockSize : 0;
+    (*shuffler)->indices = malloc(n * sizeof(unsigned int));
+    (*shuffler)->blockOrder = malloc((blocks + 1) * sizeof(unsigned int));
+    if ((*shuffler)->indices == NULL || (*shuffler)->blockOrder == NULL) {
+        freeEpochShuffler(*shuffler);
+        *shuffler = NULL;
+        return reportError(IMAGE_MALLOC_FAILED, "");
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        (*shuffler)->indices[i] = i;
+    }
+    return SUCCESS;
+}
+
+void freeEpochShuffler(EpochShuffler* shuffler) {
+    if (shuffler == NULL) {
+        return;
+    }
+    free(shuffler->indices);
+    free(shuffler->blockOrder);
+    free(shuffler);
+}
+
+// Fisher-Yates shuffle of `n` indices
+static void permuteIndices(unsigned int* indices, unsigned int n, Rng* rng) {
+    if (n < 2) {
+        return;
+    }
+    for (unsigned int i = n - 1; i > 0; i--) {
+        unsigned int j = randomBelow(rng, i + 1);
+        unsigned int t = indices[j];
+        indices[j] = indices[i];
+        indices[i] = t;
+    }
+}
 
-    if (n > 1) {
-        for (int i = n - 1; i > 0; i--) {
-            int j = (unsigned int) (((double)rand()/RAND_MAX)*(i+1));
-            Image* t = array[j];
-            array[j] = array[i];
-            array[i] = t;
+void shuffleEpoch(EpochShuffler* shuffler, Rng* rng) {
+    unsigned int n = shuffler->n;
+    unsigned int blockSize = shuffler->blockSize;
+    if (blockSize == 0) {
+        // Full permutation, starting from the identity so that the result
+        // only depends on the state of `rng`
+        for (unsigned int i = 0; i < n; i++) {
+            shuffler->indices[i] = i;
         }
+        permuteIndices(shuffler->indices, n, rng);
+        return;
     }
-}
\ No newline at end of file
+
+    // Visit the blocks in a random order, the final block may be partial
+    unsigned int blocks = (n + blockSize - 1) / blockSize;
+    for (unsigned int b = 0; b < blocks; b++) {
+        shuffler->blockOrder[b] = b;
+    }
+    permuteIndices(shuffler->blockOrder, blocks, rng);
+
+    // Expand each block then shuffle within it
+    unsigned int position = 0;
+    for (unsigned int b = 0; b < blocks; b++) {
+        unsigned int start = shuffler->blockOrder[b] * blockSize;
+        unsigned int length = (start + blockSize > n) ? n - start : blockSize;
+        for (unsigned int i = 0; i < length; i++) {
+            shuffler->indices[position + i] = start + i;
+        }
+        permuteIndices(shuffler->indices + position, length, rng);
+        position += length;
+    }
+}
+
+static int compareIndices(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*) a;
+    unsigned int y = *(const unsigned int*) b;
+    return (x > y) - (x < y);
+}
+
+void sortBatchIndices(unsigned int* indices, unsigned int count) {
+    qsort(indices, count, sizeof(unsigned int), compareIndices);
+}
+
+double monotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
@@ -8,6 +8,43 @@
 void printImage(Image* img);
 void printMatrix(Matrix* m);
 void printNetwork(NeuralNetwork* network);
-void shuffle(Image** array, int n);
+
+// --- Epoch shuffling ---
+typedef struct _EpochShuffler {
+    unsigned int n; // Number of samples being shuffled
+    unsigned int blockSize; // 0 shuffles every sample, else whole blocks
+    unsigned int* indices; // Permutation of 0..n-1 for the current epoch
+    unsigned int* blockOrder; // Order the blocks are visited in
+} EpochShuffler;
+
+/**
+ * Allocates a shuffler for `n` samples into the output vector `shuffler`. If
+ * `blockSize` is 0 each epoch is a full permutation of the samples, otherwise
+ * consecutive blocks of `blockSize` samples are visited in a random order and
+ * shuffled only amongst themselves, which suits data that is streamed in.
+ */
+int makeEpochShuffler(unsigned int n, unsigned int blockSize,
+                      EpochShuffler** shuffler);
+
+void freeEpochShuffler(EpochShuffler* shuffler);
+
+/**
+ * Fills `shuffler->indices` with the next epoch's permutation, drawn from
+ * `rng` so that the same seed always visits samples in the same order.
+ */
+void shuffleEpoch(EpochShuffler* shuffler, Rng* rng);
+
+/**
+ * Sorts the `count` indices of a mini batch `indices` in ascending order, so
+ * that gathering the batch reads the dataset sequentially.
+ */
+void sortBatchIndices(unsigned int* indices, unsigned int count);
+
+// --- Timing ---
+
+/**
+ * Returns seconds on a monotonic clock, for timing intervals.
+ */
+double monotonicSeconds(void);
 
 #endif // UTILS
\ No newline at end of file